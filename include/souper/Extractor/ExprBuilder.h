@@ -38,9 +38,31 @@ class ExprBuilder {
 
   std::map<Block *, BlockPCPredMap> BlockPCMap;
   const unsigned MAX_PHI_DEPTH = 25;
+
+  // A builder may be reused for many queries about the same LHS, which
+  // mostly share their path conditions and subexpressions. These memoize
+  // the parts of a candidate that don't depend on the RHS; they are keyed
+  // on Insts, so a builder mustn't outlive the Insts it has seen. UB
+  // conditions are kept by the InstContext instead.
+  std::unordered_map<Inst *, Inst *> DataflowConditions;
+  std::unordered_map<Inst *, Inst *> BlockPCConditions;
+  std::vector<InstMapping> LastPCs;
+  Inst *LastPCAnte = nullptr, *LastPCUB = nullptr;
+  BlockPCs LastBPCs;
 public:
   enum Builder {
-    KLEE
+    KLEE,
+    SMTLIB
+  };
+
+  // How the conditions that depend on the branches taken by phis and
+  // selects are built. Paths enumerates the paths through them, which may
+  // be exponential in their number; Linear builds one condition per Inst,
+  // choosing between those of the operands the same way the Inst chooses
+  // its value.
+  enum Encoding {
+    Paths,
+    Linear
   };
 
   ExprBuilder(InstContext &IC) : LIC(&IC) {}
@@ -78,11 +100,19 @@ protected:
   void setBlockPCMap(const BlockPCs &BPCs);
 
   Inst *getBlockPCs(Inst *Root);
+  Inst *buildBlockPCs(Inst *Root);
+  Inst *buildLinearBlockPCs(Inst *I);
+  Inst *buildUBInstCondition(Inst *Root);
+  Inst *getLinearUBCondition(Inst *I);
+  Inst *buildDataflowConditions(Inst *I);
+  Inst *getUBInstConstraint(Inst *I);
   std::map<Inst *, Inst *> getUBInstConstraints(Inst *Root);
   std::vector<Inst *> getUBPathInsts(Inst *Root);
   std::vector<Inst *> getVarInsts(const std::vector<Inst *> Insts);
   Inst *getExtractInst(Inst *I, unsigned Offset, unsigned W);
   Inst *getImpliesInst(Inst *Ante, Inst *I);
+  Inst *getAndInst(Inst *L, Inst *R);
+  Inst *getChoiceInst(Inst *I, const std::vector<Inst *> &Conds);
 
   Inst *addnswUB(Inst *I);
   Inst *addnuwUB(Inst *I);
@@ -110,6 +140,12 @@ std::string BuildQuery(InstContext &IC, const BlockPCs &BPCs,
        std::vector<Inst *> *ModelVars, Inst *Precondition, bool Negate=false);
 
 std::unique_ptr<ExprBuilder> createKLEEBuilder(InstContext &IC);
+std::unique_ptr<ExprBuilder> createSMTLIBBuilder(InstContext &IC);
+// Creates the builder selected by -souper-smt-expr-builder. Unlike
+// BuildQuery(), which starts from scratch every time, the builder keeps
+// what it has built, so that a series of queries about one LHS can share
+// the work.
+std::unique_ptr<ExprBuilder> createExprBuilder(InstContext &IC);
 Inst *getUBInstCondition(InstContext &IC, Inst *Root);
 }
 
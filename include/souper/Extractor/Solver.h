@@ -29,6 +29,10 @@ namespace souper {
 class Solver {
 public:
   virtual ~Solver();
+  // Hints that infer() is about to be called for the LHS of each of these
+  // candidates, so that a solver backed by an external cache can look them
+  // all up at once.
+  virtual void prefetch(const std::vector<CandidateReplacement> &Cands) {}
   virtual std::error_code
   infer(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
         Inst *LHS, Inst *&RHS, InstContext &IC) = 0;
@@ -93,6 +97,8 @@ std::unique_ptr<Solver> createMemCachingSolver(
     std::unique_ptr<Solver> UnderlyingSolver);
 std::unique_ptr<Solver> createExternalCachingSolver(
     std::unique_ptr<Solver> UnderlyingSolver, KVStore *KV);
+std::unique_ptr<Solver> createExhaustiveSolver(
+    std::unique_ptr<Solver> UnderlyingSolver, unsigned MaxInputBits);
 
 }
 
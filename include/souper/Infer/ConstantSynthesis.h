@@ -16,6 +16,7 @@
 #define SOUPER_CONSTANT_SYNTHESIS_H
 
 #include "llvm/ADT/APInt.h"
+#include "souper/Extractor/ExprBuilder.h"
 #include "souper/Extractor/Solver.h"
 #include "souper/Inst/Inst.h"
 
@@ -31,13 +32,16 @@ class ConstantSynthesis {
 public:
   ConstantSynthesis(PruningManager *P = nullptr) : Pruner(P) {}
 
-  // Synthesize a set of constants from the specification in LHS
+  // Synthesize a set of constants from the specification in LHS. Queries
+  // are built with EB if it is given, and with a builder of their own
+  // otherwise.
   std::error_code synthesize(SMTLIBSolver *SMTSolver,
                              const BlockPCs &BPCs,
                              const std::vector<InstMapping> &PCs,
                              InstMapping Mapping, std::set <Inst *> &ConstSet,
                              std::map <Inst *, llvm::APInt> &ResultMap,
-                             InstContext &IC, unsigned MaxTries, unsigned Timeout);
+                             InstContext &IC, unsigned MaxTries, unsigned Timeout,
+                             ExprBuilder *EB = nullptr);
 
 private:
   PruningManager *Pruner = nullptr;
@@ -24,6 +24,7 @@
 
 extern bool UseAlive;
 extern unsigned DebugLevel;
+extern unsigned ExhaustiveMaxBits;
 
 namespace souper {
 
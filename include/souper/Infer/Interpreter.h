@@ -101,8 +101,6 @@ EvalValue evaluateAShr(llvm::APInt A, llvm::APInt B);
     ValueCache Cache;
     bool CacheWritable = false;
 
-    EvalValue evaluateSingleInst(Inst *I, std::vector<EvalValue> &Args);
-
   public:
     ConcreteInterpreter() {}
     ConcreteInterpreter(ValueCache &Input) : Cache(Input) {}
@@ -115,6 +113,54 @@ EvalValue evaluateAShr(llvm::APInt A, llvm::APInt B);
     EvalValue evaluateInst(Inst *Root);
   };
 
+  // An Inst DAG flattened into a topologically ordered tape. Every node gets
+  // a dense slot index and each step reads its operands from, and writes its
+  // result to, a flat slot array. Once compiled, the DAG can be evaluated on
+  // many input sets without recursion, hashing or per-node allocation.
+  class CompiledInst {
+    struct Step {
+      Inst *I;
+      unsigned Dest;
+      unsigned FirstArg;
+      unsigned NumArgs;
+    };
+
+    std::vector<std::pair<Inst *, unsigned>> Inputs;
+    std::vector<std::pair<Inst *, unsigned>> Constants;
+    std::vector<Step> Steps;
+    std::vector<unsigned> ArgSlots;
+    unsigned NumSlots = 0;
+    unsigned Result = 0;
+    unsigned ResultWidth = 0;
+    // True if every node is at most 64 bits wide and has a lane kernel.
+    bool Narrow = true;
+
+    EvalValue run(const ValueCache &Input, std::vector<EvalValue> &Slots,
+                  std::vector<EvalValue> &Args) const;
+    bool evaluateNarrow(const std::vector<ValueCache> &InputSets,
+                        std::vector<EvalValue> &Results) const;
+
+  public:
+    CompiledInst(Inst *Root);
+
+    EvalValue evaluate(const ValueCache &Input) const;
+    void evaluate(const std::vector<ValueCache> &InputSets,
+                  std::vector<EvalValue> &Results) const;
+  };
+
+  // Decide whether Mapping holds under PCs by evaluating both sides on every
+  // possible input, with the same meaning as the SMT query: inputs that break
+  // a PC or a dataflow fact of a variable, or on which the LHS or a PC is
+  // undefined, are don't-cares; on all others the RHS must be defined and
+  // agree with the LHS on the demanded bits. Returns false, leaving IsValid
+  // alone, if the inputs total more than MaxInputBits or the mapping has
+  // something the interpreter can't model the way the query does. On an
+  // invalid mapping, Model (if given) gets the counterexample.
+  bool isValidExhaustively(const std::vector<InstMapping> &PCs,
+                           InstMapping Mapping, unsigned MaxInputBits,
+                           bool &IsValid,
+                           std::vector<std::pair<Inst *, llvm::APInt>> *Model);
+
 }
 
 
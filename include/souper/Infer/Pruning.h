@@ -38,6 +38,9 @@ public:
 
   bool isInfeasible(Inst *RHS, unsigned StatsLevel);
   bool isInfeasibleWithSolver(Inst *RHS, unsigned StatsLevel);
+  // Fingerprint a concrete RHS by its outputs on all input sets. Returns
+  // false if the RHS can't be evaluated on some input.
+  bool getOutputSignature(Inst *RHS, std::string &Signature);
   void init();
   // double init antipattern, required because init should
   // not be called when pruning is disabled
@@ -23,10 +23,14 @@
 
 #include "souper/SMTLIB2/Solver.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <map>
 #include <memory>
+#include <new>
 #include <set>
 #include <string>
+#include <type_traits>
 #include <unordered_set>
 #include <vector>
 
@@ -39,7 +43,33 @@ const std::string ReservedConstPrefix = "reservedconst_";
 const std::string ReservedInstPrefix = "reservedinst";
 const std::string BlockPred = "blockpred";
 
+struct CanonicalRoot;
 struct Inst;
+class ExprBuilder;
+
+/// The parts of an Inst that are only needed when harvesting, printing or
+/// building queries. InstContext keeps these in a table parallel to the
+/// nodes themselves, so the same index identifies a node and its metadata.
+struct InstMetadata {
+  std::string Name;
+  llvm::APInt DemandedBits;
+  HarvestType HarvestKind;
+  llvm::BasicBlock* HarvestFrom;
+  std::unordered_set<Inst *> DepsWithExternalUses;
+  std::vector<llvm::Value *> Origins;
+  mutable std::vector<Inst *> OrderedOps;
+
+  // Dataflow facts, only meaningful for variables
+  llvm::APInt KnownZeros;
+  llvm::APInt KnownOnes;
+  bool NonZero;
+  bool NonNegative;
+  bool PowOfTwo;
+  bool Negative;
+  unsigned NumSignBits;
+  llvm::ConstantRange Range=llvm::ConstantRange(1);
+  std::vector<llvm::ConstantRange> RangeRefinement;
+};
 
 struct Block {
   std::string Name;
@@ -127,17 +157,26 @@ struct Inst : llvm::FoldingSetNode {
     None,
 } Kind;
 
+  // The fields read while walking the DAG are kept together at the front;
+  // everything else lives in Meta so that nodes stay small.
   Kind K;
-  unsigned Number;
   unsigned Width;
-  Block *B;
+  unsigned Number;
+  unsigned SynthesisConstID;
   bool Available = true;
-  llvm::APInt Val;
-  std::string Name;
-  std::unordered_set<Inst *> DepsWithExternalUses;
+  // Cached result of cost(); -1 until it is first computed.
+  mutable int Cost = -1;
+  // Epoch of the last InstVisitSet this node was added to.
+  mutable uint64_t VisitEpoch = 0;
+  Block *B;
   std::vector<Inst *> Ops;
-  mutable std::vector<Inst *> OrderedOps;
-  std::vector<llvm::Value *> Origins;
+  llvm::APInt Val;
+  InstMetadata *Meta;
+  // Cached result of structuralHash(); zero until it is first computed.
+  mutable size_t StructuralHash = 0;
+  // Cached canonical form of the DAG under this node, built the first time
+  // it is a root of getCanonicalKey().
+  mutable std::shared_ptr<const CanonicalRoot> Canonical;
 
   bool operator<(const Inst &I) const;
   const std::vector<Inst *> &orderedOps() const;
@@ -163,19 +202,6 @@ struct Inst : llvm::FoldingSetNode {
   static bool isCommutative(Kind K);
   static bool isShift(Kind K);
   static int getCost(Kind K);
-  llvm::APInt KnownZeros;
-  llvm::APInt KnownOnes;
-  bool NonZero;
-  bool NonNegative;
-  bool PowOfTwo;
-  bool Negative;
-  unsigned NumSignBits;
-  llvm::APInt DemandedBits;
-  unsigned SynthesisConstID;
-  HarvestType HarvestKind;
-  llvm::BasicBlock* HarvestFrom;
-  llvm::ConstantRange Range=llvm::ConstantRange(1);
-  std::vector<llvm::ConstantRange> RangeRefinement;
 };
 
 /// A mapping from an Inst to a replacement. This may either represent a
@@ -218,23 +244,120 @@ public:
   void setInst(llvm::StringRef Name, Inst *I);
   Block *getBlock(llvm::StringRef Name);
   void setBlock(llvm::StringRef Name, Block *B);
+  /// The name of I or B in this context, or an empty string if it has none.
+  llvm::StringRef getInstName(Inst *I) const;
+  llvm::StringRef getBlockName(Block *B) const;
+  /// Gives I or B the next unused name, as the printer does.
+  void addInst(Inst *I);
+  void addBlock(Block *B);
   void clear();
   bool empty();
 };
 
+/// Storage with stable addresses for the nodes owned by an InstContext.
+/// Objects are carved out of fixed-size slabs in creation order, so that
+/// everything created after a given point can be destroyed at once and its
+/// slots reused.
+template <typename T, size_t SlabSize = 256> class SlabArena {
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+  std::vector<std::unique_ptr<Slot[]>> Slabs;
+  size_t Size = 0;
+
+public:
+  SlabArena() = default;
+  SlabArena(const SlabArena &) = delete;
+  SlabArena &operator=(const SlabArena &) = delete;
+  ~SlabArena() { truncate(0); }
+
+  T *create() {
+    if (Size == Slabs.size() * SlabSize)
+      Slabs.emplace_back(new Slot[SlabSize]);
+    T *P = new (&Slabs[Size / SlabSize][Size % SlabSize]) T();
+    ++Size;
+    return P;
+  }
+
+  size_t size() const { return Size; }
+
+  T *operator[](size_t I) const {
+    return reinterpret_cast<T *>(&Slabs[I / SlabSize][I % SlabSize]);
+  }
+
+  /// Returns true if P is one of the objects created after the first From.
+  bool contains(const T *P, size_t From) const {
+    auto Addr = reinterpret_cast<uintptr_t>(P);
+    for (size_t S = From / SlabSize; S * SlabSize < Size; ++S) {
+      auto Begin = reinterpret_cast<uintptr_t>(&Slabs[S][0]);
+      if (Addr < Begin || Addr >= Begin + SlabSize * sizeof(Slot))
+        continue;
+      size_t I = S * SlabSize + (Addr - Begin) / sizeof(Slot);
+      return I >= From && I < Size;
+    }
+    return false;
+  }
+
+  /// Destroys the objects created after the first NewSize, newest first.
+  /// The slabs themselves are kept around for reuse.
+  void truncate(size_t NewSize) {
+    while (Size > NewSize)
+      (*this)[--Size]->~T();
+  }
+};
+
 class InstContext {
-  typedef llvm::DenseMap<unsigned, std::vector<std::unique_ptr<Block>>>
-      BlockMap;
+  typedef llvm::DenseMap<unsigned, std::vector<Block *>> BlockMap;
   BlockMap BlocksByPreds;
 
-  typedef llvm::DenseMap<unsigned, std::vector<std::unique_ptr<Inst>>> InstMap;
+  typedef llvm::DenseMap<unsigned, std::vector<Inst *>> InstMap;
   InstMap VarInstsByWidth;
 
-  std::vector<std::unique_ptr<Inst>> Insts;
+  SlabArena<Inst> Insts;
+  SlabArena<InstMetadata> Metadata;
+  SlabArena<Block> Blocks;
   llvm::FoldingSet<Inst> InstSet;
   unsigned ReservedConstCounter = 0;
 
+  llvm::DenseMap<std::pair<const Inst *, unsigned>, Inst *> UBConditions;
+  // The keys of UBConditions in the order they were set, so that a rollback
+  // only looks at the ones set since its checkpoint
+  std::vector<std::pair<const Inst *, unsigned>> UBConditionLog;
+
+  Inst *newInst();
+
 public:
+  /// The state of a context at some point in time; see rollback().
+  struct Checkpoint {
+    size_t NumInsts = 0;
+    size_t NumBlocks = 0;
+    unsigned ReservedConstCounter = 0;
+    size_t NumUBConditions = 0;
+  };
+
+  Checkpoint checkpoint() const;
+  /// Destroys every instruction and block created since CP was taken.
+  /// Checkpoints must be rolled back to in the reverse order of creation,
+  /// and nothing may keep pointers to the destroyed nodes.
+  void rollback(const Checkpoint &CP);
+  bool createdSince(const Checkpoint &CP, const Inst *I) const {
+    return Insts.contains(I, CP.NumInsts);
+  }
+  bool createdSince(const Checkpoint &CP, const Block *B) const {
+    return Blocks.contains(B, CP.NumBlocks);
+  }
+
+  /// The condition under which I is free of UB, as computed by ExprBuilder
+  /// with the given encoding, or null if it wasn't computed yet. It only
+  /// depends on the DAG below I, so it is kept for as long as both I and
+  /// the condition exist, and shared by all the builders using the context.
+  Inst *getUBCondition(const Inst *I, unsigned Encoding) const {
+    auto It = UBConditions.find({I, Encoding});
+    return It == UBConditions.end() ? nullptr : It->second;
+  }
+  void setUBCondition(const Inst *I, unsigned Encoding, Inst *Cond) {
+    UBConditions[{I, Encoding}] = Cond;
+    UBConditionLog.push_back({I, Encoding});
+  }
+
   Inst *getConst(const llvm::APInt &I);
   Inst *getUntypedConst(const llvm::APInt &I);
   Inst *getReservedConst();
@@ -259,6 +382,25 @@ public:
                 llvm::APInt DemandedBits, bool Available);
 };
 
+/// Reclaims every instruction and block created in an InstContext while the
+/// scope is alive. Results that have to outlive the scope are registered
+/// with promote(); when the scope ends they are rebuilt outside of the
+/// reclaimed region and the registered pointers are updated to the copies.
+class InstContextScope {
+  InstContext &IC;
+  InstContext::Checkpoint CP;
+  std::vector<Inst **> Promoted;
+
+public:
+  explicit InstContextScope(InstContext &IC)
+      : IC(IC), CP(IC.checkpoint()) {}
+  InstContextScope(const InstContextScope &) = delete;
+  InstContextScope &operator=(const InstContextScope &) = delete;
+  ~InstContextScope();
+
+  void promote(Inst *&I) { Promoted.push_back(&I); }
+};
+
 struct SynthesisContext {
   InstContext &IC;
   SMTLIBSolver *SMTSolver;
@@ -267,10 +409,42 @@ struct SynthesisContext {
   const std::vector<InstMapping> &PCs;
   const BlockPCs &BPCs;
   unsigned Timeout;
+  // Shared by the queries about LHS; see createExprBuilder().
+  ExprBuilder *EB = nullptr;
+};
+
+/// The instructions seen by a single DAG walk. Instead of allocating, the
+/// set stamps each node it holds with an epoch that is unique to the walk,
+/// so insertion and lookup are a single load and store. A set created while
+/// another one is live on the same thread, i.e. by a nested walk, falls back
+/// to a hash set. The same nodes must not be walked by two threads at once.
+class InstVisitSet {
+  uint64_t Epoch;
+  std::unique_ptr<std::unordered_set<const Inst *>> Nested;
+
+public:
+  InstVisitSet();
+  InstVisitSet(const InstVisitSet &) = delete;
+  InstVisitSet &operator=(const InstVisitSet &) = delete;
+  ~InstVisitSet();
+
+  /// Returns true if I was not in the set yet.
+  bool insert(const Inst *I) {
+    if (Nested)
+      return Nested->insert(I).second;
+    if (I->VisitEpoch == Epoch)
+      return false;
+    I->VisitEpoch = Epoch;
+    return true;
+  }
+
+  bool count(const Inst *I) const {
+    return Nested ? Nested->count(I) : I->VisitEpoch == Epoch;
+  }
 };
 
 int cost(Inst *I, bool IgnoreDepsWithExternalUses = false);
-int countHelper(Inst *I, std::set<Inst *> &Visited);
+int countHelper(Inst *I, InstVisitSet &Visited);
 int instCount(Inst *I);
 int benefit(Inst *LHS, Inst *RHS);
 
@@ -295,6 +469,34 @@ void PrintReplacementRHS(llvm::raw_ostream &Out, Inst *RHS,
 std::string GetReplacementRHSString(Inst *RHS, ReplacementContext &Context,
                                     bool printNames = false);
 
+/// Returns a hash of the DAG rooted at I that does not depend on the names
+/// or creation order of its variables, nor on the order of the operands of
+/// commutative instructions. The result is cached in I.
+size_t structuralHash(Inst *I);
+
+/// Combines the structural hashes of a query made of path conditions and
+/// the given roots, the first of which is the LHS of the query.
+size_t structuralHash(const BlockPCs &BPCs,
+                      const std::vector<InstMapping> &PCs,
+                      const std::vector<Inst *> &Roots);
+
+/// Serializes the same query into a compact string that is equal for two
+/// queries only if they are identical up to renaming of variables. The
+/// canonical form of each root is cached in it, so once every root has
+/// been seen the key costs a lookup per root and per variable rather than
+/// a walk over the DAG.
+std::string getCanonicalKey(const BlockPCs &BPCs,
+                            const std::vector<InstMapping> &PCs,
+                            const std::vector<Inst *> &Roots);
+
+/// Gives every instruction and block of the query a name in Context, chosen
+/// so that queries with equal canonical keys give the same names to
+/// corresponding nodes. Unlike getCanonicalKey(), this walks every root.
+void nameCanonically(const BlockPCs &BPCs,
+                     const std::vector<InstMapping> &PCs,
+                     const std::vector<Inst *> &Roots,
+                     ReplacementContext &Context);
+
 void findCands(Inst *Root, std::vector<Inst *> &Guesses,
                bool WidthMustMatch, bool FilterVars, int Max);
 
@@ -63,7 +63,7 @@ template<> struct llvm::DOTGraphTraits<souper::Inst*> : public llvm::DefaultDOTG
     case souper::Inst::Kind::ReservedInst:
       return "ReservedInst";
     case souper::Inst::Kind::Var:
-      return "Var " + instr->Name;
+      return "Var " + instr->Meta->Name;
     case souper::Inst::Kind::Const:
       return instr->Val.toString(10, false);
     default:
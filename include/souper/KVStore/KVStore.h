@@ -15,22 +15,85 @@
 #ifndef SOUPER_KVSTORE_KVSTORE_H
 #define SOUPER_KVSTORE_KVSTORE_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/StringRef.h"
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace souper {
 
 class KVStore {
-  class KVImpl;
-  std::unique_ptr<KVImpl> Impl;
 public:
+  // Where a KVStore keeps its hashes. The batched operations of a backend
+  // default to a loop over the single ones.
+  class Backend {
+  public:
+    virtual ~Backend();
+    virtual void hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
+                         int Incr) = 0;
+    virtual bool hGet(llvm::StringRef Key, llvm::StringRef Field,
+                      std::string &Value) = 0;
+    virtual void hSet(llvm::StringRef Key, llvm::StringRef Field,
+                      llvm::StringRef Value) = 0;
+    virtual void hIncrByMany(llvm::ArrayRef<std::string> Keys,
+                             llvm::ArrayRef<std::string> Fields, int Incr);
+    virtual void hGetMany(llvm::ArrayRef<std::string> Keys,
+                          llvm::StringRef Field,
+                          std::vector<llvm::Optional<std::string>> &Values);
+    virtual void hSetMany(llvm::ArrayRef<std::string> Keys,
+                          llvm::StringRef Field,
+                          llvm::ArrayRef<std::string> Values);
+    virtual void keys(std::vector<std::string> &Keys) = 0;
+    virtual void hGetAll(
+        llvm::StringRef Key,
+        std::vector<std::pair<std::string, std::string>> &Fields) = 0;
+    // Reclaims the space taken by values that were overwritten, where the
+    // backend keeps them; the default does nothing.
+    virtual void compact();
+  };
+
+  // Uses the file named by -souper-cache-file if there is one, and Redis
+  // otherwise, behind an LRU of -souper-external-cache-mb megabytes.
   KVStore();
+  explicit KVStore(std::unique_ptr<Backend> Impl);
   ~KVStore();
   void hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int Incr);
   bool hGet(llvm::StringRef Key, llvm::StringRef Field, std::string &Value);
   void hSet(llvm::StringRef Key, llvm::StringRef Field, llvm::StringRef Value);
+
+  // Batched versions of the above; a batch costs about one round trip to
+  // Redis, or one lock of the cache file. The I-th field or value goes with
+  // the I-th key.
+  void hIncrByMany(llvm::ArrayRef<std::string> Keys,
+                   llvm::ArrayRef<std::string> Fields, int Incr);
+  void hGetMany(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+                std::vector<llvm::Optional<std::string>> &Values);
+  void hSetMany(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+                llvm::ArrayRef<std::string> Values);
+
+  // For the tools that inspect the whole store
+  void keys(std::vector<std::string> &Keys);
+  void hGetAll(llvm::StringRef Key,
+               std::vector<std::pair<std::string, std::string>> &Fields);
+  void compact();
+
+private:
+  std::unique_ptr<Backend> Impl;
 };
 
+std::unique_ptr<KVStore::Backend> createRedisKVBackend();
+// An append-only log of field updates in a file, which any number of
+// processes can share. Every update appends a record, so the file grows
+// until it is compacted.
+std::unique_ptr<KVStore::Backend> createFileKVBackend(llvm::StringRef Path);
+// Remembers up to about MaxBytes worth of lookups in Underlying, misses
+// included.
+std::unique_ptr<KVStore::Backend>
+createLRUKVBackend(std::unique_ptr<KVStore::Backend> Underlying,
+                   size_t MaxBytes);
+
 }
 
 #endif  // SOUPER_KVSTORE_KVSTORE_H
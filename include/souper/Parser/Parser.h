@@ -15,6 +15,7 @@
 #ifndef SOUPER_PARSER_PARSER_H
 #define SOUPER_PARSER_PARSER_H
 
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/StringRef.h"
 #include "souper/Extractor/Candidates.h"
 
@@ -56,6 +57,15 @@ struct ParsedReplacement {
 
 void TestLexer(llvm::StringRef Str);
 
+/// Check that an instruction of kind IK, or a phi in block B, is well typed
+/// with operands Ops and width Width, as the text and binary readers do
+/// before creating it. Untyped constants among Ops are given their type and
+/// a Width of 0 is inferred; on failure ErrStr says what is wrong.
+bool typeCheckInst(InstContext &IC, Inst::Kind IK, unsigned &Width,
+                   std::vector<Inst *> &Ops, std::string &ErrStr);
+bool typeCheckPhi(InstContext &IC, unsigned Width, Block *B,
+                  std::vector<Inst *> &Ops, std::string &ErrStr);
+
 ParsedReplacement ParseReplacement(InstContext &IC, llvm::StringRef Filename,
                                    llvm::StringRef Str, std::string &ErrStr);
 ParsedReplacement ParseReplacementLHS(InstContext &IC, llvm::StringRef Filename,
@@ -76,6 +86,108 @@ std::vector<ParsedReplacement> ParseReplacementRHSs(InstContext &IC,
     llvm::StringRef Filename, llvm::StringRef Str,
     std::vector<ReplacementContext> &Contexts, std::string &ErrStr);
 
+/// A compact binary form of replacements that is read back without lexing.
+/// Instructions are type checked as they are read, so malformed data is
+/// reported as an error. Like the printer, the writers give every instruction and block
+/// they write a name in Context, and write the ones that have a name there
+/// already as a reference to it. Hence an RHS written in the context of its
+/// LHS is read back in the context that reading the LHS produced.
+std::string GetReplacementBinary(const BlockPCs &BPCs,
+                                 const std::vector<InstMapping> &PCs,
+                                 InstMapping Mapping,
+                                 ReplacementContext &Context);
+std::string GetReplacementLHSBinary(const BlockPCs &BPCs,
+                                    const std::vector<InstMapping> &PCs,
+                                    Inst *LHS, ReplacementContext &Context);
+std::string GetReplacementRHSBinary(Inst *RHS, ReplacementContext &Context);
+
+/// Reads what the corresponding writer wrote; the RHS of a full replacement
+/// may be missing, for an LHS written with GetReplacementBinary().
+ParsedReplacement ReadReplacementBinary(InstContext &IC,
+                                        llvm::StringRef Filename,
+                                        llvm::StringRef Data,
+                                        ReplacementContext &Context,
+                                        std::string &ErrStr);
+ParsedReplacement ReadReplacementLHSBinary(InstContext &IC,
+                                           llvm::StringRef Filename,
+                                           llvm::StringRef Data,
+                                           ReplacementContext &Context,
+                                           std::string &ErrStr);
+ParsedReplacement ReadReplacementRHSBinary(InstContext &IC,
+                                           llvm::StringRef Filename,
+                                           llvm::StringRef Data,
+                                           ReplacementContext &Context,
+                                           std::string &ErrStr);
+
+/// A file of binary replacements is a header followed by the replacements,
+/// each prefixed by its size.
+void WriteReplacementsBinary(llvm::raw_ostream &Out,
+                             const std::vector<ParsedReplacement> &Reps);
+bool isBinaryReplacements(llvm::StringRef Data);
+std::vector<ParsedReplacement> ReadReplacementsBinary(InstContext &IC,
+    llvm::StringRef Filename, llvm::StringRef Data,
+    std::vector<ReplacementContext> &Contexts, std::string &ErrStr);
+
+/// Reads the replacements in Data, text or binary, one at a time, so that a
+/// corpus can be processed in memory that doesn't grow with its size: each
+/// replacement can go into a fresh InstContext, or into one that is rolled
+/// back once the replacement is done with. Text is cut after each statement
+/// that ends a replacement, 'cand' or 'result', or 'infer' when reading
+/// LHSs, and only then parsed, so an error is reported when the stream gets
+/// to the replacement it is in. The RHSs of binary replacements are dropped
+/// when reading LHSs, and may be missing otherwise, as with
+/// ReadReplacementBinary().
+class ReplacementStream {
+  std::string Filename;
+  llvm::StringRef Data;
+  bool LHSOnly, Binary;
+  size_t Begin, Pos;
+  // The line that Pos is on, counted from Begin
+  unsigned Line = 1;
+
+  void skipText();
+  bool skipBinary(std::string &ErrStr);
+  bool nextText(InstContext &IC, ParsedReplacement &R,
+                ReplacementContext &Context, std::string &ErrStr);
+  bool nextBinary(InstContext &IC, ParsedReplacement &R,
+                  ReplacementContext &Context, std::string &ErrStr);
+
+public:
+  /// Reads the replacements in [Begin, End) of Data, which must be offsets
+  /// at replacement boundaries, such as those split() returns.
+  ReplacementStream(llvm::StringRef Filename, llvm::StringRef Data,
+                    bool LHSOnly = false, size_t Begin = 0,
+                    size_t End = llvm::StringRef::npos);
+
+  /// Parses the next replacement into IC. Returns false at the end of the
+  /// data, or on an error, which ErrStr then describes.
+  bool next(InstContext &IC, ParsedReplacement &R,
+            ReplacementContext &Context, std::string &ErrStr);
+  /// Where the replacement that next() reads starts.
+  size_t getPosition() const { return Pos; }
+
+  /// Cuts Data into at most N pieces of about the same size at replacement
+  /// boundaries, returning the offsets of their starts followed by the size
+  /// of Data.
+  static std::vector<size_t> split(llvm::StringRef Data, bool LHSOnly,
+                                   unsigned N);
+};
+
+/// Parses the replacements in Data on Jobs threads, each reading a piece
+/// of it with a ReplacementStream, and calls Consume with each replacement
+/// from the thread that parsed it. Consume is given where the replacement
+/// starts in Data, which orders the replacements, and the InstContext it
+/// was parsed into, which is rolled back once Consume returns. Returns
+/// false if a replacement couldn't be parsed, in which case ErrStr
+/// describes the first of those; the replacements after it may not all
+/// have been consumed.
+bool ParseReplacementsParallel(llvm::StringRef Filename, llvm::StringRef Data,
+    bool LHSOnly, unsigned Jobs,
+    llvm::function_ref<void(size_t Offset, ParsedReplacement &R,
+                            ReplacementContext &Context, InstContext &IC)>
+        Consume,
+    std::string &ErrStr);
+
 }
 
 #endif  // SOUPER_PARSER_PARSER_H
@@ -17,6 +17,7 @@
 
 #include "llvm/ADT/APInt.h"
 #include "llvm/ADT/StringRef.h"
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <system_error>
@@ -24,20 +25,26 @@
 
 namespace souper {
 
+// Returns the solver's exit code, -1 if it could not be run, -2 if it timed
+// out or crashed and -3 if it was killed because *Cancel became true.
 typedef std::function<
     int(const std::vector<std::string> &Args, llvm::StringRef RedirectIn,
         llvm::StringRef RedirectOut, llvm::StringRef RedirectErr,
-        unsigned Timeout)> SolverProgram;
+        unsigned Timeout, const std::atomic<bool> *Cancel)> SolverProgram;
 
 class SMTLIBSolver {
 public:
   virtual ~SMTLIBSolver();
   virtual std::string getName() const = 0;
   virtual bool supportsModels() const = 0;
+  // If Cancel is given, the query is abandoned with operation_canceled once
+  // *Cancel becomes true, even if the solver is already working on it.
   virtual std::error_code isSatisfiable(llvm::StringRef Query, bool &Result,
                                         unsigned NumModels,
                                         std::vector<llvm::APInt> *Models,
-                                        unsigned Timeout = 0) = 0;
+                                        unsigned Timeout = 0,
+                                        const std::atomic<bool> *Cancel =
+                                            nullptr) = 0;
 };
 
 SolverProgram makeExternalSolverProgram(llvm::StringRef Path);
@@ -49,6 +56,26 @@ std::unique_ptr<SMTLIBSolver> createCVC4Solver(SolverProgram Prog, bool Keep);
 std::unique_ptr<SMTLIBSolver> createSTPSolver(SolverProgram Prog, bool Keep);
 std::unique_ptr<SMTLIBSolver> createZ3Solver(SolverProgram Prog, bool Keep);
 
+// Solvers that keep one process alive across queries, talking to it in
+// interactive SMT-LIB mode instead of spawning a process per query.
+std::unique_ptr<SMTLIBSolver> createPersistentBoolectorSolver(
+    llvm::StringRef Path, bool Keep);
+std::unique_ptr<SMTLIBSolver> createPersistentCVC4Solver(llvm::StringRef Path,
+                                                         bool Keep);
+std::unique_ptr<SMTLIBSolver> createPersistentSTPSolver(llvm::StringRef Path,
+                                                        bool Keep);
+std::unique_ptr<SMTLIBSolver> createPersistentZ3Solver(llvm::StringRef Path,
+                                                       bool Keep);
+
+// Z3 linked into the process and driven through its C API.
+std::unique_ptr<SMTLIBSolver> createZ3InProcessSolver(bool Keep);
+
+// Races every solver whose path is non-empty on each query and returns the
+// first sat/unsat answer.
+std::unique_ptr<SMTLIBSolver> createPortfolioSolver(
+    llvm::StringRef BoolectorPath, llvm::StringRef CVC4Path,
+    llvm::StringRef STPPath, llvm::StringRef Z3Path, bool Keep);
+
 }
 
 #endif // SOUPER_SMTLIB2_SOLVER_H
@@ -17,6 +17,7 @@
 
 #include "llvm/Support/CommandLine.h"
 #include "souper/Extractor/Solver.h"
+#include "souper/Infer/EnumerativeSynthesis.h"
 #include "souper/KVStore/KVStore.h"
 #include "souper/SMTLIB2/Solver.h"
 #include <memory>
@@ -44,7 +45,45 @@ static llvm::cl::opt<bool> KeepSolverInputs(
     "keep-solver-inputs", llvm::cl::desc("Do not clean up solver inputs"),
     llvm::cl::init(false));
 
+static llvm::cl::opt<bool> PersistentSolver(
+    "solver-persistent",
+    llvm::cl::desc("Keep one solver process running and reuse it for all "
+                   "queries (default=false)"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> Z3InProcess(
+    "z3-in-process",
+    llvm::cl::desc("Use the Z3 library linked into this executable instead "
+                   "of an external solver (default=false)"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> SolverPortfolio(
+    "solver-portfolio",
+    llvm::cl::desc("Run each query on all solvers given by -*-path at once "
+                   "and use the first answer (default=false)"),
+    llvm::cl::init(false));
+
 static std::unique_ptr<SMTLIBSolver> GetUnderlyingSolverFromArgs() {
+  if (Z3InProcess)
+    return createZ3InProcessSolver(KeepSolverInputs);
+
+  if (SolverPortfolio)
+    return createPortfolioSolver(BoolectorPath, CVC4Path, STPPath, Z3Path,
+                                 KeepSolverInputs);
+
+  if (PersistentSolver) {
+    if (!BoolectorPath.empty())
+      return createPersistentBoolectorSolver(BoolectorPath, KeepSolverInputs);
+    else if (!CVC4Path.empty())
+      return createPersistentCVC4Solver(CVC4Path, KeepSolverInputs);
+    else if (!STPPath.empty())
+      return createPersistentSTPSolver(STPPath, KeepSolverInputs);
+    else if (!Z3Path.empty())
+      return createPersistentZ3Solver(Z3Path, KeepSolverInputs);
+    else
+      return nullptr;
+  }
+
   if (!BoolectorPath.empty()) {
     return createBoolectorSolver(makeExternalSolverProgram(BoolectorPath),
                                  KeepSolverInputs);
@@ -69,7 +108,8 @@ static llvm::cl::opt<bool> MemCache(
 
 static llvm::cl::opt<bool> ExternalCache(
   "souper-external-cache",
-  llvm::cl::desc("Use external Redis-based cache (default=false)"),
+  llvm::cl::desc("Use external cache in Redis or in -souper-cache-file "
+                 "(default=false)"),
   llvm::cl::init(false));
 
 static llvm::cl::opt<int> SolverTimeout(
@@ -81,6 +121,8 @@ static std::unique_ptr<Solver> GetSolverFromArgs(KVStore *&KV) {
   std::unique_ptr<SMTLIBSolver> US = GetUnderlyingSolverFromArgs();
   if (!US) return NULL;
   std::unique_ptr<Solver> S = createBaseSolver (std::move(US), SolverTimeout);
+  if (ExhaustiveMaxBits)
+    S = createExhaustiveSolver(std::move(S), ExhaustiveMaxBits);
   if (ExternalCache) {
     KV = new KVStore;
     S = createExternalCachingSolver (std::move(S), KV);
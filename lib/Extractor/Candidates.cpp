@@ -304,12 +304,12 @@ void ExprBuilder::markExternalUses (Inst *I) {
   for (auto U : UsesCount)
     for (auto R : EBC.InstMap)
       if (R.second == U.first && R.first->getNumUses() != U.second)
-        I->DepsWithExternalUses.insert(U.first);
+        I->Meta->DepsWithExternalUses.insert(U.first);
 }
 
 Inst *ExprBuilder::build(Value *V, APInt DemandedBits) {
   Inst *I = buildHelper(V);
-  I->DemandedBits = DemandedBits;
+  I->Meta->DemandedBits = DemandedBits;
   return I;
 }
 
@@ -625,7 +625,7 @@ Inst *ExprBuilder::get(Value *V, APInt DemandedBits) {
   if (!E)
     E = build(V, DemandedBits);
   if (E->K != Inst::Const && !E->hasOrigin(V))
-    E->Origins.push_back(V);
+    E->Meta->Origins.push_back(V);
   return E;
 }
 
@@ -635,7 +635,7 @@ Inst *ExprBuilder::getFromUse(Value *V) {
   APInt DemandedBits = APInt::getAllOnesValue(Width);
   Inst *E = build(V, DemandedBits);
   if (E->K != Inst::Const && !E->hasOrigin(V))
-    E->Origins.push_back(V);
+    E->Meta->Origins.push_back(V);
   return E;
 }
 
@@ -648,7 +648,7 @@ Inst *ExprBuilder::get(Value *V) {
     E = build(V, DemandedBits);
   }
   if (E->K != Inst::Const && !E->hasOrigin(V))
-    E->Origins.push_back(V);
+    E->Meta->Origins.push_back(V);
   return E;
 }
 
@@ -969,8 +969,8 @@ void ExtractExprCandidates(Function &F, const LoopInfo *LI, DemandedBits *DB,
             if (U->getType()->isIntegerTy()) {
               if(Visited.insert(U).second) {
                 Inst *In = EB.getFromUse(U);
-                In->HarvestKind = HarvestType::HarvestedFromUse;
-                In->HarvestFrom = &BB;
+                In->Meta->HarvestKind = HarvestType::HarvestedFromUse;
+                In->Meta->HarvestFrom = &BB;
                 EB.markExternalUses(In);
                 BCS->Replacements.emplace_back(U, InstMapping(In, 0));
                 assert(EB.get(U)->hasOrigin(U));
@@ -992,8 +992,8 @@ void ExtractExprCandidates(Function &F, const LoopInfo *LI, DemandedBits *DB,
       } else {
         In = EB.get(&I);
       }
-      In->HarvestKind = HarvestType::HarvestedFromDef;
-      In->HarvestFrom = nullptr;
+      In->Meta->HarvestKind = HarvestType::HarvestedFromDef;
+      In->Meta->HarvestFrom = nullptr;
       EB.markExternalUses(In);
       BCS->Replacements.emplace_back(&I, InstMapping(In, 0));
       assert(EB.get(&I)->hasOrigin(&I));
@@ -15,6 +15,7 @@
 #include "llvm/Support/CommandLine.h"
 #include "souper/Extractor/ExprBuilder.h"
 
+#include <algorithm>
 #include <queue>
 
 namespace souper {
@@ -24,9 +25,23 @@ static llvm::cl::opt<souper::ExprBuilder::Builder> SMTExprBuilder(
     llvm::cl::Hidden,
     llvm::cl::desc("SMT-LIBv2 expression builder (default=klee)"),
     llvm::cl::values(clEnumValN(souper::ExprBuilder::KLEE, "klee",
-                                "Use KLEE's Expr library")),
+                                "Use KLEE's Expr library"),
+                     clEnumValN(souper::ExprBuilder::SMTLIB, "smtlib",
+                                "Print SMT-LIBv2 directly from Insts")),
     llvm::cl::init(souper::ExprBuilder::KLEE));
 
+static llvm::cl::opt<souper::ExprBuilder::Encoding> PathEncoding(
+    "souper-path-encoding",
+    llvm::cl::Hidden,
+    llvm::cl::desc("Encoding of the UB and block path conditions under "
+                   "phis and selects (default=paths)"),
+    llvm::cl::values(clEnumValN(souper::ExprBuilder::Paths, "paths",
+                                "Enumerate the paths through them"),
+                     clEnumValN(souper::ExprBuilder::Linear, "linear",
+                                "Choose between the conditions of their "
+                                "operands")),
+    llvm::cl::init(souper::ExprBuilder::Paths));
+
 bool ExprBuilder::getUBPaths(Inst *I, UBPath *Current,
                              std::vector<std::unique_ptr<UBPath>> &Paths,
                              UBPathInstMap &CachedUBPathInsts, unsigned Depth) {
@@ -271,6 +286,50 @@ Inst *ExprBuilder::createPathPred(
 // generated by souper. For example, if we say %12 depends on %11, then
 // %12 would never appear earlier than %11.
 Inst *ExprBuilder::getUBInstCondition(Inst *Root) {
+  if (PathEncoding == Linear)
+    return getLinearUBCondition(Root);
+
+  if (Inst *Cached = LIC->getUBCondition(Root, Paths))
+    return Cached;
+  Inst *Result = buildUBInstCondition(Root);
+  LIC->setUBCondition(Root, Paths, Result);
+  return Result;
+}
+
+// The linear encoding gives every Inst the condition under which it is
+// free of UB: its own, if any, and those of its operands. A phi or select
+// only depends on the operand it picks, so its condition picks between
+// theirs with the same predicates. The conditions are shared by all the
+// DAGs an Inst is part of, and the size of the result is linear in the
+// size of the DAG.
+Inst *ExprBuilder::getLinearUBCondition(Inst *I) {
+  if (Inst *Cached = LIC->getUBCondition(I, Linear))
+    return Cached;
+
+  const std::vector<Inst *> &Ops = I->orderedOps();
+  Inst *Result;
+  if (I->K == Inst::Phi) {
+    std::vector<Inst *> Conds;
+    for (auto Op : Ops)
+      Conds.push_back(getLinearUBCondition(Op));
+    Result = getChoiceInst(I, Conds);
+  } else if (I->K == Inst::Select) {
+    Result = getChoiceInst(I, {getLinearUBCondition(Ops[1]),
+                               getLinearUBCondition(Ops[2])});
+    Result = getAndInst(getLinearUBCondition(Ops[0]), Result);
+  } else {
+    Result = getUBInstConstraint(I);
+    if (!Result)
+      Result = LIC->getConst(llvm::APInt(1, true));
+    for (auto Op : Ops)
+      Result = getAndInst(Result, getLinearUBCondition(Op));
+  }
+
+  LIC->setUBCondition(I, Linear, Result);
+  return Result;
+}
+
+Inst *ExprBuilder::buildUBInstCondition(Inst *Root) {
   // A map from a Phi instruction to all of its expressions that
   // encode the path and UB Inst predicates.
   UBPathInstMap CachedUBPathInsts;
@@ -321,38 +380,46 @@ Inst *ExprBuilder::getUBInstCondition(Inst *Root) {
 }
 
 Inst *ExprBuilder::getDataflowConditions(Inst *I) {
-  Inst *Result = LIC->getConst(llvm::APInt(1, true));
-
   if (I->K != Inst::Var)
-    return Result;
+    return LIC->getConst(llvm::APInt(1, true));
+
+  Inst *&Cached = DataflowConditions[I];
+  if (!Cached)
+    Cached = buildDataflowConditions(I);
+  return Cached;
+}
+
+Inst *ExprBuilder::buildDataflowConditions(Inst *I) {
+  Inst *Result = LIC->getConst(llvm::APInt(1, true));
 
   unsigned Width = I->Width;
   Inst *Zero = LIC->getConst(llvm::APInt(Width, 0));
   Inst *One = LIC->getConst(llvm::APInt(Width, 1));
 
-  if (I->KnownZeros.getBoolValue()) {
+  if (I->Meta->KnownZeros.getBoolValue()) {
     Inst *AllOnes = LIC->getConst(llvm::APInt::getAllOnesValue(Width));
     Inst *NotZeros = LIC->getInst(Inst::Xor, Width,
-                                  {LIC->getConst(I->KnownZeros), AllOnes});
+                                  {LIC->getConst(I->Meta->KnownZeros),
+                                   AllOnes});
     Inst *VarNotZero = LIC->getInst(Inst::Or, Width, {I, NotZeros});
     Inst *ZeroBits = LIC->getInst(Inst::Eq, 1, {VarNotZero, NotZeros});
     Result = LIC->getInst(Inst::And, 1, {Result, ZeroBits});
   }
-  if (I->KnownOnes.getBoolValue()) {
-    Inst *Ones = LIC->getConst(I->KnownOnes);
+  if (I->Meta->KnownOnes.getBoolValue()) {
+    Inst *Ones = LIC->getConst(I->Meta->KnownOnes);
     Inst *VarAndOnes = LIC->getInst(Inst::And, Width, {I, Ones});
     Inst *OneBits = LIC->getInst(Inst::Eq, 1, {VarAndOnes, Ones});
     Result = LIC->getInst(Inst::And, 1, {Result, OneBits});
   }
-  if (I->NonZero) {
+  if (I->Meta->NonZero) {
     Inst *NonZeroBits = LIC->getInst(Inst::Ne, 1, {I, Zero});
     Result = LIC->getInst(Inst::And, 1, {Result, NonZeroBits});
   }
-  if (I->NonNegative) {
+  if (I->Meta->NonNegative) {
     Inst *NonNegBits = LIC->getInst(Inst::Sle, 1, {Zero, I});
     Result = LIC->getInst(Inst::And, 1, {Result, NonNegBits});
   }
-  if (I->PowOfTwo) {
+  if (I->Meta->PowOfTwo) {
     Inst *And = LIC->getInst(Inst::And, Width,
                              {I, LIC->getInst(Inst::Sub, Width, {I, One})});
     Inst *PowerTwoBits = LIC->getInst(Inst::And, 1,
@@ -360,12 +427,13 @@ Inst *ExprBuilder::getDataflowConditions(Inst *I) {
                                        LIC->getInst(Inst::Eq, 1, {And, Zero})});
     Result = LIC->getInst(Inst::And, 1, {Result, PowerTwoBits});
   }
-  if (I->Negative) {
+  if (I->Meta->Negative) {
     Inst *NegBits = LIC->getInst(Inst::Slt, 1, {I, Zero});
     Result = LIC->getInst(Inst::And, 1, {Result, NegBits});
   }
-  if (I->NumSignBits > 1) {
-    Inst *Diff = LIC->getConst(llvm::APInt(Width, Width - I->NumSignBits));
+  if (I->Meta->NumSignBits > 1) {
+    Inst *Diff = LIC->getConst(llvm::APInt(Width,
+                                           Width - I->Meta->NumSignBits));
     Inst *Res = LIC->getInst(Inst::AShr, Width, {I, Diff});
     Diff = LIC->getConst(llvm::APInt(Width, Width-1));
     Inst *TestOnes = LIC->getInst(Inst::AShr, Width,
@@ -397,12 +465,12 @@ Inst *ExprBuilder::getDataflowConditions(Inst *I) {
     }
   };
 
-  if (auto Cond = mkCRCond(I->Range)) {
+  if (auto Cond = mkCRCond(I->Meta->Range)) {
     Result = LIC->getInst(Inst::And, 1, {Result, Cond});
   }
 
   std::vector<Inst *> CRConds;
-  for (auto R : I->RangeRefinement) {
+  for (auto R : I->Meta->RangeRefinement) {
     if (auto Cond = mkCRCond(R)) {
       CRConds.push_back(Cond);
     }
@@ -424,7 +492,44 @@ Inst *ExprBuilder::getDataflowConditions(Inst *I) {
 // may make the code less structured. If we see big performance overhead,
 // we may consider to combine these two parts together.
 Inst *ExprBuilder::getBlockPCs(Inst *Root) {
+  auto It = BlockPCConditions.find(Root);
+  if (It != BlockPCConditions.end())
+    return It->second;
+  Inst *Result = PathEncoding == Linear ? buildLinearBlockPCs(Root)
+                                        : buildBlockPCs(Root);
+  BlockPCConditions[Root] = Result;
+  return Result;
+}
+
+// The blockpcs that hold when I is evaluated, in the linear encoding; see
+// getLinearUBCondition().
+Inst *ExprBuilder::buildLinearBlockPCs(Inst *I) {
+  Inst *Result = LIC->getConst(llvm::APInt(1, true));
+  if (BlockPCMap.empty())
+    return Result;
+
+  const std::vector<Inst *> &Ops = I->orderedOps();
+  if (I->K != Inst::Phi) {
+    for (auto Op : Ops)
+      Result = getAndInst(Result, getBlockPCs(Op));
+    return Result;
+  }
+
+  auto PCMap = BlockPCMap.find(I->B);
+  std::vector<Inst *> Conds;
+  for (unsigned J = 0; J < Ops.size(); ++J) {
+    Inst *Cond = getBlockPCs(Ops[J]);
+    if (PCMap != BlockPCMap.end()) {
+      auto P = PCMap->second.find(J);
+      if (P != PCMap->second.end())
+        Cond = getAndInst(P->second, Cond);
+    }
+    Conds.push_back(Cond);
+  }
+  return getChoiceInst(I, Conds);
+}
 
+Inst *ExprBuilder::buildBlockPCs(Inst *Root) {
   UBPathInstMap CachedPhis;
   Inst *Result = LIC->getConst(llvm::APInt(1, true));
   // For each Phi instruction
@@ -459,6 +564,16 @@ Inst *ExprBuilder::getBlockPCs(Inst *Root) {
 }
 
 void ExprBuilder::setBlockPCMap(const BlockPCs &BPCs) {
+  if (BPCs.size() == LastBPCs.size() &&
+      std::equal(BPCs.begin(), BPCs.end(), LastBPCs.begin(),
+                 [](const BlockPCMapping &A, const BlockPCMapping &B) {
+                   return A.B == B.B && A.PredIdx == B.PredIdx &&
+                          A.PC.LHS == B.PC.LHS && A.PC.RHS == B.PC.RHS;
+                 }))
+    return;
+  LastBPCs = BPCs;
+  BlockPCMap.clear();
+  BlockPCConditions.clear();
   for (auto BPC : BPCs) {
     assert(BPC.B && "Block is NULL!");
     BlockPCPredMap &PCMap = BlockPCMap[BPC.B];
@@ -525,6 +640,28 @@ Inst *ExprBuilder::getImpliesInst(Inst *Ante, Inst *I) {
   return LIC->getInst(Inst::Or, 1, {IsZero, I});
 }
 
+Inst *ExprBuilder::getAndInst(Inst *L, Inst *R) {
+  Inst *True = LIC->getConst(llvm::APInt(1, true));
+  if (L == True || L == R)
+    return R;
+  if (R == True)
+    return L;
+  return LIC->getInst(Inst::And, 1, {L, R});
+}
+
+// Picks one of Conds, which correspond to the operands of the phi or the
+// arms of the select I, the same way I picks its value.
+Inst *ExprBuilder::getChoiceInst(Inst *I, const std::vector<Inst *> &Conds) {
+  if (std::all_of(Conds.begin(), Conds.end(),
+                  [&Conds](Inst *C) { return C == Conds[0]; }))
+    return Conds[0];
+  if (I->K == Inst::Phi)
+    return LIC->getPhi(I->B, Conds);
+  assert(I->K == Inst::Select && Conds.size() == 2);
+  return LIC->getInst(Inst::Select, 1,
+                      {I->orderedOps()[0], Conds[0], Conds[1]});
+}
+
 Inst *ExprBuilder::addnswUB(Inst *I) {
    const std::vector<Inst *> &Ops = I->orderedOps();
    auto L = Ops[0];
@@ -700,6 +837,85 @@ Inst *ExprBuilder::ashrExactUB(Inst *I) {
    return LIC->getInst(Inst::Eq, 1, {LShift, L});
 }
 
+// Returns the condition under which I itself is free of UB, or null if it
+// can't have any.
+Inst *ExprBuilder::getUBInstConstraint(Inst *I) {
+  switch (I->K) {
+  case Inst::AddNSW:
+    return addnswUB(I);
+  case Inst::AddNUW:
+    return addnuwUB(I);
+  case Inst::AddNW:
+    return LIC->getInst(Inst::And, 1, {addnswUB(I), addnuwUB(I)});
+  case Inst::SubNSW:
+    return subnswUB(I);
+  case Inst::SubNUW:
+    return subnuwUB(I);
+  case Inst::SubNW:
+    return LIC->getInst(Inst::And, 1, {subnswUB(I), subnuwUB(I)});
+  case Inst::MulNSW:
+    return mulnswUB(I);
+  case Inst::MulNUW:
+    return mulnuwUB(I);
+  case Inst::MulNW:
+    return LIC->getInst(Inst::And, 1, {mulnswUB(I), mulnuwUB(I)});
+
+  case Inst::UDiv:
+  case Inst::SDiv:
+  case Inst::UDivExact:
+  case Inst::SDivExact:
+  case Inst::URem:
+  case Inst::SRem: { // Fall-through
+    // If the second oprand is 0, then it definitely causes UB.
+    // There are a few cases where an expression folds operations into zero,
+    // e.g., "sext i16 0 to i32", "0 + 0", "2 - 2", etc.  In all cases,
+    // we skip building the corresponding expressions and just return
+    // a constant zero.
+    Inst *R = I->Ops[1];
+    if (R == LIC->getConst(llvm::APInt(R->Width, 0)))
+      return LIC->getConst(llvm::APInt(1, false));
+
+    switch (I->K) {
+    case Inst::UDiv:
+      return udivUB(I);
+    case Inst::SDiv:
+      return sdivUB(I);
+    case Inst::UDivExact:
+      return LIC->getInst(Inst::And, 1, {udivUB(I), udivExactUB(I)});
+    case Inst::SDivExact:
+      return LIC->getInst(Inst::And, 1, {sdivUB(I), sdivExactUB(I)});
+    case Inst::URem:
+      return udivUB(I);
+    case Inst::SRem:
+      return sdivUB(I);
+    default:
+      llvm_unreachable("unknown kind");
+    }
+  }
+
+  case Inst::Shl:
+    return shiftUB(I);
+  case Inst::ShlNSW:
+    return LIC->getInst(Inst::And, 1, {shiftUB(I), shlnswUB(I)});
+  case Inst::ShlNUW:
+    return LIC->getInst(Inst::And, 1, {shiftUB(I), shlnuwUB(I)});
+  case Inst::ShlNW: {
+    Inst *nwUB = LIC->getInst(Inst::And, 1, {shlnswUB(I), shlnuwUB(I)});
+    return LIC->getInst(Inst::And, 1, {shiftUB(I), nwUB});
+  }
+  case Inst::LShr:
+    return shiftUB(I);
+  case Inst::LShrExact:
+    return LIC->getInst(Inst::And, 1, {shiftUB(I), lshrExactUB(I)});
+  case Inst::AShr:
+    return shiftUB(I);
+  case Inst::AShrExact:
+    return LIC->getInst(Inst::And, 1, {shiftUB(I), ashrExactUB(I)});
+  default:
+    return nullptr;
+  }
+}
+
 std::map<Inst *, Inst *> ExprBuilder::getUBInstConstraints(Inst *Root) {
   // breadth-first search
   std::set<Inst *> Visited;
@@ -710,135 +926,11 @@ std::map<Inst *, Inst *> ExprBuilder::getUBInstConstraints(Inst *Root) {
     Inst *I = Q.front();
     Q.pop();
     // Collect UB instructions
-    switch (I->K) {
-    case Inst::AddNSW: {
-      Result.emplace(I, addnswUB(I));
-      break;
-    }
-    case Inst::AddNUW: {
-      Result.emplace(I, addnuwUB(I));
-      break;
-    }
-    case Inst::AddNW: {
-      Result.emplace(I, LIC->getInst(Inst::And, 1,
-                                     {addnswUB(I), addnuwUB(I)}));
-      break;
-    }
-    case Inst::SubNSW: {
-      Result.emplace(I, subnswUB(I));
-      break;
-    }
-    case Inst::SubNUW: {
-      Result.emplace(I, subnuwUB(I));
-      break;
-    }
-    case Inst::SubNW: {
-      Result.emplace(I, LIC->getInst(Inst::And, 1,
-                                     {subnswUB(I), subnuwUB(I)}));
-      break;
-    }
-    case Inst::MulNSW: {
-      Result.emplace(I, mulnswUB(I));
-      break;
-    }
-    case Inst::MulNUW: {
-      Result.emplace(I, mulnuwUB(I));
-      break;
-    }
-    case Inst::MulNW: {
-      Result.emplace(I, LIC->getInst(Inst::And, 1,
-                                     {mulnswUB(I), mulnuwUB(I)}));
-      break;
-    }
-
-    case Inst::UDiv:
-    case Inst::SDiv:
-    case Inst::UDivExact:
-    case Inst::SDivExact:
-    case Inst::URem:
-    case Inst::SRem: { // Fall-through
-      // If the second oprand is 0, then it definitely causes UB.
-      // There are a few cases where an expression folds operations into zero,
-      // e.g., "sext i16 0 to i32", "0 + 0", "2 - 2", etc.  In all cases,
-      // we skip building the corresponding expressions and just return
-      // a constant zero.
-      Inst *R = I->Ops[1];
-      if (R == LIC->getConst(llvm::APInt(R->Width, 0))) {
-        Result.emplace(I, LIC->getConst(llvm::APInt(1, false)));
+    if (Inst *C = getUBInstConstraint(I)) {
+      Result.emplace(I, C);
+      // The DAG divides by zero, there is no need to look further
+      if (C == LIC->getConst(llvm::APInt(1, false)))
         return Result;
-      }
-
-      switch (I->K) {
-      default:
-        break;
-
-      case Inst::UDiv: {
-        Result.emplace(I, udivUB(I));
-        break;
-      }
-      case Inst::SDiv: {
-        Result.emplace(I, sdivUB(I));
-        break;
-      }
-      case Inst::UDivExact: {
-        Result.emplace(I, LIC->getInst(Inst::And, 1,
-                                       {udivUB(I), udivExactUB(I)}));
-        break;
-      }
-      case Inst::SDivExact: {
-        Result.emplace(I, LIC->getInst(Inst::And, 1,
-                                       {sdivUB(I), sdivExactUB(I)}));
-        break;
-      }
-      case Inst::URem: {
-        Result.emplace(I, udivUB(I));
-        break;
-      }
-      case Inst::SRem: {
-        Result.emplace(I, sdivUB(I));
-        break;
-      }
-      llvm_unreachable("unknown kind");
-      }
-    }
-
-    case Inst::Shl: {
-      Result.emplace(I, shiftUB(I));
-      break;
-    }
-    case Inst::ShlNSW: {
-      Result.emplace(I, LIC->getInst(Inst::And, 1, {shiftUB(I), shlnswUB(I)}));
-      break;
-    }
-    case Inst::ShlNUW: {
-      Result.emplace(I, LIC->getInst(Inst::And, 1, {shiftUB(I), shlnuwUB(I)}));
-      break;
-    }
-    case Inst::ShlNW: {
-      Inst *nwUB = LIC->getInst(Inst::And, 1, {shlnswUB(I), shlnuwUB(I)});
-      Result.emplace(I, LIC->getInst(Inst::And, 1, {shiftUB(I), nwUB}));
-      break;
-    }
-    case Inst::LShr: {
-      Result.emplace(I, shiftUB(I));
-      break;
-    }
-    case Inst::LShrExact: {
-      Result.emplace(I, LIC->getInst(Inst::And, 1,
-                                     {shiftUB(I), lshrExactUB(I)}));
-      break;
-    }
-    case Inst::AShr: {
-      Result.emplace(I, shiftUB(I));
-      break;
-    }
-    case Inst::AShrExact: {
-      Result.emplace(I, LIC->getInst(Inst::And, 1,
-                                     {shiftUB(I), ashrExactUB(I)}));
-      break;
-    }
-    default:
-      break;
     }
 
     if (Visited.insert(I).second)
@@ -912,8 +1004,8 @@ Inst *ExprBuilder::GetCandidateExprForReplacement(
   Inst *Ante = LIC->getConst(llvm::APInt(1, true));
 
   // Get demanded bits
-  Inst *DemandedBits = LIC->getConst(LHS->DemandedBits);
-  if (!LHS->DemandedBits.isAllOnesValue())
+  Inst *DemandedBits = LIC->getConst(LHS->Meta->DemandedBits);
+  if (!LHS->Meta->DemandedBits.isAllOnesValue())
     LHS = LIC->getInst(Inst::And, LHS->Width, {LHS, DemandedBits});
 
   // Get UB constraints of LHS
@@ -922,12 +1014,24 @@ Inst *ExprBuilder::GetCandidateExprForReplacement(
     return nullptr;
 
   // Build PCs
-  for (const auto &PC : PCs) {
-    Inst *Eq = LIC->getInst(Inst::Eq, 1, {PC.LHS, PC.RHS});
-    Ante = LIC->getInst(Inst::And, 1, {Ante, Eq});
-    // Get UB constraints of PC
-    LHSUB = LIC->getInst(Inst::And, 1, {LHSUB, getUBInstCondition(Eq)});
+  if (!LastPCAnte || PCs.size() != LastPCs.size() ||
+      !std::equal(PCs.begin(), PCs.end(), LastPCs.begin(),
+                  [](const InstMapping &A, const InstMapping &B) {
+                    return A.LHS == B.LHS && A.RHS == B.RHS;
+                  })) {
+    LastPCs = PCs;
+    LastPCAnte = LIC->getConst(llvm::APInt(1, true));
+    LastPCUB = LIC->getConst(llvm::APInt(1, true));
+    for (const auto &PC : PCs) {
+      Inst *Eq = LIC->getInst(Inst::Eq, 1, {PC.LHS, PC.RHS});
+      LastPCAnte = LIC->getInst(Inst::And, 1, {LastPCAnte, Eq});
+      // Get UB constraints of PC
+      LastPCUB = LIC->getInst(Inst::And, 1,
+                              {LastPCUB, getUBInstCondition(Eq)});
+    }
   }
+  Ante = LIC->getInst(Inst::And, 1, {Ante, LastPCAnte});
+  LHSUB = LIC->getInst(Inst::And, 1, {LHSUB, LastPCUB});
 
   // Build BPCs
   if (BPCs.size()) {
@@ -939,7 +1043,7 @@ Inst *ExprBuilder::GetCandidateExprForReplacement(
   Inst *RHS = Mapping.RHS;
 
   // Get demanded bits
-  if (!Mapping.LHS->DemandedBits.isAllOnesValue())
+  if (!Mapping.LHS->Meta->DemandedBits.isAllOnesValue())
     RHS = LIC->getInst(Inst::And, RHS->Width, {RHS, DemandedBits});
 
   // Get known bit constraints
@@ -972,33 +1076,26 @@ Inst *ExprBuilder::GetCandidateExprForReplacement(
   return Result;
 }
 
-std::string BuildQuery(InstContext &IC, const BlockPCs &BPCs,
-    const std::vector<InstMapping> &PCs, InstMapping Mapping,
-    std::vector<Inst *> *ModelVars, Inst *Precondition, bool Negate) {
-  std::unique_ptr<ExprBuilder> EB;
+std::unique_ptr<ExprBuilder> createExprBuilder(InstContext &IC) {
   switch (SMTExprBuilder) {
   case ExprBuilder::KLEE:
-    EB = createKLEEBuilder(IC);
-    break;
+    return createKLEEBuilder(IC);
+  case ExprBuilder::SMTLIB:
+    return createSMTLIBBuilder(IC);
   default:
     llvm::report_fatal_error("cannot reach here");
-    break;
   }
+}
 
+std::string BuildQuery(InstContext &IC, const BlockPCs &BPCs,
+    const std::vector<InstMapping> &PCs, InstMapping Mapping,
+    std::vector<Inst *> *ModelVars, Inst *Precondition, bool Negate) {
+  std::unique_ptr<ExprBuilder> EB = createExprBuilder(IC);
   return EB->BuildQuery(BPCs, PCs, Mapping, ModelVars, Precondition, Negate);
 }
 
 Inst *getUBInstCondition(InstContext &IC, Inst *Root) {
-  std::unique_ptr<ExprBuilder> EB;
-  switch (SMTExprBuilder) {
-  case ExprBuilder::KLEE:
-    EB = createKLEEBuilder(IC);
-    break;
-  default:
-    llvm::report_fatal_error("cannot reach here");
-    break;
-  }
-
+  std::unique_ptr<ExprBuilder> EB = createExprBuilder(IC);
   return EB->getUBInstCondition(Root);
 }
 
@@ -77,8 +77,12 @@ public:
     Printer.setQuery(KQuery);
     std::vector<const klee::Array *> Arr;
     if (ModelVars) {
+      // Arrays outlive the query they were made for, so only ask for the
+      // values of those this query reads.
+      InstVisitSet Reachable;
+      markReachable(Cand, Reachable);
       for (unsigned I = 0; I != Vars.size(); ++I) {
-        if (Vars[I]) {
+        if (Vars[I] && Reachable.count(Vars[I])) {
           Arr.push_back(Arrays[I].get());
           ModelVars->push_back(Vars[I]);
         }
@@ -130,7 +134,7 @@ private:
       return klee::ConstantExpr::alloc(I->Val);
     case Inst::Hole:
     case Inst::Var:
-      return makeSizedArrayRead(I->Width, I->Name, I);
+      return makeSizedArrayRead(I->Width, I->Meta->Name, I);
     case Inst::Phi: {
       const auto &PredExpr = I->B->PredVars;
       assert((PredExpr.size() || Ops.size() == 1) && "there must be block predicates");
@@ -476,6 +480,22 @@ private:
     });
   }
 
+  // Marks the Insts that get() visits for Root, including the block
+  // predicates of phis.
+  void markReachable(Inst *Root, InstVisitSet &Visited) {
+    std::vector<Inst *> Stack{Root};
+    while (!Stack.empty()) {
+      Inst *I = Stack.back();
+      Stack.pop_back();
+      if (!Visited.insert(I))
+        continue;
+      if (I->K == Inst::Phi)
+        Stack.insert(Stack.end(), I->B->PredVars.begin(),
+                     I->B->PredVars.end());
+      Stack.insert(Stack.end(), I->Ops.begin(), I->Ops.end());
+    }
+  }
+
   ref<Expr> makeSizedArrayRead(unsigned Width, llvm::StringRef Name, Inst *Origin) {
     std::string NameStr;
     if (Name.empty())
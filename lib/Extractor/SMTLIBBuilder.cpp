@@ -0,0 +1,574 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/Extractor/ExprBuilder.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cctype>
+#include <unordered_map>
+
+using namespace souper;
+
+namespace {
+
+// Longest chain of single-use subterms printed inline before one of them
+// is bound anyway; this bounds the recursion of print().
+const unsigned MaxInlineDepth = 32;
+
+// Prints SMT-LIB queries straight from the Inst DAG. Every value is a bit
+// vector, including 1-bit ones. Subterms used more than once are bound by
+// let, one let per level of the DAG, so that a query is linear in the size
+// of the candidate.
+class SMTLIBBuilder : public ExprBuilder {
+  struct Node {
+    llvm::SmallVector<Inst *, 3> Deps;
+    unsigned Uses = 0;
+    unsigned Depth = 0;
+    unsigned Level = 0;
+    unsigned Id = 0;
+    bool Visited = false;
+    bool Bound = false;
+  };
+
+  // Like the arrays of the KLEE builder, variables outlive the query that
+  // first used them, so that a builder can be shared by many queries.
+  UniqueNameSet VarNames;
+  std::vector<Inst *> Vars;
+  std::unordered_map<Inst *, std::string> VarSymbols;
+
+  // The nodes of the query being printed.
+  std::unordered_map<Inst *, Node> Nodes;
+  std::vector<Inst *> PostOrder;
+  unsigned MaxLevel = 0;
+
+public:
+  SMTLIBBuilder(InstContext &IC) : ExprBuilder(IC) {}
+
+  std::string GetExprStr(const BlockPCs &BPCs,
+                         const std::vector<InstMapping> &PCs,
+                         InstMapping Mapping,
+                         std::vector<Inst *> *ModelVars, bool Negate) override {
+    Inst *Cand = GetCandidateExprForReplacement(BPCs, PCs, Mapping,
+                                                /*Precondition=*/0, Negate);
+    if (!Cand)
+      return std::string();
+    collect(Cand);
+
+    std::string SStr;
+    llvm::raw_string_ostream SS(SStr);
+    printLets(Cand, SS);
+    return SS.str();
+  }
+
+  std::string BuildQuery(const BlockPCs &BPCs,
+                         const std::vector<InstMapping> &PCs,
+                         InstMapping Mapping,
+                         std::vector<Inst *> *ModelVars,
+                         Inst *Precondition, bool Negate) override {
+    Inst *Cand = GetCandidateExprForReplacement(BPCs, PCs, Mapping,
+                                                Precondition, Negate);
+    if (!Cand)
+      return std::string();
+    collect(Cand);
+
+    std::string SMTStr;
+    llvm::raw_string_ostream SMTSS(SMTStr);
+    if (ModelVars)
+      SMTSS << "(set-option :produce-models true)\n";
+    SMTSS << "(set-logic QF_BV)\n";
+    std::vector<Inst *> Used;
+    for (Inst *V : Vars) {
+      if (!Nodes.count(V))
+        continue;
+      Used.push_back(V);
+      SMTSS << "(declare-fun " << VarSymbols[V] << " () (_ BitVec "
+            << V->Width << "))\n";
+    }
+    // The candidate has to be valid, so look for an assignment that
+    // falsifies it.
+    SMTSS << "(assert (= #b0 ";
+    printLets(Cand, SMTSS);
+    SMTSS << "))\n(check-sat)\n";
+    if (ModelVars) {
+      for (Inst *V : Used) {
+        SMTSS << "(get-value (" << VarSymbols[V] << "))\n";
+        ModelVars->push_back(V);
+      }
+    }
+    SMTSS << "(exit)\n";
+
+    return SMTSS.str();
+  }
+
+private:
+  static bool isLeaf(Inst *I) {
+    return I->K == Inst::Var || I->K == Inst::Hole || I->K == Inst::Const;
+  }
+
+  // The Insts whose terms the term of I is made of. These are the operands
+  // except where the term is built from a UB condition or, for the
+  // overflow intrinsics, skips the aggregate.
+  void getDeps(Inst *I, llvm::SmallVectorImpl<Inst *> &Deps) {
+    switch (I->K) {
+    case Inst::Phi:
+      Deps.append(I->Ops.begin(), I->Ops.end());
+      assert(I->B->PredVars.size() + 1 >= I->Ops.size() &&
+             "there must be block predicates");
+      Deps.append(I->B->PredVars.begin(),
+                  I->B->PredVars.begin() + (I->Ops.size() - 1));
+      return;
+    case Inst::ExtractValue:
+      Deps.push_back(I->Ops[0]->Ops[I->Ops[1]->Val.getZExtValue()]);
+      return;
+    case Inst::SAddO:
+    case Inst::UAddO:
+    case Inst::SSubO:
+    case Inst::USubO:
+    case Inst::SMulO:
+    case Inst::UMulO:
+      Deps.push_back(getOverflowCond(I));
+      return;
+    case Inst::UAddSat:
+    case Inst::USubSat:
+      Deps.append(I->Ops.begin(), I->Ops.end());
+      Deps.push_back(getOverflowCond(I));
+      return;
+    default:
+      Deps.append(I->Ops.begin(), I->Ops.end());
+      return;
+    }
+  }
+
+  // The condition under which I doesn't overflow.
+  Inst *getOverflowCond(Inst *I) {
+    switch (I->K) {
+    case Inst::SAddO:
+      return addnswUB(I);
+    case Inst::UAddO:
+    case Inst::UAddSat:
+      return addnuwUB(I);
+    case Inst::SSubO:
+      return subnswUB(I);
+    case Inst::USubO:
+    case Inst::USubSat:
+      return subnuwUB(I);
+    case Inst::SMulO:
+      return mulnswUB(I);
+    case Inst::UMulO:
+      return mulnuwUB(I);
+    default:
+      llvm_unreachable("not an overflow check");
+    }
+  }
+
+  // Finds the nodes of the query and decides which of them are bound.
+  void collect(Inst *Root) {
+    Nodes.clear();
+    PostOrder.clear();
+    std::vector<std::pair<Inst *, bool>> Stack;
+    Stack.emplace_back(Root, false);
+    while (!Stack.empty()) {
+      Inst *I = Stack.back().first;
+      bool Expanded = Stack.back().second;
+      Stack.pop_back();
+      if (Expanded) {
+        PostOrder.push_back(I);
+        continue;
+      }
+      Node &N = Nodes[I];
+      if (N.Visited)
+        continue;
+      N.Visited = true;
+      Stack.emplace_back(I, true);
+      if ((I->K == Inst::Var || I->K == Inst::Hole) && !VarSymbols.count(I))
+        addVar(I);
+      getDeps(I, N.Deps);
+      for (Inst *D : N.Deps) {
+        ++Nodes[D].Uses;
+        Stack.emplace_back(D, false);
+      }
+    }
+
+    unsigned NextId = 0;
+    MaxLevel = 0;
+    for (Inst *I : PostOrder) {
+      Node &N = Nodes[I];
+      if (isLeaf(I))
+        continue;
+      unsigned Depth = 1, Level = 0;
+      for (Inst *D : N.Deps) {
+        const Node &DN = Nodes[D];
+        Level = std::max(Level, DN.Level);
+        if (!DN.Bound)
+          Depth = std::max(Depth, DN.Depth + 1);
+      }
+      N.Level = Level;
+      N.Depth = Depth;
+      if (I != Root && (N.Uses > 1 || Depth > MaxInlineDepth)) {
+        N.Bound = true;
+        N.Level = Level + 1;
+        N.Depth = 0;
+        N.Id = NextId++;
+        MaxLevel = std::max(MaxLevel, N.Level);
+      }
+    }
+  }
+
+  void addVar(Inst *I) {
+    llvm::StringRef Name = I->Meta->Name;
+    std::string Sym;
+    for (char C : Name)
+      Sym += (isalnum(C) || C == '_' || C == '.') ? C : '_';
+    if (Sym.empty())
+      Sym = "x";
+    else if (Sym[0] >= '0' && Sym[0] <= '9')
+      Sym = "a" + Sym;
+    VarSymbols[I] = VarNames.makeName(Sym);
+    Vars.push_back(I);
+  }
+
+  // Prints the bound subterms, level by level, around the root.
+  void printLets(Inst *Root, llvm::raw_ostream &OS) {
+    std::vector<std::vector<Inst *>> Levels(MaxLevel + 1);
+    for (Inst *I : PostOrder)
+      if (Nodes[I].Bound)
+        Levels[Nodes[I].Level].push_back(I);
+    for (unsigned L = 1; L <= MaxLevel; ++L) {
+      OS << "(let (";
+      for (Inst *I : Levels[L]) {
+        OS << "(?t" << Nodes[I].Id << ' ';
+        print(I, OS);
+        OS << ')';
+      }
+      OS << ")\n";
+    }
+    print(Root, OS);
+    for (unsigned L = 1; L <= MaxLevel; ++L)
+      OS << ')';
+  }
+
+  static void printConst(const llvm::APInt &Val, llvm::raw_ostream &OS) {
+    unsigned W = Val.getBitWidth();
+    bool Hex = W % 4 == 0;
+    llvm::SmallString<64> S;
+    Val.toStringUnsigned(S, Hex ? 16 : 2);
+    OS << (Hex ? "#x" : "#b");
+    for (unsigned I = S.size(), E = Hex ? W / 4 : W; I < E; ++I)
+      OS << '0';
+    OS << S;
+  }
+
+  void term(Inst *I, llvm::raw_ostream &OS) {
+    const Node &N = Nodes[I];
+    if (N.Bound)
+      OS << "?t" << N.Id;
+    else
+      print(I, OS);
+  }
+
+  void app(const char *Op, Inst *I, llvm::raw_ostream &OS) {
+    OS << '(' << Op;
+    for (Inst *D : Nodes[I].Deps) {
+      OS << ' ';
+      term(D, OS);
+    }
+    OS << ')';
+  }
+
+  void cmp(const char *Op, Inst *I, llvm::raw_ostream &OS) {
+    OS << "(ite ";
+    app(Op, I, OS);
+    OS << " #b1 #b0)";
+  }
+
+  // The number of set bits of the W-bit term in Var, which must not be
+  // shadowed by ?p. The bits are added in parallel by halving the number
+  // of fields in each step, rather than one at a time.
+  static void printPopCount(llvm::StringRef Var, unsigned W,
+                            llvm::raw_ostream &OS) {
+    if (W == 1) {
+      OS << Var;
+      return;
+    }
+    unsigned P = llvm::PowerOf2Ceil(W);
+    unsigned Parens = 0;
+    if (P != W) {
+      OS << "(let ((?p ((_ zero_extend " << P - W << ") " << Var << "))) ";
+      Var = "?p";
+      ++Parens;
+    }
+    for (unsigned S = 1; S < P; S *= 2) {
+      llvm::APInt Mask(P, 0);
+      for (unsigned B = 0; B != P; ++B)
+        if ((B / S) % 2 == 0)
+          Mask.setBit(B);
+      OS << "(let ((?p (bvadd (bvand " << Var << ' ';
+      printConst(Mask, OS);
+      OS << ") (bvand (bvlshr " << Var << ' ';
+      printConst(llvm::APInt(P, S), OS);
+      OS << ") ";
+      printConst(Mask, OS);
+      OS << ")))) ";
+      Var = "?p";
+      ++Parens;
+    }
+    if (P != W)
+      OS << "((_ extract " << W - 1 << " 0) ?p)";
+    else
+      OS << "?p";
+    for (unsigned I = 0; I != Parens; ++I)
+      OS << ')';
+  }
+
+  // The number of leading (Leading) or trailing zeros of I's operand: the
+  // operand is smeared towards its other end and the zeros left counted.
+  void printCountZeros(Inst *I, bool Leading, llvm::raw_ostream &OS) {
+    unsigned W = I->Width;
+    OS << "(let ((?v ";
+    term(I->Ops[0], OS);
+    OS << ")) ";
+    unsigned Parens = 1;
+    for (unsigned S = 1; S < W; S *= 2) {
+      OS << "(let ((?v (bvor ?v (" << (Leading ? "bvlshr" : "bvshl")
+         << " ?v ";
+      printConst(llvm::APInt(W, S), OS);
+      OS << ")))) ";
+      ++Parens;
+    }
+    OS << "(bvsub ";
+    printConst(llvm::APInt(W, W), OS);
+    OS << ' ';
+    printPopCount("?v", W, OS);
+    OS << ')';
+    for (unsigned J = 0; J != Parens; ++J)
+      OS << ')';
+  }
+
+  // Saturating signed addition or subtraction, computed one bit wider.
+  void printSignedSat(Inst *I, const char *Op, llvm::raw_ostream &OS) {
+    unsigned W = I->Width;
+    llvm::APInt SMin = llvm::APInt::getSignedMinValue(W);
+    llvm::APInt SMax = llvm::APInt::getSignedMaxValue(W);
+    OS << "(let ((?w (" << Op << " ((_ sign_extend 1) ";
+    term(I->Ops[0], OS);
+    OS << ") ((_ sign_extend 1) ";
+    term(I->Ops[1], OS);
+    OS << ")))) (ite (bvsle ?w ";
+    printConst(SMin.sext(W + 1), OS);
+    OS << ") ";
+    printConst(SMin, OS);
+    OS << " (ite (bvsge ?w ";
+    printConst(SMax.sext(W + 1), OS);
+    OS << ") ";
+    printConst(SMax, OS);
+    OS << " ((_ extract " << W - 1 << " 0) ?w))))";
+  }
+
+  void print(Inst *I, llvm::raw_ostream &OS) {
+    const std::vector<Inst *> &Ops = I->Ops;
+    switch (I->K) {
+    case Inst::Const:
+      printConst(I->Val, OS);
+      return;
+    case Inst::Hole:
+    case Inst::Var:
+      OS << VarSymbols[I];
+      return;
+    case Inst::Phi: {
+      // e.g. P2 ? (P1 ? Op1 : Op2) : Op3, like the KLEE builder
+      const auto &PredVars = I->B->PredVars;
+      for (unsigned J = Ops.size() - 1; J != 0; --J) {
+        OS << "(ite (= ";
+        term(PredVars[J - 1], OS);
+        OS << " #b1) ";
+      }
+      term(Ops[0], OS);
+      for (unsigned J = 1; J != Ops.size(); ++J) {
+        OS << ' ';
+        term(Ops[J], OS);
+        OS << ')';
+      }
+      return;
+    }
+    case Inst::Add:
+    case Inst::AddNSW:
+    case Inst::AddNUW:
+    case Inst::AddNW:
+      return app("bvadd", I, OS);
+    case Inst::Sub:
+    case Inst::SubNSW:
+    case Inst::SubNUW:
+    case Inst::SubNW:
+      return app("bvsub", I, OS);
+    case Inst::Mul:
+    case Inst::MulNSW:
+    case Inst::MulNUW:
+    case Inst::MulNW:
+      return app("bvmul", I, OS);
+    case Inst::UDiv:
+    case Inst::UDivExact:
+      return app("bvudiv", I, OS);
+    case Inst::SDiv:
+    case Inst::SDivExact:
+      return app("bvsdiv", I, OS);
+    case Inst::URem:
+      return app("bvurem", I, OS);
+    case Inst::SRem:
+      return app("bvsrem", I, OS);
+    case Inst::And:
+      return app("bvand", I, OS);
+    case Inst::Or:
+      return app("bvor", I, OS);
+    case Inst::Xor:
+      return app("bvxor", I, OS);
+    case Inst::Shl:
+    case Inst::ShlNSW:
+    case Inst::ShlNUW:
+    case Inst::ShlNW:
+      return app("bvshl", I, OS);
+    case Inst::LShr:
+    case Inst::LShrExact:
+      return app("bvlshr", I, OS);
+    case Inst::AShr:
+    case Inst::AShrExact:
+      return app("bvashr", I, OS);
+    case Inst::Select:
+      OS << "(ite (= ";
+      term(Ops[0], OS);
+      OS << " #b1) ";
+      term(Ops[1], OS);
+      OS << ' ';
+      term(Ops[2], OS);
+      OS << ')';
+      return;
+    case Inst::ZExt:
+      OS << "((_ zero_extend " << I->Width - Ops[0]->Width << ") ";
+      term(Ops[0], OS);
+      OS << ')';
+      return;
+    case Inst::SExt:
+      OS << "((_ sign_extend " << I->Width - Ops[0]->Width << ") ";
+      term(Ops[0], OS);
+      OS << ')';
+      return;
+    case Inst::Trunc:
+      OS << "((_ extract " << I->Width - 1 << " 0) ";
+      term(Ops[0], OS);
+      OS << ')';
+      return;
+    case Inst::Eq:
+      return cmp("=", I, OS);
+    case Inst::Ne:
+      return cmp("distinct", I, OS);
+    case Inst::Ult:
+      return cmp("bvult", I, OS);
+    case Inst::Slt:
+      return cmp("bvslt", I, OS);
+    case Inst::Ule:
+      return cmp("bvule", I, OS);
+    case Inst::Sle:
+      return cmp("bvsle", I, OS);
+    case Inst::CtPop:
+      OS << "(let ((?c ";
+      term(Ops[0], OS);
+      OS << ")) ";
+      printPopCount("?c", I->Width, OS);
+      OS << ')';
+      return;
+    case Inst::Cttz:
+      return printCountZeros(I, /*Leading=*/false, OS);
+    case Inst::Ctlz:
+      return printCountZeros(I, /*Leading=*/true, OS);
+    case Inst::BSwap: {
+      // The lowest byte becomes the highest.
+      OS << "(let ((?b ";
+      term(Ops[0], OS);
+      OS << ")) (concat";
+      for (unsigned B = 0; B != I->Width / 8; ++B)
+        OS << " ((_ extract " << B * 8 + 7 << ' ' << B * 8 << ") ?b)";
+      OS << "))";
+      return;
+    }
+    case Inst::BitReverse: {
+      OS << "(let ((?b ";
+      term(Ops[0], OS);
+      OS << ")) (concat";
+      for (unsigned B = 0; B != I->Width; ++B)
+        OS << " ((_ extract " << B << ' ' << B << ") ?b)";
+      OS << "))";
+      return;
+    }
+    case Inst::FShl:
+    case Inst::FShr: {
+      unsigned W = I->Width;
+      OS << '(' << "(_ extract " << (I->K == Inst::FShl ? 2 * W - 1 : W - 1)
+         << ' ' << (I->K == Inst::FShl ? W : 0) << ") ("
+         << (I->K == Inst::FShl ? "bvshl" : "bvlshr") << " (concat ";
+      term(Ops[0], OS);
+      OS << ' ';
+      term(Ops[1], OS);
+      OS << ") ((_ zero_extend " << W << ") (bvurem ";
+      term(Ops[2], OS);
+      OS << ' ';
+      printConst(llvm::APInt(W, W), OS);
+      OS << "))))";
+      return;
+    }
+    case Inst::SAddO:
+    case Inst::UAddO:
+    case Inst::SSubO:
+    case Inst::USubO:
+    case Inst::SMulO:
+    case Inst::UMulO:
+      OS << "(bvnot ";
+      term(Nodes[I].Deps[0], OS);
+      OS << ')';
+      return;
+    case Inst::ExtractValue:
+      term(Nodes[I].Deps[0], OS);
+      return;
+    case Inst::SAddSat:
+      return printSignedSat(I, "bvadd", OS);
+    case Inst::SSubSat:
+      return printSignedSat(I, "bvsub", OS);
+    case Inst::UAddSat:
+    case Inst::USubSat:
+      OS << "(ite (= ";
+      term(Nodes[I].Deps[2], OS);
+      OS << " #b1) (" << (I->K == Inst::UAddSat ? "bvadd" : "bvsub") << ' ';
+      term(Ops[0], OS);
+      OS << ' ';
+      term(Ops[1], OS);
+      OS << ") ";
+      printConst(I->K == Inst::UAddSat ? llvm::APInt::getMaxValue(I->Width)
+                                       : llvm::APInt::getMinValue(I->Width),
+                 OS);
+      OS << ')';
+      return;
+    default:
+      break;
+    }
+    llvm_unreachable("unknown kind");
+  }
+};
+
+}
+
+std::unique_ptr<ExprBuilder> souper::createSMTLIBBuilder(InstContext &IC) {
+  return std::unique_ptr<ExprBuilder>(new SMTLIBBuilder(IC));
+}
@@ -15,6 +15,7 @@
 #define DEBUG_TYPE "souper"
 
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Instruction.h"
@@ -26,6 +27,7 @@
 #include "souper/Infer/ConstantSynthesis.h"
 #include "souper/Infer/EnumerativeSynthesis.h"
 #include "souper/Infer/InstSynthesis.h"
+#include "souper/Infer/Interpreter.h"
 #include "souper/Infer/Pruning.h"
 #include "souper/KVStore/KVStore.h"
 #include "souper/Parser/Parser.h"
@@ -36,8 +38,28 @@ STATISTIC(MemHitsInfer, "Number of internal cache hits for infer()");
 STATISTIC(MemMissesInfer, "Number of internal cache misses for infer()");
 STATISTIC(MemHitsIsValid, "Number of internal cache hits for isValid()");
 STATISTIC(MemMissesIsValid, "Number of internal cache misses for isValid()");
+STATISTIC(MemHashCollisions,
+          "Number of internal cache lookups whose structural hash collided");
+STATISTIC(MemHitsDataflow, "Number of internal cache hits for dataflow facts");
+STATISTIC(MemMissesDataflow,
+          "Number of internal cache misses for dataflow facts");
 STATISTIC(ExternalHits, "Number of external cache hits");
 STATISTIC(ExternalMisses, "Number of external cache misses");
+STATISTIC(ExternalPrefetched,
+          "Number of external cache lookups answered by a prefetch");
+STATISTIC(ExternalDataflowHits,
+          "Number of external cache hits for dataflow facts");
+STATISTIC(ExternalDataflowMisses,
+          "Number of external cache misses for dataflow facts");
+STATISTIC(DemandedBitsQueries,
+          "Number of solver queries made to infer demanded bits");
+STATISTIC(KnownBitsQueries, "Number of solver queries made to infer known bits");
+STATISTIC(SignBitsQueries, "Number of solver queries made to infer sign bits");
+STATISTIC(RangeQueries, "Number of solver queries made to infer ranges");
+STATISTIC(RangeSynthesisFallbacks,
+          "Number of range sizes left to constant synthesis");
+STATISTIC(ExhaustiveIsValid, "Number of isValid() queries answered by "
+                             "evaluating every input");
 
 using namespace souper;
 using namespace llvm;
@@ -71,11 +93,71 @@ static cl::opt<int> MaxLHSSize("souper-max-lhs-size",
 static cl::opt<int> MaxConstantSynthesisTries("souper-max-constant-synthesis-tries",
     cl::desc("Max number of constant synthesis tries. (default=30)"),
     cl::init(30));
+static cl::opt<bool> DemandedBitsPerBit("souper-demanded-bits-per-bit",
+    cl::desc("Infer demanded bits with two queries per bit instead of one "
+             "query per demanded bit (default=false)"),
+    cl::init(false));
+static cl::opt<bool> KnownBitsPerBit("souper-known-bits-per-bit",
+    cl::desc("Infer known bits with one query per bit and polarity instead of "
+             "refining a guess with counterexamples (default=false)"),
+    cl::init(false));
 
 
+// Finds the shortest possibly wrapped interval [Start, Start+Size) that
+// contains all of Values, which must be sorted and distinct. Size has one
+// bit more than the values so that it can hold the size of the full set.
+void getCoveringInterval(const std::vector<APInt> &Values, APInt &Start,
+                         APInt &Size) {
+  unsigned W = Values.front().getBitWidth();
+  // The interval begins right after the largest gap between neighbours,
+  // counting the gap that wraps around from the last value to the first.
+  unsigned Begin = 0;
+  APInt MaxGap = Values.front() - Values.back();
+  for (unsigned I = 0; I + 1 < Values.size(); ++I) {
+    APInt Gap = Values[I + 1] - Values[I];
+    if (Gap.ugt(MaxGap)) {
+      MaxGap = Gap;
+      Begin = I + 1;
+    }
+  }
+  if (Values.size() == 1)
+    Begin = 0;
+  const APInt &End = Values[(Begin + Values.size() - 1) % Values.size()];
+  Start = Values[Begin];
+  Size = (End - Start).zext(W + 1) + 1;
+}
+
 class BaseSolver : public Solver {
   std::unique_ptr<SMTLIBSolver> SMTSolver;
   unsigned Timeout;
+  // Set while a dataflow fact is being inferred. Its queries differ only in
+  // the guess about LHS, so they share the builder.
+  std::unique_ptr<ExprBuilder> EB;
+
+  class SharedBuilder {
+    BaseSolver &S;
+    bool Owner;
+
+  public:
+    SharedBuilder(BaseSolver &S, InstContext &IC) : S(S), Owner(!S.EB) {
+      if (Owner)
+        S.EB = createExprBuilder(IC);
+    }
+    ~SharedBuilder() {
+      if (Owner)
+        S.EB.reset();
+    }
+  };
+
+  std::string buildQuery(InstContext &IC, const BlockPCs &BPCs,
+                         const std::vector<InstMapping> &PCs,
+                         InstMapping Mapping, std::vector<Inst *> *ModelVars,
+                         Inst *Precondition, bool Negate = false) {
+    if (EB)
+      return EB->BuildQuery(BPCs, PCs, Mapping, ModelVars, Precondition,
+                            Negate);
+    return BuildQuery(IC, BPCs, PCs, Mapping, ModelVars, Precondition, Negate);
+  }
 
 public:
   BaseSolver(std::unique_ptr<SMTLIBSolver> SMTSolver, unsigned Timeout)
@@ -86,7 +168,7 @@ public:
     if (!Visited.insert(Node).second)
       return;
     if (Node->K == Inst::Var) {
-      std::string Name = Node->Name;
+      std::string Name = Node->Meta->Name;
       VarsVect.insert(std::pair<std::string, unsigned>(Name, Node->Width));
     }
     for (auto const &Op : Node->Ops) {
@@ -100,7 +182,7 @@ public:
     if (!Visited.insert(Node).second)
       return;
     if (Node->K == Inst::Var) {
-      std::string Name = Node->Name;
+      std::string Name = Node->Meta->Name;
       VarsVect.insert(std::pair<std::string, unsigned>(Name, Node->Width));
     }
     for (auto const &Op : Node->Ops) {
@@ -128,7 +210,7 @@ public:
     }
 
     Inst *Copy = nullptr;
-    if (Node->K == Inst::Var && Node->Name == VarName) {
+    if (Node->K == Inst::Var && Node->Meta->Name == VarName) {
       unsigned VarWidth = Node->Width;
       if (SetBit) {
         APInt SetBit = APInt::getOneBitSet(VarWidth, BitPos);
@@ -141,7 +223,7 @@ public:
                                      {Node, IC.getConst(ClearBit)});
         Copy = ClearMask;
       }
-    } else if (Node->K == Inst::Var && Node->Name != VarName) {
+    } else if (Node->K == Inst::Var && Node->Meta->Name != VarName) {
       Copy = Node;
     } else if (Node->K == Inst::Const || Node->K == Inst::UntypedConst) {
       Copy = Node;
@@ -166,8 +248,9 @@ public:
     InstMapping Mapping(Ante, True);
 
     bool IsSat;
-    std::string Query = BuildQuery(IC, BPCs, PCs, Mapping, 0,
+    std::string Query = buildQuery(IC, BPCs, PCs, Mapping, 0,
                                    /*Precondition=*/0, true);
+    ++DemandedBitsQueries;
     std::error_code EC = SMTSolver->isSatisfiable(Query, IsSat, 0, 0, Timeout);
 
     if (EC)
@@ -175,15 +258,150 @@ public:
     return !IsSat;
   }
 
+  Inst *replaceVar(Inst *Node, const std::string &VarName, Inst *Replacement,
+                   InstContext &IC, std::map<Inst *, Inst *> &InstCache) {
+    if (InstCache.count(Node))
+      return InstCache.at(Node);
+    Inst *Copy;
+    if (Node->K == Inst::Var) {
+      Copy = Node->Meta->Name == VarName ? Replacement : Node;
+    } else if (Node->K == Inst::Const || Node->K == Inst::UntypedConst) {
+      Copy = Node;
+    } else {
+      std::vector<Inst *> Ops;
+      for (auto const &Op : Node->Ops)
+        Ops.push_back(replaceVar(Op, VarName, Replacement, IC, InstCache));
+      if (Node->K == Inst::Phi)
+        Copy = IC.getPhi(Node->B, Ops);
+      else
+        Copy = IC.getInst(Node->K, Node->Width, Ops);
+    }
+    InstCache[Node] = Copy;
+    return Copy;
+  }
+
+  // Finds the demanded bits of VarName with a query that asks for any
+  // input and any single bit of VarName whose flip changes the LHS. The
+  // bit is read from the model of a one-hot selector and excluded from the
+  // next query; the input is also used to flip every other undecided bit
+  // in the interpreter, which usually finds most demanded bits at once.
+  // When the query becomes unsatisfiable, no undecided bit is demanded.
+  // Bits are left in Undecided, for the per-bit tests, if a model can't be
+  // used.
+  void findDemandedBits(const BlockPCs &BPCs,
+                        const std::vector<InstMapping> &PCs, Inst *LHS,
+                        const std::string &VarName, unsigned VarWidth,
+                        APInt &Demanded, APInt &Undecided, InstContext &IC) {
+    Inst *Var = nullptr;
+    std::vector<Inst *> Vars;
+    findVars(LHS, Vars);
+    for (auto V : Vars) {
+      if (V->Meta->Name != VarName)
+        continue;
+      // Leave distinct variables that share a name to the per-bit tests.
+      if (Var)
+        return;
+      Var = V;
+    }
+    if (!Var) {
+      // LHS doesn't depend on the variable at all.
+      Undecided = APInt::getNullValue(VarWidth);
+      return;
+    }
+    Inst *Sel = IC.createVar(VarWidth, "demandedbit");
+    std::map<Inst *, Inst *> InstCache;
+    Inst *NewLHS = replaceVar(LHS, VarName,
+                              IC.getInst(Inst::Xor, VarWidth, {Var, Sel}),
+                              IC, InstCache);
+    bool CanEvaluate =
+      !hasGivenInst(LHS, [](Inst *I) { return I->K == Inst::Phi; });
+    CompiledInst Tape(LHS);
+
+    Inst *Zero = IC.getConst(APInt::getNullValue(VarWidth));
+    Inst *OneHot = IC.getInst(Inst::And, 1, {
+        IC.getInst(Inst::Ne, 1, {Sel, Zero}),
+        IC.getInst(Inst::Eq, 1, {IC.getInst(Inst::And, VarWidth, {
+              Sel, IC.getInst(Inst::Sub, VarWidth, {
+                  Sel, IC.getConst(APInt(VarWidth, 1))})}), Zero})});
+    Inst *True = IC.getConst(APInt(1, 1));
+
+    while (!!Undecided) {
+      Inst *InUndecided = IC.getInst(Inst::Eq, 1, {
+          IC.getInst(Inst::And, VarWidth, {Sel, IC.getConst(~Undecided)}),
+          Zero});
+      Inst *Ante = IC.getInst(Inst::And, 1, {
+          IC.getInst(Inst::And, 1, {OneHot, InUndecided}),
+          IC.getInst(Inst::Ne, 1, {LHS, NewLHS})});
+      InstMapping Mapping(Ante, True);
+      std::vector<Inst *> ModelInsts;
+      std::string Query = buildQuery(IC, BPCs, PCs, Mapping, &ModelInsts,
+                                     /*Precondition=*/0, true);
+      if (Query.empty())
+        return;
+      bool IsSat;
+      std::vector<APInt> ModelVals;
+      ++DemandedBitsQueries;
+      if (SMTSolver->isSatisfiable(Query, IsSat, ModelInsts.size(),
+                                   &ModelVals, Timeout))
+        return;
+      if (!IsSat) {
+        Undecided = APInt::getNullValue(VarWidth);
+        return;
+      }
+
+      ValueCache VC;
+      for (unsigned I = 0; I != ModelInsts.size(); ++I)
+        VC[ModelInsts[I]] = ModelVals[I];
+      if (!VC.count(Sel))
+        return;
+      APInt Bit = VC[Sel].getValue();
+      if (!Bit.isPowerOf2() || !(Bit & Undecided))
+        return;
+      Demanded |= Bit;
+      Undecided &= ~Bit;
+
+      if (!CanEvaluate)
+        continue;
+      bool HaveInputs = true;
+      for (auto V : Vars)
+        HaveInputs &= VC.count(V) != 0;
+      if (!HaveInputs)
+        continue;
+      std::vector<ValueCache> Inputs{VC};
+      std::vector<unsigned> Flipped;
+      for (unsigned J = 0; J != VarWidth; ++J) {
+        if (!Undecided[J])
+          continue;
+        ValueCache Input = VC;
+        Input[Var] = VC[Var].getValue() ^ APInt::getOneBitSet(VarWidth, J);
+        Inputs.push_back(Input);
+        Flipped.push_back(J);
+      }
+      std::vector<EvalValue> Results;
+      Tape.evaluate(Inputs, Results);
+      if (!Results[0].hasValue())
+        continue;
+      for (unsigned J = 0; J != Flipped.size(); ++J) {
+        if (Results[J + 1].hasValue() &&
+            Results[J + 1].getValue() != Results[0].getValue()) {
+          Demanded.setBit(Flipped[J]);
+          Undecided.clearBit(Flipped[J]);
+        }
+      }
+    }
+  }
+
   std::error_code testDemandedBits(const BlockPCs &BPCs,
                                    const std::vector<InstMapping> &PCs,
                                    Inst *LHS,
                                    std::map<std::string, APInt> &ResDBVect,
                                    InstContext &IC) override {
+    SharedBuilder Shared(*this, IC);
     unsigned W = LHS->Width;
 
-    if (!LHS->DemandedBits.isAllOnesValue()) {
-      LHS = IC.getInst(Inst::And, W, {LHS, IC.getConst(LHS->DemandedBits)});
+    if (!LHS->Meta->DemandedBits.isAllOnesValue()) {
+      LHS = IC.getInst(Inst::And, W,
+                       {LHS, IC.getConst(LHS->Meta->DemandedBits)});
     }
 
     std::map<Inst *, Inst *> InstCache;
@@ -200,13 +418,20 @@ public:
       findMoreVarsViaPC(PC.RHS, VarsVect, Visited);
     }
 
+    bool Guided = !DemandedBitsPerBit && SMTSolver->supportsModels();
     for (std::map<std::string,unsigned>::iterator it = VarsVect.begin();
          it != VarsVect.end(); ++it) {
        std::string VarName = it->first;
        unsigned VarWidth = VarsVect[VarName];
        APInt ResultDB = APInt::getNullValue(VarWidth);
+       APInt Undecided = APInt::getAllOnesValue(VarWidth);
+       if (Guided)
+         findDemandedBits(BPCs, PCs, LHS, VarName, VarWidth, ResultDB,
+                          Undecided, IC);
 
       for (unsigned Bit=0; Bit<VarWidth; Bit++) {
+        if (!Undecided[Bit])
+          continue;
         std::map<Inst *, Inst *> InstCache;
         Inst *SetLHS = traverse(LHS, Bit, IC, VarName, InstCache, true);
         InstCache.clear();
@@ -230,7 +455,7 @@ public:
     Inst *Mask = IC.getConst(APInt::getOneBitSet(W, W-1));
     InstMapping Mapping(IC.getInst(Inst::And, W, { LHS, Mask }), IC.getConst(APInt::getNullValue(W)));
     bool IsSat;
-    std::error_code EC = SMTSolver->isSatisfiable(BuildQuery(IC, BPCs, PCs,
+    std::error_code EC = SMTSolver->isSatisfiable(buildQuery(IC, BPCs, PCs,
                                                   Mapping, 0, /*Precondition=*/0),
                                                   IsSat, 0, 0, Timeout);
     if (EC) {
@@ -247,7 +472,7 @@ public:
     Inst *Mask = IC.getConst(APInt::getOneBitSet(W, W-1));
     InstMapping Mapping(IC.getInst(Inst::And, W, { LHS, Mask }), Mask);
     bool IsSat;
-    std::error_code EC = SMTSolver->isSatisfiable(BuildQuery(IC, BPCs, PCs,
+    std::error_code EC = SMTSolver->isSatisfiable(buildQuery(IC, BPCs, PCs,
                                                   Mapping, 0, /*Precondition=*/0),
                                                   IsSat, 0, 0, Timeout);
     if (EC) {
@@ -281,10 +506,16 @@ public:
                           const std::vector<InstMapping> &PCs,
                           Inst *LHS, KnownBits &Known,
                           InstContext &IC) override {
+    SharedBuilder Shared(*this, IC);
     unsigned W = LHS->Width;
     Known.One = APInt::getNullValue(W);
     Known.Zero = APInt::getNullValue(W);
+    APInt Candidates = APInt::getAllOnesValue(W);
+    if (!KnownBitsPerBit && SMTSolver->supportsModels())
+      refineKnownBits(BPCs, PCs, LHS, Known, Candidates, IC);
     for (unsigned I=0; I<W; I++) {
+      if (!Candidates[I])
+        continue;
       APInt ZeroGuess = Known.Zero | APInt::getOneBitSet(W, I);
       if (testKnown(BPCs, PCs, ZeroGuess, Known.One, LHS, IC)) {
         Known.Zero = ZeroGuess;
@@ -297,6 +528,85 @@ public:
     return std::error_code();
   }
 
+  // Checks Mapping like isValid() does. If it doesn't hold and the solver
+  // can produce models, Witness is set to the value LHS takes on the
+  // counterexample. It is left without a value if LHS can't be evaluated
+  // there; in particular the interpreter would pick an arbitrary incoming
+  // value for a phi.
+  std::error_code checkWithWitness(const BlockPCs &BPCs,
+                                   const std::vector<InstMapping> &PCs,
+                                   InstMapping Mapping, Inst *LHS,
+                                   InstContext &IC, bool &IsValid,
+                                   EvalValue &Witness) {
+    Witness = EvalValue();
+    bool WantModel = SMTSolver->supportsModels() &&
+      !hasGivenInst(LHS, [](Inst *I) { return I->K == Inst::Phi; });
+    std::vector<Inst *> ModelInsts;
+    std::string Query = buildQuery(IC, BPCs, PCs, Mapping,
+                                   WantModel ? &ModelInsts : 0,
+                                   /*Precondition=*/0);
+    if (Query.empty())
+      return std::make_error_code(std::errc::value_too_large);
+    bool IsSat;
+    std::vector<APInt> ModelVals;
+    std::error_code EC = SMTSolver->isSatisfiable(
+        Query, IsSat, ModelInsts.size(), WantModel ? &ModelVals : 0, Timeout);
+    if (EC)
+      return EC;
+    IsValid = !IsSat;
+    if (!IsSat || !WantModel)
+      return EC;
+
+    ValueCache VC;
+    for (unsigned I = 0; I != ModelInsts.size(); ++I)
+      VC[ModelInsts[I]] = ModelVals[I];
+    std::vector<Inst *> Vars;
+    findVars(LHS, Vars);
+    for (auto V : Vars)
+      if (!VC.count(V))
+        return EC;
+    Witness = ConcreteInterpreter(VC).evaluateInst(LHS);
+    return EC;
+  }
+
+  // Guesses that every bit of LHS is known and weakens the guess with each
+  // counterexample: a value the LHS can take rules out, for every bit, the
+  // polarity that value doesn't have. Since a conjunction of per-bit facts
+  // holds iff each of them does, the guess that finally survives is exactly
+  // the set of known bits, found in at most W+1 queries and usually far
+  // fewer. Bits are left in Candidates, for the per-bit loop to settle, if
+  // a counterexample can't be evaluated or fails to shrink the guess.
+  void refineKnownBits(const BlockPCs &BPCs,
+                       const std::vector<InstMapping> &PCs, Inst *LHS,
+                       KnownBits &Known, APInt &Candidates, InstContext &IC) {
+    unsigned W = LHS->Width;
+    APInt Zeros = APInt::getAllOnesValue(W), Ones = APInt::getNullValue(W);
+    while (true) {
+      InstMapping Mapping(IC.getInst(Inst::And, W,
+                                     { IC.getConst(Zeros | Ones), LHS }),
+                          IC.getConst(Ones));
+      bool IsValid;
+      EvalValue V;
+      ++KnownBitsQueries;
+      if (checkWithWitness(BPCs, PCs, Mapping, LHS, IC, IsValid, V))
+        return;
+      if (IsValid) {
+        Known.Zero = Zeros;
+        Known.One = Ones;
+        Candidates = APInt::getNullValue(W);
+        return;
+      }
+      if (!V.hasValue())
+        return;
+      APInt NewZeros = Zeros & ~V.getValue(), NewOnes = Ones & V.getValue();
+      if (NewZeros == Zeros && NewOnes == Ones)
+        return;
+      Zeros = NewZeros;
+      Ones = NewOnes;
+      Candidates = Zeros | Ones;
+    }
+  }
+
   std::error_code powerTwo(const BlockPCs &BPCs,
                            const std::vector<InstMapping> &PCs,
                            Inst *LHS, bool &PowTwo,
@@ -312,7 +622,7 @@ public:
                                     IC.getInst(Inst::Eq, 1, {PowerMask, Zero})});
     InstMapping Mapping(PowerTwoInst, True);
     bool IsSat;
-    std::error_code EC = SMTSolver->isSatisfiable(BuildQuery(IC, BPCs, PCs,
+    std::error_code EC = SMTSolver->isSatisfiable(buildQuery(IC, BPCs, PCs,
                                                   Mapping, 0, /*Precondition=*/0),
                                                   IsSat, 0, 0, Timeout);
     if (EC)
@@ -335,7 +645,7 @@ public:
     Inst *NonZeroGuess = IC.getInst(Inst::Ne, 1, {LHS, Zero});
     InstMapping Mapping(NonZeroGuess, True);
     bool IsSat;
-    std::error_code EC = SMTSolver->isSatisfiable(BuildQuery(IC, BPCs, PCs,
+    std::error_code EC = SMTSolver->isSatisfiable(buildQuery(IC, BPCs, PCs,
                                                   Mapping, 0, /*Precondition=*/0),
                                                   IsSat, 0, 0, Timeout);
     if (EC)
@@ -352,30 +662,43 @@ public:
                            const std::vector<InstMapping> &PCs,
                            Inst *LHS, unsigned &SignBits,
                            InstContext &IC) override {
+    SharedBuilder Shared(*this, IC);
     unsigned W = LHS->Width;
-    SignBits = 1;
     Inst *True = IC.getConst(APInt(1, 1, false));
 
-    for (unsigned I=2; I<=W; I++) {
+    // Having at least I sign bits is monotone in I, so binary search for
+    // the largest I that holds. Each counterexample's value has some number
+    // of sign bits that bounds the answer from above; that bound is often
+    // exact, so it is tried as soon as it is found.
+    unsigned Lo = 1, Hi = W;
+    bool TryHi = true;
+    while (Lo < Hi) {
+      unsigned I = TryHi ? Hi : Lo + (Hi - Lo + 1) / 2;
       Inst *ShiftAmt = IC.getConst(APInt(W, W-I, false));
       Inst *Res = IC.getInst(Inst::AShr, W, {LHS, ShiftAmt});
       Inst *Guess1 = IC.getInst(Inst::Eq, 1, {Res, IC.getConst(APInt(W, 0, false))});
       Inst *Guess2 = IC.getInst(Inst::Eq, 1, {Res, IC.getConst(APInt::getAllOnesValue(W))});
       Inst *Guess = IC.getInst(Inst::Or, 1, {Guess1, Guess2});
       InstMapping Mapping(Guess, True);
-      bool IsSat;
-      std::error_code EC = SMTSolver->isSatisfiable(BuildQuery(IC, BPCs, PCs,
-                                                    Mapping, 0, /*Precondition=*/0),
-                                                    IsSat, 0, 0, Timeout);
-      if (EC)
+      bool IsValid;
+      EvalValue V;
+      ++SignBitsQueries;
+      if (checkWithWitness(BPCs, PCs, Mapping, LHS, IC, IsValid, V))
         llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing sign bits");
 
-      if (!IsSat) {
-        SignBits = I;
+      if (IsValid) {
+        Lo = I;
+        TryHi = false;
       } else {
-        break;
+        Hi = I - 1;
+        TryHi = false;
+        if (V.hasValue() && V.getValue().getNumSignBits() < Hi) {
+          Hi = std::max(Lo, V.getValue().getNumSignBits());
+          TryHi = true;
+        }
       }
     }
+    SignBits = Lo;
     return std::error_code();
   }
 
@@ -457,7 +780,7 @@ public:
     }
 
     // Do not do further synthesis if LHS is harvested from uses.
-    if (LHS->HarvestKind == HarvestType::HarvestedFromUse)
+    if (LHS->Meta->HarvestKind == HarvestType::HarvestedFromUse)
       return EC;
 
     if (InferNop) {
@@ -625,7 +948,8 @@ public:
                                    { IC.getConst(Zeros | Ones), LHS }),
                         IC.getConst(Ones));
     bool IsSat;
-    auto Q = BuildQuery(IC, BPCs, PCs, Mapping, 0, /*Precondition=*/0);
+    auto Q = buildQuery(IC, BPCs, PCs, Mapping, 0, /*Precondition=*/0);
+    ++KnownBitsQueries;
     std::error_code EC = SMTSolver->isSatisfiable(Q, IsSat, 0, 0, Timeout);
     if (EC) {
       llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing known bits");
@@ -672,7 +996,8 @@ public:
     // the query to take care of UB, therefore, the new query is or(trunc(LHS), 1) = Guess(ReservedX, LHS)
     LHS = IC.getInst(Inst::Or, 1, {IC.getInst(Inst::Trunc, 1, {LHS}), IC.getConst(llvm::APInt(1, true))}),
     CS.synthesize(SMTSolver.get(), BPCs, PCs, InstMapping(LHS, Guess),
-                  ConstSet, ResultMap, IC, MaxConstantSynthesisTries, Timeout);
+                  ConstSet, ResultMap, IC, MaxConstantSynthesisTries, Timeout,
+                  EB.get());
     if (ResultMap.empty()) {
       IsFound = false;
     } else {
@@ -681,21 +1006,73 @@ public:
     }
   }
 
+  // Looks for an X such that LHS always lies in [X, X+C). Witnesses holds,
+  // sorted, values LHS is known to take; it is shared by all the sizes the
+  // caller tries. Any such range has to cover every witness, which rules
+  // out small sizes without a query and leaves a window of starts, from
+  // which the one leaving equal slack on either side is tried. Each
+  // counterexample becomes a new witness. Constant synthesis settles the
+  // size if that doesn't converge quickly.
+  bool findRange(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+                 Inst *LHS, APInt C, APInt &X,
+                 std::vector<APInt> &Witnesses, InstContext &IC) {
+    unsigned W = LHS->Width;
+    Inst *True = IC.getConst(APInt(1, 1, false));
+    for (int Tries = 0; Tries < MaxConstantSynthesisTries; ++Tries) {
+      X = APInt::getNullValue(W);
+      if (!Witnesses.empty()) {
+        APInt Start, Size;
+        getCoveringInterval(Witnesses, Start, Size);
+        if (Size.ugt(C.zext(W + 1)))
+          return false;
+        X = Start - (C.zext(W + 1) - Size).lshr(1).trunc(W);
+      }
+
+      // (LHS - X) <u C, i.e. LHS is in the possibly wrapped [X, X+C)
+      Inst *Offset = IC.getInst(Inst::Sub, W, {LHS, IC.getConst(X)});
+      InstMapping Mapping(IC.getInst(Inst::Ult, 1, {Offset, IC.getConst(C)}),
+                          True);
+      bool IsValid;
+      EvalValue V;
+      ++RangeQueries;
+      if (checkWithWitness(BPCs, PCs, Mapping, LHS, IC, IsValid, V))
+        break;
+      if (IsValid)
+        return true;
+      if (!V.hasValue())
+        break;
+      APInt Val = V.getValue();
+      auto It = std::lower_bound(Witnesses.begin(), Witnesses.end(), Val,
+                                 [](const APInt &A, const APInt &B) {
+                                   return A.ult(B);
+                                 });
+      if (It != Witnesses.end() && *It == Val)
+        break;
+      Witnesses.insert(It, Val);
+    }
+
+    ++RangeSynthesisFallbacks;
+    bool Found = false;
+    testRange(BPCs, PCs, LHS, C, X, Found, IC);
+    return Found;
+  }
+
   llvm::ConstantRange constantRange(const BlockPCs &BPCs,
                                     const std::vector<InstMapping> &PCs,
                                     Inst *LHS,
                                     InstContext &IC) override {
+    SharedBuilder Shared(*this, IC);
     unsigned W = LHS->Width;
 
     APInt L = APInt(W, 1), R = APInt::getAllOnesValue(W);
     APInt BinSearchResultX, BinSearchResultC;
     bool BinSearchHasResult = false;
+    std::vector<APInt> Witnesses;
 
     while (L.ule(R)) {
       APInt M = L + ((R - L)).lshr(1);
       APInt BinSearchX;
-      bool Found = false;
-      testRange(BPCs, PCs, LHS, M, BinSearchX, Found, IC);
+      bool Found = findRange(BPCs, PCs, LHS, M, BinSearchX, Witnesses, IC);
       if (Found) {
         R = M - 1;
 
@@ -722,88 +1099,152 @@ public:
   }
 };
 
-class MemCachingSolver : public Solver {
-  std::unique_ptr<Solver> UnderlyingSolver;
-  std::unordered_map<std::string, std::pair<std::error_code, bool>> IsValidCache;
-  std::unordered_map<std::string, std::pair<std::error_code, std::string>>
-    InferCache;
+// Dataflow facts are cached as strings so that the in-memory and the
+// external cache share one encoding. Known bits and demanded bits are
+// written most significant bit first, as in Souper IR.
+std::string encodeBool(bool B) {
+  return B ? "true" : "false";
+}
 
-public:
-  MemCachingSolver(std::unique_ptr<Solver> UnderlyingSolver)
-      : UnderlyingSolver(std::move(UnderlyingSolver)) {}
+bool decodeBool(StringRef S, bool &B) {
+  if (S != "true" && S != "false")
+    return false;
+  B = S == "true";
+  return true;
+}
 
-  std::error_code infer(const BlockPCs &BPCs,
-                        const std::vector<InstMapping> &PCs,
-                        Inst *LHS, Inst *&RHS, InstContext &IC) override {
-    ReplacementContext Context;
-    std::string Repl = GetReplacementLHSString(BPCs, PCs, LHS, Context);
-    const auto &ent = InferCache.find(Repl);
-    if (ent == InferCache.end()) {
-      ++MemMissesInfer;
-      std::error_code EC = UnderlyingSolver->infer(BPCs, PCs, LHS, RHS, IC);
-      std::string RHSStr;
-      if (!EC && RHS) {
-        RHSStr = GetReplacementRHSString(RHS, Context);
-      }
-      InferCache.emplace(Repl, std::make_pair(EC, RHSStr));
-      return EC;
-    } else {
-      ++MemHitsInfer;
-      std::string ES;
-      StringRef S = ent->second.second;
-      if (S == "") {
-        RHS = 0;
-      } else {
-        ParsedReplacement R = ParseReplacementRHS(IC, "<cache>", S, Context, ES);
-        if (ES != "")
-          return std::make_error_code(std::errc::protocol_error);
-        RHS = R.Mapping.RHS;
-      }
-      return ent->second.first;
-    }
+bool decodeKnownBits(StringRef S, unsigned Width, KnownBits &Known) {
+  if (S.size() != Width)
+    return false;
+  Known = KnownBits(Width);
+  for (unsigned J = 0; J != Width; ++J) {
+    char C = S[Width - 1 - J];
+    if (C == '0')
+      Known.Zero.setBit(J);
+    else if (C == '1')
+      Known.One.setBit(J);
+    else if (C != 'x')
+      return false;
   }
-  std::error_code inferConst(const BlockPCs &BPCs,
-                             const std::vector<InstMapping> &PCs,
-                             Inst *LHS, Inst *&RHS,
-                             std::set<Inst *> &ConstSet,
-                             std::map<Inst *, llvm::APInt> &ResultMap,
-                             InstContext &IC) override {
-    return UnderlyingSolver->inferConst(BPCs, PCs, LHS, RHS, ConstSet, ResultMap, IC);
+  return true;
+}
+
+std::string encodeRange(const ConstantRange &R) {
+  return R.getLower().toString(10, false) + "," +
+    R.getUpper().toString(10, false);
+}
+
+bool decodeRange(StringRef S, unsigned Width, ConstantRange &R) {
+  std::pair<StringRef, StringRef> Bounds = S.split(',');
+  if (Bounds.first.empty() || Bounds.second.empty())
+    return false;
+  R = ConstantRange(APInt(Width, Bounds.first, 10),
+                    APInt(Width, Bounds.second, 10));
+  return true;
+}
+
+// Demanded bits are reported per variable name, but names are not part of
+// a cache key, so variables are referred to by their name in Context.
+std::string encodeDemandedBits(const BlockPCs &BPCs,
+                               const std::vector<InstMapping> &PCs, Inst *LHS,
+                               const std::map<std::string, APInt> &DBitsVect,
+                               ReplacementContext &Context) {
+  std::vector<Inst *> Vars;
+  findVars(LHS, Vars);
+  for (const auto &PC : PCs) {
+    findVars(PC.LHS, Vars);
+    findVars(PC.RHS, Vars);
+  }
+  for (const auto &BPC : BPCs) {
+    findVars(BPC.PC.LHS, Vars);
+    findVars(BPC.PC.RHS, Vars);
   }
+  std::string S;
+  for (const auto &DB : DBitsVect) {
+    for (auto V : Vars) {
+      if (V->Meta->Name != DB.first)
+        continue;
+      if (!S.empty())
+        S += " ";
+      S += Context.printInst(V, llvm::nulls(), /*printNames=*/false) + "=" +
+        Inst::getDemandedBitsString(DB.second);
+      break;
+    }
+  }
+  return S;
+}
 
-  llvm::ConstantRange constantRange(const BlockPCs &BPCs,
-                                    const std::vector<InstMapping> &PCs,
-                                    Inst *LHS,
-                                    InstContext &IC) override {
-    return UnderlyingSolver->constantRange(BPCs, PCs, LHS, IC);
+bool decodeDemandedBits(StringRef S, ReplacementContext &Context,
+                        std::map<std::string, APInt> &DBitsVect) {
+  SmallVector<StringRef, 4> Entries;
+  S.split(Entries, ' ', -1, /*KeepEmpty=*/false);
+  for (StringRef E : Entries) {
+    std::pair<StringRef, StringRef> NameAndBits = E.split('=');
+    if (!NameAndBits.first.startswith("%") || NameAndBits.second.empty())
+      return false;
+    Inst *V = Context.getInst(NameAndBits.first.drop_front());
+    if (!V)
+      return false;
+    DBitsVect[V->Meta->Name] = APInt(NameAndBits.second.size(),
+                               NameAndBits.second, 2);
   }
+  return true;
+}
 
-  std::error_code isValid(InstContext &IC, const BlockPCs &BPCs,
-                          const std::vector<InstMapping> &PCs,
-                          InstMapping Mapping, bool &IsValid,
-                          std::vector<std::pair<Inst *, llvm::APInt>> *Model)
-    override {
-    // TODO: add caching support for models.
-    if (Model)
-      return UnderlyingSolver->isValid(IC, BPCs, PCs, Mapping, IsValid, Model);
+// Answers the dataflow queries of a caching solver through cachedFact(),
+// which looks a fact up by name and computes it on a miss.
+class DataflowCachingSolver : public Solver {
+protected:
+  std::unique_ptr<Solver> UnderlyingSolver;
 
-    std::string Repl = GetReplacementString(BPCs, PCs, Mapping);
-    const auto &ent = IsValidCache.find(Repl);
-    if (ent == IsValidCache.end()) {
-      ++MemMissesIsValid;
-      std::error_code EC = UnderlyingSolver->isValid(IC, BPCs, PCs,
-                                                     Mapping, IsValid, 0);
-      IsValidCache.emplace(Repl, std::make_pair(EC, IsValid));
+  // Sets Value to the cached fact called Field for LHS, or to the result of
+  // Compute, which is cached if it succeeds. Facts that refer to the nodes
+  // of the query pass a Context, which receives names for them.
+  virtual std::error_code
+  cachedFact(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+             Inst *LHS, StringRef Field, ReplacementContext *Context,
+             std::string &Value,
+             function_ref<std::error_code(std::string &)> Compute) = 0;
+
+  std::error_code cachedBool(const BlockPCs &BPCs,
+                             const std::vector<InstMapping> &PCs,
+                             Inst *LHS, StringRef Field, bool &Result,
+                             function_ref<std::error_code(bool &)> Compute) {
+    std::string S;
+    std::error_code EC = cachedFact(BPCs, PCs, LHS, Field, nullptr, S,
+                                    [&](std::string &Value) {
+      std::error_code EC = Compute(Result);
+      Value = encodeBool(Result);
       return EC;
-    } else {
-      ++MemHitsIsValid;
-      IsValid = ent->second.second;
-      return ent->second.first;
-    }
+    });
+    if (!EC && !decodeBool(S, Result))
+      return std::make_error_code(std::errc::protocol_error);
+    return EC;
   }
 
-  std::string getName() override {
-    return UnderlyingSolver->getName() + " + internal cache";
+public:
+  DataflowCachingSolver(std::unique_ptr<Solver> UnderlyingSolver)
+      : UnderlyingSolver(std::move(UnderlyingSolver)) {}
+
+  void prefetch(const std::vector<CandidateReplacement> &Cands) override {
+    UnderlyingSolver->prefetch(Cands);
+  }
+
+  llvm::ConstantRange constantRange(const BlockPCs &BPCs,
+                                    const std::vector<InstMapping> &PCs,
+                                    Inst *LHS,
+                                    InstContext &IC) override {
+    std::string S;
+    ConstantRange R(LHS->Width, true);
+    std::error_code EC = cachedFact(BPCs, PCs, LHS, "range", nullptr, S,
+                                    [&](std::string &Value) {
+      R = UnderlyingSolver->constantRange(BPCs, PCs, LHS, IC);
+      Value = encodeRange(R);
+      return std::error_code();
+    });
+    if (EC || !decodeRange(S, LHS->Width, R))
+      return ConstantRange(LHS->Width, true);
+    return R;
   }
 
   std::error_code testDemandedBits(const BlockPCs &BPCs,
@@ -811,60 +1252,259 @@ public:
                                    Inst *LHS,
                                    std::map<std::string,APInt> &DBitsVect,
                                    InstContext &IC) override {
-    return UnderlyingSolver->testDemandedBits(BPCs, PCs, LHS, DBitsVect, IC);
+    ReplacementContext Context;
+    std::string S;
+    std::error_code EC = cachedFact(BPCs, PCs, LHS, "demandedBits", &Context,
+                                    S, [&](std::string &Value) {
+      std::map<std::string, APInt> Computed;
+      std::error_code EC =
+        UnderlyingSolver->testDemandedBits(BPCs, PCs, LHS, Computed, IC);
+      Value = encodeDemandedBits(BPCs, PCs, LHS, Computed, Context);
+      return EC;
+    });
+    if (!EC && !decodeDemandedBits(S, Context, DBitsVect))
+      return std::make_error_code(std::errc::protocol_error);
+    return EC;
   }
 
   std::error_code nonNegative(const BlockPCs &BPCs,
                               const std::vector<InstMapping> &PCs,
                               Inst *LHS, bool &NonNegative,
                               InstContext &IC) override {
-    return UnderlyingSolver->nonNegative(BPCs, PCs, LHS, NonNegative, IC);
+    return cachedBool(BPCs, PCs, LHS, "nonNegative", NonNegative,
+                      [&](bool &Result) {
+      return UnderlyingSolver->nonNegative(BPCs, PCs, LHS, Result, IC);
+    });
   }
 
   std::error_code negative(const BlockPCs &BPCs,
                            const std::vector<InstMapping> &PCs,
                            Inst *LHS, bool &Negative,
                            InstContext &IC) override {
-    return UnderlyingSolver->negative(BPCs, PCs, LHS, Negative, IC);
+    return cachedBool(BPCs, PCs, LHS, "negative", Negative,
+                      [&](bool &Result) {
+      return UnderlyingSolver->negative(BPCs, PCs, LHS, Result, IC);
+    });
   }
 
   std::error_code knownBits(const BlockPCs &BPCs,
                             const std::vector<InstMapping> &PCs,
                             Inst *LHS, KnownBits &Known,
                             InstContext &IC) override {
-    return UnderlyingSolver->knownBits(BPCs, PCs, LHS, Known, IC);
+    std::string S;
+    std::error_code EC = cachedFact(BPCs, PCs, LHS, "knownBits", nullptr, S,
+                                    [&](std::string &Value) {
+      std::error_code EC = UnderlyingSolver->knownBits(BPCs, PCs, LHS,
+                                                       Known, IC);
+      Value = Inst::getKnownBitsString(Known.Zero, Known.One);
+      return EC;
+    });
+    if (!EC && !decodeKnownBits(S, LHS->Width, Known))
+      return std::make_error_code(std::errc::protocol_error);
+    return EC;
   }
 
   std::error_code powerTwo(const BlockPCs &BPCs,
                            const std::vector<InstMapping> &PCs,
                            Inst *LHS, bool &PowerTwo,
                            InstContext &IC) override {
-    return UnderlyingSolver->powerTwo(BPCs, PCs, LHS, PowerTwo, IC);
+    return cachedBool(BPCs, PCs, LHS, "powerOfTwo", PowerTwo,
+                      [&](bool &Result) {
+      return UnderlyingSolver->powerTwo(BPCs, PCs, LHS, Result, IC);
+    });
   }
 
   std::error_code nonZero(const BlockPCs &BPCs,
                           const std::vector<InstMapping> &PCs,
                           Inst *LHS, bool &NonZero,
                           InstContext &IC) override {
-    return UnderlyingSolver->nonZero(BPCs, PCs, LHS, NonZero, IC);
+    return cachedBool(BPCs, PCs, LHS, "nonZero", NonZero,
+                      [&](bool &Result) {
+      return UnderlyingSolver->nonZero(BPCs, PCs, LHS, Result, IC);
+    });
   }
 
   std::error_code signBits(const BlockPCs &BPCs,
                            const std::vector<InstMapping> &PCs,
                            Inst *LHS, unsigned &SignBits,
                            InstContext &IC) override {
-    return UnderlyingSolver->signBits(BPCs, PCs, LHS, SignBits, IC);
+    std::string S;
+    std::error_code EC = cachedFact(BPCs, PCs, LHS, "signBits", nullptr, S,
+                                    [&](std::string &Value) {
+      std::error_code EC = UnderlyingSolver->signBits(BPCs, PCs, LHS,
+                                                      SignBits, IC);
+      Value = std::to_string(SignBits);
+      return EC;
+    });
+    if (!EC && StringRef(S).getAsInteger(10, SignBits))
+      return std::make_error_code(std::errc::protocol_error);
+    return EC;
+  }
+};
+
+class MemCachingSolver : public DataflowCachingSolver {
+  // Queries are bucketed by their structural hash and told apart by their
+  // canonical key, so neither variable names nor the order in which the
+  // variables were created affect whether a query hits. Both are cached in
+  // the roots of the query, so looking up a query whose roots were seen
+  // before doesn't walk their DAGs; only results that refer to nodes of the
+  // query, which need the nodes named, do.
+  template <typename T> struct Entry {
+    std::string Key;
+    std::error_code EC;
+    T Result;
+  };
+  std::unordered_map<size_t, std::vector<Entry<bool>>> IsValidCache;
+  std::unordered_map<size_t, std::vector<Entry<std::string>>> InferCache;
+  std::unordered_map<size_t, std::vector<Entry<std::string>>> DataflowCache;
+
+  template <typename T>
+  static Entry<T> *lookup(std::vector<Entry<T>> &Bucket,
+                          const std::string &Key) {
+    for (auto &E : Bucket)
+      if (E.Key == Key)
+        return &E;
+    if (!Bucket.empty())
+      ++MemHashCollisions;
+    return nullptr;
+  }
+
+  std::error_code
+  cachedFact(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+             Inst *LHS, StringRef Field, ReplacementContext *Context,
+             std::string &Value,
+             function_ref<std::error_code(std::string &)> Compute) override {
+    auto &Bucket = DataflowCache[hash_combine(structuralHash(BPCs, PCs, {LHS}),
+                                              Field)];
+    std::string Key = Field.str() + '\0' + getCanonicalKey(BPCs, PCs, {LHS});
+    if (Context)
+      nameCanonically(BPCs, PCs, {LHS}, *Context);
+    if (auto *E = lookup(Bucket, Key)) {
+      ++MemHitsDataflow;
+      Value = E->Result;
+      return E->EC;
+    }
+
+    ++MemMissesDataflow;
+    std::error_code EC = Compute(Value);
+    if (!EC)
+      Bucket.push_back({std::move(Key), EC, Value});
+    return EC;
+  }
+
+public:
+  MemCachingSolver(std::unique_ptr<Solver> UnderlyingSolver)
+      : DataflowCachingSolver(std::move(UnderlyingSolver)) {}
+
+  std::error_code infer(const BlockPCs &BPCs,
+                        const std::vector<InstMapping> &PCs,
+                        Inst *LHS, Inst *&RHS, InstContext &IC) override {
+    // Cached RHSs are stored in binary form relative to the canonical names
+    // of the query's nodes, which are only given out when an RHS is written
+    // or read.
+    ReplacementContext Context;
+    auto &Bucket = InferCache[structuralHash(BPCs, PCs, {LHS})];
+    std::string Key = getCanonicalKey(BPCs, PCs, {LHS});
+    if (auto *E = lookup(Bucket, Key)) {
+      ++MemHitsInfer;
+      std::string ES;
+      StringRef S = E->Result;
+      if (S == "") {
+        RHS = 0;
+      } else {
+        nameCanonically(BPCs, PCs, {LHS}, Context);
+        ParsedReplacement R =
+          ReadReplacementRHSBinary(IC, "<cache>", S, Context, ES);
+        if (ES != "")
+          return std::make_error_code(std::errc::protocol_error);
+        RHS = R.Mapping.RHS;
+      }
+      return E->EC;
+    }
+
+    ++MemMissesInfer;
+    std::error_code EC = UnderlyingSolver->infer(BPCs, PCs, LHS, RHS, IC);
+    std::string RHSStr;
+    if (!EC && RHS) {
+      nameCanonically(BPCs, PCs, {LHS}, Context);
+      RHSStr = GetReplacementRHSBinary(RHS, Context);
+    }
+    Bucket.push_back({std::move(Key), EC, RHSStr});
+    return EC;
+  }
+  std::error_code inferConst(const BlockPCs &BPCs,
+                             const std::vector<InstMapping> &PCs,
+                             Inst *LHS, Inst *&RHS,
+                             std::set<Inst *> &ConstSet,
+                             std::map<Inst *, llvm::APInt> &ResultMap,
+                             InstContext &IC) override {
+    return UnderlyingSolver->inferConst(BPCs, PCs, LHS, RHS, ConstSet, ResultMap, IC);
+  }
+
+  std::error_code isValid(InstContext &IC, const BlockPCs &BPCs,
+                          const std::vector<InstMapping> &PCs,
+                          InstMapping Mapping, bool &IsValid,
+                          std::vector<std::pair<Inst *, llvm::APInt>> *Model)
+    override {
+    // TODO: add caching support for models.
+    if (Model)
+      return UnderlyingSolver->isValid(IC, BPCs, PCs, Mapping, IsValid, Model);
+
+    std::vector<Inst *> Roots = {Mapping.LHS, Mapping.RHS};
+    auto &Bucket = IsValidCache[structuralHash(BPCs, PCs, Roots)];
+    std::string Key = getCanonicalKey(BPCs, PCs, Roots);
+    if (auto *E = lookup(Bucket, Key)) {
+      ++MemHitsIsValid;
+      IsValid = E->Result;
+      return E->EC;
+    }
+
+    ++MemMissesIsValid;
+    std::error_code EC = UnderlyingSolver->isValid(IC, BPCs, PCs,
+                                                   Mapping, IsValid, 0);
+    Bucket.push_back({std::move(Key), EC, IsValid});
+    return EC;
   }
 
+  std::string getName() override {
+    return UnderlyingSolver->getName() + " + internal cache";
+  }
 };
 
-class ExternalCachingSolver : public Solver {
-  std::unique_ptr<Solver> UnderlyingSolver;
+class ExternalCachingSolver : public DataflowCachingSolver {
   KVStore *KV;
+  // The results of infer() looked up by the last prefetch(), by LHS; None
+  // means the LHS wasn't in the cache. Entries are used up by infer().
+  std::unordered_map<std::string, llvm::Optional<std::string>> Prefetched;
+
+  // Dataflow facts live in the same hash as the result of infer(), one
+  // field per fact.
+  std::error_code
+  cachedFact(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+             Inst *LHS, StringRef Field, ReplacementContext *Context,
+             std::string &Value,
+             function_ref<std::error_code(std::string &)> Compute) override {
+    ReplacementContext LocalContext;
+    if (!Context)
+      Context = &LocalContext;
+    std::string LHSStr = GetReplacementLHSString(BPCs, PCs, LHS, *Context);
+    if (LHSStr.length() > MaxLHSSize)
+      return Compute(Value);
+    if (KV->hGet(LHSStr, Field, Value)) {
+      ++ExternalDataflowHits;
+      return std::error_code();
+    }
+
+    ++ExternalDataflowMisses;
+    std::error_code EC = Compute(Value);
+    if (!EC)
+      KV->hSet(LHSStr, Field, Value);
+    return EC;
+  }
 
 public:
   ExternalCachingSolver(std::unique_ptr<Solver> UnderlyingSolver, KVStore *KV)
-      : UnderlyingSolver(std::move(UnderlyingSolver)), KV(KV) {
+      : DataflowCachingSolver(std::move(UnderlyingSolver)), KV(KV) {
   }
 
   std::error_code inferConst(const BlockPCs &BPCs,
@@ -877,6 +1517,24 @@ public:
   }
 
 
+  void prefetch(const std::vector<CandidateReplacement> &Cands) override {
+    Prefetched.clear();
+    std::vector<std::string> Keys;
+    for (auto &Cand : Cands) {
+      ReplacementContext Context;
+      std::string LHSStr = GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                                   Cand.Mapping.LHS, Context);
+      if (LHSStr.length() > MaxLHSSize)
+        continue;
+      if (Prefetched.emplace(LHSStr, llvm::None).second)
+        Keys.push_back(std::move(LHSStr));
+    }
+    std::vector<llvm::Optional<std::string>> Values;
+    KV->hGetMany(Keys, "result", Values);
+    for (size_t I = 0; I != Keys.size(); ++I)
+      Prefetched[Keys[I]] = std::move(Values[I]);
+  }
+
   std::error_code infer(const BlockPCs &BPCs,
                         const std::vector<InstMapping> &PCs,
                         Inst *LHS, Inst *&RHS, InstContext &IC) override {
@@ -885,7 +1543,18 @@ public:
     if (LHSStr.length() > MaxLHSSize)
       return std::make_error_code(std::errc::value_too_large);
     std::string S;
-    if (KV->hGet(LHSStr, "result", S)) {
+    bool Found;
+    auto P = Prefetched.find(LHSStr);
+    if (P != Prefetched.end()) {
+      ++ExternalPrefetched;
+      Found = P->second.hasValue();
+      if (Found)
+        S = std::move(*P->second);
+      Prefetched.erase(P);
+    } else {
+      Found = KV->hGet(LHSStr, "result", S);
+    }
+    if (Found) {
       ++ExternalHits;
       if (S == "") {
         RHS = 0;
@@ -914,6 +1583,52 @@ public:
     }
   }
 
+  std::error_code isValid(InstContext &IC, const BlockPCs &BPCs,
+                          const std::vector<InstMapping> &PCs,
+                          InstMapping Mapping, bool &IsValid,
+                          std::vector<std::pair<Inst *, llvm::APInt>> *Model)
+  override {
+    // N.B. we decided that since the important clients have moved to infer(),
+    // we'll no longer support external caching for isValid()
+    return UnderlyingSolver->isValid(IC, BPCs, PCs, Mapping, IsValid, Model);
+  }
+
+  std::string getName() override {
+    return UnderlyingSolver->getName() + " + external cache";
+  }
+};
+
+// Answers isValid() without the solver when the inputs are few enough bits
+// to evaluate the mapping on all of them; everything else is passed on.
+class ExhaustiveSolver : public Solver {
+  std::unique_ptr<Solver> UnderlyingSolver;
+  unsigned MaxInputBits;
+
+public:
+  ExhaustiveSolver(std::unique_ptr<Solver> UnderlyingSolver,
+                   unsigned MaxInputBits)
+      : UnderlyingSolver(std::move(UnderlyingSolver)),
+        MaxInputBits(MaxInputBits) {}
+
+  void prefetch(const std::vector<CandidateReplacement> &Cands) override {
+    UnderlyingSolver->prefetch(Cands);
+  }
+
+  std::error_code infer(const BlockPCs &BPCs,
+                        const std::vector<InstMapping> &PCs,
+                        Inst *LHS, Inst *&RHS, InstContext &IC) override {
+    return UnderlyingSolver->infer(BPCs, PCs, LHS, RHS, IC);
+  }
+
+  std::error_code inferConst(const BlockPCs &BPCs,
+                             const std::vector<InstMapping> &PCs,
+                             Inst *LHS, Inst *&RHS,
+                             std::set<Inst *> &ConstSet,
+                             std::map<Inst *, llvm::APInt> &ResultMap,
+                             InstContext &IC) override {
+    return UnderlyingSolver->inferConst(BPCs, PCs, LHS, RHS, ConstSet, ResultMap, IC);
+  }
+
   llvm::ConstantRange constantRange(const BlockPCs &BPCs,
                                     const std::vector<InstMapping> &PCs,
                                     Inst *LHS,
@@ -926,13 +1641,17 @@ public:
                           InstMapping Mapping, bool &IsValid,
                           std::vector<std::pair<Inst *, llvm::APInt>> *Model)
   override {
-    // N.B. we decided that since the important clients have moved to infer(),
-    // we'll no longer support external caching for isValid()
+    // block PCs only constrain phis, which the interpreter can't enumerate
+    if (BPCs.empty() &&
+        isValidExhaustively(PCs, Mapping, MaxInputBits, IsValid, Model)) {
+      ++ExhaustiveIsValid;
+      return std::error_code();
+    }
     return UnderlyingSolver->isValid(IC, BPCs, PCs, Mapping, IsValid, Model);
   }
 
   std::string getName() override {
-    return UnderlyingSolver->getName() + " + external cache";
+    return UnderlyingSolver->getName() + " + exhaustive";
   }
 
   std::error_code testDemandedBits(const BlockPCs &BPCs,
@@ -1010,4 +1729,10 @@ std::unique_ptr<Solver> createExternalCachingSolver(
       new ExternalCachingSolver(std::move(UnderlyingSolver), KV));
 }
 
+std::unique_ptr<Solver> createExhaustiveSolver(
+    std::unique_ptr<Solver> UnderlyingSolver, unsigned MaxInputBits) {
+  return std::unique_ptr<Solver>(
+      new ExhaustiveSolver(std::move(UnderlyingSolver), MaxInputBits));
+}
+
 }
@@ -507,10 +507,10 @@ namespace souper {
     if (KBCache.find(I) != KBCache.end())
       return true;
 
-    if (I->K == Inst::Var && (I->KnownZeros.getBoolValue() || I->KnownOnes.getBoolValue())) {
+    if (I->K == Inst::Var && (I->Meta->KnownZeros.getBoolValue() || I->Meta->KnownOnes.getBoolValue())) {
       llvm::KnownBits metadataKB;
-      metadataKB.Zero = I->KnownZeros;
-      metadataKB.One = I->KnownOnes;
+      metadataKB.Zero = I->Meta->KnownZeros;
+      metadataKB.One = I->Meta->KnownOnes;
 
       KBCache.emplace(I, std::move(metadataKB));
       return true;
@@ -811,8 +811,8 @@ namespace souper {
     if (CRCache.find(I) != CRCache.end())
       return true;
 
-    if (I->K == Inst::Var && !I->Range.isFullSet()) {
-      CRCache.emplace(I, I->Range);
+    if (I->K == Inst::Var && !I->Meta->Range.isFullSet()) {
+      CRCache.emplace(I, I->Meta->Range);
       return true;
     }
 
@@ -561,13 +561,13 @@ bool souper::AliveDriver::translateAndCache(const souper::Inst *I,
 
   if (NamesCache.find(I) != NamesCache.end()) {
     Name = NamesCache[I];
-  } else if (I->Name != "") {
+  } else if (I->Meta->Name != "") {
     if (I->SynthesisConstID != 0) {
       // No way to avoid string matching without
       // changes in Inst and EnumerativeSynthesis
       Name = "%" + souper::ReservedConstPrefix + std::to_string(I->SynthesisConstID);
     } else {
-      Name = "%var_" + I->Name;
+      Name = "%var_" + I->Meta->Name;
     }
   } else {
     Name = "%" + std::to_string(InstNumbers++);
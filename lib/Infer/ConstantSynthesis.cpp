@@ -36,7 +36,13 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
                               const std::vector<InstMapping> &PCs,
                               InstMapping Mapping, std::set<Inst *> &ConstSet,
                               std::map <Inst *, llvm::APInt> &ResultMap,
-                              InstContext &IC, unsigned MaxTries, unsigned Timeout) {
+                              InstContext &IC, unsigned MaxTries, unsigned Timeout,
+                              ExprBuilder *EB) {
+  std::unique_ptr<ExprBuilder> OwnEB;
+  if (!EB) {
+    OwnEB = createExprBuilder(IC);
+    EB = OwnEB.get();
+  }
 
   Inst *TrueConst = IC.getConst(llvm::APInt(1, true));
   Inst *FalseConst = IC.getConst(llvm::APInt(1, false));
@@ -78,8 +84,8 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
     // TriedAnte /\ SubstAnte
     Inst *FirstQueryAnte = IC.getInst(Inst::And, 1, {SubstAnte, TriedAnte});
 
-    std::string Query = BuildQuery(IC, BPCs, PCs, InstMapping(Mapping.LHS, Mapping.RHS),
-                                   &ModelInstsFirstQuery, FirstQueryAnte, true);
+    std::string Query = EB->BuildQuery(BPCs, PCs, InstMapping(Mapping.LHS, Mapping.RHS),
+                                       &ModelInstsFirstQuery, FirstQueryAnte, true);
 
 
     if (Query.empty())
@@ -112,7 +118,7 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
     for (unsigned J = 0; J != ModelInstsFirstQuery.size(); ++J) {
       if (ConstSet.find(ModelInstsFirstQuery[J]) != ConstSet.end()) {
         if (DebugLevel > 3) {
-          llvm::errs() << ModelInstsFirstQuery[J]->Name;
+          llvm::errs() << ModelInstsFirstQuery[J]->Meta->Name;
           llvm::errs() << ": ";
           llvm::errs() << ModelValsFirstQuery[J];
           llvm::errs() << "\n";
@@ -159,8 +165,8 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
     std::vector<Inst *> ModelInstsSecondQuery;
     std::vector<llvm::APInt> ModelValsSecondQuery;
 
-    Query = BuildQuery(IC, BPCsCopy, PCsCopy, InstMapping(LHSCopy, RHSCopy),
-                       &ModelInstsSecondQuery, 0);
+    Query = EB->BuildQuery(BPCsCopy, PCsCopy, InstMapping(LHSCopy, RHSCopy),
+                           &ModelInstsSecondQuery, 0);
 
     if (Query.empty())
       return std::make_error_code(std::errc::value_too_large);
@@ -189,7 +195,8 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
       ValueCache VC;
       for (unsigned J = 0; J != ModelInstsSecondQuery.size(); ++J) {
         Inst* Var = ModelInstsSecondQuery[J];
-        if (Var->Name == BlockPred && !ModelValsSecondQuery[J].isNullValue())
+        if (Var->Meta->Name == BlockPred &&
+            !ModelValsSecondQuery[J].isNullValue())
           for (auto B : Blocks)
             for (unsigned I = 0 ; I < B->PredVars.size(); ++I)
               if (B->PredVars[I] == Var)
@@ -201,8 +208,7 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
         }
       }
 
-      ConcreteInterpreter CI(LHSCopy, VC);
-      auto LHSV = CI.evaluateInst(LHSCopy);
+      auto LHSV = CompiledInst(LHSCopy).evaluate(VC);
 
       if (!LHSV.hasValue()) {
         llvm::report_fatal_error("the model returned from second query evaluates to poison for LHS");
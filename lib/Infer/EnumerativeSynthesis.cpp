@@ -12,16 +12,23 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#define DEBUG_TYPE "souper"
+
 #include "llvm/ADT/APInt.h"
 #include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
 #include "souper/Infer/AliveDriver.h"
 #include "souper/Infer/ConstantSynthesis.h"
 #include "souper/Infer/EnumerativeSynthesis.h"
 #include "souper/Infer/Pruning.h"
 
+#include <atomic>
+#include <deque>
 #include <queue>
 #include <functional>
+#include <unordered_set>
 
 static const unsigned MaxTries = 30;
 static const unsigned MaxInputSpecializationTries = 2;
@@ -29,10 +36,16 @@ static const unsigned MaxLHSCands = 15;
 
 bool UseAlive;
 unsigned DebugLevel;
+unsigned ExhaustiveMaxBits;
 
 using namespace souper;
 using namespace llvm;
 
+STATISTIC(GuessesCheckedExhaustively, "Number of concrete guesses verified "
+                                      "by evaluating every input");
+STATISTIC(GuessesCollapsed, "Number of guesses dropped because a cheaper "
+                            "guess computes the same outputs");
+
 static const std::vector<Inst::Kind> UnaryOperators = {
   Inst::CtPop, Inst::BSwap, Inst::BitReverse, Inst::Cttz, Inst::Ctlz
 };
@@ -79,6 +92,11 @@ namespace {
   static cl::opt<bool, /*ExternalStorage=*/true>
     AliveFlagParser("souper-use-alive", cl::desc("Use Alive2 as the backend"),
     cl::Hidden, cl::location(UseAlive), cl::init(false));
+  static cl::opt<unsigned, /*ExternalStorage=*/true>
+    ExhaustiveFlagParser("souper-exhaustive-max-bits",
+    cl::desc("Verify by evaluating every input when the inputs total at "
+             "most this many bits, 0 to always use the solver (default=0)"),
+    cl::location(ExhaustiveMaxBits), cl::init(0));
   static cl::opt<bool> LSBPruning("souper-lsb-pruning",
     cl::desc("Try to prune guesses by looking for a difference in LSB"),
     cl::init(false));
@@ -97,6 +115,21 @@ namespace {
   static cl::opt<bool> IgnoreCost("souper-enumerative-synthesis-ignore-cost",
     cl::desc("Ignore cost of RHSes -- just generate them. (default=false)"),
     cl::init(false));
+  static cl::opt<bool> LazyGuesses("souper-enumerative-synthesis-lazy-guesses",
+    cl::desc("Generate guesses on demand in cost order instead of "
+             "materializing and sorting all of them (default=false)"),
+    cl::init(false));
+  static cl::opt<bool> DedupGuesses("souper-enumerative-synthesis-dedup-guesses",
+    cl::desc("Drop concrete guesses that agree with a cheaper guess on all "
+             "pruning inputs (default=false)"),
+    cl::init(false));
+  static cl::opt<unsigned> SynthesisJobs("souper-synthesis-jobs",
+    cl::desc("Number of guesses to verify concurrently (default=1)"),
+    cl::init(1));
+  static cl::opt<bool> ReclaimScratch("souper-enumerative-synthesis-reclaim",
+    cl::desc("Free the instructions created while synthesizing each RHS, "
+             "except for the result (default=true)"),
+    cl::init(true));
 }
 
 // TODO
@@ -151,6 +184,10 @@ void addGuess(Inst *RHS, unsigned TargetWidth, InstContext &IC, int MaxCost, std
 
 typedef std::function<bool(Inst *, std::vector<Inst *> &)> PruneFunc;
 
+// Returns the next guess to verify, in non-decreasing cost order, or null
+// once there are no more guesses.
+typedef std::function<Inst *()> GuessStream;
+
 // Does a short-circuiting AND operation
 PruneFunc MkPruneFunc(std::vector<PruneFunc> Funcs) {
   return [Funcs](Inst *I, std::vector<Inst *> &RI) {
@@ -163,19 +200,26 @@ PruneFunc MkPruneFunc(std::vector<PruneFunc> Funcs) {
   };
 }
 
-bool CountPrune(Inst *I, std::vector<Inst *> &ReservedInsts, std::set<Inst*> Visited) {
+// Instructions reused from the LHS are free, so they are marked visited
+// before counting.
+bool CountPrune(Inst *I, std::vector<Inst *> &ReservedInsts,
+                const std::set<Inst *> &Cands) {
+  InstVisitSet Visited;
+  for (auto C : Cands)
+    Visited.insert(C);
   if (souper::countHelper(I, Visited) > MaxNumInstructions)
     return false;
 
   return true;
 }
 
-void getGuesses(std::vector<Inst *> &Guesses,
-                const std::vector<Inst *> &Inputs,
-                int Width, int LHSCost,
-                InstContext &IC, Inst *PrevInst, Inst *PrevSlot,
-                int &TooExpensive,
-                PruneFunc prune) {
+// Generate every single-instruction guess that can fill PrevSlot in
+// PrevInst; the guesses may contain holes of their own.
+void getPartialGuesses(std::vector<Inst *> &PartialGuesses,
+                       const std::vector<Inst *> &Inputs,
+                       int Width, int LHSCost,
+                       InstContext &IC, Inst *PrevInst, Inst *PrevSlot,
+                       int &TooExpensive) {
 
   std::vector<Inst *> unaryHoleUsers;
   findInsts(PrevInst, unaryHoleUsers, [PrevSlot](Inst *I) {
@@ -191,8 +235,6 @@ void getGuesses(std::vector<Inst *> &Guesses,
     unaryExclList.push_back(Inst::BitReverse);
   }
 
-  std::vector<Inst *> PartialGuesses;
-
   std::vector<Inst *> Comps(Inputs.begin(), Inputs.end());
 
   // Conversion Operators
@@ -454,6 +496,17 @@ void getGuesses(std::vector<Inst *> &Guesses,
       }
     }
   }
+}
+
+void getGuesses(std::vector<Inst *> &Guesses,
+                const std::vector<Inst *> &Inputs,
+                int Width, int LHSCost,
+                InstContext &IC, Inst *PrevInst, Inst *PrevSlot,
+                int &TooExpensive,
+                PruneFunc prune) {
+  std::vector<Inst *> PartialGuesses;
+  getPartialGuesses(PartialGuesses, Inputs, Width, LHSCost, IC, PrevInst,
+                    PrevSlot, TooExpensive);
 
   for (auto I : PartialGuesses) {
     Inst *JoinedGuess;
@@ -490,36 +543,35 @@ void getGuesses(std::vector<Inst *> &Guesses,
   }
 }
 
-Inst *findConst(souper::Inst *I,
-                std::set<const Inst *> &Visited) {
+Inst *findConst(souper::Inst *I, InstVisitSet &Visited) {
   if (I->K == Inst::Var && I->SynthesisConstID != 0) {
     return I;
   } else {
+    Visited.insert(I);
     for (auto &&Op : I->Ops) {
-      if (Visited.find(Op) == Visited.end()) {
+      if (!Visited.count(Op)) {
         auto Ret = findConst(Op, Visited);
         if (Ret) {
           return Ret;
         }
       }
     }
-    Visited.insert(I);
   }
   return nullptr;
 }
 
-bool exceeds64Bits(const Inst *I, std::set<const Inst *> &Visited) {
+bool exceeds64Bits(const Inst *I, InstVisitSet &Visited) {
   if (I->Width > 64) {
     return true;
   } else {
+    Visited.insert(I);
     for (auto &&Op : I->Ops) {
-      if (Visited.find(Op) == Visited.end()) {
+      if (!Visited.count(Op)) {
         if (exceeds64Bits(Op, Visited)) {
           return true;
         }
       }
     }
-    Visited.insert(I);
   }
   return false;
 }
@@ -533,7 +585,7 @@ bool canDifferInLSB(SynthesisContext &SC, Inst *RHSGuess) {
 
   InstMapping NewMapping{NewLHS, NewRHS};
 
-  auto Query = BuildQuery(SC.IC, SC.BPCs, SC.PCs, NewMapping, 0, 0);
+  auto Query = SC.EB->BuildQuery(SC.BPCs, SC.PCs, NewMapping, 0, 0);
 
   bool QueryIsSat;
   auto EC = SC.SMTSolver->isSatisfiable(Query, QueryIsSat, 0, 0, SC.Timeout);
@@ -550,9 +602,11 @@ std::error_code synthesizeWithAlive(SynthesisContext &SC, Inst *&RHS,
   std::error_code EC;
   std::map<Inst *, Inst *> InstCache;
   std::map<Block *, Block *> BlockCache;
-  std::set<const Inst *> Visited;
-  if (exceeds64Bits(SC.LHS, Visited))
-    llvm::report_fatal_error("LHS exceeds 64 bits");
+  {
+    InstVisitSet Visited;
+    if (exceeds64Bits(SC.LHS, Visited))
+      llvm::report_fatal_error("LHS exceeds 64 bits");
+  }
 
   Inst *Ante = SC.IC.getConst(APInt(1, true));
   for (auto PC : SC.PCs ) {
@@ -562,7 +616,7 @@ std::error_code synthesizeWithAlive(SynthesisContext &SC, Inst *&RHS,
 
   AliveDriver Verifier(SC.LHS, Ante, SC.IC);
   for (auto &&G : Guesses) {
-    std::set<const Inst *> Visited;
+    InstVisitSet Visited;
     auto C = findConst(G, Visited);
     if (!C) {
       if (Verifier.verify(G)) {
@@ -597,8 +651,7 @@ std::error_code synthesizeWithAlive(SynthesisContext &SC, Inst *&RHS,
   return EC;
 }
 
-std::error_code isConcreteCandidateSat(SynthesisContext &SC, Inst *RHSGuess, bool &IsSat) {
-  std::error_code EC;
+std::string buildConcreteCandidateQuery(SynthesisContext &SC, Inst *RHSGuess) {
   BlockPCs BPCsCopy;
   std::vector<InstMapping> PCsCopy;
   std::map<Inst *, Inst *> InstCache;
@@ -608,7 +661,28 @@ std::error_code isConcreteCandidateSat(SynthesisContext &SC, Inst *RHSGuess, boo
 
   InstMapping Mapping(SC.LHS, RHSGuess);
 
-  std::string Query2 = BuildQuery(SC.IC, BPCsCopy, PCsCopy, Mapping, 0, 0);
+  return SC.EB->BuildQuery(BPCsCopy, PCsCopy, Mapping, 0, 0);
+}
+
+// Settle a concrete guess without the solver if its inputs are small enough
+// to try them all. Returns false if the guess needs a solver query.
+bool isConcreteCandidateSatExhaustive(SynthesisContext &SC, Inst *RHSGuess,
+                                      bool &IsSat) {
+  bool IsValid;
+  if (!ExhaustiveMaxBits || !SC.BPCs.empty() ||
+      !isValidExhaustively(SC.PCs, InstMapping(SC.LHS, RHSGuess),
+                           ExhaustiveMaxBits, IsValid, nullptr))
+    return false;
+  ++GuessesCheckedExhaustively;
+  IsSat = !IsValid;
+  return true;
+}
+
+std::error_code isConcreteCandidateSat(SynthesisContext &SC, Inst *RHSGuess, bool &IsSat) {
+  std::error_code EC;
+  if (isConcreteCandidateSatExhaustive(SC, RHSGuess, IsSat))
+    return EC;
+  std::string Query2 = buildConcreteCandidateQuery(SC, RHSGuess);
 
   EC = SC.SMTSolver->isSatisfiable(Query2, IsSat, 0, 0, SC.Timeout);
   if (EC && DebugLevel > 1) {
@@ -650,7 +724,8 @@ bool isBigQuerySat(SynthesisContext &SC,
 
   // (LHS != i_1) && (LHS != i_2) && ... && (LHS != i_n) == true
   InstMapping Mapping(Ante, SC.IC.getConst(APInt(1, true)));
-  std::string Query = BuildQuery(SC.IC, BPCsCopy, PCsCopy, Mapping, 0, 0, /*Negate=*/false);
+  std::string Query = SC.EB->BuildQuery(BPCsCopy, PCsCopy, Mapping, 0, 0,
+                                         /*Negate=*/false);
   if (Query.empty()) {
     if (DebugLevel > 2)
       llvm::errs() << "Big Query is too big, skipping\n";
@@ -670,18 +745,133 @@ bool isBigQuerySat(SynthesisContext &SC,
   return BigQueryIsSat;
 }
 
-std::error_code synthesizeWithKLEE(SynthesisContext &SC, Inst *&RHS,
-                                   const std::vector<souper::Inst *> &Guesses) {
+namespace {
+struct PendingGuess {
+  Inst *Guess;
+  std::set<Inst *> ConstSet;
+  std::string Query;
+  std::shared_future<void> Done;
+  std::error_code EC;
+  bool IsSat = true;
+};
+}
+
+// Verify guesses on a thread pool while keeping the cost order: a window of
+// guesses is in flight at once, but results are consumed strictly from the
+// front, so a success is only accepted once every cheaper guess has failed.
+// Queries are built on this thread since InstContext isn't thread safe, and
+// guesses with constants run their CEGIS loop here while the pool works on
+// the concrete guesses behind them.
+std::error_code synthesizeWithKLEEParallel(SynthesisContext &SC, Inst *&RHS,
+                                           const GuessStream &NextGuess) {
   std::error_code EC;
+  std::atomic<bool> Cancelled(false);
+  std::deque<std::unique_ptr<PendingGuess>> Window;
+  // Declared last so that it is destroyed first, after waiting for the
+  // workers that still reference Window.
+  llvm::ThreadPool Pool(SynthesisJobs);
+
+  // Once the answer is known, queued queries are skipped and queries that
+  // already reached the solver are abandoned, killing their solver processes.
+  auto Finish = [&]() {
+    Cancelled = true;
+    Pool.wait();
+  };
+
+  int GuessIndex = -1;
+  bool Exhausted = false;
+  const size_t WindowSize = 2 * SynthesisJobs;
+  while (true) {
+    while (Window.size() < WindowSize && !Exhausted) {
+      Inst *G = NextGuess();
+      if (!G) {
+        Exhausted = true;
+        break;
+      }
+      auto P = std::make_unique<PendingGuess>();
+      P->Guess = G;
+      souper::getConstants(P->Guess, P->ConstSet);
+      if (P->ConstSet.empty() &&
+          !isConcreteCandidateSatExhaustive(SC, P->Guess, P->IsSat)) {
+        P->Query = buildConcreteCandidateQuery(SC, P->Guess);
+        PendingGuess *PP = P.get();
+        P->Done = Pool.async([PP, &SC, &Cancelled]() {
+          if (Cancelled) {
+            PP->EC = std::make_error_code(std::errc::operation_canceled);
+            return;
+          }
+          PP->EC = SC.SMTSolver->isSatisfiable(PP->Query, PP->IsSat, 0, 0,
+                                               SC.Timeout, &Cancelled);
+        });
+      }
+      Window.push_back(std::move(P));
+    }
 
-  if (EnableBigQuery && isBigQuerySat(SC,Guesses)) {
-    return EC; // None of the guesses work
+    if (Window.empty())
+      break;
+
+    std::unique_ptr<PendingGuess> P = std::move(Window.front());
+    Window.pop_front();
+    GuessIndex++;
+
+    if (DebugLevel > 2) {
+      llvm::errs() << "\n--------------------------------------------\nguess " << GuessIndex << "\n\n";
+      ReplacementContext RC;
+      RC.printInst(P->Guess, llvm::errs(), /*printNames=*/true);
+      llvm::errs() << "\n";
+    }
+
+    if (P->ConstSet.empty()) {
+      if (P->Done.valid())
+        P->Done.wait();
+      if (P->EC) {
+        if (DebugLevel > 1)
+          llvm::errs() << "verification query failed!\n";
+        Finish();
+        return P->EC;
+      }
+      if (P->IsSat) {
+        if (DebugLevel > 3)
+          llvm::errs() << "second query is SAT-- constant doesn't work\n";
+        continue;
+      }
+      if (DebugLevel > 3)
+        llvm::errs() << "query is UNSAT\n";
+      RHS = P->Guess;
+      Finish();
+      return EC;
+    } else {
+      ConstantSynthesis CS;
+      std::map <Inst *, llvm::APInt> ResultConstMap;
+
+      EC = CS.synthesize(SC.SMTSolver, SC.BPCs, SC.PCs, InstMapping (SC.LHS, P->Guess), P->ConstSet,
+                         ResultConstMap, SC.IC, /*MaxTries=*/MaxTries, SC.Timeout,
+                         SC.EB);
+      if (!ResultConstMap.empty()) {
+        std::map<Inst *, Inst *> InstCache;
+        std::map<Block *, Block *> BlockCache;
+        RHS = getInstCopy(P->Guess, SC.IC, InstCache, BlockCache, &ResultConstMap, false);
+        Finish();
+        return EC;
+      }
+    }
   }
 
+  Finish();
+  return EC;
+}
+
+std::error_code synthesizeWithKLEE(SynthesisContext &SC, Inst *&RHS,
+                                   const GuessStream &NextGuess) {
+  std::error_code EC;
+
+  if (SynthesisJobs > 1)
+    return synthesizeWithKLEEParallel(SC, RHS, NextGuess);
+
   // find the valid one
   int GuessIndex = -1;
 
-  for (auto I : Guesses) {
+  for (Inst *I = NextGuess(); I; I = NextGuess()) {
     GuessIndex++;
     if (DebugLevel > 2) {
       llvm::errs() << "\n--------------------------------------------\nguess " << GuessIndex << "\n\n";
@@ -717,7 +907,8 @@ std::error_code synthesizeWithKLEE(SynthesisContext &SC, Inst *&RHS,
       std::map <Inst *, llvm::APInt> ResultConstMap;
 
       EC = CS.synthesize(SC.SMTSolver, SC.BPCs, SC.PCs, InstMapping (SC.LHS, I), ConstSet,
-                         ResultConstMap, SC.IC, /*MaxTries=*/MaxTries, SC.Timeout);
+                         ResultConstMap, SC.IC, /*MaxTries=*/MaxTries, SC.Timeout,
+                         SC.EB);
       if (!ResultConstMap.empty()) {
         std::map<Inst *, Inst *> InstCache;
         std::map<Block *, Block *> BlockCache;
@@ -731,6 +922,36 @@ std::error_code synthesizeWithKLEE(SynthesisContext &SC, Inst *&RHS,
   return EC;
 }
 
+namespace {
+// Observational equivalence: of several concrete guesses that produce the
+// same outputs on every input set of the pruning manager, only the first
+// one is kept. Guesses are seen in cost order, so that is the cheapest one.
+// This trades completeness for speed: a dropped guess may be correct on
+// inputs where the kept one is wrong.
+class GuessDeduplicator {
+  PruningManager &PM;
+  std::unordered_set<std::string> Seen;
+
+public:
+  GuessDeduplicator(PruningManager &PM) : PM(PM) {}
+
+  bool isDuplicate(Inst *Guess) {
+    std::string Signature;
+    if (!PM.getOutputSignature(Guess, Signature))
+      return false;
+    if (Seen.insert(Signature).second)
+      return false;
+    ++GuessesCollapsed;
+    if (DebugLevel > 3) {
+      llvm::errs() << "dropping observationally equivalent guess\n";
+      ReplacementContext RC;
+      RC.printInst(Guess, llvm::errs(), /*printNames=*/true);
+    }
+    return true;
+  }
+};
+}
+
 void generateAndSortGuesses(SynthesisContext &SC,
                             std::vector<Inst *> &Guesses) {
   std::vector<Inst *> Cands;
@@ -752,10 +973,10 @@ void generateAndSortGuesses(SynthesisContext &SC,
   std::vector<PruneFunc> PruneFuncs = { [&Visited](Inst *I, std::vector<Inst*> &ReservedInsts)  {
     return CountPrune(I, ReservedInsts, Visited);
   }};
-  if (EnableDataflowPruning) {
+  if (EnableDataflowPruning || DedupGuesses)
     DataflowPruning.init();
+  if (EnableDataflowPruning)
     PruneFuncs.push_back(DataflowPruning.getPruneFunc());
-  }
   auto PruneCallback = MkPruneFunc(PruneFuncs);
   // TODO(zhengyangl): Refactor the syntactic pruning into a
   // prune function here, between Cost and Dataflow
@@ -781,46 +1002,200 @@ void generateAndSortGuesses(SynthesisContext &SC,
                      return souper::cost(a) < souper::cost(b);
                    });
 
+  if (DedupGuesses) {
+    GuessDeduplicator Dedup(DataflowPruning);
+    Guesses.erase(std::remove_if(Guesses.begin(), Guesses.end(),
+                                 [&Dedup](Inst *I) {
+                                   return Dedup.isDuplicate(I);
+                                 }),
+                  Guesses.end());
+  }
+
   if (DebugLevel > 1)
     llvm::errs() << "There are " << Guesses.size() << " Guesses\n";
 }
 
+namespace {
+// Enumerates the same space of guesses as generateAndSortGuesses, but
+// lazily and in non-decreasing cost order, by best-first expansion of
+// partial guesses. A partial guess is keyed by the cost of everything but
+// its holes, a lower bound on the cost of its completions. Holes are
+// filled left to right, so unlike getGuesses no guess is produced twice,
+// and memory is bounded by the frontier instead of the whole guess space.
+class LazyGuessGenerator {
+  struct Entry {
+    int Cost;
+    unsigned Seq;
+    Inst *I;
+    bool Complete;
+  };
+  struct Later {
+    bool operator()(const Entry &A, const Entry &B) const {
+      if (A.Cost != B.Cost)
+        return A.Cost > B.Cost;
+      return A.Seq > B.Seq;
+    }
+  };
+
+  SynthesisContext &SC;
+  std::vector<Inst *> Cands;
+  std::vector<Inst *> Inputs;
+  int LHSCost;
+  int TooExpensive = 0;
+  PruningManager DataflowPruning;
+  std::set<Inst *> Visited;
+  PruneFunc Prune;
+  GuessDeduplicator Dedup;
+  std::priority_queue<Entry, std::vector<Entry>, Later> Frontier;
+  unsigned Seq = 0;
+
+  void addComplete(Inst *I) {
+    std::vector<Inst *> Complete;
+    addGuess(I, SC.LHS->Width, SC.IC, LHSCost, Complete, TooExpensive);
+    for (auto G : Complete)
+      Frontier.push({souper::cost(G), Seq++, G, true});
+  }
+
+  void add(Inst *I) {
+    std::vector<Inst *> Holes;
+    getHoles(I, Holes);
+    if (Holes.empty()) {
+      std::vector<Inst *> Empty;
+      if (Prune(I, Empty))
+        addComplete(I);
+    } else if (Prune(I, Holes)) {
+      // holes are distinct nodes, each with cost 1
+      Frontier.push({souper::cost(I) - (int)Holes.size(), Seq++, I, false});
+    }
+  }
+
+public:
+  LazyGuessGenerator(SynthesisContext &SC)
+      : SC(SC), DataflowPruning(SC, Inputs, DebugLevel),
+        Dedup(DataflowPruning) {
+    findCands(SC.LHS, Cands, /*WidthMustMatch=*/false, /*FilterVars=*/false, MaxLHSCands);
+    if (DebugLevel > 1)
+      llvm::errs() << "got " << Cands.size() << " candidates from LHS\n";
+
+    LHSCost = souper::cost(SC.LHS, /*IgnoreDepsWithExternalUses=*/true);
+    findVars(SC.LHS, Inputs);
+    Visited.insert(Cands.begin(), Cands.end());
+
+    std::vector<PruneFunc> PruneFuncs = { [this](Inst *I, std::vector<Inst*> &ReservedInsts) {
+      return CountPrune(I, ReservedInsts, Visited);
+    }};
+    if (EnableDataflowPruning || DedupGuesses)
+      DataflowPruning.init();
+    if (EnableDataflowPruning)
+      PruneFuncs.push_back(DataflowPruning.getPruneFunc());
+    Prune = MkPruneFunc(PruneFuncs);
+
+    std::vector<Inst *> PartialGuesses;
+    getPartialGuesses(PartialGuesses, Cands, SC.LHS->Width, LHSCost, SC.IC,
+                      nullptr, nullptr, TooExpensive);
+    for (auto I : PartialGuesses)
+      add(I);
+
+    // nops
+    for (auto I : Inputs)
+      addComplete(I);
+  }
+
+  Inst *next() {
+    while (!Frontier.empty()) {
+      Entry E = Frontier.top();
+      Frontier.pop();
+      if (E.Complete) {
+        if (DedupGuesses && Dedup.isDuplicate(E.I))
+          continue;
+        return E.I;
+      }
+
+      std::vector<Inst *> Holes;
+      getHoles(E.I, Holes);
+      Inst *Slot = Holes.front();
+      std::vector<Inst *> PartialGuesses;
+      getPartialGuesses(PartialGuesses, Cands, Slot->Width, LHSCost, SC.IC,
+                        E.I, Slot, TooExpensive);
+      for (auto I : PartialGuesses) {
+        std::map<Inst *, Inst *> InstCache;
+        add(instJoin(E.I, Slot, I, InstCache, SC.IC));
+      }
+    }
+    return nullptr;
+  }
+
+  void printStats(llvm::raw_ostream &OS) {
+    DataflowPruning.printStats(OS);
+  }
+};
+}
+
 std::error_code
 EnumerativeSynthesis::synthesize(SMTLIBSolver *SMTSolver,
                                 const BlockPCs &BPCs,
                                 const std::vector<InstMapping> &PCs,
                                 Inst *LHS, Inst *&RHS,
                                 InstContext &IC, unsigned Timeout) {
-  SynthesisContext SC{IC, SMTSolver, LHS, getUBInstCondition(SC.IC, SC.LHS), PCs, BPCs, Timeout};
+  // Guesses, holes and synthesis constants are only needed while looking
+  // for the RHS; everything but the RHS itself is dropped on return.
+  std::unique_ptr<InstContextScope> Scratch;
+  if (ReclaimScratch) {
+    Scratch.reset(new InstContextScope(IC));
+    Scratch->promote(RHS);
+  }
+
+  // Every query below is about LHS, so they share one builder. It is
+  // destroyed before the scratch nodes it refers to.
+  std::unique_ptr<ExprBuilder> EB = createExprBuilder(IC);
+  SynthesisContext SC{IC, SMTSolver, LHS, EB->getUBInstCondition(LHS), PCs,
+                      BPCs, Timeout, EB.get()};
 
-  std::vector<Inst *> Guesses;
   std::error_code EC;
-  generateAndSortGuesses(SC, Guesses);
+  std::error_code Ret;
+
+  // The big query and Alive need the whole list of guesses up front
+  if (LazyGuesses && !UseAlive && !EnableBigQuery) {
+    LazyGuessGenerator Generator(SC);
+    if (SkipSolver)
+      return EC;
+    Ret = synthesizeWithKLEE(SC, RHS, [&Generator]() {
+      return Generator.next();
+    });
+    if (DebugLevel >= 1)
+      Generator.printStats(llvm::errs());
+  } else {
+    std::vector<Inst *> Guesses;
+    generateAndSortGuesses(SC, Guesses);
 
-  if (SkipSolver || Guesses.empty())
-    return EC;
+    if (SkipSolver || Guesses.empty())
+      return EC;
 
-  if (UseAlive) {
-    return synthesizeWithAlive(SC, RHS, Guesses);
-  } else {
-    auto Ret = synthesizeWithKLEE(SC, RHS, Guesses);
-    if (DoubleCheckWithAlive && !Ret && RHS) {
-      if (isTransformationValid(LHS, RHS, PCs, IC)) {
-        return Ret;
-      } else {
-        llvm::errs() << "Transformation proved wrong by alive.";
-        ReplacementContext RC;
-        RC.printInst(LHS, llvm::errs(), /*printNames=*/true);
-        llvm::errs() << "=>";
-        ReplacementContext RC2;
-        RC2.printInst(RHS, llvm::errs(), /*printNames=*/true);
-        RHS = nullptr;
-        std::error_code EC;
-        return EC;
-      }
-    }
-    return Ret;
+    if (UseAlive)
+      return synthesizeWithAlive(SC, RHS, Guesses);
+
+    if (EnableBigQuery && isBigQuerySat(SC, Guesses))
+      return EC; // None of the guesses work
+
+    size_t Next = 0;
+    Ret = synthesizeWithKLEE(SC, RHS, [&Guesses, &Next]() -> Inst * {
+      return Next == Guesses.size() ? nullptr : Guesses[Next++];
+    });
   }
 
-  return EC;
+  if (DoubleCheckWithAlive && !Ret && RHS) {
+    if (isTransformationValid(LHS, RHS, PCs, IC)) {
+      return Ret;
+    } else {
+      llvm::errs() << "Transformation proved wrong by alive.";
+      ReplacementContext RC;
+      RC.printInst(LHS, llvm::errs(), /*printNames=*/true);
+      llvm::errs() << "=>";
+      ReplacementContext RC2;
+      RC2.printInst(RHS, llvm::errs(), /*printNames=*/true);
+      RHS = nullptr;
+      return EC;
+    }
+  }
+  return Ret;
 }
@@ -262,7 +262,7 @@ std::error_code InstSynthesis::synthesize(SMTLIBSolver *SMTSolver,
       // Parse input counterexamples from the model
       std::map<Inst *, Inst *> InputMap;
       for (unsigned J = 0; J < ModelInsts.size(); ++J) {
-        auto Name = ModelInsts[J]->Name;
+        auto Name = ModelInsts[J]->Meta->Name;
         if (Name.find(INPUT_PREFIX) != std::string::npos) {
           auto In = ModelInsts[J];
           auto Val = ModelVals[J];
@@ -389,7 +389,7 @@ void InstSynthesis::initInputVars(InstContext &IC) {
     I.emplace_back(In, Loc);
     // Update input name
     LocVarStr = getLocVarStr(In, INPUT_PREFIX);
-    Inputs[J]->Name = LocVarStr;
+    Inputs[J]->Meta->Name = LocVarStr;
     LocInstMap[LocVarStr] = std::make_pair(In, Loc);
     // Update CompInstMap map with concrete Inst
     CompInstMap[In] = Inputs[J];
@@ -1005,7 +1005,7 @@ LocVar InstSynthesis::parseWiringModel(const SolverSolution &Solution,
   auto ModelVals = Solution.second;
   assert(ModelVals.size() && "there must models to parse");
   for (unsigned J = 0; J < ModelInsts.size(); ++J) {
-    auto Name = ModelInsts[J]->Name;
+    auto Name = ModelInsts[J]->Meta->Name;
     // Parse location variable models
     if (Name.find(LOC_PREFIX) != std::string::npos) {
       LocVar Loc = getLocVarFromStr(Name.substr(LOC_PREFIX.size()));
@@ -1391,7 +1391,7 @@ std::error_code InstSynthesis::getInitialConcreteInputs(std::vector<std::map<Ins
 
     std::map<Inst *, Inst *> ConcreteInputs;
     for (unsigned K = 0; K < ModelInsts.size(); ++K) {
-      auto Name = ModelInsts[K]->Name;
+      auto Name = ModelInsts[K]->Meta->Name;
       if (Name.find(INPUT_PREFIX) != std::string::npos) {
         auto Input = ModelInsts[K];
         ConcreteInputs[Input] = LIC->getConst(ModelVals[K]);
@@ -1412,9 +1412,10 @@ Inst *InstSynthesis::initConcreteInputWirings(Inst *Query, Inst *WiringQuery,
     auto InputMap = S[K];
     if (DebugLevel > 2) {
       for (auto const &Input : InputMap) {
-        if (Input.first->Name.find(COMP_INPUT_PREFIX) != std::string::npos)
+        if (Input.first->Meta->Name.find(COMP_INPUT_PREFIX) !=
+            std::string::npos)
           continue;
-        llvm::outs() << "setting input " << Input.first->Name
+        llvm::outs() << "setting input " << Input.first->Meta->Name
                      << " to " << Input.second->Val << "\n";
       }
     }
@@ -1431,7 +1432,7 @@ Inst *InstSynthesis::initConcreteInputWirings(Inst *Query, Inst *WiringQuery,
     }
     Inst *Copy = replaceVars(WiringQuery, *LIC, InputMap);
     Query = LIC->getInst(Inst::And, 1, {Query, Copy});
-    Query->DemandedBits = APInt::getAllOnesValue(Query->Width);
+    Query->Meta->DemandedBits = APInt::getAllOnesValue(Query->Width);
   }
 
   return Query;
@@ -12,8 +12,15 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/ErrorHandling.h"
 #include "souper/Infer/Interpreter.h"
 
+#include <algorithm>
+#include <set>
+
 namespace souper {
   EvalValue evaluateAddNSW(llvm::APInt a, llvm::APInt b) {
     bool Ov;
@@ -105,7 +112,8 @@ namespace souper {
 #define ARG1 Args[1].getValue()
 #define ARG2 Args[2].getValue()
 
-  EvalValue ConcreteInterpreter::evaluateSingleInst(Inst *Inst, std::vector<EvalValue> &Args) {
+  static EvalValue evaluateSingleInst(Inst *Inst,
+                                      llvm::MutableArrayRef<EvalValue> Args) {
     // UB propagates unconditionally
     for (auto &A : Args)
       if (A.K == EvalValue::ValueKind::UB)
@@ -219,7 +227,7 @@ namespace souper {
 
     case Inst::SDiv:
       if (ARG1 == 0 ||
-          (ARG0.isMinSignedValue() && ARG1 == -1))
+          (ARG0.isMinSignedValue() && ARG1.isAllOnesValue()))
         return EvalValue::ub();
       return {ARG0.sdiv(ARG1)};
 
@@ -433,8 +441,7 @@ namespace souper {
     if (Cache.find(Root) != Cache.end())
       return Cache[Root];
 
-    // TODO SmallVector
-    std::vector<EvalValue> EvaluatedArgs;
+    llvm::SmallVector<EvalValue, 3> EvaluatedArgs;
     for (auto &&I : Root->Ops)
       EvaluatedArgs.push_back(evaluateInst(I));
     auto Result = evaluateSingleInst(Root, EvaluatedArgs);
@@ -442,4 +449,558 @@ namespace souper {
       Cache[Root] = Result;
     return Result;
   }
+
+  // Lane kernels for the narrow path. Every value of width W <= 64 lives
+  // zero-extended in a uint64_t lane; its state (value, poison or UB) lives
+  // in a parallel byte lane. The kernels are plain loops over contiguous
+  // lanes so that the compiler can vectorize them.
+  namespace {
+  enum LaneState : uint8_t { LaneVal = 0, LanePoison = 1, LaneUB = 2 };
+
+  // Number of input sets evaluated together; keeps the lanes of a tape in
+  // cache.
+  const unsigned LaneBlock = 256;
+
+  inline uint64_t widthMask(unsigned W) {
+    return W == 64 ? ~0ULL : (1ULL << W) - 1;
+  }
+
+  inline int64_t sext(uint64_t V, unsigned W) {
+    return (int64_t)(V << (64 - W)) >> (64 - W);
+  }
+
+  bool hasLaneKernel(Inst *I) {
+    if (I->Width > 64)
+      return false;
+    for (auto Op : I->Ops)
+      if (Op->Width > 64)
+        return false;
+    switch (I->K) {
+    case Inst::Var:
+    case Inst::Const:
+    case Inst::UntypedConst:
+    case Inst::Add:
+    case Inst::AddNSW:
+    case Inst::AddNUW:
+    case Inst::AddNW:
+    case Inst::Sub:
+    case Inst::SubNSW:
+    case Inst::SubNUW:
+    case Inst::SubNW:
+    case Inst::Mul:
+    case Inst::MulNSW:
+    case Inst::MulNUW:
+    case Inst::MulNW:
+    case Inst::UDiv:
+    case Inst::SDiv:
+    case Inst::URem:
+    case Inst::SRem:
+    case Inst::And:
+    case Inst::Or:
+    case Inst::Xor:
+    case Inst::Shl:
+    case Inst::LShr:
+    case Inst::AShr:
+    case Inst::Select:
+    case Inst::ZExt:
+    case Inst::SExt:
+    case Inst::Trunc:
+    case Inst::Eq:
+    case Inst::Ne:
+    case Inst::Ult:
+    case Inst::Slt:
+    case Inst::Ule:
+    case Inst::Sle:
+    case Inst::CtPop:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // Compute one step over N lanes. A, B and C are the operand lanes, with
+  // states SA, SB and SC. Lanes whose operands aren't values get garbage in
+  // R but their state in RS is set correctly.
+  void runLaneKernel(Inst *I, unsigned N,
+                     const uint64_t *A, const uint64_t *B, const uint64_t *C,
+                     const uint8_t *SA, const uint8_t *SB, const uint8_t *SC,
+                     uint64_t *R, uint8_t *RS) {
+    unsigned W = I->Width;
+    uint64_t M = widthMask(W);
+    unsigned OW = I->Ops[0]->Width;
+
+    if (I->K == Inst::Select) {
+      // UB in any operand wins; otherwise poison only comes from the
+      // condition or the chosen operand
+      for (unsigned L = 0; L != N; ++L) {
+        bool Cond = A[L] & 1;
+        R[L] = Cond ? B[L] : C[L];
+        uint8_t S = SA[L] != LaneVal ? SA[L] : (Cond ? SB[L] : SC[L]);
+        RS[L] = (SA[L] | SB[L] | SC[L]) & LaneUB ? LaneUB : S;
+      }
+      return;
+    }
+
+    // UB dominates poison, which dominates a value
+    for (unsigned L = 0; L != N; ++L)
+      RS[L] = B ? std::max(SA[L], SB[L]) : SA[L];
+
+// Set the state of lanes whose operands are both values.
+#define LANE_FLAG(Cond, State) \
+    if (RS[L] == LaneVal && (Cond)) RS[L] = State
+
+    switch (I->K) {
+    case Inst::Add:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = (A[L] + B[L]) & M;
+      break;
+    case Inst::AddNSW:
+    case Inst::AddNUW:
+    case Inst::AddNW:
+      for (unsigned L = 0; L != N; ++L) {
+        uint64_t U;
+        int64_t S;
+        bool UOv = __builtin_add_overflow(A[L], B[L], &U) || (U & ~M);
+        bool SOv = __builtin_add_overflow(sext(A[L], W), sext(B[L], W), &S) ||
+                   S != sext(S & M, W);
+        R[L] = U & M;
+        LANE_FLAG((I->K != Inst::AddNUW && SOv) ||
+                  (I->K != Inst::AddNSW && UOv), LanePoison);
+      }
+      break;
+    case Inst::Sub:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = (A[L] - B[L]) & M;
+      break;
+    case Inst::SubNSW:
+    case Inst::SubNUW:
+    case Inst::SubNW:
+      for (unsigned L = 0; L != N; ++L) {
+        int64_t S;
+        bool UOv = A[L] < B[L];
+        bool SOv = __builtin_sub_overflow(sext(A[L], W), sext(B[L], W), &S) ||
+                   S != sext(S & M, W);
+        R[L] = (A[L] - B[L]) & M;
+        LANE_FLAG((I->K != Inst::SubNUW && SOv) ||
+                  (I->K != Inst::SubNSW && UOv), LanePoison);
+      }
+      break;
+    case Inst::Mul:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = (A[L] * B[L]) & M;
+      break;
+    case Inst::MulNSW:
+    case Inst::MulNUW:
+    case Inst::MulNW:
+      for (unsigned L = 0; L != N; ++L) {
+        uint64_t U;
+        int64_t S;
+        bool UOv = __builtin_mul_overflow(A[L], B[L], &U) || (U & ~M);
+        bool SOv = __builtin_mul_overflow(sext(A[L], W), sext(B[L], W), &S) ||
+                   S != sext(S & M, W);
+        R[L] = (A[L] * B[L]) & M;
+        LANE_FLAG((I->K != Inst::MulNUW && SOv) ||
+                  (I->K != Inst::MulNSW && UOv), LanePoison);
+      }
+      break;
+    case Inst::UDiv:
+    case Inst::URem:
+      for (unsigned L = 0; L != N; ++L) {
+        uint64_t D = B[L] ? B[L] : 1;
+        R[L] = I->K == Inst::UDiv ? A[L] / D : A[L] % D;
+        LANE_FLAG(B[L] == 0, LaneUB);
+      }
+      break;
+    case Inst::SDiv:
+    case Inst::SRem:
+      for (unsigned L = 0; L != N; ++L) {
+        int64_t X = sext(A[L], W), Y = sext(B[L], W);
+        bool Ov = Y == 0 || (A[L] == (1ULL << (W - 1)) && B[L] == M);
+        if (Ov)
+          Y = 1;
+        R[L] = (uint64_t)(I->K == Inst::SDiv ? X / Y : X % Y) & M;
+        LANE_FLAG(Ov, LaneUB);
+      }
+      break;
+    case Inst::And:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = A[L] & B[L];
+      break;
+    case Inst::Or:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = A[L] | B[L];
+      break;
+    case Inst::Xor:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = A[L] ^ B[L];
+      break;
+    case Inst::Shl:
+      for (unsigned L = 0; L != N; ++L) {
+        R[L] = B[L] < W ? (A[L] << B[L]) & M : 0;
+        LANE_FLAG(B[L] >= W, LanePoison);
+      }
+      break;
+    case Inst::LShr:
+      for (unsigned L = 0; L != N; ++L) {
+        R[L] = B[L] < W ? A[L] >> B[L] : 0;
+        LANE_FLAG(B[L] >= W, LanePoison);
+      }
+      break;
+    case Inst::AShr:
+      for (unsigned L = 0; L != N; ++L) {
+        R[L] = B[L] < W ? (uint64_t)(sext(A[L], W) >> B[L]) & M : 0;
+        LANE_FLAG(B[L] >= W, LanePoison);
+      }
+      break;
+    case Inst::ZExt:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = A[L];
+      break;
+    case Inst::SExt:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = (uint64_t)sext(A[L], OW) & M;
+      break;
+    case Inst::Trunc:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = A[L] & M;
+      break;
+    case Inst::Eq:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = A[L] == B[L];
+      break;
+    case Inst::Ne:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = A[L] != B[L];
+      break;
+    case Inst::Ult:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = A[L] < B[L];
+      break;
+    case Inst::Ule:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = A[L] <= B[L];
+      break;
+    case Inst::Slt:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = sext(A[L], OW) < sext(B[L], OW);
+      break;
+    case Inst::Sle:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = sext(A[L], OW) <= sext(B[L], OW);
+      break;
+    case Inst::CtPop:
+      for (unsigned L = 0; L != N; ++L)
+        R[L] = __builtin_popcountll(A[L]) & M;
+      break;
+    default:
+      llvm_unreachable("no lane kernel for instruction");
+    }
+
+#undef LANE_FLAG
+  }
+  }
+
+  CompiledInst::CompiledInst(Inst *Root) {
+    // Assign slots in post order so that every operand is computed before
+    // its users. Variables and constants don't get a step: variables are
+    // loaded from the input set, constants once per evaluation.
+    llvm::DenseMap<Inst *, unsigned> Slot;
+    std::vector<std::pair<Inst *, unsigned>> Stack;
+    Stack.push_back({Root, 0});
+    while (!Stack.empty()) {
+      Inst *I = Stack.back().first;
+      unsigned &NextOp = Stack.back().second;
+      if (NextOp == 0 && Slot.count(I)) {
+        Stack.pop_back();
+        continue;
+      }
+      if (NextOp < I->Ops.size()) {
+        Inst *Op = I->Ops[NextOp++];
+        if (!Slot.count(Op))
+          Stack.push_back({Op, 0});
+        continue;
+      }
+      Stack.pop_back();
+      if (Slot.count(I))
+        continue;
+
+      unsigned Dest = NumSlots++;
+      Slot[I] = Dest;
+      Narrow = Narrow && hasLaneKernel(I);
+      if (I->K == Inst::Var) {
+        Inputs.push_back({I, Dest});
+      } else if (I->K == Inst::Const || I->K == Inst::UntypedConst) {
+        Constants.push_back({I, Dest});
+      } else {
+        Steps.push_back({I, Dest, (unsigned)ArgSlots.size(),
+                         (unsigned)I->Ops.size()});
+        for (auto Op : I->Ops)
+          ArgSlots.push_back(Slot[Op]);
+      }
+    }
+    Result = Slot[Root];
+    ResultWidth = Root->Width;
+  }
+
+  EvalValue CompiledInst::run(const ValueCache &Input,
+                              std::vector<EvalValue> &Slots,
+                              std::vector<EvalValue> &Args) const {
+    for (auto &In : Inputs) {
+      auto It = Input.find(In.first);
+      if (It == Input.end())
+        llvm::report_fatal_error("Interpreter can't find an input value, exiting");
+      Slots[In.second] = It->second;
+    }
+
+    for (auto &S : Steps) {
+      Args.resize(S.NumArgs);
+      for (unsigned J = 0; J != S.NumArgs; ++J)
+        Args[J] = Slots[ArgSlots[S.FirstArg + J]];
+      Slots[S.Dest] = evaluateSingleInst(S.I, Args);
+    }
+    return Slots[Result];
+  }
+
+  EvalValue CompiledInst::evaluate(const ValueCache &Input) const {
+    std::vector<EvalValue> Slots(NumSlots), Args;
+    for (auto &C : Constants)
+      Slots[C.second] = EvalValue(C.first->Val);
+    return run(Input, Slots, Args);
+  }
+
+  bool CompiledInst::evaluateNarrow(const std::vector<ValueCache> &InputSets,
+                                    std::vector<EvalValue> &Results) const {
+    std::vector<uint64_t> Lanes(NumSlots * LaneBlock);
+    std::vector<uint8_t> States(NumSlots * LaneBlock);
+    auto lanes = [&](unsigned Slot) { return &Lanes[Slot * LaneBlock]; };
+    auto states = [&](unsigned Slot) { return &States[Slot * LaneBlock]; };
+
+    for (auto &C : Constants) {
+      std::fill_n(lanes(C.second), LaneBlock, C.first->Val.getZExtValue());
+      std::fill_n(states(C.second), LaneBlock, LaneVal);
+    }
+
+    Results.clear();
+    Results.reserve(InputSets.size());
+    for (size_t Base = 0; Base < InputSets.size(); Base += LaneBlock) {
+      unsigned N = std::min<size_t>(LaneBlock, InputSets.size() - Base);
+
+      for (auto &In : Inputs) {
+        uint64_t *R = lanes(In.second);
+        uint8_t *RS = states(In.second);
+        for (unsigned L = 0; L != N; ++L) {
+          auto It = InputSets[Base + L].find(In.first);
+          if (It == InputSets[Base + L].end())
+            llvm::report_fatal_error("Interpreter can't find an input value, exiting");
+          const EvalValue &V = It->second;
+          switch (V.K) {
+          case EvalValue::ValueKind::Val:
+            R[L] = V.Value.getZExtValue();
+            RS[L] = LaneVal;
+            break;
+          case EvalValue::ValueKind::Poison:
+            RS[L] = LanePoison;
+            break;
+          case EvalValue::ValueKind::UB:
+            RS[L] = LaneUB;
+            break;
+          default:
+            // leave undef and friends to the generic path
+            Results.clear();
+            return false;
+          }
+        }
+      }
+
+      for (auto &S : Steps) {
+        const unsigned *Args = &ArgSlots[S.FirstArg];
+        runLaneKernel(S.I, N,
+                      lanes(Args[0]),
+                      S.NumArgs > 1 ? lanes(Args[1]) : nullptr,
+                      S.NumArgs > 2 ? lanes(Args[2]) : nullptr,
+                      states(Args[0]),
+                      S.NumArgs > 1 ? states(Args[1]) : nullptr,
+                      S.NumArgs > 2 ? states(Args[2]) : nullptr,
+                      lanes(S.Dest), states(S.Dest));
+      }
+
+      for (unsigned L = 0; L != N; ++L) {
+        switch (states(Result)[L]) {
+        case LaneVal:
+          Results.push_back(EvalValue(llvm::APInt(ResultWidth, lanes(Result)[L])));
+          break;
+        case LanePoison:
+          Results.push_back(EvalValue::poison());
+          break;
+        default:
+          Results.push_back(EvalValue::ub());
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  void CompiledInst::evaluate(const std::vector<ValueCache> &InputSets,
+                              std::vector<EvalValue> &Results) const {
+    if (Narrow && evaluateNarrow(InputSets, Results))
+      return;
+
+    // Slots and the argument buffer are reused for every input set. Slots
+    // holding constants are never overwritten, so they're filled in once.
+    std::vector<EvalValue> Slots(NumSlots), Args;
+    for (auto &C : Constants)
+      Slots[C.second] = EvalValue(C.first->Val);
+
+    Results.clear();
+    Results.reserve(InputSets.size());
+    for (auto &Input : InputSets)
+      Results.push_back(run(Input, Slots, Args));
+  }
+
+  namespace {
+  bool canDivideByZero(Inst *I) {
+    switch (I->K) {
+    case Inst::UDiv:
+    case Inst::SDiv:
+    case Inst::UDivExact:
+    case Inst::SDivExact:
+    case Inst::URem:
+    case Inst::SRem:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // The query only counts UB on the operand a select picks, while the
+  // interpreter lets UB escape from either operand.
+  bool hasUBUnderSelect(Inst *Root) {
+    std::vector<Inst *> Selects;
+    findInsts(Root, Selects, [](Inst *I) { return I->K == Inst::Select; });
+    for (auto S : Selects)
+      if (hasGivenInst(S->Ops[1], canDivideByZero) ||
+          hasGivenInst(S->Ops[2], canDivideByZero))
+        return true;
+    return false;
+  }
+
+  // Mirrors the dataflow conditions the query builder puts on variables.
+  bool satisfiesDataflowFacts(Inst *Var, const llvm::APInt &V) {
+    unsigned W = Var->Width;
+    if (Var->Meta->KnownZeros.getBitWidth() == W &&
+        (V & Var->Meta->KnownZeros) != 0)
+      return false;
+    if (Var->Meta->KnownOnes.getBitWidth() == W &&
+        (V & Var->Meta->KnownOnes) != Var->Meta->KnownOnes)
+      return false;
+    if (Var->Meta->NonZero && V == 0)
+      return false;
+    if (Var->Meta->NonNegative && V.isNegative())
+      return false;
+    if (Var->Meta->PowOfTwo && !V.isPowerOf2())
+      return false;
+    if (Var->Meta->Negative && !V.isNegative())
+      return false;
+    if (Var->Meta->NumSignBits > 1 &&
+        V.getNumSignBits() < Var->Meta->NumSignBits)
+      return false;
+    if (Var->Meta->Range.getBitWidth() == W && !Var->Meta->Range.contains(V))
+      return false;
+    bool InRefinement = Var->Meta->RangeRefinement.empty();
+    for (auto &R : Var->Meta->RangeRefinement)
+      if (R.getBitWidth() != W || R.isEmptySet() || R.contains(V))
+        InRefinement = true;
+    return InRefinement;
+  }
+  }
+
+  bool isValidExhaustively(const std::vector<InstMapping> &PCs,
+                           InstMapping Mapping, unsigned MaxInputBits,
+                           bool &IsValid,
+                           std::vector<std::pair<Inst *, llvm::APInt>> *Model) {
+    // Roots are LHS, RHS, then both sides of each PC
+    std::vector<Inst *> Roots = {Mapping.LHS, Mapping.RHS};
+    for (auto &PC : PCs) {
+      Roots.push_back(PC.LHS);
+      Roots.push_back(PC.RHS);
+    }
+
+    auto NotModeled = [](Inst *I) {
+      return I->K == Inst::Phi || I->K == Inst::Hole ||
+             I->K == Inst::ReservedConst || I->K == Inst::ReservedInst;
+    };
+    std::vector<Inst *> Vars;
+    std::set<Inst *> Seen;
+    unsigned InputBits = 0;
+    for (auto R : Roots) {
+      if (hasGivenInst(R, NotModeled) || hasUBUnderSelect(R))
+        return false;
+      std::vector<Inst *> RootVars;
+      findInsts(R, RootVars, [](Inst *I) { return I->K == Inst::Var; });
+      for (auto V : RootVars) {
+        if (!Seen.insert(V).second)
+          continue;
+        Vars.push_back(V);
+        InputBits += V->Width;
+        if (InputBits > MaxInputBits || InputBits > 32)
+          return false;
+      }
+    }
+
+    std::vector<CompiledInst> Tapes(Roots.begin(), Roots.end());
+    llvm::APInt Demanded = Mapping.LHS->Meta->DemandedBits;
+    if (Demanded.getBitWidth() != Mapping.LHS->Width)
+      Demanded = llvm::APInt::getAllOnesValue(Mapping.LHS->Width);
+
+    const unsigned ChunkSize = 1024;
+    std::vector<ValueCache> InputSets;
+    std::vector<std::vector<EvalValue>> Vals(Roots.size());
+    uint64_t NumInputs = 1ULL << InputBits;
+    for (uint64_t Base = 0; Base < NumInputs; Base += ChunkSize) {
+      InputSets.clear();
+      for (uint64_t Input = Base;
+           Input < std::min(Base + ChunkSize, NumInputs); ++Input) {
+        ValueCache VC;
+        uint64_t Bits = Input;
+        bool Ok = true;
+        for (auto V : Vars) {
+          llvm::APInt X(V->Width, Bits & ((1ULL << V->Width) - 1));
+          Bits >>= V->Width;
+          if (!satisfiesDataflowFacts(V, X)) {
+            Ok = false;
+            break;
+          }
+          VC.emplace(V, X);
+        }
+        if (Ok)
+          InputSets.push_back(std::move(VC));
+      }
+
+      for (unsigned R = 0; R != Roots.size(); ++R)
+        Tapes[R].evaluate(InputSets, Vals[R]);
+
+      for (unsigned L = 0; L != InputSets.size(); ++L) {
+        bool Assumed = Vals[0][L].hasValue();
+        for (unsigned P = 2; Assumed && P != Roots.size(); P += 2)
+          Assumed = Vals[P][L].hasValue() && Vals[P + 1][L].hasValue() &&
+                    Vals[P][L].Value == Vals[P + 1][L].Value;
+        if (!Assumed)
+          continue;
+
+        auto &LHSV = Vals[0][L], &RHSV = Vals[1][L];
+        if (RHSV.hasValue() && ((LHSV.Value ^ RHSV.Value) & Demanded) == 0)
+          continue;
+
+        IsValid = false;
+        if (Model)
+          for (auto V : Vars)
+            Model->push_back({V, InputSets[L][V].getValue()});
+        return true;
+      }
+    }
+
+    IsValid = true;
+    return true;
+  }
 }
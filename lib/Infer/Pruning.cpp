@@ -169,12 +169,18 @@ bool PruningManager::isInfeasible(souper::Inst *RHS,
     }
   }
 
+  // A concrete RHS only needs plain evaluation on each input; do it for all
+  // inputs at once on a compiled tape.
+  std::vector<EvalValue> RHSVals;
+  if (RHSIsConcrete && !LHSHasPhi)
+    CompiledInst(RHS).evaluate(InputVals, RHSVals);
+
   for (int I = 0; I < InputVals.size(); ++I) {
     if (StatsLevel > 2) {
       llvm::errs() << "  Input:\n";
       for (auto &&p : InputVals[I]) {
         if (p.second.hasValue()) {
-          llvm::errs() << "  Var " << p.first->Name << " : "
+          llvm::errs() << "  Var " << p.first->Meta->Name << " : "
                         << p.second.getValue() << "\n";
         }
       }
@@ -320,7 +326,7 @@ bool PruningManager::isInfeasible(souper::Inst *RHS,
             }
           }
         } else {
-          auto RHSV = ConcreteInterpreters[I].evaluateInst(RHS);
+          auto RHSV = RHSVals[I];
           if (RHSV.hasValue()) {
             if (Val != RHSV.getValue()) {
               if (StatsLevel > 2) {
@@ -354,7 +360,7 @@ bool PruningManager::isInfeasible(souper::Inst *RHS,
 
       if (ResidualSize < 8192 && Rs.size() < 3) {
         // TODO: Tune. These thresholds control when the solver is involved
-        C.first->RangeRefinement = Rs;
+        C.first->Meta->RangeRefinement = Rs;
       }
     }
 }
@@ -428,7 +434,8 @@ bool PruningManager::isInfeasibleWithSolver(Inst *RHS, unsigned StatsLevel) {
             llvm::errs() << "Failed to prune using Solver, Solver returned SAT\n";
             llvm::errs() << "Model:";
             for (int i = 0; i < Holes.size(); ++i) {
-              llvm::errs() << ModelVars[i]->Name << " : " << Models[i] << "\n";
+              llvm::errs() << ModelVars[i]->Meta->Name << " : "
+                           << Models[i] << "\n";
             }
             llvm::errs() << "\n\n";
           }
@@ -440,6 +447,23 @@ bool PruningManager::isInfeasibleWithSolver(Inst *RHS, unsigned StatsLevel) {
   return false;
 }
 
+bool PruningManager::getOutputSignature(Inst *RHS, std::string &Signature) {
+  Signature.clear();
+  if (!isConcrete(RHS))
+    return false;
+  std::vector<EvalValue> Vals;
+  CompiledInst(RHS).evaluate(InputVals, Vals);
+  for (auto &V : Vals) {
+    if (V.K == EvalValue::ValueKind::Unimplemented)
+      return false;
+    Signature.push_back(static_cast<char>(V.K));
+    if (V.hasValue())
+      Signature.append(reinterpret_cast<const char *>(V.Value.getRawData()),
+                       V.Value.getNumWords() * sizeof(uint64_t));
+  }
+  return true;
+}
+
 PruningManager::PruningManager(
   souper::SynthesisContext &SC_, std::vector<Inst*> &Inputs_, unsigned StatsLevel_)
                   : SC(SC_), NumPruned(0),
@@ -519,7 +543,7 @@ bool PruningManager::isInputValid(ValueCache &Cache) {
         continue;
 
       if (p.second.hasValue()) {
-        llvm::errs() << "  Var " << p.first->Name << " : "
+        llvm::errs() << "  Var " << p.first->Meta->Name << " : "
                      << p.second.getValue() << ", ";
       }
     }
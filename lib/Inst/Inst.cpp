@@ -14,16 +14,22 @@
 
 #include "souper/Inst/Inst.h"
 
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/StringSwitch.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <atomic>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <unordered_map>
 
 using namespace souper;
 
 bool Inst::hasOrigin(llvm::Value *V) const {
+  const auto &Origins = Meta->Origins;
   return std::find(Origins.begin(), Origins.end(), V) != Origins.end();
 }
 
@@ -77,17 +83,17 @@ bool Inst::operator<(const Inst &Other) const {
     return (*OpsA[I] < *OpsB[I]);
   }
 
-  if (HarvestKind == HarvestType::HarvestedFromDef &&
-      Other.HarvestKind == HarvestType::HarvestedFromUse) {
+  if (Meta->HarvestKind == HarvestType::HarvestedFromDef &&
+      Other.Meta->HarvestKind == HarvestType::HarvestedFromUse) {
     return false;
   }
-  else if (HarvestKind == HarvestType::HarvestedFromUse &&
-           Other.HarvestKind == HarvestType::HarvestedFromDef) {
+  else if (Meta->HarvestKind == HarvestType::HarvestedFromUse &&
+           Other.Meta->HarvestKind == HarvestType::HarvestedFromDef) {
     return true;
   }
 
-  if (HarvestFrom != Other.HarvestFrom)
-    return HarvestFrom < Other.HarvestFrom;
+  if (Meta->HarvestFrom != Other.Meta->HarvestFrom)
+    return Meta->HarvestFrom < Other.Meta->HarvestFrom;
   return false;
 }
 
@@ -95,6 +101,7 @@ const std::vector<Inst *> &Inst::orderedOps() const {
   if (!isCommutative(K))
     return Ops;
 
+  auto &OrderedOps = Meta->OrderedOps;
   if (OrderedOps.empty()) {
     OrderedOps = Ops;
     std::sort(OrderedOps.begin(), OrderedOps.end(), [](Inst *A, Inst *B) {
@@ -182,30 +189,32 @@ std::string ReplacementContext::printInstImpl(Inst *I, llvm::raw_ostream &Out,
       Out << "%" << InstName << ":i" << I->Width << " = "
           << Inst::getKindName(I->K);
       if (I->K == Inst::Var) {
-        if (I->KnownZeros.getBoolValue() || I->KnownOnes.getBoolValue())
-          Out << " (knownBits=" << Inst::getKnownBitsString(I->KnownZeros, I->KnownOnes)
+        const InstMetadata *M = I->Meta;
+        if (M->KnownZeros.getBoolValue() || M->KnownOnes.getBoolValue())
+          Out << " (knownBits="
+              << Inst::getKnownBitsString(M->KnownZeros, M->KnownOnes)
               << ")";
-        if (I->NonNegative)
+        if (M->NonNegative)
           Out << " (nonNegative)";
-        if (I->Negative)
+        if (M->Negative)
           Out << " (negative)";
-        if (I->NonZero)
+        if (M->NonZero)
           Out << " (nonZero)";
-        if (I->PowOfTwo)
+        if (M->PowOfTwo)
           Out << " (powerOfTwo)";
-        if (I->NumSignBits > 1)
-          Out << " (signBits=" << I->NumSignBits << ")";
-        if (!I->Range.isFullSet())
-          Out << " (range=[" << I->Range.getLower()
-              << "," << I->Range.getUpper() << "))";
+        if (M->NumSignBits > 1)
+          Out << " (signBits=" << M->NumSignBits << ")";
+        if (!M->Range.isFullSet())
+          Out << " (range=[" << M->Range.getLower()
+              << "," << M->Range.getUpper() << "))";
       }
       Out << OpsSS.str();
 
-      if (OrigI->DepsWithExternalUses.find(I) != OrigI->DepsWithExternalUses.end())
+      if (OrigI->Meta->DepsWithExternalUses.count(I))
         Out << " (hasExternalUses)";
 
-      if (printNames && !I->Name.empty())
-        Out << " ; " << I->Name;
+      if (printNames && !I->Meta->Name.empty())
+        Out << " ; " << I->Meta->Name;
       Out << '\n';
       break;
     }
@@ -287,6 +296,39 @@ void ReplacementContext::setBlock(llvm::StringRef Name, Block *B) {
   BlockNames[B] = Name;
 }
 
+llvm::StringRef ReplacementContext::getInstName(Inst *I) const {
+  auto It = InstNames.find(I);
+  return It == InstNames.end() ? llvm::StringRef() : It->second;
+}
+
+llvm::StringRef ReplacementContext::getBlockName(Block *B) const {
+  auto It = BlockNames.find(B);
+  return It == BlockNames.end() ? llvm::StringRef() : It->second;
+}
+
+// The printer numbers instructions and blocks together, so the next name is
+// the number of names given out so far, unless that was taken by a parsed
+// name already. Names are counted rather than named nodes, since two nodes
+// that were distinct when written may be one when read back.
+static std::string getFreshName(size_t N,
+                                const std::map<std::string, Inst *> &Insts,
+                                const std::map<std::string, Block *> &Blocks) {
+  std::string Name = std::to_string(N);
+  while (Insts.count(Name) || Blocks.count(Name))
+    Name = std::to_string(++N);
+  return Name;
+}
+
+void ReplacementContext::addInst(Inst *I) {
+  setInst(getFreshName(NameToInst.size() + NameToBlock.size(), NameToInst,
+                       NameToBlock), I);
+}
+
+void ReplacementContext::addBlock(Block *B) {
+  setBlock(getFreshName(NameToInst.size() + NameToBlock.size(), NameToInst,
+                        NameToBlock), B);
+}
+
 std::string Inst::getKnownBitsString(llvm::APInt Zero, llvm::APInt One) {
   std::string Str;
   for (int K = Zero.getBitWidth() - 1; K >= 0; --K) {
@@ -540,10 +582,10 @@ void Inst::Profile(llvm::FoldingSetNodeID &ID) const {
     ID.AddPointer(B);
     break;
   default:
-    if (!DemandedBits.isAllOnesValue())
-      ID.Add(DemandedBits);
-    if (HarvestKind == HarvestType::HarvestedFromUse) {
-      ID.Add(HarvestFrom);
+    if (!Meta->DemandedBits.isAllOnesValue())
+      ID.Add(Meta->DemandedBits);
+    if (Meta->HarvestKind == HarvestType::HarvestedFromUse) {
+      ID.Add(Meta->HarvestFrom);
     }
     break;
   }
@@ -552,6 +594,163 @@ void Inst::Profile(llvm::FoldingSetNodeID &ID) const {
     ID.AddPointer(Op);
 }
 
+Inst *InstContext::newInst() {
+  Inst *N = Insts.create();
+  N->Meta = Metadata.create();
+  return N;
+}
+
+InstContext::Checkpoint InstContext::checkpoint() const {
+  Checkpoint CP;
+  CP.NumInsts = Insts.size();
+  CP.NumBlocks = Blocks.size();
+  CP.ReservedConstCounter = ReservedConstCounter;
+  CP.NumUBConditions = UBConditionLog.size();
+  return CP;
+}
+
+void InstContext::rollback(const Checkpoint &CP) {
+  assert(CP.NumInsts <= Insts.size() && CP.NumBlocks <= Blocks.size() &&
+         "rolling back to a checkpoint that was already rolled back past");
+
+  // A condition set before CP only involves nodes that are older still.
+  // Of the ones set since, those that involve no new node are kept, and
+  // stay in the log for the rollbacks to earlier checkpoints.
+  size_t NumKept = CP.NumUBConditions;
+  for (size_t I = CP.NumUBConditions; I != UBConditionLog.size(); ++I) {
+    auto Key = UBConditionLog[I];
+    auto It = UBConditions.find(Key);
+    if (It == UBConditions.end())
+      continue;
+    if (createdSince(CP, Key.first) || createdSince(CP, It->second))
+      UBConditions.erase(It);
+    else
+      UBConditionLog[NumKept++] = Key;
+  }
+  UBConditionLog.resize(NumKept);
+
+  // Variables and blocks are numbered by their position in these lists, so
+  // the ones being destroyed are always at the back.
+  for (size_t I = Insts.size(); I-- > CP.NumInsts;) {
+    Inst *N = Insts[I];
+    if (N->K == Inst::Var) {
+      auto &InstList = VarInstsByWidth[N->Width];
+      assert(!InstList.empty() && InstList.back() == N);
+      InstList.pop_back();
+    } else {
+      // A no-op for the kinds that are never uniqued
+      InstSet.RemoveNode(N);
+    }
+  }
+  Insts.truncate(CP.NumInsts);
+  Metadata.truncate(CP.NumInsts);
+
+  for (size_t I = Blocks.size(); I-- > CP.NumBlocks;) {
+    Block *B = Blocks[I];
+    auto &BlockList = BlocksByPreds[B->Preds];
+    assert(!BlockList.empty() && BlockList.back() == B);
+    BlockList.pop_back();
+  }
+  Blocks.truncate(CP.NumBlocks);
+
+  ReservedConstCounter = CP.ReservedConstCounter;
+}
+
+namespace {
+
+// Copies the part of the DAG rooted at I that From created since CP into To.
+// Older nodes are shared with the copy rather than duplicated.
+Inst *copyCreatedSince(Inst *I, const InstContext &From,
+                       const InstContext::Checkpoint &CP, InstContext &To,
+                       std::map<Inst *, Inst *> &InstCache,
+                       std::map<Block *, Block *> &BlockCache) {
+  if (!From.createdSince(CP, I))
+    return I;
+  auto It = InstCache.find(I);
+  if (It != InstCache.end())
+    return It->second;
+
+  std::vector<Inst *> Ops;
+  for (auto Op : I->Ops)
+    Ops.push_back(copyCreatedSince(Op, From, CP, To, InstCache, BlockCache));
+
+  Inst *Copy;
+  switch (I->K) {
+  case Inst::Const:
+    Copy = To.getConst(I->Val);
+    break;
+  case Inst::UntypedConst:
+    Copy = To.getUntypedConst(I->Val);
+    break;
+  case Inst::Var:
+    Copy = To.createVar(I->Width, I->Meta->Name, I->Meta->Range,
+                        I->Meta->KnownZeros, I->Meta->KnownOnes,
+                        I->Meta->NonZero, I->Meta->NonNegative,
+                        I->Meta->PowOfTwo, I->Meta->Negative,
+                        I->Meta->NumSignBits, I->SynthesisConstID);
+    break;
+  case Inst::Hole:
+    Copy = To.createHole(I->Width);
+    break;
+  case Inst::ReservedConst:
+    Copy = To.getReservedConst();
+    Copy->Width = I->Width;
+    Copy->SynthesisConstID = I->SynthesisConstID;
+    break;
+  case Inst::ReservedInst:
+    Copy = To.getReservedInst();
+    Copy->Width = I->Width;
+    break;
+  case Inst::Phi: {
+    Block *B = I->B;
+    if (From.createdSince(CP, B)) {
+      Block *&BlockCopy = BlockCache[B];
+      if (!BlockCopy) {
+        BlockCopy = To.createBlock(B->Preds);
+        BlockCopy->Name = B->Name;
+      }
+      B = BlockCopy;
+    }
+    Copy = To.getPhi(B, Ops, I->Meta->DemandedBits);
+    break;
+  }
+  default:
+    Copy = To.getInst(I->K, I->Width, Ops, I->Meta->DemandedBits, I->Available);
+    Copy->Meta->HarvestKind = I->Meta->HarvestKind;
+    Copy->Meta->HarvestFrom = I->Meta->HarvestFrom;
+    break;
+  }
+  InstCache[I] = Copy;
+  return Copy;
+}
+
+}
+
+InstContextScope::~InstContextScope() {
+  if (Promoted.empty()) {
+    IC.rollback(CP);
+    return;
+  }
+
+  // Rolling back destroys the scratch part of the promoted DAGs, so park a
+  // copy of it in a separate context and bring it back afterwards.
+  InstContext Tmp;
+  std::map<Inst *, Inst *> InstCache;
+  std::map<Block *, Block *> BlockCache;
+  for (auto P : Promoted)
+    if (*P)
+      *P = copyCreatedSince(*P, IC, CP, Tmp, InstCache, BlockCache);
+
+  IC.rollback(CP);
+
+  InstCache.clear();
+  BlockCache.clear();
+  for (auto P : Promoted)
+    if (*P)
+      *P = copyCreatedSince(*P, Tmp, InstContext::Checkpoint(), IC, InstCache,
+                            BlockCache);
+}
+
 Inst *InstContext::getConst(const llvm::APInt &Val) {
   llvm::FoldingSetNodeID ID;
   ID.AddInteger(Inst::Const);
@@ -562,8 +761,7 @@ Inst *InstContext::getConst(const llvm::APInt &Val) {
   if (Inst *I = InstSet.FindNodeOrInsertPos(ID, IP))
     return I;
 
-  auto N = new Inst;
-  Insts.emplace_back(N);
+  Inst *N = newInst();
   N->K = Inst::Const;
   N->Width = Val.getBitWidth();
   N->Val = Val;
@@ -581,8 +779,7 @@ Inst *InstContext::getUntypedConst(const llvm::APInt &Val) {
   if (Inst *I = InstSet.FindNodeOrInsertPos(ID, IP))
     return I;
 
-  auto N = new Inst;
-  Insts.emplace_back(N);
+  Inst *N = newInst();
   N->K = Inst::UntypedConst;
   N->Width = 0;
   N->Val = Val;
@@ -591,8 +788,7 @@ Inst *InstContext::getUntypedConst(const llvm::APInt &Val) {
 }
 
 Inst *InstContext::getReservedConst() {
-  auto N = new Inst;
-  Insts.emplace_back(N);
+  Inst *N = newInst();
   N->K = Inst::ReservedConst;
   N->SynthesisConstID = ++ReservedConstCounter;
   N->Width = 0;
@@ -600,16 +796,14 @@ Inst *InstContext::getReservedConst() {
 }
 
 Inst *InstContext::getReservedInst() {
-  auto N = new Inst;
-  Insts.emplace_back(N);
+  Inst *N = newInst();
   N->K = Inst::ReservedInst;
   N->Width = 0;
   return N;
 }
 
 Inst *InstContext::createHole(unsigned Width) {
-  auto N = new Inst;
-  Insts.emplace_back(N);
+  Inst *N = newInst();
   N->K = Inst::Hole;
   N->Width = Width;
   return N;
@@ -623,22 +817,22 @@ Inst *InstContext::createVar(unsigned Width, llvm::StringRef Name,
   // Create a new vector of Insts if Width is not found in VarInstsByWidth
   auto &InstList = VarInstsByWidth[Width];
   unsigned Number = InstList.size();
-  auto I = new Inst;
-  InstList.emplace_back(I);
+  Inst *I = newInst();
+  InstList.push_back(I);
   assert(Range.getBitWidth() == Width && Zero.getBitWidth() == Width && One.getBitWidth() == Width);
 
   I->K = Inst::Var;
   I->Number = Number;
   I->Width = Width;
-  I->Name = Name;
-  I->Range = Range;
-  I->KnownZeros = Zero;
-  I->KnownOnes = One;
-  I->NonZero = NonZero;
-  I->NonNegative = NonNegative;
-  I->PowOfTwo = PowOfTwo;
-  I->Negative = Negative;
-  I->NumSignBits = NumSignBits;
+  I->Meta->Name = Name;
+  I->Meta->Range = Range;
+  I->Meta->KnownZeros = Zero;
+  I->Meta->KnownOnes = One;
+  I->Meta->NonZero = NonZero;
+  I->Meta->NonNegative = NonNegative;
+  I->Meta->PowOfTwo = PowOfTwo;
+  I->Meta->Negative = Negative;
+  I->Meta->NumSignBits = NumSignBits;
   I->SynthesisConstID = SynthesisConstID;
   return I;
 }
@@ -662,8 +856,8 @@ Inst *InstContext::createSynthesisConstant(unsigned Width, unsigned SynthesisCon
 Block *InstContext::createBlock(unsigned Preds) {
   auto &BlockList = BlocksByPreds[Preds];
   unsigned Number = BlockList.size();
-  auto B = new Block;
-  BlockList.emplace_back(B);
+  Block *B = Blocks.create();
+  BlockList.push_back(B);
 
   B->Number = Number;
   B->Preds = Preds;
@@ -686,13 +880,12 @@ Inst *InstContext::getPhi(Block *B, const std::vector<Inst *> &Ops, llvm::APInt
   if (Inst *I = InstSet.FindNodeOrInsertPos(ID, IP))
     return I;
 
-  auto N = new Inst;
-  Insts.emplace_back(N);
+  Inst *N = newInst();
   N->K = Inst::Phi;
   N->Width = Ops[0]->Width;
   N->B = B;
   N->Ops = Ops;
-  N->DemandedBits = DemandedBits;
+  N->Meta->DemandedBits = DemandedBits;
   InstSet.InsertNode(N, IP);
   return N;
 }
@@ -729,15 +922,14 @@ Inst *InstContext::getInst(Inst::Kind K, unsigned Width,
   if (Inst *I = InstSet.FindNodeOrInsertPos(ID, IP))
     return I;
 
-  auto N = new Inst;
-  Insts.emplace_back(N);
+  Inst *N = newInst();
   N->K = K;
   N->Width = Width;
   N->Ops = *InstOps;
-  N->DemandedBits = DemandedBits;
+  N->Meta->DemandedBits = DemandedBits;
   N->Available = Available;
-  N->HarvestKind = HarvestType::HarvestedFromDef;
-  N->HarvestFrom = nullptr;
+  N->Meta->HarvestKind = HarvestType::HarvestedFromDef;
+  N->Meta->HarvestFrom = nullptr;
   InstSet.InsertNode(N, IP);
   return N;
 }
@@ -884,12 +1076,34 @@ int Inst::getCost(Inst::Kind K) {
   }
 }
 
-static int costHelper(Inst *I, Inst *Root, std::set<Inst *> &Visited,
+namespace {
+
+std::atomic<uint64_t> NextVisitEpoch(0);
+thread_local const InstVisitSet *ActiveVisitSet = nullptr;
+
+}
+
+InstVisitSet::InstVisitSet() {
+  if (ActiveVisitSet) {
+    Nested.reset(new std::unordered_set<const Inst *>);
+    Epoch = 0;
+  } else {
+    ActiveVisitSet = this;
+    Epoch = ++NextVisitEpoch;
+  }
+}
+
+InstVisitSet::~InstVisitSet() {
+  if (ActiveVisitSet == this)
+    ActiveVisitSet = nullptr;
+}
+
+static int costHelper(Inst *I, Inst *Root, InstVisitSet &Visited,
                       bool IgnoreDepsWithExternalUses) {
-  if (!Visited.insert(I).second)
+  if (!Visited.insert(I))
     return 0;
   if (IgnoreDepsWithExternalUses && I != Root &&
-      Root->DepsWithExternalUses.find(I) != Root->DepsWithExternalUses.end()) {
+      Root->Meta->DepsWithExternalUses.count(I)) {
     return 0;
   }
   int Cost = Inst::getCost(I->K);
@@ -899,13 +1113,23 @@ static int costHelper(Inst *I, Inst *Root, std::set<Inst *> &Visited,
 }
 
 int souper::cost(Inst *I, bool IgnoreDepsWithExternalUses) {
-  std::set<Inst *> Visited;
-  return costHelper(I, I, Visited, IgnoreDepsWithExternalUses);
+  // Nodes never change once created, so the cost of a DAG only needs to be
+  // computed once, unless some of it is to be skipped
+  bool Cacheable = !IgnoreDepsWithExternalUses ||
+                   I->Meta->DepsWithExternalUses.empty();
+  if (Cacheable && I->Cost >= 0)
+    return I->Cost;
+
+  InstVisitSet Visited;
+  int Cost = costHelper(I, I, Visited, IgnoreDepsWithExternalUses);
+  if (Cacheable)
+    I->Cost = Cost;
+  return Cost;
 }
 
 
-int souper::countHelper(Inst *I, std::set<Inst *> &Visited) {
-  if (!Visited.insert(I).second)
+int souper::countHelper(Inst *I, InstVisitSet &Visited) {
+  if (!Visited.insert(I))
     return 0;
 
   int Count;
@@ -924,7 +1148,7 @@ int souper::countHelper(Inst *I, std::set<Inst *> &Visited) {
 }
 
 int souper::instCount(Inst *I) {
-  std::set<Inst *> Visited;
+  InstVisitSet Visited;
   return countHelper(I, Visited);
 }
 
@@ -945,12 +1169,12 @@ void souper::PrintReplacement(llvm::raw_ostream &Out,
   std::string SRef = Context.printInst(Mapping.LHS, Out, printNames);
   std::string RRef = Context.printInst(Mapping.RHS, Out, printNames);
   Out << "cand " << SRef << " " << RRef;
-  if (!Mapping.LHS->DemandedBits.isAllOnesValue()) {
+  if (!Mapping.LHS->Meta->DemandedBits.isAllOnesValue()) {
     Out<< " (" << "demandedBits="
-       << Inst::getDemandedBitsString(Mapping.LHS->DemandedBits)
+       << Inst::getDemandedBitsString(Mapping.LHS->Meta->DemandedBits)
        << ")";
   }
-  if (Mapping.LHS->HarvestKind == HarvestType::HarvestedFromUse) {
+  if (Mapping.LHS->Meta->HarvestKind == HarvestType::HarvestedFromUse) {
     Out << " (harvestedFromUse)";
   }
   Out << "\n";
@@ -978,12 +1202,12 @@ void souper::PrintReplacementLHS(llvm::raw_ostream &Out,
   std::string SRef = Context.printInst(LHS, Out, printNames);
 
   Out << "infer " << SRef;
-  if (!LHS->DemandedBits.isAllOnesValue()) {
+  if (!LHS->Meta->DemandedBits.isAllOnesValue()) {
     Out<< " (" << "demandedBits="
-       << Inst::getDemandedBitsString(LHS->DemandedBits)
+       << Inst::getDemandedBitsString(LHS->Meta->DemandedBits)
        << ")";
   }
-  if (LHS->HarvestKind == HarvestType::HarvestedFromUse) {
+  if (LHS->Meta->HarvestKind == HarvestType::HarvestedFromUse) {
     Out << " (harvestedFromUse)";
   }
   Out << "\n";
@@ -1013,6 +1237,334 @@ std::string souper::GetReplacementRHSString(Inst *RHS,
   return SS.str();
 }
 
+size_t souper::structuralHash(Inst *I) {
+  if (I->StructuralHash)
+    return I->StructuralHash;
+
+  llvm::hash_code H = llvm::hash_combine(I->K, I->Width);
+  switch (I->K) {
+  default:
+    break;
+  case Inst::Const:
+  case Inst::UntypedConst:
+    H = llvm::hash_combine(H, I->Val);
+    break;
+  case Inst::Var:
+    H = llvm::hash_combine(H, I->Meta->KnownZeros, I->Meta->KnownOnes,
+                           I->Meta->NonZero, I->Meta->NonNegative,
+                           I->Meta->PowOfTwo, I->Meta->Negative,
+                           I->Meta->NumSignBits, I->SynthesisConstID);
+    if (!I->Meta->Range.isFullSet())
+      H = llvm::hash_combine(H, I->Meta->Range.getLower(),
+                             I->Meta->Range.getUpper());
+    break;
+  case Inst::Phi:
+    H = llvm::hash_combine(H, I->B->Preds);
+    break;
+  }
+
+  std::vector<size_t> OpHashes;
+  for (auto Op : I->Ops)
+    OpHashes.push_back(structuralHash(Op));
+  if (Inst::isCommutative(I->K))
+    std::sort(OpHashes.begin(), OpHashes.end());
+  H = llvm::hash_combine(H, llvm::hash_combine_range(OpHashes.begin(),
+                                                     OpHashes.end()));
+
+  // Zero means "not computed yet".
+  size_t Hash = H;
+  I->StructuralHash = Hash ? Hash : 1;
+  return I->StructuralHash;
+}
+
+size_t souper::structuralHash(const BlockPCs &BPCs,
+                              const std::vector<InstMapping> &PCs,
+                              const std::vector<Inst *> &Roots) {
+  llvm::hash_code H = llvm::hash_combine(PCs.size(), BPCs.size(),
+                                         Roots.size());
+  for (const auto &PC : PCs)
+    H = llvm::hash_combine(H, structuralHash(PC.LHS),
+                           structuralHash(PC.RHS));
+  for (const auto &BPC : BPCs)
+    H = llvm::hash_combine(H, BPC.B->Preds, BPC.PredIdx,
+                           structuralHash(BPC.PC.LHS),
+                           structuralHash(BPC.PC.RHS));
+  for (auto R : Roots)
+    H = llvm::hash_combine(H, structuralHash(R),
+                           R->Meta->DepsWithExternalUses.size());
+  if (!Roots.empty() && !Roots[0]->Meta->DemandedBits.isAllOnesValue())
+    H = llvm::hash_combine(H, Roots[0]->Meta->DemandedBits);
+  if (!Roots.empty() &&
+      Roots[0]->Meta->HarvestKind == HarvestType::HarvestedFromUse)
+    H = llvm::hash_combine(H, true);
+  return H;
+}
+
+namespace {
+
+// Builds the string returned by getCanonicalKey(). Every instruction gets
+// an index in the order it is first completed by a post-order walk. The
+// operands of commutative instructions are visited sorted by their
+// structural hash and, to tell apart operands such as two plain variables,
+// by a hash of the positions they are used at, so the walk order depends
+// on neither variable numbers nor operand addresses.
+class CanonicalKeyBuilder {
+  std::string Key;
+  llvm::DenseMap<Inst *, unsigned> InstIdx;
+  llvm::DenseMap<Block *, unsigned> BlockIdx;
+  llvm::DenseMap<Inst *, size_t> UseHash;
+
+  void topoSort(Inst *I, std::set<Inst *> &Visited,
+                std::vector<Inst *> &Order) {
+    if (!Visited.insert(I).second)
+      return;
+    for (auto Op : I->Ops)
+      topoSort(Op, Visited, Order);
+    Order.push_back(I);
+  }
+
+public:
+  void computeUseHashes(const std::vector<Inst *> &Roots) {
+    std::set<Inst *> Visited;
+    std::vector<Inst *> Order;
+    for (unsigned J = 0; J != Roots.size(); ++J) {
+      UseHash[Roots[J]] += llvm::hash_value(J);
+      topoSort(Roots[J], Visited, Order);
+    }
+    // Users come before their operands in reverse post-order. Uses are
+    // summed so that their order does not matter.
+    for (auto It = Order.rbegin(); It != Order.rend(); ++It) {
+      Inst *I = *It;
+      bool Commutative = Inst::isCommutative(I->K);
+      size_t User = llvm::hash_combine(UseHash.lookup(I), structuralHash(I));
+      for (unsigned J = 0; J != I->Ops.size(); ++J) {
+        size_t Use = llvm::hash_combine(User, Commutative ? 0 : J);
+        UseHash[I->Ops[J]] += Use;
+      }
+    }
+  }
+
+  std::vector<Inst *> Insts;
+  std::vector<Block *> Blocks;
+
+  void put(uint64_t V) {
+    Key.append(reinterpret_cast<const char *>(&V), sizeof(V));
+  }
+
+  void put(const llvm::APInt &V) {
+    put(V.getBitWidth());
+    for (unsigned J = 0; J != V.getNumWords(); ++J)
+      put(V.getRawData()[J]);
+  }
+
+  unsigned visitBlock(Block *B) {
+    auto It = BlockIdx.find(B);
+    if (It != BlockIdx.end())
+      return It->second;
+    unsigned Idx = Blocks.size();
+    Blocks.push_back(B);
+    BlockIdx[B] = Idx;
+    put('B');
+    put(B->Preds);
+    return Idx;
+  }
+
+  unsigned visit(Inst *I) {
+    auto It = InstIdx.find(I);
+    if (It != InstIdx.end())
+      return It->second;
+
+    std::vector<Inst *> Ops = I->Ops;
+    if (Inst::isCommutative(I->K))
+      std::stable_sort(Ops.begin(), Ops.end(), [this](Inst *A, Inst *B) {
+        return std::make_pair(structuralHash(A), UseHash.lookup(A)) <
+               std::make_pair(structuralHash(B), UseHash.lookup(B));
+      });
+    std::vector<unsigned> OpIdx;
+    for (auto Op : Ops)
+      OpIdx.push_back(visit(Op));
+    unsigned BIdx = I->K == Inst::Phi ? visitBlock(I->B) : 0;
+
+    put('I');
+    put(I->K);
+    put(I->Width);
+    switch (I->K) {
+    default:
+      break;
+    case Inst::Const:
+    case Inst::UntypedConst:
+      put(I->Val);
+      break;
+    case Inst::Var:
+      put(I->Meta->KnownZeros);
+      put(I->Meta->KnownOnes);
+      put(I->Meta->NonZero | I->Meta->NonNegative << 1 |
+          I->Meta->PowOfTwo << 2 | I->Meta->Negative << 3);
+      put(I->Meta->NumSignBits);
+      put(I->SynthesisConstID);
+      if (!I->Meta->Range.isFullSet()) {
+        put(I->Meta->Range.getLower());
+        put(I->Meta->Range.getUpper());
+      }
+      break;
+    case Inst::Phi:
+      put(BIdx);
+      break;
+    }
+    put(OpIdx.size());
+    for (auto Idx : OpIdx)
+      put(Idx);
+
+    unsigned Idx = Insts.size();
+    Insts.push_back(I);
+    InstIdx[I] = Idx;
+    return Idx;
+  }
+
+  void visitRoot(Inst *I) {
+    put('R');
+    put(visit(I));
+    std::vector<unsigned> Deps;
+    for (auto D : I->Meta->DepsWithExternalUses) {
+      auto It = InstIdx.find(D);
+      if (It != InstIdx.end())
+        Deps.push_back(It->second);
+    }
+    std::sort(Deps.begin(), Deps.end());
+    put(Deps.size());
+    for (auto D : Deps)
+      put(D);
+  }
+
+  std::string &getKey() { return Key; }
+};
+
+}
+
+// The canonical form of the DAG under one root, built by a
+// CanonicalKeyBuilder that sees only that root. It is cached in the root, so
+// a query over roots seen before costs a lookup per root and per variable.
+struct souper::CanonicalRoot {
+  // Identifies the key of the root; equal keys get equal IDs.
+  uint64_t ID;
+  // The number of DepsWithExternalUses the key was built with.
+  size_t NumDeps;
+  // The nodes whose identity the key doesn't capture, in walk order; these
+  // are what the roots of a query can share beyond their structure.
+  std::vector<Inst *> Leaves;
+  std::vector<Block *> Blocks;
+};
+
+static uint64_t internRootKey(std::string Key) {
+  static std::mutex Lock;
+  static std::unordered_map<std::string, uint64_t> IDs;
+  std::lock_guard<std::mutex> Guard(Lock);
+  return IDs.emplace(std::move(Key), IDs.size()).first->second;
+}
+
+static const CanonicalRoot &getCanonicalRoot(Inst *R) {
+  size_t NumDeps = R->Meta->DepsWithExternalUses.size();
+  if (R->Canonical && R->Canonical->NumDeps == NumDeps)
+    return *R->Canonical;
+
+  CanonicalKeyBuilder KB;
+  KB.computeUseHashes({R});
+  KB.visitRoot(R);
+  auto C = std::make_shared<CanonicalRoot>();
+  C->ID = internRootKey(std::move(KB.getKey()));
+  C->NumDeps = NumDeps;
+  for (auto I : KB.Insts)
+    if (I->K == Inst::Var || I->K == Inst::Hole ||
+        I->K == Inst::ReservedConst || I->K == Inst::ReservedInst)
+      C->Leaves.push_back(I);
+  C->Blocks = std::move(KB.Blocks);
+  R->Canonical = C;
+  return *C;
+}
+
+// Calls F with every root of a query, in the order the key lists them.
+static void forEachRoot(const BlockPCs &BPCs,
+                        const std::vector<InstMapping> &PCs,
+                        const std::vector<Inst *> &Roots,
+                        llvm::function_ref<void(Inst *)> F) {
+  for (const auto &PC : PCs) {
+    F(PC.LHS);
+    F(PC.RHS);
+  }
+  for (const auto &BPC : BPCs) {
+    F(BPC.PC.LHS);
+    F(BPC.PC.RHS);
+  }
+  for (auto R : Roots)
+    F(R);
+}
+
+std::string souper::getCanonicalKey(const BlockPCs &BPCs,
+                                    const std::vector<InstMapping> &PCs,
+                                    const std::vector<Inst *> &Roots) {
+  // Each root contributes the ID of its own key, and the shared nodes that
+  // tie it to the other roots, numbered in order of first appearance.
+  // Everything else a root shares with another follows from those, since
+  // instructions are hash-consed.
+  std::string Key;
+  auto Put = [&Key](uint64_t V) {
+    Key.append(reinterpret_cast<const char *>(&V), sizeof(V));
+  };
+  llvm::DenseMap<Inst *, unsigned> LeafIdx;
+  llvm::DenseMap<Block *, unsigned> BlockIdx;
+  auto PutBlock = [&](Block *B) {
+    Put(BlockIdx.insert({B, BlockIdx.size()}).first->second);
+  };
+  forEachRoot(BPCs, PCs, Roots, [&](Inst *R) {
+    const CanonicalRoot &C = getCanonicalRoot(R);
+    Put(C.ID);
+    for (auto L : C.Leaves)
+      Put(LeafIdx.insert({L, LeafIdx.size()}).first->second);
+    for (auto B : C.Blocks)
+      PutBlock(B);
+  });
+  Put(PCs.size());
+  for (const auto &BPC : BPCs) {
+    PutBlock(BPC.B);
+    Put(BPC.PredIdx);
+  }
+  Put(Roots.size());
+  if (!Roots.empty()) {
+    if (!Roots[0]->Meta->DemandedBits.isAllOnesValue()) {
+      const llvm::APInt &DB = Roots[0]->Meta->DemandedBits;
+      Put(DB.getBitWidth());
+      for (unsigned J = 0; J != DB.getNumWords(); ++J)
+        Put(DB.getRawData()[J]);
+    }
+    Put(Roots[0]->Meta->HarvestKind == HarvestType::HarvestedFromUse);
+  }
+  return Key;
+}
+
+void souper::nameCanonically(const BlockPCs &BPCs,
+                             const std::vector<InstMapping> &PCs,
+                             const std::vector<Inst *> &Roots,
+                             ReplacementContext &Context) {
+  // Number the nodes of every root in the order its own walk visits them,
+  // giving a node that several roots share a name from each. Use the same
+  // naming scheme as the printer so that instructions printed later in
+  // this context get fresh names.
+  unsigned N = 0;
+  std::vector<Block *> Blocks;
+  forEachRoot(BPCs, PCs, Roots, [&](Inst *R) {
+    CanonicalKeyBuilder KB;
+    KB.computeUseHashes({R});
+    KB.visitRoot(R);
+    for (auto I : KB.Insts)
+      Context.setInst(std::to_string(N++), I);
+    Blocks.insert(Blocks.end(), KB.Blocks.begin(), KB.Blocks.end());
+  });
+  for (const auto &BPC : BPCs)
+    Blocks.push_back(BPC.B);
+  for (auto B : Blocks)
+    Context.setBlock(std::to_string(N++), B);
+}
+
 void souper::findCands(Inst *Root, std::vector<Inst *> &Guesses,
                bool WidthMustMatch, bool FilterVars, int Max) {
   // breadth-first search
@@ -1058,35 +1610,34 @@ void souper::findInsts(Inst *Root, std::vector<Inst *> &Insts, std::function<boo
   if (Root == nullptr)
     return;
 
-  std::set<Inst *> Visited;
-  std::queue<Inst *> Q;
-  Q.push(Root);
-  while (!Q.empty()) {
-    Inst *I = Q.front();
-    Q.pop();
-    if (!Visited.insert(I).second)
-      continue;
+  // The queue is never popped from, only advanced through, so each node
+  // is enqueued at most once
+  InstVisitSet Visited;
+  std::vector<Inst *> Q{Root};
+  Visited.insert(Root);
+  for (size_t Head = 0; Head != Q.size(); ++Head) {
+    Inst *I = Q[Head];
     if (Condition(I))
       Insts.push_back(I);
     for (auto Op : I->Ops)
-      Q.push(Op);
+      if (Visited.insert(Op))
+        Q.push_back(Op);
   }
 }
 
-void hasConstantHelper(Inst *I, std::set<Inst *> &Visited,
+void hasConstantHelper(Inst *I, InstVisitSet &Visited,
                        std::set<Inst *> &ConstSet) {
   if (I->K == Inst::Var && I->SynthesisConstID != 0) {
     ConstSet.insert(I);
   } else {
-    if (Visited.insert(I).second)
+    if (Visited.insert(I))
       for (auto Op : I->Ops)
         hasConstantHelper(Op, Visited, ConstSet);
   }
 }
 
-// TODO do this a more efficient way
 void souper::getConstants(Inst *I, std::set<Inst *> &ConstSet) {
-  std::set<Inst *> Visited;
+  InstVisitSet Visited;
   hasConstantHelper(I, Visited, ConstSet);
 }
 
@@ -1094,22 +1645,10 @@ void souper::getConstants(Inst *I, std::set<Inst *> &ConstSet) {
 
 // TODO: Convert to a more generic getGivenInst similar to hasGivenInst below
 void souper::getHoles(Inst *Root, std::vector<Inst *> &Holes) {
-  // breadth-first search
-  std::set<Inst *> Visited;
-  std::queue<Inst *> Q;
-  Q.push(Root);
-  while (!Q.empty()) {
-    Inst *I = Q.front();
-    Q.pop();
-    if (!Visited.insert(I).second)
-      continue;
-    if (I->K == Inst::Hole) {
-      assert(I->Width > 0);
-      Holes.push_back(I);
-    }
-    for (auto Op : I->Ops)
-      Q.push(Op);
-  }
+  findInsts(Root, Holes, [](Inst *I) {
+    assert(I->K != Inst::Hole || I->Width > 0);
+    return I->K == Inst::Hole;
+  });
 }
 
 bool souper::hasGivenInst(Inst *Root, std::function<bool(Inst*)> InstTester) {
@@ -1148,10 +1687,11 @@ Inst *souper::getInstCopy(Inst *I, InstContext &IC,
     }
     if (!Copy) {
       if (CloneVars && I->SynthesisConstID == 0)
-        Copy = IC.createVar(I->Width, I->Name, I->Range, I->KnownZeros,
-                            I->KnownOnes, I->NonZero, I->NonNegative,
-                            I->PowOfTwo, I->Negative, I->NumSignBits,
-                            I->SynthesisConstID);
+        Copy = IC.createVar(I->Width, I->Meta->Name, I->Meta->Range,
+                            I->Meta->KnownZeros, I->Meta->KnownOnes,
+                            I->Meta->NonZero, I->Meta->NonNegative,
+                            I->Meta->PowOfTwo, I->Meta->Negative,
+                            I->Meta->NumSignBits, I->SynthesisConstID);
       else {
         Copy = I;
       }
@@ -1160,14 +1700,14 @@ Inst *souper::getInstCopy(Inst *I, InstContext &IC,
     if (!BlockCache.count(I->B)) {
       auto BlockCopy = IC.createBlock(I->B->Preds);
       BlockCache[I->B] = BlockCopy;
-      Copy = IC.getPhi(BlockCopy, Ops, I->DemandedBits);
+      Copy = IC.getPhi(BlockCopy, Ops, I->Meta->DemandedBits);
     } else {
-      Copy = IC.getPhi(BlockCache.at(I->B), Ops, I->DemandedBits);
+      Copy = IC.getPhi(BlockCache.at(I->B), Ops, I->Meta->DemandedBits);
     }
   } else if (I->K == Inst::Const || I->K == Inst::UntypedConst) {
     Copy = I;
   } else {
-    Copy = IC.getInst(I->K, I->Width, Ops, I->DemandedBits, I->Available);
+    Copy = IC.getInst(I->K, I->Width, Ops, I->Meta->DemandedBits, I->Available);
   }
   assert(Copy);
   InstCache[I] = Copy;
@@ -1193,10 +1733,11 @@ Inst *souper::instJoin(Inst *I, Inst *EmptyInst, Inst *NewInst,
   } else if (I->K == Inst::Var) {
     // copy constant
     if (I->SynthesisConstID != 0) {
-      Copy = IC.createVar(I->Width, I->Name, I->Range, I->KnownZeros,
-                          I->KnownOnes, I->NonZero, I->NonNegative,
-                          I->PowOfTwo, I->Negative, I->NumSignBits,
-                          I->SynthesisConstID);
+      Copy = IC.createVar(I->Width, I->Meta->Name, I->Meta->Range,
+                          I->Meta->KnownZeros, I->Meta->KnownOnes,
+                          I->Meta->NonZero, I->Meta->NonNegative,
+                          I->Meta->PowOfTwo, I->Meta->Negative,
+                          I->Meta->NumSignBits, I->SynthesisConstID);
     } else {
       Copy = I;
     }
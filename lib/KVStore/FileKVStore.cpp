@@ -0,0 +1,430 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/KVStore/KVStore.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace souper;
+
+// A cache file starts with a header, which is followed by a log of records
+// that each set one field of one hash:
+//
+//   header: "SOUPERKV", u32 version, u32 reserved
+//   record: u32 magic, u32 key size, u32 field size, u32 value size,
+//           key, field, value
+//
+// Integers are in native byte order. Records are only ever appended, and
+// the last one for a field is the one that counts. Before every operation a
+// process maps whatever was appended since it last looked and adds it to its
+// index of the file. Appending holds an exclusive flock() on the file and
+// looking holds a shared one, so no one sees a record while it is being
+// written. A record left half-written by a process that died is cut off by
+// the next writer.
+//
+// Since every update appends a record, a file that takes the static profile
+// grows with each increment. compact() writes the latest value of each field
+// to a new file and renames it over the old one while holding the lock on
+// the old one; the other processes notice when they next take the lock and
+// switch to the new file.
+
+namespace {
+
+const char FileMagic[8] = {'S', 'O', 'U', 'P', 'E', 'R', 'K', 'V'};
+const uint32_t FileVersion = 1;
+const uint32_t RecordMagic = 0x52564b53;
+const uint64_t FileHeaderSize = 16;
+const uint64_t RecordHeaderSize = 16;
+
+class FileBackend;
+
+class FileLock {
+  int FD;
+public:
+  FileLock(FileBackend &B, bool Exclusive);
+  ~FileLock() { flock(FD, LOCK_UN); }
+};
+
+class FileBackend : public KVStore::Backend {
+  friend class FileLock;
+
+  std::string Path;
+  int FD;
+  const char *Map = nullptr;
+  uint64_t MapSize = 0;
+  // The end of the last record in the index
+  uint64_t End = 0;
+  struct ValueRef {
+    uint64_t Offset;
+    uint32_t Size;
+  };
+  StringMap<StringMap<ValueRef>> Index;
+
+  [[noreturn]] void fail(const Twine &What);
+  void open();
+  void close();
+  bool replaced();
+  uint64_t update();
+  void write(StringRef Records);
+  bool lookup(StringRef Key, StringRef Field, StringRef &Value);
+  int64_t lookupInt(StringRef Key, StringRef Field);
+
+public:
+  FileBackend(StringRef Path);
+  ~FileBackend();
+  void hIncrBy(StringRef Key, StringRef Field, int Incr) override;
+  bool hGet(StringRef Key, StringRef Field, std::string &Value) override;
+  void hSet(StringRef Key, StringRef Field, StringRef Value) override;
+  void hIncrByMany(ArrayRef<std::string> Keys, ArrayRef<std::string> Fields,
+                   int Incr) override;
+  void hGetMany(ArrayRef<std::string> Keys, StringRef Field,
+                std::vector<Optional<std::string>> &Values) override;
+  void hSetMany(ArrayRef<std::string> Keys, StringRef Field,
+                ArrayRef<std::string> Values) override;
+  void keys(std::vector<std::string> &Keys) override;
+  void hGetAll(StringRef Key,
+               std::vector<std::pair<std::string, std::string>> &Fields)
+    override;
+  void compact() override;
+};
+
+FileLock::FileLock(FileBackend &B, bool Exclusive) {
+  while (true) {
+    while (flock(B.FD, Exclusive ? LOCK_EX : LOCK_SH) != 0) {
+      if (errno != EINTR)
+        B.fail("can't lock: " + Twine(strerror(errno)));
+    }
+    if (!B.replaced())
+      break;
+    // Compacted while we waited for the lock
+    flock(B.FD, LOCK_UN);
+    B.close();
+    B.open();
+  }
+  FD = B.FD;
+}
+
+void appendU32(std::string &Buf, uint32_t N) {
+  Buf.append((const char *)&N, sizeof(N));
+}
+
+void appendRecord(std::string &Buf, StringRef Key, StringRef Field,
+                  StringRef Value) {
+  appendU32(Buf, RecordMagic);
+  appendU32(Buf, Key.size());
+  appendU32(Buf, Field.size());
+  appendU32(Buf, Value.size());
+  Buf += Key;
+  Buf += Field;
+  Buf += Value;
+}
+
+FileBackend::FileBackend(StringRef Path) : Path(Path) {
+  open();
+}
+
+FileBackend::~FileBackend() {
+  close();
+}
+
+void FileBackend::open() {
+  FD = ::open(Path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (FD < 0)
+    fail(strerror(errno));
+}
+
+void FileBackend::close() {
+  if (Map)
+    munmap((void *)Map, MapSize);
+  Map = nullptr;
+  MapSize = 0;
+  End = 0;
+  Index.clear();
+  ::close(FD);
+}
+
+// Whether the path now names another file than the one that is open
+bool FileBackend::replaced() {
+  struct stat Open, Named;
+  if (fstat(FD, &Open) != 0)
+    fail(strerror(errno));
+  if (stat(Path.c_str(), &Named) != 0) {
+    // Deleted, so there is nothing better to switch to
+    if (errno == ENOENT)
+      return false;
+    fail(strerror(errno));
+  }
+  return Open.st_dev != Named.st_dev || Open.st_ino != Named.st_ino;
+}
+
+void FileBackend::fail(const Twine &What) {
+  report_fatal_error("Cache file " + Path + ": " + What);
+}
+
+// Indexes the records appended since the last call, which must be made with
+// the file locked, and returns the size of the file.
+uint64_t FileBackend::update() {
+  struct stat St;
+  if (fstat(FD, &St) != 0)
+    fail(strerror(errno));
+  uint64_t Size = St.st_size;
+  if (Size < End)
+    fail("truncated while in use");
+  if (Size == End)
+    return Size;
+
+  if (Size > MapSize) {
+    if (Map)
+      munmap((void *)Map, MapSize);
+    // Leave room to grow, so that the file needn't be remapped every time
+    uint64_t NewSize = std::max(Size, 2 * MapSize);
+    void *M = mmap(nullptr, NewSize, PROT_READ, MAP_SHARED, FD, 0);
+    if (M == MAP_FAILED) {
+      Map = nullptr;
+      MapSize = 0;
+      fail(strerror(errno));
+    }
+    Map = (const char *)M;
+    MapSize = NewSize;
+  }
+
+  if (End == 0) {
+    // A short file is a header that was cut off, which the next write redoes
+    if (std::memcmp(Map, FileMagic,
+                    std::min<uint64_t>(Size, sizeof(FileMagic))) != 0)
+      fail("not a Souper cache file");
+    if (Size < FileHeaderSize)
+      return Size;
+    uint32_t Version;
+    std::memcpy(&Version, Map + sizeof(FileMagic), sizeof(Version));
+    if (Version != FileVersion)
+      fail("unsupported version " + Twine(Version));
+    End = FileHeaderSize;
+  }
+
+  while (Size - End >= RecordHeaderSize) {
+    uint32_t Header[4];
+    std::memcpy(Header, Map + End, sizeof(Header));
+    uint64_t RecordEnd = End + RecordHeaderSize + Header[1] + Header[2] +
+      Header[3];
+    if (Header[0] != RecordMagic || RecordEnd > Size)
+      break;
+    const char *Key = Map + End + RecordHeaderSize;
+    const char *Field = Key + Header[1];
+    Index[StringRef(Key, Header[1])][StringRef(Field, Header[2])] =
+      {RecordEnd - Header[3], Header[3]};
+    End = RecordEnd;
+  }
+  return Size;
+}
+
+// Appends the given records, which must be done with the file locked
+// exclusively.
+void FileBackend::write(StringRef Records) {
+  if (update() != End) {
+    if (ftruncate(FD, End) != 0)
+      fail(strerror(errno));
+  }
+
+  std::string Buf;
+  if (End == 0) {
+    Buf.append(FileMagic, sizeof(FileMagic));
+    appendU32(Buf, FileVersion);
+    appendU32(Buf, 0);
+  }
+  Buf += Records;
+
+  const char *P = Buf.data();
+  size_t Left = Buf.size();
+  off_t Offset = End;
+  while (Left) {
+    ssize_t N = pwrite(FD, P, Left, Offset);
+    if (N < 0) {
+      if (errno == EINTR)
+        continue;
+      fail(strerror(errno));
+    }
+    P += N;
+    Left -= N;
+    Offset += N;
+  }
+  update();
+}
+
+bool FileBackend::lookup(StringRef Key, StringRef Field, StringRef &Value) {
+  auto K = Index.find(Key);
+  if (K == Index.end())
+    return false;
+  auto F = K->second.find(Field);
+  if (F == K->second.end())
+    return false;
+  Value = StringRef(Map + F->second.Offset, F->second.Size);
+  return true;
+}
+
+int64_t FileBackend::lookupInt(StringRef Key, StringRef Field) {
+  StringRef Value;
+  int64_t N = 0;
+  if (lookup(Key, Field, Value) && Value.getAsInteger(10, N))
+    fail("hash value is not an integer");
+  return N;
+}
+
+void FileBackend::hIncrBy(StringRef Key, StringRef Field, int Incr) {
+  FileLock L(*this, /*Exclusive=*/true);
+  update();
+  std::string Buf;
+  appendRecord(Buf, Key, Field, std::to_string(lookupInt(Key, Field) + Incr));
+  write(Buf);
+}
+
+bool FileBackend::hGet(StringRef Key, StringRef Field, std::string &Value) {
+  FileLock L(*this, /*Exclusive=*/false);
+  update();
+  StringRef V;
+  if (!lookup(Key, Field, V))
+    return false;
+  Value = V.str();
+  return true;
+}
+
+void FileBackend::hSet(StringRef Key, StringRef Field, StringRef Value) {
+  FileLock L(*this, /*Exclusive=*/true);
+  std::string Buf;
+  appendRecord(Buf, Key, Field, Value);
+  write(Buf);
+}
+
+void FileBackend::hIncrByMany(ArrayRef<std::string> Keys,
+                              ArrayRef<std::string> Fields, int Incr) {
+  assert(Keys.size() == Fields.size());
+  FileLock L(*this, /*Exclusive=*/true);
+  update();
+  // A field may come up more than once in a batch
+  std::map<std::pair<StringRef, StringRef>, int64_t> Counts;
+  for (size_t I = 0; I != Keys.size(); ++I) {
+    auto Ins = Counts.insert({{Keys[I], Fields[I]}, 0});
+    if (Ins.second)
+      Ins.first->second = lookupInt(Keys[I], Fields[I]);
+    Ins.first->second += Incr;
+  }
+  std::string Buf;
+  for (const auto &C : Counts)
+    appendRecord(Buf, C.first.first, C.first.second,
+                 std::to_string(C.second));
+  write(Buf);
+}
+
+void FileBackend::hGetMany(ArrayRef<std::string> Keys, StringRef Field,
+                           std::vector<Optional<std::string>> &Values) {
+  FileLock L(*this, /*Exclusive=*/false);
+  update();
+  Values.assign(Keys.size(), None);
+  for (size_t I = 0; I != Keys.size(); ++I) {
+    StringRef V;
+    if (lookup(Keys[I], Field, V))
+      Values[I] = V.str();
+  }
+}
+
+void FileBackend::hSetMany(ArrayRef<std::string> Keys, StringRef Field,
+                           ArrayRef<std::string> Values) {
+  assert(Keys.size() == Values.size());
+  FileLock L(*this, /*Exclusive=*/true);
+  std::string Buf;
+  for (size_t I = 0; I != Keys.size(); ++I)
+    appendRecord(Buf, Keys[I], Field, Values[I]);
+  write(Buf);
+}
+
+void FileBackend::keys(std::vector<std::string> &Keys) {
+  FileLock L(*this, /*Exclusive=*/false);
+  update();
+  for (const auto &K : Index)
+    Keys.push_back(K.getKey().str());
+}
+
+void FileBackend::hGetAll(
+    StringRef Key, std::vector<std::pair<std::string, std::string>> &Fields) {
+  FileLock L(*this, /*Exclusive=*/false);
+  update();
+  auto K = Index.find(Key);
+  if (K == Index.end())
+    return;
+  for (const auto &F : K->second)
+    Fields.emplace_back(F.getKey().str(),
+                        std::string(Map + F.second.Offset, F.second.Size));
+}
+
+void FileBackend::compact() {
+  FileLock L(*this, /*Exclusive=*/true);
+  update();
+  std::string Buf(FileMagic, sizeof(FileMagic));
+  appendU32(Buf, FileVersion);
+  appendU32(Buf, 0);
+  for (const auto &K : Index)
+    for (const auto &F : K.second)
+      appendRecord(Buf, K.getKey(), F.getKey(),
+                   StringRef(Map + F.second.Offset, F.second.Size));
+
+  // Replacing the file all at once keeps the old one intact for the
+  // processes that still have it mapped
+  std::string TmpPath = Path + ".compact";
+  int TmpFD = ::open(TmpPath.c_str(),
+                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (TmpFD < 0)
+    fail(strerror(errno));
+  const char *P = Buf.data();
+  size_t Left = Buf.size();
+  while (Left) {
+    ssize_t N = ::write(TmpFD, P, Left);
+    if (N < 0) {
+      if (errno == EINTR)
+        continue;
+      ::close(TmpFD);
+      unlink(TmpPath.c_str());
+      fail(strerror(errno));
+    }
+    P += N;
+    Left -= N;
+  }
+  if (fsync(TmpFD) != 0 || ::close(TmpFD) != 0 ||
+      rename(TmpPath.c_str(), Path.c_str()) != 0) {
+    unlink(TmpPath.c_str());
+    fail(strerror(errno));
+  }
+}
+
+}
+
+namespace souper {
+
+std::unique_ptr<KVStore::Backend> createFileKVBackend(StringRef Path) {
+  return std::unique_ptr<KVStore::Backend>(new FileBackend(Path));
+}
+
+}
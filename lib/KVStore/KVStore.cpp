@@ -17,25 +17,57 @@
 #include "llvm/Support/CommandLine.h"
 #include "hiredis.h"
 
+#include <algorithm>
+
 using namespace llvm;
 using namespace souper;
 
 static cl::opt<unsigned> RedisPort("souper-redis-port", cl::init(6379),
     cl::desc("Redis server port (default=6379)"));
 
-namespace souper {
+static cl::opt<unsigned> RedisPipelineDepth("souper-redis-pipeline-depth",
+    cl::init(1024), cl::Hidden,
+    cl::desc("Maximum number of Redis commands in flight (default=1024)"));
+
+static cl::opt<std::string> CacheFile("souper-cache-file", cl::init(""),
+    cl::desc("Keep the external cache in this file instead of in Redis"));
+
+static cl::opt<unsigned> LRUSize("souper-external-cache-mb", cl::init(64),
+    cl::desc("Megabytes of external cache lookups to remember in memory, "
+             "0 for none (default=64)"));
 
-class KVStore::KVImpl {
+namespace {
+
+class RedisBackend : public KVStore::Backend {
   redisContext *Ctx;
 public:
-  KVImpl();
-  ~KVImpl();
-  void hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int Incr);
-  bool hGet(llvm::StringRef Key, llvm::StringRef Field, std::string &Value);
-  void hSet(llvm::StringRef Key, llvm::StringRef Field, llvm::StringRef Value);
+  RedisBackend();
+  ~RedisBackend();
+  void hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
+               int Incr) override;
+  bool hGet(llvm::StringRef Key, llvm::StringRef Field,
+            std::string &Value) override;
+  void hSet(llvm::StringRef Key, llvm::StringRef Field,
+            llvm::StringRef Value) override;
+  void hIncrByMany(llvm::ArrayRef<std::string> Keys,
+                   llvm::ArrayRef<std::string> Fields, int Incr) override;
+  void hGetMany(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+                std::vector<llvm::Optional<std::string>> &Values) override;
+  void hSetMany(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+                llvm::ArrayRef<std::string> Values) override;
+  void keys(std::vector<std::string> &Keys) override;
+  void hGetAll(
+      llvm::StringRef Key,
+      std::vector<std::pair<std::string, std::string>> &Fields) override;
+
+private:
+  // Sends the N commands queued by Append before reading their replies,
+  // which are passed to Reply in order, then freed.
+  template <typename AppendFn, typename ReplyFn>
+  void pipeline(size_t N, AppendFn Append, ReplyFn Reply);
 };
 
-KVStore::KVImpl::KVImpl() {
+RedisBackend::RedisBackend() {
   const char *hostname = "127.0.0.1";
   struct timeval Timeout = { 1, 500000 }; // 1.5 seconds
   Ctx = redisConnectWithTimeout(hostname, RedisPort, Timeout);
@@ -48,14 +80,15 @@ KVStore::KVImpl::KVImpl() {
   }
 }
 
-KVStore::KVImpl::~KVImpl() {
+RedisBackend::~RedisBackend() {
   redisFree(Ctx);
 }
 
-void KVStore::KVImpl::hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
+void RedisBackend::hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
                               int Incr) {
-  redisReply *reply = (redisReply *)redisCommand(Ctx, "HINCRBY %s %s 1",
-                                                 Key.data(), Field.data());
+  redisReply *reply = (redisReply *)redisCommand(Ctx, "HINCRBY %s %s %d",
+                                                 Key.data(), Field.data(),
+                                                 Incr);
   if (!reply || Ctx->err) {
     llvm::report_fatal_error((llvm::StringRef)"Redis error: " + Ctx->errstr);
   }
@@ -67,7 +100,7 @@ void KVStore::KVImpl::hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
   freeReplyObject(reply);
 }
 
-bool KVStore::KVImpl::hGet(llvm::StringRef Key, llvm::StringRef Field,
+bool RedisBackend::hGet(llvm::StringRef Key, llvm::StringRef Field,
                            std::string &Value) {
   redisReply *reply = (redisReply *)redisCommand(Ctx, "HGET %s %s", Key.data(),
                                                  Field.data());
@@ -88,7 +121,7 @@ bool KVStore::KVImpl::hGet(llvm::StringRef Key, llvm::StringRef Field,
   }
 }
 
-void KVStore::KVImpl::hSet(llvm::StringRef Key, llvm::StringRef Field,
+void RedisBackend::hSet(llvm::StringRef Key, llvm::StringRef Field,
                               llvm::StringRef Value) {
   redisReply *reply = (redisReply *)redisCommand(Ctx, "HSET %s %s %s",
       Key.data(), Field.data(), Value.data());
@@ -103,7 +136,163 @@ void KVStore::KVImpl::hSet(llvm::StringRef Key, llvm::StringRef Field,
   freeReplyObject(reply);
 }
 
-KVStore::KVStore() : Impl (new KVImpl) {}
+template <typename AppendFn, typename ReplyFn>
+void RedisBackend::pipeline(size_t N, AppendFn Append, ReplyFn Reply) {
+  size_t Depth = std::max(1u, (unsigned)RedisPipelineDepth);
+  for (size_t Begin = 0; Begin < N; Begin += Depth) {
+    size_t End = std::min(N, Begin + Depth);
+    for (size_t I = Begin; I != End; ++I) {
+      if (Append(I) != REDIS_OK)
+        llvm::report_fatal_error((llvm::StringRef)"Redis error: " +
+                                 Ctx->errstr);
+    }
+    for (size_t I = Begin; I != End; ++I) {
+      redisReply *reply = nullptr;
+      if (redisGetReply(Ctx, (void **)&reply) != REDIS_OK || !reply)
+        llvm::report_fatal_error((llvm::StringRef)"Redis error: " +
+                                 Ctx->errstr);
+      Reply(I, reply);
+      freeReplyObject(reply);
+    }
+  }
+}
+
+void RedisBackend::hIncrByMany(llvm::ArrayRef<std::string> Keys,
+                                  llvm::ArrayRef<std::string> Fields,
+                                  int Incr) {
+  assert(Keys.size() == Fields.size());
+  pipeline(Keys.size(), [&](size_t I) {
+    return redisAppendCommand(Ctx, "HINCRBY %b %b %d",
+                              Keys[I].data(), Keys[I].size(),
+                              Fields[I].data(), Fields[I].size(), Incr);
+  }, [](size_t I, redisReply *reply) {
+    if (reply->type != REDIS_REPLY_INTEGER) {
+      llvm::report_fatal_error(
+          "Redis protocol error for static profile, didn't expect reply type "
+          + std::to_string(reply->type));
+    }
+  });
+}
+
+void RedisBackend::hGetMany(llvm::ArrayRef<std::string> Keys,
+                               llvm::StringRef Field,
+                               std::vector<llvm::Optional<std::string>> &Values) {
+  Values.assign(Keys.size(), llvm::None);
+  pipeline(Keys.size(), [&](size_t I) {
+    return redisAppendCommand(Ctx, "HGET %b %b",
+                              Keys[I].data(), Keys[I].size(),
+                              Field.data(), Field.size());
+  }, [&](size_t I, redisReply *reply) {
+    if (reply->type == REDIS_REPLY_STRING) {
+      Values[I] = std::string(reply->str, reply->len);
+    } else if (reply->type != REDIS_REPLY_NIL) {
+      llvm::report_fatal_error(
+          "Redis protocol error for cache lookup, didn't expect reply type " +
+          std::to_string(reply->type));
+    }
+  });
+}
+
+void RedisBackend::hSetMany(llvm::ArrayRef<std::string> Keys,
+                               llvm::StringRef Field,
+                               llvm::ArrayRef<std::string> Values) {
+  assert(Keys.size() == Values.size());
+  pipeline(Keys.size(), [&](size_t I) {
+    return redisAppendCommand(Ctx, "HSET %b %b %b",
+                              Keys[I].data(), Keys[I].size(),
+                              Field.data(), Field.size(),
+                              Values[I].data(), Values[I].size());
+  }, [](size_t I, redisReply *reply) {
+    if (reply->type != REDIS_REPLY_INTEGER) {
+      llvm::report_fatal_error(
+          "Redis protocol error for cache fill, didn't expect reply type " +
+          std::to_string(reply->type));
+    }
+  });
+}
+
+void RedisBackend::keys(std::vector<std::string> &Keys) {
+  redisReply *reply = (redisReply *)redisCommand(Ctx, "KEYS *");
+  if (!reply || Ctx->err) {
+    llvm::report_fatal_error((llvm::StringRef)"Redis error: " + Ctx->errstr);
+  }
+  if (reply->type != REDIS_REPLY_ARRAY) {
+    llvm::report_fatal_error(
+        "Redis protocol error for key listing, didn't expect reply type " +
+        std::to_string(reply->type));
+  }
+  for (size_t I = 0; I != reply->elements; ++I)
+    Keys.emplace_back(reply->element[I]->str, reply->element[I]->len);
+  freeReplyObject(reply);
+}
+
+void RedisBackend::hGetAll(
+    llvm::StringRef Key,
+    std::vector<std::pair<std::string, std::string>> &Fields) {
+  redisReply *reply = (redisReply *)redisCommand(Ctx, "HGETALL %b",
+                                                 Key.data(), Key.size());
+  if (!reply || Ctx->err) {
+    llvm::report_fatal_error((llvm::StringRef)"Redis error: " + Ctx->errstr);
+  }
+  if (reply->type != REDIS_REPLY_ARRAY) {
+    llvm::report_fatal_error(
+        "Redis protocol error for hash listing, didn't expect reply type " +
+        std::to_string(reply->type));
+  }
+  for (size_t I = 0; I + 1 < reply->elements; I += 2)
+    Fields.emplace_back(
+        std::string(reply->element[I]->str, reply->element[I]->len),
+        std::string(reply->element[I+1]->str, reply->element[I+1]->len));
+  freeReplyObject(reply);
+}
+
+}
+
+namespace souper {
+
+KVStore::Backend::~Backend() {}
+
+void KVStore::Backend::hIncrByMany(llvm::ArrayRef<std::string> Keys,
+                                   llvm::ArrayRef<std::string> Fields,
+                                   int Incr) {
+  assert(Keys.size() == Fields.size());
+  for (size_t I = 0; I != Keys.size(); ++I)
+    hIncrBy(Keys[I], Fields[I], Incr);
+}
+
+void KVStore::Backend::hGetMany(
+    llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+    std::vector<llvm::Optional<std::string>> &Values) {
+  Values.assign(Keys.size(), llvm::None);
+  for (size_t I = 0; I != Keys.size(); ++I) {
+    std::string Value;
+    if (hGet(Keys[I], Field, Value))
+      Values[I] = std::move(Value);
+  }
+}
+
+void KVStore::Backend::hSetMany(llvm::ArrayRef<std::string> Keys,
+                                llvm::StringRef Field,
+                                llvm::ArrayRef<std::string> Values) {
+  assert(Keys.size() == Values.size());
+  for (size_t I = 0; I != Keys.size(); ++I)
+    hSet(Keys[I], Field, Values[I]);
+}
+
+void KVStore::Backend::compact() {}
+
+std::unique_ptr<KVStore::Backend> createRedisKVBackend() {
+  return std::unique_ptr<KVStore::Backend>(new RedisBackend);
+}
+
+KVStore::KVStore()
+    : Impl(CacheFile.empty() ? createRedisKVBackend()
+                             : createFileKVBackend(CacheFile)) {
+  if (LRUSize)
+    Impl = createLRUKVBackend(std::move(Impl), size_t(LRUSize) << 20);
+}
+
+KVStore::KVStore(std::unique_ptr<Backend> Impl) : Impl(std::move(Impl)) {}
 
 KVStore::~KVStore() {}
 
@@ -121,4 +310,32 @@ void KVStore::hSet(llvm::StringRef Key, llvm::StringRef Field,
   Impl->hSet(Key, Field, Value);
 }
 
+void KVStore::hIncrByMany(llvm::ArrayRef<std::string> Keys,
+                          llvm::ArrayRef<std::string> Fields, int Incr) {
+  Impl->hIncrByMany(Keys, Fields, Incr);
+}
+
+void KVStore::hGetMany(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+                       std::vector<llvm::Optional<std::string>> &Values) {
+  Impl->hGetMany(Keys, Field, Values);
+}
+
+void KVStore::hSetMany(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+                       llvm::ArrayRef<std::string> Values) {
+  Impl->hSetMany(Keys, Field, Values);
+}
+
+void KVStore::keys(std::vector<std::string> &Keys) {
+  Impl->keys(Keys);
+}
+
+void KVStore::hGetAll(llvm::StringRef Key,
+                      std::vector<std::pair<std::string, std::string>> &Fields) {
+  Impl->hGetAll(Key, Fields);
+}
+
+void KVStore::compact() {
+  Impl->compact();
+}
+
 }
@@ -0,0 +1,207 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define DEBUG_TYPE "souper"
+
+#include "souper/KVStore/KVStore.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/Twine.h"
+
+#include <list>
+
+using namespace llvm;
+using namespace souper;
+
+STATISTIC(KVCacheHits, "Number of external cache lookups answered in memory");
+STATISTIC(KVCacheNegativeHits,
+          "Number of external cache lookups answered in memory by a miss");
+STATISTIC(KVCacheMisses, "Number of external cache lookups not in memory");
+STATISTIC(KVCacheEvictions,
+          "Number of external cache lookups forgotten to stay in budget");
+
+namespace {
+
+// Remembers the outcome of recent lookups, misses included, so that asking
+// for the same field again doesn't go to the underlying store. The entries
+// are charged for their strings plus a fixed overhead, and the least
+// recently used ones are dropped once the total exceeds the budget. Writes
+// go through to the underlying store; counters aren't remembered, since
+// other processes update them too.
+class LRUBackend : public KVStore::Backend {
+  struct Entry {
+    // The key and field, separated by a NUL
+    std::string Name;
+    Optional<std::string> Value;
+  };
+  // Roughly what the list node and the map slot of an entry cost
+  static const size_t EntryOverhead = sizeof(Entry) + 6 * sizeof(void *);
+
+  std::unique_ptr<KVStore::Backend> Underlying;
+  size_t MaxBytes;
+  size_t Bytes = 0;
+  // Most recently used first
+  std::list<Entry> Entries;
+  DenseMap<StringRef, std::list<Entry>::iterator> Map;
+
+  static std::string name(StringRef Key, StringRef Field) {
+    return (Key + Twine('\0') + Field).str();
+  }
+  static size_t size(const Entry &E) {
+    return EntryOverhead + E.Name.size() + (E.Value ? E.Value->size() : 0);
+  }
+  bool lookup(const std::string &Name, Optional<std::string> &Value);
+  void remember(std::string Name, Optional<std::string> Value);
+  void forget(const std::string &Name);
+
+public:
+  LRUBackend(std::unique_ptr<KVStore::Backend> Underlying, size_t MaxBytes)
+      : Underlying(std::move(Underlying)), MaxBytes(MaxBytes) {}
+  void hIncrBy(StringRef Key, StringRef Field, int Incr) override;
+  bool hGet(StringRef Key, StringRef Field, std::string &Value) override;
+  void hSet(StringRef Key, StringRef Field, StringRef Value) override;
+  void hIncrByMany(ArrayRef<std::string> Keys, ArrayRef<std::string> Fields,
+                   int Incr) override;
+  void hGetMany(ArrayRef<std::string> Keys, StringRef Field,
+                std::vector<Optional<std::string>> &Values) override;
+  void hSetMany(ArrayRef<std::string> Keys, StringRef Field,
+                ArrayRef<std::string> Values) override;
+  void keys(std::vector<std::string> &Keys) override {
+    Underlying->keys(Keys);
+  }
+  void hGetAll(StringRef Key,
+               std::vector<std::pair<std::string, std::string>> &Fields)
+    override {
+    Underlying->hGetAll(Key, Fields);
+  }
+  void compact() override { Underlying->compact(); }
+};
+
+bool LRUBackend::lookup(const std::string &Name,
+                        Optional<std::string> &Value) {
+  auto I = Map.find(Name);
+  if (I == Map.end()) {
+    ++KVCacheMisses;
+    return false;
+  }
+  Entries.splice(Entries.begin(), Entries, I->second);
+  Value = I->second->Value;
+  if (Value)
+    ++KVCacheHits;
+  else
+    ++KVCacheNegativeHits;
+  return true;
+}
+
+void LRUBackend::remember(std::string Name, Optional<std::string> Value) {
+  forget(Name);
+  Entries.push_front({std::move(Name), std::move(Value)});
+  Bytes += size(Entries.front());
+  Map[Entries.front().Name] = Entries.begin();
+  // An entry that is over budget on its own is dropped right away
+  while (Bytes > MaxBytes) {
+    Bytes -= size(Entries.back());
+    Map.erase(Entries.back().Name);
+    Entries.pop_back();
+    ++KVCacheEvictions;
+  }
+}
+
+void LRUBackend::forget(const std::string &Name) {
+  auto I = Map.find(Name);
+  if (I == Map.end())
+    return;
+  auto E = I->second;
+  Map.erase(I);
+  Bytes -= size(*E);
+  Entries.erase(E);
+}
+
+void LRUBackend::hIncrBy(StringRef Key, StringRef Field, int Incr) {
+  forget(name(Key, Field));
+  Underlying->hIncrBy(Key, Field, Incr);
+}
+
+bool LRUBackend::hGet(StringRef Key, StringRef Field, std::string &Value) {
+  std::string Name = name(Key, Field);
+  Optional<std::string> V;
+  if (!lookup(Name, V)) {
+    std::string S;
+    if (Underlying->hGet(Key, Field, S))
+      V = std::move(S);
+    remember(std::move(Name), V);
+  }
+  if (!V)
+    return false;
+  Value = std::move(*V);
+  return true;
+}
+
+void LRUBackend::hSet(StringRef Key, StringRef Field, StringRef Value) {
+  Underlying->hSet(Key, Field, Value);
+  remember(name(Key, Field), Value.str());
+}
+
+void LRUBackend::hIncrByMany(ArrayRef<std::string> Keys,
+                             ArrayRef<std::string> Fields, int Incr) {
+  assert(Keys.size() == Fields.size());
+  for (size_t I = 0; I != Keys.size(); ++I)
+    forget(name(Keys[I], Fields[I]));
+  Underlying->hIncrByMany(Keys, Fields, Incr);
+}
+
+void LRUBackend::hGetMany(ArrayRef<std::string> Keys, StringRef Field,
+                          std::vector<Optional<std::string>> &Values) {
+  // Only the keys that aren't remembered go to the underlying store, in one
+  // batch
+  Values.assign(Keys.size(), None);
+  std::vector<size_t> Missing;
+  std::vector<std::string> MissingKeys;
+  for (size_t I = 0; I != Keys.size(); ++I) {
+    if (!lookup(name(Keys[I], Field), Values[I])) {
+      Missing.push_back(I);
+      MissingKeys.push_back(Keys[I]);
+    }
+  }
+  if (Missing.empty())
+    return;
+  std::vector<Optional<std::string>> Fetched;
+  Underlying->hGetMany(MissingKeys, Field, Fetched);
+  for (size_t I = 0; I != Missing.size(); ++I) {
+    remember(name(MissingKeys[I], Field), Fetched[I]);
+    Values[Missing[I]] = std::move(Fetched[I]);
+  }
+}
+
+void LRUBackend::hSetMany(ArrayRef<std::string> Keys, StringRef Field,
+                          ArrayRef<std::string> Values) {
+  assert(Keys.size() == Values.size());
+  Underlying->hSetMany(Keys, Field, Values);
+  for (size_t I = 0; I != Keys.size(); ++I)
+    remember(name(Keys[I], Field), Values[I]);
+}
+
+}
+
+namespace souper {
+
+std::unique_ptr<KVStore::Backend>
+createLRUKVBackend(std::unique_ptr<KVStore::Backend> Underlying,
+                   size_t MaxBytes) {
+  return std::unique_ptr<KVStore::Backend>(
+      new LRUBackend(std::move(Underlying), MaxBytes));
+}
+
+}
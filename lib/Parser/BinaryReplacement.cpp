@@ -0,0 +1,812 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/Parser/Parser.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <unordered_set>
+
+using namespace llvm;
+using namespace souper;
+
+// A replacement is written as
+//
+//   version, number of entries, entries, roots
+//
+// where every number is an unsigned LEB128 varint. The entries define, in
+// order, the instructions and blocks that the roots refer to. Each starts
+// with a tag:
+//
+//   ExternInst, name        an instruction named in the context
+//   ExternBlock, name       a block named in the context
+//   NewBlock, preds         a new block
+//   FirstKind + kind, width, kind-specific fields, operands
+//                           an instruction
+//
+// Operands are given as the distance back to the instruction they refer to,
+// so they usually fit in a byte, and are preceded by their number. An
+// instruction whose tag is preceded by ExternalUses is one that the text
+// marks with "(hasExternalUses)". Constants are always written in place,
+// and constants of up to 64 bits are zigzag-encoded so that small negative
+// ones are short too. A string is either the index, plus one, of one of the
+// strings already seen in the replacement, or 0 followed by its length and
+// bytes.
+//
+// The roots are the PCs, the blockpcs, the LHS along with its demanded bits
+// and harvest kind, and the RHS, given as indices into the instructions and
+// blocks that the entries defined; the LHS and RHS indices are plus one, so
+// that 0 can stand for a missing one.
+
+namespace {
+
+const uint64_t FormatVersion = 1;
+const char FileMagic[8] = {'S', 'O', 'U', 'P', 'E', 'R', 'R', 'B'};
+
+enum Tag : uint64_t {
+  ExternInst,
+  ExternBlock,
+  NewBlock,
+  ExternalUses,
+  FirstKind
+};
+
+enum VarFlags {
+  VarNonZero = 1 << 0,
+  VarNonNegative = 1 << 1,
+  VarPowOfTwo = 1 << 2,
+  VarNegative = 1 << 3,
+  VarKnownBits = 1 << 4,
+  VarRange = 1 << 5
+};
+
+enum LHSFlags {
+  LHSHarvestedFromUse = 1 << 0,
+  LHSDemandedBits = 1 << 1
+};
+
+void put(std::string &Out, uint64_t V) {
+  uint8_t Buf[16];
+  unsigned N = encodeULEB128(V, Buf);
+  Out.append(reinterpret_cast<const char *>(Buf), N);
+}
+
+void put(std::string &Out, const APInt &V) {
+  if (V.getBitWidth() <= 64) {
+    uint64_t S = V.getSExtValue();
+    put(Out, (S << 1) ^ (0 - (S >> 63)));
+  } else {
+    for (unsigned J = 0; J != V.getNumWords(); ++J)
+      put(Out, V.getRawData()[J]);
+  }
+}
+
+class BinaryWriter {
+  ReplacementContext &Context;
+  std::string Entries, Roots;
+  uint64_t NumEntries = 0;
+  unsigned NumInsts = 0, NumBlocks = 0;
+  DenseMap<Inst *, unsigned> InstIdx;
+  DenseMap<Block *, unsigned> BlockIdx;
+  StringMap<unsigned> Strings;
+  // The root being written; the instructions it depends on that have
+  // external uses are marked.
+  Inst *Root = nullptr;
+
+  void putString(StringRef S) {
+    auto It = Strings.find(S);
+    if (It != Strings.end()) {
+      put(Entries, It->second + 1);
+      return;
+    }
+    put(Entries, 0);
+    put(Entries, S.size());
+    Entries += S;
+    unsigned Idx = Strings.size();
+    Strings[S] = Idx;
+  }
+
+  unsigned visitBlock(Block *B) {
+    auto It = BlockIdx.find(B);
+    if (It != BlockIdx.end())
+      return It->second;
+    StringRef Name = Context.getBlockName(B);
+    if (!Name.empty()) {
+      put(Entries, ExternBlock);
+      putString(Name);
+    } else {
+      put(Entries, NewBlock);
+      put(Entries, B->Preds);
+      Context.addBlock(B);
+    }
+    ++NumEntries;
+    return BlockIdx[B] = NumBlocks++;
+  }
+
+  unsigned visit(Inst *I) {
+    auto It = InstIdx.find(I);
+    if (It != InstIdx.end())
+      return It->second;
+    bool IsConst = I->K == Inst::Const || I->K == Inst::UntypedConst;
+    if (!IsConst) {
+      StringRef Name = Context.getInstName(I);
+      if (!Name.empty()) {
+        put(Entries, ExternInst);
+        putString(Name);
+        ++NumEntries;
+        return InstIdx[I] = NumInsts++;
+      }
+    }
+
+    std::vector<unsigned> OpIdx;
+    for (auto Op : I->Ops)
+      OpIdx.push_back(visit(Op));
+    unsigned BIdx = I->K == Inst::Phi ? visitBlock(I->B) : 0;
+
+    if (Root->Meta->DepsWithExternalUses.count(I))
+      put(Entries, ExternalUses);
+    put(Entries, FirstKind + I->K);
+    put(Entries, I->Width);
+    switch (I->K) {
+    default:
+      break;
+    case Inst::Const:
+      put(Entries, I->Val);
+      break;
+    case Inst::UntypedConst:
+      put(Entries, I->Val.getBitWidth());
+      put(Entries, I->Val);
+      break;
+    case Inst::Var: {
+      const InstMetadata *M = I->Meta;
+      bool Known = M->KnownZeros.getBoolValue() || M->KnownOnes.getBoolValue();
+      bool Range = !M->Range.isFullSet();
+      putString(M->Name);
+      put(Entries, I->SynthesisConstID);
+      put(Entries, (M->NonZero ? VarNonZero : 0) |
+                   (M->NonNegative ? VarNonNegative : 0) |
+                   (M->PowOfTwo ? VarPowOfTwo : 0) |
+                   (M->Negative ? VarNegative : 0) |
+                   (Known ? VarKnownBits : 0) | (Range ? VarRange : 0));
+      put(Entries, M->NumSignBits);
+      if (Known) {
+        put(Entries, M->KnownZeros);
+        put(Entries, M->KnownOnes);
+      }
+      if (Range) {
+        put(Entries, M->Range.getLower());
+        put(Entries, M->Range.getUpper());
+      }
+      break;
+    }
+    case Inst::Phi:
+      put(Entries, BIdx);
+      break;
+    }
+
+    if (!IsConst) {
+      put(Entries, OpIdx.size());
+      for (auto Idx : OpIdx)
+        put(Entries, NumInsts - Idx);
+      Context.addInst(I);
+    }
+    ++NumEntries;
+    return InstIdx[I] = NumInsts++;
+  }
+
+  void putRoot(Inst *I) {
+    Root = I;
+    put(Roots, visit(I));
+  }
+
+public:
+  BinaryWriter(ReplacementContext &Context) : Context(Context) {}
+
+  void writePCs(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs) {
+    put(Roots, PCs.size());
+    for (const auto &PC : PCs) {
+      putRoot(PC.LHS);
+      putRoot(PC.RHS);
+    }
+    put(Roots, BPCs.size());
+    for (const auto &BPC : BPCs) {
+      put(Roots, visitBlock(BPC.B));
+      put(Roots, BPC.PredIdx);
+      putRoot(BPC.PC.LHS);
+      putRoot(BPC.PC.RHS);
+    }
+  }
+
+  void writeLHS(Inst *LHS) {
+    if (!LHS) {
+      put(Roots, 0);
+      return;
+    }
+    Root = LHS;
+    put(Roots, visit(LHS) + 1);
+    const InstMetadata *M = LHS->Meta;
+    bool Demanded = !M->DemandedBits.isAllOnesValue();
+    put(Roots, (M->HarvestKind == HarvestType::HarvestedFromUse ?
+                LHSHarvestedFromUse : 0) |
+               (Demanded ? LHSDemandedBits : 0));
+    if (Demanded) {
+      put(Roots, M->DemandedBits.getBitWidth());
+      put(Roots, M->DemandedBits);
+    }
+  }
+
+  void writeRHS(Inst *RHS) {
+    if (!RHS) {
+      put(Roots, 0);
+      return;
+    }
+    Root = RHS;
+    put(Roots, visit(RHS) + 1);
+  }
+
+  std::string finish() {
+    std::string Out;
+    put(Out, FormatVersion);
+    put(Out, NumEntries);
+    Out += Entries;
+    Out += Roots;
+    return Out;
+  }
+};
+
+enum class ReadKind { Full, LHS, RHS };
+
+class BinaryReader {
+  InstContext &IC;
+  ReplacementContext &Context;
+  StringRef Filename;
+  const uint8_t *Begin, *P, *End;
+  // Where the data starts in the file, for error messages
+  size_t Offset;
+  std::string &ErrStr;
+  std::vector<Inst *> Insts;
+  std::vector<Block *> Blocks;
+  std::vector<StringRef> Strings;
+  std::unordered_set<Inst *> WithExternalUses;
+
+  bool fail(const Twine &Msg) {
+    ErrStr = (Filename + ": byte " + Twine(Offset + (P - Begin)) + ": " +
+              Msg).str();
+    return false;
+  }
+
+  size_t left() const { return End - P; }
+
+  bool get(uint64_t &V) {
+    unsigned N;
+    const char *Err = nullptr;
+    V = decodeULEB128(P, &N, End, &Err);
+    if (Err)
+      return fail(Err);
+    P += N;
+    return true;
+  }
+
+  bool get(unsigned &V) {
+    uint64_t W;
+    if (!get(W))
+      return false;
+    if (W > std::numeric_limits<unsigned>::max())
+      return fail(Twine(W) + " is too large");
+    V = W;
+    return true;
+  }
+
+  bool get(unsigned Width, APInt &V) {
+    if (Width <= 64) {
+      uint64_t Z;
+      if (!get(Z))
+        return false;
+      V = APInt(Width, (Z >> 1) ^ (0 - (Z & 1)), /*isSigned=*/true);
+      return true;
+    }
+    SmallVector<uint64_t, 4> Words(APInt::getNumWords(Width));
+    for (auto &W : Words)
+      if (!get(W))
+        return false;
+    V = APInt(Width, Words);
+    return true;
+  }
+
+  bool getString(StringRef &S) {
+    uint64_t Ref;
+    if (!get(Ref))
+      return false;
+    if (Ref) {
+      if (Ref > Strings.size())
+        return fail("bad string reference");
+      S = Strings[Ref - 1];
+      return true;
+    }
+    uint64_t Size;
+    if (!get(Size))
+      return false;
+    if (Size > left())
+      return fail("string runs past the end");
+    S = StringRef(reinterpret_cast<const char *>(P), Size);
+    P += Size;
+    Strings.push_back(S);
+    return true;
+  }
+
+  bool getInst(Inst *&I) {
+    uint64_t Idx;
+    if (!get(Idx))
+      return false;
+    if (Idx >= Insts.size())
+      return fail("bad instruction reference");
+    I = Insts[Idx];
+    return true;
+  }
+
+  bool getBlock(Block *&B) {
+    uint64_t Idx;
+    if (!get(Idx))
+      return false;
+    if (Idx >= Blocks.size())
+      return fail("bad block reference");
+    B = Blocks[Idx];
+    return true;
+  }
+
+  bool readEntry();
+  bool readInst(Inst::Kind K, bool HasExternalUses);
+
+public:
+  BinaryReader(InstContext &IC, ReplacementContext &Context,
+               StringRef Filename, StringRef Data, size_t Offset,
+               std::string &ErrStr)
+      : IC(IC), Context(Context), Filename(Filename),
+        Begin(Data.bytes_begin()), P(Begin), End(Data.bytes_end()),
+        Offset(Offset), ErrStr(ErrStr) {}
+
+  bool read(ParsedReplacement &R, ReadKind RK);
+};
+
+bool BinaryReader::readEntry() {
+  uint64_t T;
+  if (!get(T))
+    return false;
+  bool HasExternalUses = T == ExternalUses;
+  if (HasExternalUses) {
+    if (!get(T))
+      return false;
+    if (T < FirstKind)
+      return fail("expected an instruction");
+  }
+
+  switch (T) {
+  case ExternInst: {
+    StringRef Name;
+    if (!getString(Name))
+      return false;
+    Inst *I = Context.getInst(Name);
+    if (!I)
+      return fail("%" + Name + " is not an inst");
+    Insts.push_back(I);
+    return true;
+  }
+  case ExternBlock: {
+    StringRef Name;
+    if (!getString(Name))
+      return false;
+    Block *B = Context.getBlock(Name);
+    if (!B)
+      return fail("%" + Name + " is not a block");
+    Blocks.push_back(B);
+    return true;
+  }
+  case NewBlock: {
+    unsigned Preds;
+    if (!get(Preds))
+      return false;
+    if (Preds == 0 || Preds > MaxPreds)
+      return fail(Twine(Preds) + " is not a valid number of block "
+                  "predecessors");
+    Block *B = IC.createBlock(Preds);
+    Context.addBlock(B);
+    Blocks.push_back(B);
+    return true;
+  }
+  default:
+    if (T - FirstKind >= Inst::None)
+      return fail("unknown instruction kind " + Twine(T - FirstKind));
+    return readInst(Inst::Kind(T - FirstKind), HasExternalUses);
+  }
+}
+
+bool BinaryReader::readInst(Inst::Kind K, bool HasExternalUses) {
+  unsigned Width;
+  if (!get(Width))
+    return false;
+  if (Width == 0 && K != Inst::UntypedConst && K != Inst::ReservedConst &&
+      K != Inst::ReservedInst)
+    return fail("width must be at least 1");
+
+  if (K == Inst::Const || K == Inst::UntypedConst) {
+    if (K == Inst::UntypedConst) {
+      if (!get(Width))
+        return false;
+      if (Width == 0)
+        return fail("width must be at least 1");
+    }
+    APInt Val;
+    if (!get(Width, Val))
+      return false;
+    Insts.push_back(K == Inst::Const ? IC.getConst(Val) :
+                    IC.getUntypedConst(Val));
+    return true;
+  }
+
+  StringRef Name;
+  unsigned SynthesisConstID = 0, Flags = 0, SignBits = 1;
+  APInt Zero, One, Lower, Upper;
+  Block *B = nullptr;
+  if (K == Inst::Var) {
+    if (!getString(Name) || !get(SynthesisConstID) || !get(Flags) ||
+        !get(SignBits))
+      return false;
+    Zero = One = APInt(Width, 0);
+    if ((Flags & VarKnownBits) && (!get(Width, Zero) || !get(Width, One)))
+      return false;
+    if (Flags & VarRange) {
+      if (!get(Width, Lower) || !get(Width, Upper))
+        return false;
+      if (Lower == Upper && !Lower.isMaxValue() && !Lower.isMinValue())
+        return fail("empty range must be [min,min) or [max,max)");
+    }
+  } else if (K == Inst::Phi) {
+    if (!getBlock(B))
+      return false;
+  }
+
+  unsigned NumOps;
+  if (!get(NumOps))
+    return false;
+  // Every operand takes at least a byte
+  if (NumOps > left())
+    return fail("operands run past the end");
+  std::vector<Inst *> Ops;
+  for (unsigned J = 0; J != NumOps; ++J) {
+    uint64_t Dist;
+    if (!get(Dist))
+      return false;
+    if (Dist == 0 || Dist > Insts.size())
+      return fail("bad operand reference");
+    Ops.push_back(Insts[Insts.size() - Dist]);
+  }
+
+  Inst *I;
+  switch (K) {
+  case Inst::Var:
+  case Inst::Hole:
+  case Inst::ReservedConst:
+  case Inst::ReservedInst:
+    if (!Ops.empty())
+      return fail(Twine(Inst::getKindName(K)) + " may not have operands");
+    if (K == Inst::Var)
+      I = IC.createVar(Width, Name,
+                       Flags & VarRange ? ConstantRange(Lower, Upper) :
+                                          ConstantRange(Width, true),
+                       Zero, One, Flags & VarNonZero, Flags & VarNonNegative,
+                       Flags & VarPowOfTwo, Flags & VarNegative, SignBits,
+                       SynthesisConstID);
+    else if (K == Inst::Hole)
+      I = IC.createHole(Width);
+    else {
+      // Reserved nodes are created untyped, but synthesis may have given
+      // them a width since
+      I = K == Inst::ReservedConst ? IC.getReservedConst() :
+                                     IC.getReservedInst();
+      I->Width = Width;
+    }
+    break;
+  case Inst::Phi: {
+    std::string TypeErr;
+    if (!typeCheckPhi(IC, Width, B, Ops, TypeErr))
+      return fail(TypeErr);
+    I = IC.getPhi(B, Ops);
+    break;
+  }
+  default: {
+    // The parser expands an overflow intrinsic into the operation and its
+    // overflow bit, which is what was written; check that shape, and the
+    // intrinsic against the operands it was written with.
+    std::vector<Inst *> CheckOps = Ops;
+    if (Inst::isOverflowIntrinsicMain(K)) {
+      Inst::Kind OpK =
+          K == Inst::SAddWithOverflow || K == Inst::UAddWithOverflow ?
+          Inst::Add :
+          K == Inst::SSubWithOverflow || K == Inst::USubWithOverflow ?
+          Inst::Sub : Inst::Mul;
+      if (Ops.size() != 2 || Ops[0]->K != OpK ||
+          Ops[1]->K != Inst::getOverflowComplement(K) ||
+          Ops[0]->Ops != Ops[1]->Ops)
+        return fail(Twine(Inst::getKindName(K)) +
+                    " must be an operation and its overflow bit");
+      CheckOps = Ops[0]->Ops;
+    }
+    std::string TypeErr;
+    if (!typeCheckInst(IC, K, Width, CheckOps, TypeErr))
+      return fail(TypeErr);
+    if (!Inst::isOverflowIntrinsicMain(K))
+      Ops = CheckOps;
+    I = IC.getInst(K, Width, Ops);
+    break;
+  }
+  }
+
+  // As in the parser, external uses accumulate over the replacement
+  if (HasExternalUses)
+    WithExternalUses.insert(I);
+  if (!I->Ops.empty())
+    for (auto EU : WithExternalUses)
+      I->Meta->DepsWithExternalUses.insert(EU);
+  Context.addInst(I);
+  Insts.push_back(I);
+  return true;
+}
+
+bool BinaryReader::read(ParsedReplacement &R, ReadKind RK) {
+  uint64_t Version, NumEntries;
+  if (!get(Version))
+    return false;
+  if (Version != FormatVersion)
+    return fail("unsupported version " + Twine(Version));
+  if (!get(NumEntries))
+    return false;
+  if (NumEntries > left())
+    return fail("entries run past the end");
+  for (uint64_t J = 0; J != NumEntries; ++J)
+    if (!readEntry())
+      return false;
+
+  uint64_t NumPCs;
+  if (!get(NumPCs))
+    return false;
+  for (uint64_t J = 0; J != NumPCs; ++J) {
+    InstMapping PC;
+    if (!getInst(PC.LHS) || !getInst(PC.RHS))
+      return false;
+    R.PCs.push_back(PC);
+  }
+  uint64_t NumBPCs;
+  if (!get(NumBPCs))
+    return false;
+  for (uint64_t J = 0; J != NumBPCs; ++J) {
+    BlockPCMapping BPC;
+    if (!getBlock(BPC.B) || !get(BPC.PredIdx) || !getInst(BPC.PC.LHS) ||
+        !getInst(BPC.PC.RHS))
+      return false;
+    if (BPC.PredIdx >= BPC.B->Preds)
+      return fail("blockpc index " + Twine(BPC.PredIdx) + " is out of range");
+    R.BPCs.push_back(BPC);
+  }
+
+  uint64_t LHSIdx;
+  if (!get(LHSIdx))
+    return false;
+  if (LHSIdx) {
+    if (LHSIdx > Insts.size())
+      return fail("bad instruction reference");
+    R.Mapping.LHS = Insts[LHSIdx - 1];
+    unsigned Flags;
+    if (!get(Flags))
+      return false;
+    InstMetadata *M = R.Mapping.LHS->Meta;
+    M->HarvestKind = Flags & LHSHarvestedFromUse ?
+      HarvestType::HarvestedFromUse : HarvestType::HarvestedFromDef;
+    if (Flags & LHSDemandedBits) {
+      unsigned Width;
+      if (!get(Width))
+        return false;
+      if (Width == 0)
+        return fail("width must be at least 1");
+      if (Width != R.Mapping.LHS->Width)
+        return fail("demanded bits width does not match the LHS width");
+      if (!get(Width, M->DemandedBits))
+        return false;
+    } else if (R.Mapping.LHS->Width) {
+      M->DemandedBits = APInt::getAllOnesValue(R.Mapping.LHS->Width);
+    }
+  }
+  uint64_t RHSIdx;
+  if (!get(RHSIdx))
+    return false;
+  if (RHSIdx) {
+    if (RHSIdx > Insts.size())
+      return fail("bad instruction reference");
+    R.Mapping.RHS = Insts[RHSIdx - 1];
+  }
+  if (P != End)
+    return fail("unexpected data after the replacement");
+
+  switch (RK) {
+  case ReadKind::Full:
+    if (!R.Mapping.LHS)
+      return fail("replacement has no LHS");
+    break;
+  case ReadKind::LHS:
+    if (!R.Mapping.LHS || R.Mapping.RHS)
+      return fail("expected just an LHS");
+    break;
+  case ReadKind::RHS:
+    if (R.Mapping.LHS || !R.Mapping.RHS || !R.PCs.empty() || !R.BPCs.empty())
+      return fail("expected just an RHS");
+    break;
+  }
+  return true;
+}
+
+// Reads the size of the replacement at Pos, moving Pos past it, or returns
+// false at the end of the data or on an error
+bool readSize(StringRef Filename, StringRef Data, size_t &Pos, size_t &Size,
+              std::string &ErrStr) {
+  if (Pos == 0)
+    Pos = sizeof(FileMagic);
+  if (Pos == Data.size())
+    return false;
+  unsigned N;
+  const char *Err = nullptr;
+  uint64_t S = decodeULEB128(Data.bytes_begin() + Pos, &N, Data.bytes_end(),
+                             &Err);
+  if (Err || S > Data.size() - Pos - N) {
+    ErrStr = (Filename + ": byte " + Twine(Pos) +
+              ": truncated replacement").str();
+    return false;
+  }
+  Pos += N;
+  Size = S;
+  return true;
+}
+
+ParsedReplacement readReplacement(InstContext &IC, StringRef Filename,
+                                  StringRef Data, size_t Offset,
+                                  ReplacementContext &Context,
+                                  std::string &ErrStr, ReadKind RK) {
+  ParsedReplacement R;
+  BinaryReader Reader(IC, Context, Filename, Data, Offset, ErrStr);
+  if (!Reader.read(R, RK))
+    return ParsedReplacement();
+  return R;
+}
+
+}
+
+std::string souper::GetReplacementBinary(const BlockPCs &BPCs,
+                                         const std::vector<InstMapping> &PCs,
+                                         InstMapping Mapping,
+                                         ReplacementContext &Context) {
+  BinaryWriter W(Context);
+  W.writePCs(BPCs, PCs);
+  W.writeLHS(Mapping.LHS);
+  W.writeRHS(Mapping.RHS);
+  return W.finish();
+}
+
+std::string souper::GetReplacementLHSBinary(const BlockPCs &BPCs,
+                                            const std::vector<InstMapping> &PCs,
+                                            Inst *LHS,
+                                            ReplacementContext &Context) {
+  return GetReplacementBinary(BPCs, PCs, InstMapping(LHS, 0), Context);
+}
+
+std::string souper::GetReplacementRHSBinary(Inst *RHS,
+                                            ReplacementContext &Context) {
+  BinaryWriter W(Context);
+  W.writePCs({}, {});
+  W.writeLHS(0);
+  W.writeRHS(RHS);
+  return W.finish();
+}
+
+ParsedReplacement souper::ReadReplacementBinary(InstContext &IC,
+                                                StringRef Filename,
+                                                StringRef Data,
+                                                ReplacementContext &Context,
+                                                std::string &ErrStr) {
+  return readReplacement(IC, Filename, Data, 0, Context, ErrStr,
+                         ReadKind::Full);
+}
+
+ParsedReplacement souper::ReadReplacementLHSBinary(InstContext &IC,
+                                                   StringRef Filename,
+                                                   StringRef Data,
+                                                   ReplacementContext &Context,
+                                                   std::string &ErrStr) {
+  return readReplacement(IC, Filename, Data, 0, Context, ErrStr,
+                         ReadKind::LHS);
+}
+
+ParsedReplacement souper::ReadReplacementRHSBinary(InstContext &IC,
+                                                   StringRef Filename,
+                                                   StringRef Data,
+                                                   ReplacementContext &Context,
+                                                   std::string &ErrStr) {
+  return readReplacement(IC, Filename, Data, 0, Context, ErrStr,
+                         ReadKind::RHS);
+}
+
+void souper::WriteReplacementsBinary(
+    raw_ostream &Out, const std::vector<ParsedReplacement> &Reps) {
+  Out.write(FileMagic, sizeof(FileMagic));
+  for (const auto &R : Reps) {
+    ReplacementContext Context;
+    std::string Rep = GetReplacementBinary(R.BPCs, R.PCs, R.Mapping, Context);
+    std::string Size;
+    put(Size, Rep.size());
+    Out << Size << Rep;
+  }
+}
+
+bool souper::isBinaryReplacements(StringRef Data) {
+  return Data.startswith(StringRef(FileMagic, sizeof(FileMagic)));
+}
+
+std::vector<ParsedReplacement> souper::ReadReplacementsBinary(
+    InstContext &IC, StringRef Filename, StringRef Data,
+    std::vector<ReplacementContext> &Contexts, std::string &ErrStr) {
+  if (!isBinaryReplacements(Data)) {
+    ErrStr = (Filename + ": not a file of binary replacements").str();
+    return {};
+  }
+  std::vector<ParsedReplacement> Reps;
+  ReplacementStream S(Filename, Data);
+  while (true) {
+    ParsedReplacement R;
+    Contexts.emplace_back();
+    if (!S.next(IC, R, Contexts.back(), ErrStr)) {
+      Contexts.pop_back();
+      break;
+    }
+    Reps.push_back(std::move(R));
+  }
+  if (!ErrStr.empty())
+    return {};
+  return Reps;
+}
+
+bool ReplacementStream::skipBinary(std::string &ErrStr) {
+  size_t Size;
+  if (!readSize(Filename, Data, Pos, Size, ErrStr))
+    return false;
+  Pos += Size;
+  return true;
+}
+
+bool ReplacementStream::nextBinary(InstContext &IC, ParsedReplacement &R,
+                                   ReplacementContext &Context,
+                                   std::string &ErrStr) {
+  size_t Size;
+  if (!readSize(Filename, Data, Pos, Size, ErrStr))
+    return false;
+  R = readReplacement(IC, Filename, Data.substr(Pos, Size), Pos, Context,
+                      ErrStr, ReadKind::Full);
+  Pos += Size;
+  if (!ErrStr.empty())
+    return false;
+  if (LHSOnly)
+    R.Mapping.RHS = 0;
+  return true;
+}
@@ -18,10 +18,13 @@
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
 #include "souper/Extractor/Candidates.h"
 #include "souper/Inst/Inst.h"
 
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <unordered_set>
 
@@ -327,14 +330,6 @@ struct Parser {
            ErrStr;
   }
 
-  bool lossy(const APInt &I, unsigned NewWidth) {
-    unsigned W = I.getBitWidth();
-    if (NewWidth >= W)
-      return false;
-    auto NI = I.trunc(NewWidth);
-    return NI.zext(W) != I && NI.sext(W) != I;
-  }
-
   bool consumeToken(std::string &ErrStr) {
     CurTok = L.getNextToken(ErrStr);
     if (CurTok.K == Token::Error) {
@@ -348,13 +343,6 @@ struct Parser {
   Inst *parseInst(std::string &ErrStr);
   InstMapping parseInstMapping(std::string &ErrStr);
 
-  bool typeCheckPhi(unsigned Width, Block *B, std::vector<Inst *> &Ops,
-                    std::string &ErrStr);
-  bool typeCheckInst(Inst::Kind IK, unsigned &Width, std::vector<Inst *> &Ops,
-                     std::string &ErrStr);
-  bool typeCheckOpsMatchingWidths(llvm::MutableArrayRef<Inst *> Ops,
-                                  std::string &ErrStr);
-
   bool parseLine(std::string &ErrStr);
 
   ParsedReplacement parseReplacement(std::string &ErrStr);
@@ -412,8 +400,17 @@ bool Parser::isOverflow(Inst::Kind IK) {
           IK == Inst::SMulWithOverflow || IK == Inst::UMulWithOverflow);
 }
 
-bool Parser::typeCheckOpsMatchingWidths(llvm::MutableArrayRef<Inst *> Ops,
-                                        std::string &ErrStr) {
+static bool lossy(const APInt &I, unsigned NewWidth) {
+  unsigned W = I.getBitWidth();
+  if (NewWidth >= W)
+    return false;
+  auto NI = I.trunc(NewWidth);
+  return NI.zext(W) != I && NI.sext(W) != I;
+}
+
+static bool typeCheckOpsMatchingWidths(InstContext &IC,
+                                       llvm::MutableArrayRef<Inst *> Ops,
+                                       std::string &ErrStr) {
   unsigned Width = 0;
   for (auto Op : Ops) {
     if (Width == 0)
@@ -441,21 +438,15 @@ bool Parser::typeCheckOpsMatchingWidths(llvm::MutableArrayRef<Inst *> Ops,
   return true;
 }
 
-bool Parser::typeCheckPhi(unsigned Width, Block *B,
+bool souper::typeCheckPhi(InstContext &IC, unsigned Width, Block *B,
                           std::vector<Inst *> &Ops, std::string &ErrStr) {
   if (B->Preds != Ops.size()) {
     ErrStr = "phi has " + utostr(Ops.size()) +
       " operand(s) but preceding block has " + utostr(B->Preds);
     return false;
   }
-  auto IdxIt = BlockPCIdxMap.find(B);
-  if (IdxIt != BlockPCIdxMap.end() && IdxIt->second >= Ops.size()) {
-    ErrStr = "blockpc's predecessor number is larger "
-             "than the number of phi's operands";
-    return false;
-  }
 
-  if (!typeCheckOpsMatchingWidths(Ops, ErrStr))
+  if (!typeCheckOpsMatchingWidths(IC, Ops, ErrStr))
     return false;
 
   if (Width != 0 && Width != Ops[0]->Width) {
@@ -465,7 +456,7 @@ bool Parser::typeCheckPhi(unsigned Width, Block *B,
   }
 
   for (auto Op : Ops) {
-    if (isOverflow(Op->K)) {
+    if (Inst::isOverflowIntrinsicMain(Op->K)) {
       ErrStr = "overflow intrinsic cannot be an operand of phi instruction";
       return false;
     }
@@ -474,9 +465,8 @@ bool Parser::typeCheckPhi(unsigned Width, Block *B,
   return true;
 }
 
-bool Parser::typeCheckInst(Inst::Kind IK, unsigned &Width,
-                           std::vector<Inst *> &Ops,
-                           std::string &ErrStr) {
+bool souper::typeCheckInst(InstContext &IC, Inst::Kind IK, unsigned &Width,
+                           std::vector<Inst *> &Ops, std::string &ErrStr) {
   unsigned MinOps = 2, MaxOps = 2;
   llvm::MutableArrayRef<Inst *> OpsMatchingWidths = Ops;
 
@@ -627,11 +617,11 @@ bool Parser::typeCheckInst(Inst::Kind IK, unsigned &Width,
   // ExtractValue instruction is an index value. We don't type check
   // the operands width as the two elements vary in width.
   if (IK != Inst::ExtractValue) {
-    if (!typeCheckOpsMatchingWidths(OpsMatchingWidths, ErrStr))
+    if (!typeCheckOpsMatchingWidths(IC, OpsMatchingWidths, ErrStr))
       return false;
 
     for (auto Op : Ops) {
-      if (isOverflow(Op->K)) {
+      if (Inst::isOverflowIntrinsicMain(Op->K)) {
         ErrStr = std::string("overflow intrinsic cannot be an operand of ") + Inst::getKindName(IK) +
                  std::string(" instruction");
         return false;
@@ -679,6 +669,10 @@ bool Parser::typeCheckInst(Inst::Kind IK, unsigned &Width,
     break;
 
   case Inst::ExtractValue:
+    if (Ops[1]->K != Inst::Const && Ops[1]->K != Inst::UntypedConst) {
+      ErrStr = "extractvalue index must be a constant";
+      return false;
+    }
     if (Ops[1]->Val == 0) {
       switch (Ops[0]->K) {
         case Inst::SAddWithOverflow:
@@ -762,7 +756,7 @@ InstMapping Parser::parseInstMapping(std::string &ErrStr) {
   if (!SrcRep[1])
     return InstMapping();
 
-  if (!typeCheckOpsMatchingWidths(SrcRep, ErrStr)) {
+  if (!typeCheckOpsMatchingWidths(IC, SrcRep, ErrStr)) {
     ErrStr = makeErrStr(ErrStr);
     return InstMapping();
   }
@@ -773,8 +767,8 @@ InstMapping Parser::parseInstMapping(std::string &ErrStr) {
 bool Parser::parseInstAttribute(std::string &ErrStr, Inst *LHS) {
   int DemandedBitsCount = 0;
   int HarvestKindCount = 0;
-  LHS->HarvestKind = HarvestType::HarvestedFromDef;
-  LHS->DemandedBits = APInt::getAllOnesValue(LHS->Width);
+  LHS->Meta->HarvestKind = HarvestType::HarvestedFromDef;
+  LHS->Meta->DemandedBits = APInt::getAllOnesValue(LHS->Width);
   while (CurTok.K == Token::OpenParen) {
     llvm::APInt DemandedBitsVal = APInt(LHS->Width, 0, false);
     llvm::APInt ConstOne(LHS->Width, 1, false);
@@ -823,7 +817,7 @@ bool Parser::parseInstAttribute(std::string &ErrStr, Inst *LHS) {
       }
       if (!consumeToken(ErrStr))
         return false;
-      LHS->DemandedBits = DemandedBitsVal;
+      LHS->Meta->DemandedBits = DemandedBitsVal;
     } else if (CurTok.str() == "harvestedFromUse") {
       HarvestKindCount++;
       if (HarvestKindCount > 1) {
@@ -838,7 +832,7 @@ bool Parser::parseInstAttribute(std::string &ErrStr, Inst *LHS) {
       }
       if (!consumeToken(ErrStr))
         return false;
-      LHS->HarvestKind = HarvestType::HarvestedFromUse;
+      LHS->Meta->HarvestKind = HarvestType::HarvestedFromUse;
     } else {
       ErrStr = makeErrStr("invalid Inst attribute string");
       return false;
@@ -1308,13 +1302,19 @@ bool Parser::parseLine(std::string &ErrStr) {
       Inst *I;
       if (IK == Inst::Phi) {
         assert(B);
-        if (!typeCheckPhi(InstWidth, B, Ops, ErrStr)) {
+        if (!typeCheckPhi(IC, InstWidth, B, Ops, ErrStr)) {
           ErrStr = makeErrStr(TP, ErrStr);
           return false;
         }
+        auto IdxIt = BlockPCIdxMap.find(B);
+        if (IdxIt != BlockPCIdxMap.end() && IdxIt->second >= Ops.size()) {
+          ErrStr = makeErrStr(TP, "blockpc's predecessor number is larger "
+                                  "than the number of phi's operands");
+          return false;
+        }
         I = IC.getPhi(B, Ops);
       } else {
-        if (!typeCheckInst(IK, InstWidth, Ops, ErrStr)) {
+        if (!typeCheckInst(IC, IK, InstWidth, Ops, ErrStr)) {
           ErrStr = makeErrStr(TP, ErrStr);
           return false;
         }
@@ -1352,7 +1352,7 @@ bool Parser::parseLine(std::string &ErrStr) {
       if (hasExternalUses)
         ExternalUsesSet.insert(I);
       for (auto EU: ExternalUsesSet)
-        I->DepsWithExternalUses.insert(EU);
+        I->Meta->DepsWithExternalUses.insert(EU);
       Context.setInst(InstName, I);
       return true;
     }
@@ -1507,3 +1507,156 @@ std::vector<ParsedReplacement> souper::ParseReplacementRHSs(
   }
   return R;
 }
+
+// Whether Line is a statement that ends a replacement
+static bool endsReplacement(StringRef Line, bool LHSOnly) {
+  Line = Line.ltrim(" \t\r");
+  auto Is = [Line](StringRef Keyword) {
+    StringRef Rest = Line;
+    return Rest.consume_front(Keyword) &&
+           (Rest.empty() || Rest[0] == ' ' || Rest[0] == '\t' ||
+            Rest[0] == '\r' || Rest[0] == '\n' || Rest[0] == ';');
+  };
+  return LHSOnly ? Is("infer") : Is("cand") || Is("result");
+}
+
+ReplacementStream::ReplacementStream(StringRef Filename, StringRef Data,
+                                     bool LHSOnly, size_t Begin, size_t End)
+    : Filename(Filename), Data(Data.substr(0, End)), LHSOnly(LHSOnly),
+      Binary(isBinaryReplacements(Data)), Begin(Begin), Pos(Begin) {}
+
+bool ReplacementStream::next(InstContext &IC, ParsedReplacement &R,
+                             ReplacementContext &Context,
+                             std::string &ErrStr) {
+  if (Pos == Data.size())
+    return false;
+  if (Binary)
+    return nextBinary(IC, R, Context, ErrStr);
+  return nextText(IC, R, Context, ErrStr);
+}
+
+void ReplacementStream::skipText() {
+  while (Pos != Data.size()) {
+    size_t Eol = Data.find('\n', Pos);
+    size_t Next = Eol == StringRef::npos ? Data.size() : Eol + 1;
+    bool End = endsReplacement(Data.slice(Pos, Next), LHSOnly);
+    if (Eol != StringRef::npos)
+      ++Line;
+    Pos = Next;
+    if (End)
+      return;
+  }
+}
+
+bool ReplacementStream::nextText(InstContext &IC, ParsedReplacement &R,
+                                 ReplacementContext &Context,
+                                 std::string &ErrStr) {
+  // Only comments may follow the last replacement
+  std::string LexErrStr;
+  Lexer L(Data.data() + Pos, Data.end());
+  if (L.getNextToken(LexErrStr).K == Token::Eof) {
+    Pos = Data.size();
+    return false;
+  }
+
+  size_t Start = Pos;
+  unsigned StartLine = Line;
+  skipText();
+  StringRef Text = Data.slice(Start, Pos);
+  auto Parse = [&](unsigned FirstLine) {
+    std::vector<ParsedReplacement> Reps;
+    std::vector<ReplacementContext> RCs;
+    Parser P(Filename, Text, IC, Reps,
+             LHSOnly ? ReplacementKind::ParseLHS : ReplacementKind::ParseBoth,
+             0, &RCs);
+    P.L.LineNum = FirstLine;
+    R = P.parseReplacement(ErrStr);
+    if (ErrStr.empty())
+      Context = std::move(RCs[0]);
+  };
+  Parse(StartLine);
+  if (ErrStr.empty())
+    return true;
+  // The lines before Begin are only counted when an error needs them
+  if (Begin != 0) {
+    ErrStr.clear();
+    Parse(StartLine + std::count(Data.begin(), Data.begin() + Begin, '\n'));
+  }
+  return false;
+}
+
+std::vector<size_t> ReplacementStream::split(StringRef Data, bool LHSOnly,
+                                             unsigned N) {
+  std::vector<size_t> Offsets = {0};
+  if (isBinaryReplacements(Data)) {
+    // Binary replacements can only be found by walking them from the start
+    ReplacementStream S("", Data);
+    std::string ErrStr;
+    for (unsigned K = 1; K < N; ++K) {
+      size_t Target = Data.size() * K / N;
+      while (S.Pos < Target && S.skipBinary(ErrStr))
+        ;
+      if (!ErrStr.empty() || S.Pos == Data.size())
+        break;
+      if (S.Pos != Offsets.back())
+        Offsets.push_back(S.Pos);
+    }
+  } else {
+    for (unsigned K = 1; K < N; ++K) {
+      size_t Target = std::max(Data.size() * K / N, Offsets.back());
+      size_t Eol = Data.find('\n', Target);
+      if (Eol == StringRef::npos)
+        break;
+      ReplacementStream S("", Data, LHSOnly, Eol + 1);
+      S.skipText();
+      if (S.Pos == Data.size())
+        break;
+      Offsets.push_back(S.Pos);
+    }
+  }
+  Offsets.push_back(Data.size());
+  return Offsets;
+}
+
+bool souper::ParseReplacementsParallel(StringRef Filename, StringRef Data,
+    bool LHSOnly, unsigned Jobs,
+    function_ref<void(size_t Offset, ParsedReplacement &R,
+                      ReplacementContext &Context, InstContext &IC)> Consume,
+    std::string &ErrStr) {
+  Jobs = std::max(Jobs, 1u);
+  std::vector<size_t> Offsets = ReplacementStream::split(Data, LHSOnly, Jobs);
+  unsigned Pieces = Offsets.size() - 1;
+  std::vector<std::string> Errors(Pieces);
+  // The pieces after one that failed stop early, but the ones before it run
+  // to the end, so that the first error in the data is the one reported
+  std::atomic<unsigned> FirstFailed(Pieces);
+  {
+    llvm::ThreadPool Pool(Jobs);
+    for (unsigned J = 0; J != Pieces; ++J) {
+      Pool.async([&, J]() {
+        InstContext IC;
+        ReplacementStream S(Filename, Data, LHSOnly, Offsets[J],
+                            Offsets[J + 1]);
+        while (J < FirstFailed) {
+          InstContext::Checkpoint CP = IC.checkpoint();
+          size_t Offset = S.getPosition();
+          ParsedReplacement R;
+          ReplacementContext Context;
+          if (!S.next(IC, R, Context, Errors[J]))
+            break;
+          Consume(Offset, R, Context, IC);
+          IC.rollback(CP);
+        }
+        if (!Errors[J].empty()) {
+          unsigned F = FirstFailed;
+          while (J < F && !FirstFailed.compare_exchange_weak(F, J))
+            ;
+        }
+      });
+    }
+  }
+  if (FirstFailed == Pieces)
+    return true;
+  ErrStr = Errors[FirstFailed];
+  return false;
+}
@@ -189,9 +189,9 @@ public:
     if (ReplacedValues.find(I) != ReplacedValues.end())
       return ReplacedValues[I];
 
-    if (I->Origins.size() > 0) {
+    if (I->Meta->Origins.size() > 0) {
       // if there's an Origin, we're connecting to existing code
-      for (auto V : I->Origins) {
+      for (auto V : I->Meta->Origins) {
         if (V->getType() != T)
           continue; // TODO: can we assert this doesn't happen?
         if (isa<Argument>(V) || isa<Constant>(V))
@@ -439,19 +439,25 @@ public:
       }
     }
 
-
-    for (auto &Cand : CandMap) {
-
-      if (StaticProfile) {
+    if (StaticProfile) {
+      std::vector<std::string> Keys, Fields;
+      for (auto &Cand : CandMap) {
         std::string Str;
         llvm::raw_string_ostream Loc(Str);
         Cand.Origin->getDebugLoc().print(Loc);
-        std::string HField = "sprofile " + Loc.str();
+        Fields.push_back("sprofile " + Loc.str());
         ReplacementContext Context;
-        KV->hIncrBy(GetReplacementLHSString(Cand.BPCs, Cand.PCs,
-                                            Cand.Mapping.LHS,
-                                            Context), HField, 1);
+        Keys.push_back(GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                               Cand.Mapping.LHS, Context));
       }
+      KV->hIncrByMany(Keys, Fields, 1);
+    }
+
+    // Look up all of the candidates in the external cache, if any, in one go
+    if (!DynamicProfileAll)
+      S->prefetch(CandMap);
+
+    for (auto &Cand : CandMap) {
       if (DynamicProfileAll) {
         dynamicProfile(F, Cand);
         Changed = true;
@@ -478,7 +484,8 @@ public:
                                ReplacedValues, Builder, F->getParent());
 
       // if LHS comes from use, then NewVal should be a constant
-      assert(Cand.Mapping.LHS->HarvestKind != HarvestType::HarvestedFromUse ||
+      assert(Cand.Mapping.LHS->Meta->HarvestKind !=
+                 HarvestType::HarvestedFromUse ||
              isa<llvm::Constant>(NewVal));
 
       // TODO can we assert that getValue() succeeds?
@@ -501,7 +508,7 @@ public:
         ++ReplacementIdx;
       ReplacementsDone++;
 
-      if (Cand.Mapping.LHS->HarvestKind == HarvestType::HarvestedFromDef)
+      if (Cand.Mapping.LHS->Meta->HarvestKind == HarvestType::HarvestedFromDef)
         ReplacedValues[Cand.Mapping.LHS] = NewVal;
 
       if (DebugLevel > 1) {
@@ -531,7 +538,8 @@ public:
       if (DynamicProfile)
         dynamicProfile(F, Cand);
 
-      if (Cand.Mapping.LHS->HarvestKind == HarvestType::HarvestedFromDef) {
+      if (Cand.Mapping.LHS->Meta->HarvestKind ==
+          HarvestType::HarvestedFromDef) {
         I->replaceAllUsesWith(NewVal);
         Changed = true;
       } else {
@@ -541,7 +549,7 @@ public:
           ++UI;
           // TODO: Handle general values, not only instructions
           auto *Usr = dyn_cast<llvm::Instruction>(U.getUser());
-          if (Usr && Usr->getParent() == Cand.Mapping.LHS->HarvestFrom) {
+          if (Usr && Usr->getParent() == Cand.Mapping.LHS->Meta->HarvestFrom) {
             U.set(NewVal);
             Changed = true;
           }
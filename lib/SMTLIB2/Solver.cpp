@@ -23,27 +23,64 @@
 #include "llvm/Support/Program.h"
 #include "llvm/Support/raw_ostream.h"
 #include "souper/SMTLIB2/Solver.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <system_error>
 
 using namespace llvm;
 using namespace souper;
 
+STATISTIC(Cancellations, "Number of SMT queries cancelled while running");
 STATISTIC(Errors, "Number of SMT solver errors");
 STATISTIC(Sats, "Number of satisfiable SMT queries");
 STATISTIC(Timeouts, "Number of SMT solver timeouts");
 STATISTIC(Unsats, "Number of unsatisfiable SMT queries");
+STATISTIC(SessionStarts, "Number of persistent SMT solver processes started");
+STATISTIC(PortfolioBoolectorWins, "Number of portfolio races won by Boolector");
+STATISTIC(PortfolioCVC4Wins, "Number of portfolio races won by CVC4");
+STATISTIC(PortfolioSTPWins, "Number of portfolio races won by STP");
+STATISTIC(PortfolioZ3Wins, "Number of portfolio races won by Z3");
 
 SMTLIBSolver::~SMTLIBSolver() {}
 
 namespace {
 
+// Like sys::Wait, but polls the process so that it can be killed as soon as
+// Cancel becomes true. Returns -3 in that case.
+int waitCancellable(sys::ProcessInfo PI, unsigned Timeout,
+                    const std::atomic<bool> &Cancel) {
+  auto Deadline = std::chrono::steady_clock::now() +
+                  std::chrono::seconds(Timeout);
+  unsigned SleepUs = 50;
+  while (true) {
+    sys::ProcessInfo Done = sys::Wait(PI, 0, /*WaitUntilTerminates=*/false);
+    if (Done.Pid == PI.Pid)
+      return Done.ReturnCode;
+    bool TimedOut = Timeout && std::chrono::steady_clock::now() >= Deadline;
+    if (Cancel || TimedOut) {
+      ::kill(PI.Pid, SIGKILL);
+      sys::Wait(PI, 0, /*WaitUntilTerminates=*/true);
+      return TimedOut ? -2 : -3;
+    }
+    ::usleep(SleepUs);
+    SleepUs = std::min(SleepUs * 2, 5000u);
+  }
+}
+
 // Bare bones SMT-LIB parser; enough to parse a get-value response.
 struct SMTLIBParser {
   const char *Begin, *End;
@@ -201,6 +238,29 @@ std::vector<APInt> ParseModels(StringRef Models, unsigned NumModels,
   return ModelVals;
 }
 
+// Interpret a solver's response to a query ending in (check-sat) and
+// optionally some (get-value ...) commands.
+std::error_code ParseResponse(StringRef Out, bool &Result, unsigned NumModels,
+                              std::vector<APInt> *Models) {
+  if (Out.startswith("sat\n")) {
+    Result = true;
+    ++Sats;
+    std::string ErrStr;
+    if (Models)
+      *Models = ParseModels(Out.slice(4, StringRef::npos), NumModels, ErrStr);
+    if (!ErrStr.empty())
+      return std::make_error_code(std::errc::protocol_error);
+    return std::error_code();
+  } else if (Out.startswith("unsat\n")) {
+    Result = false;
+    ++Unsats;
+    return std::error_code();
+  } else {
+    ++Errors;
+    return std::make_error_code(std::errc::protocol_error);
+  }
+}
+
 class ProcessSMTLIBSolver : public SMTLIBSolver {
   std::string Name;
   bool Keep;
@@ -229,7 +289,8 @@ public:
 
   std::error_code isSatisfiable(StringRef Query, bool &Result,
                                 unsigned NumModels, std::vector<APInt> *Models,
-                                unsigned Timeout) override {
+                                unsigned Timeout,
+                                const std::atomic<bool> *Cancel) override {
     int InputFD;
     SmallString<64> InputPath;
     if (std::error_code EC =
@@ -252,8 +313,8 @@ public:
     }
     ::close(OutputFD);
 
-    int ExitCode =
-        Prog(Args, InputPath, OutputPath, /*ErrorPath=*/"/dev/null", Timeout);
+    int ExitCode = Prog(Args, InputPath, OutputPath, /*ErrorPath=*/"/dev/null",
+                        Timeout, Cancel);
 
     if (Keep) {
       llvm::errs() << "Solver input saved to " << InputPath << '\n';
@@ -262,6 +323,11 @@ public:
     }
 
     switch (ExitCode) {
+    case -3:
+      ::remove(OutputPath.c_str());
+      ++Cancellations;
+      return std::make_error_code(std::errc::operation_canceled);
+
     case -2:
       ::remove(OutputPath.c_str());
       ++Timeouts;
@@ -281,30 +347,422 @@ public:
         return EC;
       }
 
-      if ((*MB)->getBuffer().startswith("sat\n")) {
-        ::remove(OutputPath.c_str());
-        Result = true;
-        ++Sats;
-        std::string ErrStr;
-        if (Models) {
-          *Models = ParseModels((*MB)->getBuffer().slice(4, StringRef::npos),
-                                NumModels, ErrStr);
-        }
-        if (!ErrStr.empty())
-          return std::make_error_code(std::errc::protocol_error);
-        return std::error_code();
-      } else if ((*MB)->getBuffer().startswith("unsat\n")) {
-        ::remove(OutputPath.c_str());
-        Result = false;
-        ++Unsats;
+      std::error_code EC =
+          ParseResponse((*MB)->getBuffer(), Result, NumModels, Models);
+      ::remove(OutputPath.c_str());
+      return EC;
+    }
+    }
+  }
+
+};
+
+const char *const EndMarker = "souper-end-of-response";
+
+// Keeps solver processes alive and talks to them over a socket in
+// interactive SMT-LIB mode. Every query is preceded by (reset) so that no
+// state leaks between queries, and followed by an echo of a marker string
+// so we know where the solver's response ends. Concurrent callers each get
+// their own process; idle processes are kept around for reuse.
+class PersistentSMTLIBSolver : public SMTLIBSolver {
+  std::string Name;
+  bool Keep;
+  std::string Path;
+  bool SupportsModels;
+  std::vector<std::string> Args;
+
+  struct Session {
+    pid_t Pid = -1;
+    int FD = -1;
+  };
+
+  std::vector<Session> Idle;
+  std::mutex Lock;
+
+  bool start(Session &S) {
+    int FDs[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, FDs) == -1)
+      return false;
+
+    std::vector<const char *> ArgPtrs;
+    ArgPtrs.push_back(Path.c_str());
+    std::transform(Args.begin(), Args.end(), std::back_inserter(ArgPtrs),
+                   [](const std::string &Arg) { return Arg.c_str(); });
+    ArgPtrs.push_back(0);
+
+    pid_t Child = fork();
+    if (Child == -1) {
+      ::close(FDs[0]);
+      ::close(FDs[1]);
+      return false;
+    }
+
+    if (Child == 0) {
+      int NullFD = open("/dev/null", O_WRONLY);
+      if (NullFD == -1) _exit(1);
+      if (dup2(FDs[1], STDIN_FILENO) == -1) _exit(1);
+      if (dup2(FDs[1], STDOUT_FILENO) == -1) _exit(1);
+      if (dup2(NullFD, STDERR_FILENO) == -1) _exit(1);
+
+      rlimit rlim;
+      if (getrlimit(RLIMIT_NOFILE, &rlim) == -1) _exit(1);
+      for (unsigned fd = 3; fd != rlim.rlim_cur; ++fd)
+        close(fd);
+
+      execv(Path.c_str(), const_cast<char **>(ArgPtrs.data()));
+      _exit(1);
+    }
+
+    ::close(FDs[1]);
+    S.FD = FDs[0];
+    S.Pid = Child;
+    ++SessionStarts;
+    return true;
+  }
+
+  static void stop(Session &S) {
+    if (S.FD != -1) {
+      ::close(S.FD);
+      S.FD = -1;
+    }
+    if (S.Pid != -1) {
+      ::kill(S.Pid, SIGKILL);
+      ::waitpid(S.Pid, nullptr, 0);
+      S.Pid = -1;
+    }
+  }
+
+  static bool send(Session &S, StringRef Data) {
+    const char *Ptr = Data.data();
+    size_t Left = Data.size();
+    while (Left) {
+      ssize_t N = ::send(S.FD, Ptr, Left, MSG_NOSIGNAL);
+      if (N == -1) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      Ptr += N;
+      Left -= N;
+    }
+    return true;
+  }
+
+  // Read until the end marker shows up. Returns timed_out if the deadline
+  // passes first, or operation_canceled if Cancel becomes true; the caller
+  // then has to throw the process away since it is still busy with the old
+  // query.
+  static std::error_code receive(Session &S, std::string &Response,
+                                 unsigned Timeout,
+                                 const std::atomic<bool> *Cancel) {
+    auto Deadline = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(Timeout);
+    char Buf[4096];
+    while (true) {
+      size_t Pos = Response.find(EndMarker);
+      if (Pos != std::string::npos) {
+        // Drop the line holding the marker; some solvers quote echoed
+        // strings, others don't.
+        size_t LineStart = Response.rfind('\n', Pos);
+        Response.resize(LineStart == std::string::npos ? 0 : LineStart + 1);
         return std::error_code();
+      }
+
+      if (Cancel && *Cancel)
+        return std::make_error_code(std::errc::operation_canceled);
+
+      int PollTimeout = -1;
+      if (Timeout) {
+        auto Left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            Deadline - std::chrono::steady_clock::now()).count();
+        if (Left <= 0)
+          return std::make_error_code(std::errc::timed_out);
+        PollTimeout = Left;
+      }
+      // Wake up now and then to look at Cancel.
+      if (Cancel && (PollTimeout == -1 || PollTimeout > 10))
+        PollTimeout = 10;
+
+      pollfd PFD = {S.FD, POLLIN, 0};
+      int Ready = ::poll(&PFD, 1, PollTimeout);
+      if (Ready == -1) {
+        if (errno == EINTR)
+          continue;
+        return std::error_code(errno, std::generic_category());
+      }
+      if (Ready == 0)
+        continue;
+
+      ssize_t N = ::read(S.FD, Buf, sizeof(Buf));
+      if (N == -1) {
+        if (errno == EINTR)
+          continue;
+        return std::error_code(errno, std::generic_category());
+      }
+      if (N == 0)
+        return std::make_error_code(std::errc::broken_pipe);
+      Response.append(Buf, N);
+    }
+  }
+
+public:
+  PersistentSMTLIBSolver(std::string Name, bool Keep, StringRef Path,
+                         bool SupportsModels,
+                         const std::vector<std::string> &Args)
+      : Name(Name), Keep(Keep), Path(Path), SupportsModels(SupportsModels),
+        Args(Args) {}
+
+  ~PersistentSMTLIBSolver() {
+    for (auto &S : Idle) {
+      send(S, "(exit)\n");
+      stop(S);
+    }
+  }
+
+  std::string getName() const override {
+    return Name;
+  }
+
+  bool supportsModels() const override {
+    return SupportsModels;
+  }
+
+  std::error_code isSatisfiable(StringRef Query, bool &Result,
+                                unsigned NumModels, std::vector<APInt> *Models,
+                                unsigned Timeout,
+                                const std::atomic<bool> *Cancel) override {
+    if (Keep) {
+      int InputFD;
+      SmallString<64> InputPath;
+      if (!sys::fs::createTemporaryFile("input", "smt2", InputFD, InputPath)) {
+        raw_fd_ostream InputFile(InputFD, true, /*unbuffered=*/true);
+        InputFile << Query;
+        llvm::errs() << "Solver input saved to " << InputPath << '\n';
+      }
+    }
+
+    Session S;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      if (!Idle.empty()) {
+        S = Idle.back();
+        Idle.pop_back();
+      }
+    }
+    if (S.Pid == -1 && !start(S)) {
+      ++Errors;
+      return std::make_error_code(std::errc::executable_format_error);
+    }
+
+    // An (exit) at the end of the query would end the session.
+    StringRef Body = Query.rtrim();
+    if (Body.endswith("(exit)"))
+      Body = Body.drop_back(strlen("(exit)"));
+
+    std::string Input = "(reset)\n";
+    Input += Body;
+    Input += "\n(echo \"";
+    Input += EndMarker;
+    Input += "\")\n";
+
+    std::string Response;
+    std::error_code EC;
+    if (!send(S, Input))
+      EC = std::make_error_code(std::errc::broken_pipe);
+    else
+      EC = receive(S, Response, Timeout, Cancel);
+
+    if (EC) {
+      stop(S);
+      if (EC == std::errc::timed_out) {
+        ++Timeouts;
+      } else if (EC == std::errc::operation_canceled) {
+        ++Cancellations;
       } else {
-        ::remove(OutputPath.c_str());
         ++Errors;
-        return std::make_error_code(std::errc::protocol_error);
+        EC = std::make_error_code(std::errc::executable_format_error);
       }
+      return EC;
     }
+
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Idle.push_back(S);
     }
+
+    return ParseResponse(Response, Result, NumModels, Models);
+  }
+
+};
+
+struct PortfolioMember {
+  std::string Name;
+  std::string Path;
+  std::vector<std::string> Args;
+  bool SupportsModels;
+  llvm::Statistic *Wins;
+};
+
+// Runs every query on several solvers at once and takes the first
+// definite answer. The remaining solvers are killed as soon as one of them
+// answers sat or unsat.
+class PortfolioSMTLIBSolver : public SMTLIBSolver {
+  std::vector<PortfolioMember> Members;
+  bool Keep;
+
+  struct Racer {
+    const PortfolioMember *M;
+    sys::ProcessInfo PI;
+    SmallString<64> OutputPath;
+    bool Running;
+  };
+
+  static void killRacer(Racer &R) {
+    if (!R.Running)
+      return;
+    ::kill(R.PI.Pid, SIGKILL);
+    sys::Wait(R.PI, 0, /*WaitUntilTerminates=*/true);
+    R.Running = false;
+  }
+
+public:
+  PortfolioSMTLIBSolver(std::vector<PortfolioMember> Members, bool Keep)
+      : Members(std::move(Members)), Keep(Keep) {}
+
+  std::string getName() const override {
+    std::string Name = "Portfolio(";
+    for (const auto &M : Members) {
+      if (&M != &Members.front())
+        Name += ", ";
+      Name += M.Name;
+    }
+    return Name + ")";
+  }
+
+  bool supportsModels() const override {
+    for (const auto &M : Members)
+      if (M.SupportsModels)
+        return true;
+    return false;
+  }
+
+  std::error_code isSatisfiable(StringRef Query, bool &Result,
+                                unsigned NumModels, std::vector<APInt> *Models,
+                                unsigned Timeout,
+                                const std::atomic<bool> *Cancel) override {
+    int InputFD;
+    SmallString<64> InputPath;
+    if (std::error_code EC =
+            sys::fs::createTemporaryFile("input", "smt2", InputFD, InputPath)) {
+      ++Errors;
+      return EC;
+    }
+
+    raw_fd_ostream InputFile(InputFD, true, /*unbuffered=*/true);
+    InputFile << Query;
+    InputFile.close();
+
+    std::vector<Racer> Racers;
+    for (const auto &M : Members) {
+      // Only solvers that can produce models may answer a query that
+      // asks for them.
+      if (Models && !M.SupportsModels)
+        continue;
+
+      Racer R;
+      R.M = &M;
+      R.Running = false;
+      int OutputFD;
+      if (sys::fs::createTemporaryFile("output", "out", OutputFD,
+                                       R.OutputPath))
+        continue;
+      ::close(OutputFD);
+
+      std::vector<StringRef> ArgPtrs;
+      ArgPtrs.push_back(M.Path);
+      ArgPtrs.insert(ArgPtrs.end(), M.Args.begin(), M.Args.end());
+      Optional<StringRef> Redirects[] = {StringRef(InputPath),
+                                         StringRef(R.OutputPath),
+                                         StringRef("/dev/null")};
+      bool ExecutionFailed = false;
+      R.PI = sys::ExecuteNoWait(M.Path, ArgPtrs, None, Redirects,
+                                /*MemoryLimit=*/0, /*ErrMsg=*/nullptr,
+                                &ExecutionFailed);
+      if (ExecutionFailed) {
+        ::remove(R.OutputPath.c_str());
+        continue;
+      }
+      R.Running = true;
+      Racers.push_back(R);
+    }
+
+    if (Keep) {
+      llvm::errs() << "Solver input saved to " << InputPath << '\n';
+    } else {
+      ::remove(InputPath.c_str());
+    }
+
+    auto Deadline = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(Timeout);
+    // Start polling quickly since most queries are trivial, then back off.
+    unsigned SleepUs = 50;
+    unsigned NumRunning = Racers.size();
+    std::error_code EC = std::make_error_code(std::errc::protocol_error);
+    bool Answered = false;
+
+    while (NumRunning && !Answered) {
+      for (auto &R : Racers) {
+        if (!R.Running)
+          continue;
+        sys::ProcessInfo Done = sys::Wait(R.PI, 0,
+                                          /*WaitUntilTerminates=*/false);
+        if (Done.Pid != R.PI.Pid)
+          continue;
+        R.Running = false;
+        --NumRunning;
+
+        llvm::ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
+            MemoryBuffer::getFile(R.OutputPath.str());
+        if (!MB)
+          continue;
+        StringRef Out = (*MB)->getBuffer();
+        if (!Out.startswith("sat\n") && !Out.startswith("unsat\n"))
+          continue;
+
+        EC = ParseResponse(Out, Result, NumModels, Models);
+        ++*R.M->Wins;
+        Answered = true;
+        break;
+      }
+      if (Answered || !NumRunning)
+        break;
+
+      if (Timeout && std::chrono::steady_clock::now() >= Deadline) {
+        EC = std::make_error_code(std::errc::timed_out);
+        break;
+      }
+      if (Cancel && *Cancel) {
+        EC = std::make_error_code(std::errc::operation_canceled);
+        break;
+      }
+      ::usleep(SleepUs);
+      SleepUs = std::min(SleepUs * 2, 5000u);
+    }
+
+    for (auto &R : Racers) {
+      killRacer(R);
+      ::remove(R.OutputPath.c_str());
+    }
+
+    if (!Answered) {
+      if (EC == std::errc::timed_out)
+        ++Timeouts;
+      else if (EC == std::errc::operation_canceled)
+        ++Cancellations;
+      else
+        ++Errors;
+    }
+    return EC;
   }
 
 };
@@ -315,12 +773,22 @@ SolverProgram souper::makeExternalSolverProgram(StringRef Path) {
   std::string PathStr = Path;
   return [PathStr](const std::vector<std::string> &Args, StringRef RedirectIn,
                    StringRef RedirectOut, StringRef RedirectErr,
-                   unsigned Timeout) {
+                   unsigned Timeout, const std::atomic<bool> *Cancel) {
     std::vector<StringRef> ArgPtrs;
     ArgPtrs.push_back(PathStr);
     ArgPtrs.insert(ArgPtrs.end(), Args.begin(), Args.end());
     Optional<StringRef> Redirects[] = {RedirectIn, RedirectOut, RedirectErr};
-    return sys::ExecuteAndWait(PathStr, ArgPtrs, None, Redirects, Timeout);
+    if (!Cancel)
+      return sys::ExecuteAndWait(PathStr, ArgPtrs, None, Redirects, Timeout);
+
+    bool ExecutionFailed = false;
+    sys::ProcessInfo PI = sys::ExecuteNoWait(PathStr, ArgPtrs, None, Redirects,
+                                             /*MemoryLimit=*/0,
+                                             /*ErrMsg=*/nullptr,
+                                             &ExecutionFailed);
+    if (ExecutionFailed)
+      return -1;
+    return waitCancellable(PI, Timeout, *Cancel);
   };
 }
 
@@ -328,7 +796,7 @@ SolverProgram souper::makeInternalSolverProgram(int MainPtr(int argc,
                                                             char **argv)) {
   return [MainPtr](const std::vector<std::string> &Args, StringRef RedirectIn,
                    StringRef RedirectOut, StringRef RedirectErr,
-                   unsigned Timeout) {
+                   unsigned Timeout, const std::atomic<bool> *Cancel) {
     int pid = fork();
     if (pid == 0) {
       int InFD = open(RedirectIn.str().c_str(), O_RDONLY);
@@ -365,6 +833,8 @@ SolverProgram souper::makeInternalSolverProgram(int MainPtr(int argc,
     } else {
       sys::ProcessInfo PI;
       PI.Pid = pid;
+      if (Cancel)
+        return waitCancellable(PI, Timeout, *Cancel);
       PI = sys::Wait(PI, Timeout, /*WaitUntilTerminates=*/Timeout == 0);
       return PI.ReturnCode;
     }
@@ -394,3 +864,51 @@ std::unique_ptr<SMTLIBSolver> souper::createZ3Solver(SolverProgram Prog,
   return std::unique_ptr<SMTLIBSolver>(
       new ProcessSMTLIBSolver("Z3", Keep, Prog, true, {"-smt2", "-in"}));
 }
+
+std::unique_ptr<SMTLIBSolver>
+souper::createPersistentBoolectorSolver(StringRef Path, bool Keep) {
+  return std::unique_ptr<SMTLIBSolver>(
+      new PersistentSMTLIBSolver("Boolector", Keep, Path, false,
+                                 {"--smt2", "--incremental"}));
+}
+
+std::unique_ptr<SMTLIBSolver>
+souper::createPersistentCVC4Solver(StringRef Path, bool Keep) {
+  return std::unique_ptr<SMTLIBSolver>(
+      new PersistentSMTLIBSolver("CVC4", Keep, Path, true,
+                                 {"--lang=smt", "--incremental"}));
+}
+
+std::unique_ptr<SMTLIBSolver>
+souper::createPersistentSTPSolver(StringRef Path, bool Keep) {
+  return std::unique_ptr<SMTLIBSolver>(
+      new PersistentSMTLIBSolver("STP", Keep, Path, false, {"--SMTLIB2"}));
+}
+
+std::unique_ptr<SMTLIBSolver>
+souper::createPersistentZ3Solver(StringRef Path, bool Keep) {
+  return std::unique_ptr<SMTLIBSolver>(
+      new PersistentSMTLIBSolver("Z3", Keep, Path, true, {"-smt2", "-in"}));
+}
+
+std::unique_ptr<SMTLIBSolver>
+souper::createPortfolioSolver(StringRef BoolectorPath, StringRef CVC4Path,
+                              StringRef STPPath, StringRef Z3Path, bool Keep) {
+  std::vector<PortfolioMember> Members;
+  if (!BoolectorPath.empty())
+    Members.push_back({"Boolector", BoolectorPath.str(), {"--smt2"}, false,
+                       &PortfolioBoolectorWins});
+  if (!CVC4Path.empty())
+    Members.push_back({"CVC4", CVC4Path.str(), {"--lang=smt"}, true,
+                       &PortfolioCVC4Wins});
+  if (!STPPath.empty())
+    Members.push_back({"STP", STPPath.str(), {"--SMTLIB2"}, false,
+                       &PortfolioSTPWins});
+  if (!Z3Path.empty())
+    Members.push_back({"Z3", Z3Path.str(), {"-smt2", "-in"}, true,
+                       &PortfolioZ3Wins});
+  if (Members.empty())
+    return nullptr;
+  return std::unique_ptr<SMTLIBSolver>(
+      new PortfolioSMTLIBSolver(std::move(Members), Keep));
+}
@@ -0,0 +1,331 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define DEBUG_TYPE "souper"
+
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "souper/SMTLIB2/Solver.h"
+#include "z3.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+using namespace souper;
+
+STATISTIC(Z3Cancellations, "Number of in-process Z3 queries cancelled");
+STATISTIC(Z3Errors, "Number of in-process Z3 errors");
+STATISTIC(Z3Sats, "Number of satisfiable in-process Z3 queries");
+STATISTIC(Z3Timeouts, "Number of in-process Z3 timeouts");
+STATISTIC(Z3Unsats, "Number of unsatisfiable in-process Z3 queries");
+
+namespace {
+
+// Split an SMT-LIB script into its top-level commands. Comments, string
+// literals and quoted symbols are skipped over so that parentheses inside
+// them are not counted.
+std::vector<StringRef> splitCommands(StringRef Script) {
+  std::vector<StringRef> Commands;
+  unsigned Level = 0;
+  size_t Start = 0;
+  for (size_t I = 0, E = Script.size(); I != E; ++I) {
+    char C = Script[I];
+    if (C == ';') {
+      while (I != E && Script[I] != '\n')
+        ++I;
+      if (I == E)
+        break;
+    } else if (C == '"' || C == '|') {
+      ++I;
+      while (I != E && Script[I] != C)
+        ++I;
+      if (I == E)
+        break;
+    } else if (C == '(') {
+      if (Level++ == 0)
+        Start = I;
+    } else if (C == ')' && Level) {
+      if (--Level == 0)
+        Commands.push_back(Script.slice(Start, I + 1));
+    }
+  }
+  return Commands;
+}
+
+// Given "(get-value (t1 t2 ...))", return the terms t1, t2, ...
+std::vector<StringRef> getValueTerms(StringRef Command) {
+  StringRef Body = Command.drop_front(1).drop_back(1).ltrim();
+  Body = Body.drop_front(strlen("get-value")).trim();
+  if (Body.startswith("(") && Body.endswith(")"))
+    Body = Body.drop_front(1).drop_back(1);
+
+  std::vector<StringRef> Terms = splitCommands(Body);
+  // A bare symbol isn't an s-expression; pick those up too.
+  if (Terms.empty() && !Body.trim().empty())
+    Terms.push_back(Body.trim());
+  return Terms;
+}
+
+// Runs queries on Z3 contexts that live as long as the solver. The SMT-LIB
+// text produced by the query builders is handed to Z3's own parser and
+// models are read back through the API, so neither a process nor a textual
+// response is involved. A context can only be used by one thread at a time,
+// so concurrent callers each get their own; idle contexts are kept around
+// for reuse.
+class Z3InProcessSolver : public SMTLIBSolver {
+  bool Keep;
+  std::vector<Z3_context> Idle;
+  std::mutex Lock;
+
+  static void ignoreErrors(Z3_context, Z3_error_code) {}
+
+  static bool failed(Z3_context Ctx) {
+    return Z3_get_error_code(Ctx) != Z3_OK;
+  }
+
+  Z3_context acquire() {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      if (!Idle.empty()) {
+        Z3_context Ctx = Idle.back();
+        Idle.pop_back();
+        return Ctx;
+      }
+    }
+    Z3_config Cfg = Z3_mk_config();
+    Z3_set_param_value(Cfg, "model", "true");
+    Z3_context Ctx = Z3_mk_context_rc(Cfg);
+    Z3_del_config(Cfg);
+    Z3_set_error_handler(Ctx, ignoreErrors);
+    return Ctx;
+  }
+
+  void release(Z3_context Ctx) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Idle.push_back(Ctx);
+  }
+
+  // Solves Script, whose last NumTerms assertions stand for the terms we
+  // want values for. Interrupted is set if Z3_interrupt was called on Ctx.
+  static std::error_code check(Z3_context Ctx, const std::string &Script,
+                               unsigned NumTerms, bool &Result,
+                               unsigned NumModels, std::vector<APInt> *Models,
+                               unsigned Timeout,
+                               const std::atomic<bool> *Cancel,
+                               bool &Interrupted) {
+    Z3_ast_vector Asserts = Z3_parse_smtlib2_string(Ctx, Script.c_str(),
+                                                    0, 0, 0, 0, 0, 0);
+    if (failed(Ctx) || !Asserts) {
+      ++Z3Errors;
+      return std::make_error_code(std::errc::protocol_error);
+    }
+    Z3_ast_vector_inc_ref(Ctx, Asserts);
+
+    unsigned NumAsserts = Z3_ast_vector_size(Ctx, Asserts);
+    if (NumAsserts < NumTerms) {
+      Z3_ast_vector_dec_ref(Ctx, Asserts);
+      ++Z3Errors;
+      return std::make_error_code(std::errc::protocol_error);
+    }
+
+    Z3_solver S = Z3_mk_solver(Ctx);
+    Z3_solver_inc_ref(Ctx, S);
+    if (Timeout) {
+      Z3_params P = Z3_mk_params(Ctx);
+      Z3_params_inc_ref(Ctx, P);
+      Z3_params_set_uint(Ctx, P, Z3_mk_string_symbol(Ctx, "timeout"),
+                         Timeout * 1000);
+      Z3_solver_set_params(Ctx, S, P);
+      Z3_params_dec_ref(Ctx, P);
+    }
+    for (unsigned I = 0; I != NumAsserts - NumTerms; ++I)
+      Z3_solver_assert(Ctx, S, Z3_ast_vector_get(Ctx, Asserts, I));
+
+    // Z3 can only be interrupted from another thread, so watch Cancel from
+    // one while the check runs. An interrupt that arrives before the check
+    // has started is dropped, so keep sending them until the check returns.
+    std::mutex WatchLock;
+    std::condition_variable Checked;
+    bool Done = false;
+    std::thread Watcher;
+    if (Cancel)
+      Watcher = std::thread([&]() {
+        std::unique_lock<std::mutex> WatchGuard(WatchLock);
+        while (!Done) {
+          if (*Cancel) {
+            Z3_interrupt(Ctx);
+            Interrupted = true;
+          }
+          Checked.wait_for(WatchGuard, std::chrono::milliseconds(1));
+        }
+      });
+    Z3_lbool Status = Z3_solver_check(Ctx, S);
+    if (Cancel) {
+      {
+        std::lock_guard<std::mutex> WatchGuard(WatchLock);
+        Done = true;
+      }
+      Checked.notify_one();
+      Watcher.join();
+    }
+
+    std::error_code EC;
+    switch (Status) {
+    case Z3_L_TRUE: {
+      Result = true;
+      ++Z3Sats;
+      if (!Models)
+        break;
+      if (NumTerms != NumModels) {
+        EC = std::make_error_code(std::errc::protocol_error);
+        break;
+      }
+      Models->clear();
+      Z3_model M = Z3_solver_get_model(Ctx, S);
+      Z3_model_inc_ref(Ctx, M);
+      for (unsigned I = NumAsserts - NumTerms; I != NumAsserts; ++I) {
+        Z3_ast Eq = Z3_ast_vector_get(Ctx, Asserts, I);
+        Z3_ast Term = Z3_get_app_arg(Ctx, Z3_to_app(Ctx, Eq), 0);
+        Z3_ast Val;
+        if (!Z3_model_eval(Ctx, M, Term, /*model_completion=*/true, &Val)) {
+          EC = std::make_error_code(std::errc::protocol_error);
+          break;
+        }
+        Z3_inc_ref(Ctx, Val);
+        if (Z3_get_sort_kind(Ctx, Z3_get_sort(Ctx, Val)) != Z3_BV_SORT) {
+          Z3_dec_ref(Ctx, Val);
+          EC = std::make_error_code(std::errc::protocol_error);
+          break;
+        }
+        unsigned Width = Z3_get_bv_sort_size(Ctx, Z3_get_sort(Ctx, Val));
+        Models->push_back(APInt(Width, Z3_get_numeral_string(Ctx, Val), 10));
+        Z3_dec_ref(Ctx, Val);
+      }
+      Z3_model_dec_ref(Ctx, M);
+      break;
+    }
+    case Z3_L_FALSE:
+      Result = false;
+      ++Z3Unsats;
+      break;
+    case Z3_L_UNDEF: {
+      StringRef Reason = Z3_solver_get_reason_unknown(Ctx, S);
+      if (Interrupted) {
+        ++Z3Cancellations;
+        EC = std::make_error_code(std::errc::operation_canceled);
+      } else if (Reason.contains("timeout") || Reason.contains("canceled")) {
+        ++Z3Timeouts;
+        EC = std::make_error_code(std::errc::timed_out);
+      } else {
+        ++Z3Errors;
+        EC = std::make_error_code(std::errc::protocol_error);
+      }
+      break;
+    }
+    }
+
+    Z3_solver_dec_ref(Ctx, S);
+    Z3_ast_vector_dec_ref(Ctx, Asserts);
+    return EC;
+  }
+
+public:
+  Z3InProcessSolver(bool Keep) : Keep(Keep) {}
+
+  ~Z3InProcessSolver() {
+    for (Z3_context Ctx : Idle)
+      Z3_del_context(Ctx);
+  }
+
+  std::string getName() const override {
+    return "Z3 (in-process)";
+  }
+
+  bool supportsModels() const override {
+    return true;
+  }
+
+  std::error_code isSatisfiable(StringRef Query, bool &Result,
+                                unsigned NumModels, std::vector<APInt> *Models,
+                                unsigned Timeout,
+                                const std::atomic<bool> *Cancel) override {
+    if (Cancel && *Cancel) {
+      ++Z3Cancellations;
+      return std::make_error_code(std::errc::operation_canceled);
+    }
+
+    if (Keep) {
+      int InputFD;
+      SmallString<64> InputPath;
+      if (!sys::fs::createTemporaryFile("input", "smt2", InputFD, InputPath)) {
+        raw_fd_ostream InputFile(InputFD, true, /*unbuffered=*/true);
+        InputFile << Query;
+        llvm::errs() << "Solver input saved to " << InputPath << '\n';
+      }
+    }
+
+    // Z3's parser only collects assertions, so drop the commands it cannot
+    // handle and turn every term we want a value for into one extra trailing
+    // assertion that we can pick apart after solving.
+    std::string Script;
+    unsigned NumTerms = 0;
+    for (StringRef Cmd : splitCommands(Query)) {
+      StringRef Name = Cmd.drop_front(1).ltrim();
+      if (Name.startswith("check-sat") || Name.startswith("exit") ||
+          Name.startswith("set-option") || Name.startswith("set-logic") ||
+          Name.startswith("get-model") || Name.startswith("get-value"))
+        continue;
+      Script += Cmd;
+      Script += '\n';
+    }
+    std::string Terms;
+    for (StringRef Cmd : splitCommands(Query)) {
+      if (!Cmd.drop_front(1).ltrim().startswith("get-value"))
+        continue;
+      for (StringRef T : getValueTerms(Cmd)) {
+        Terms += "(assert (= " + T.str() + " " + T.str() + "))\n";
+        ++NumTerms;
+      }
+    }
+    Script += Terms;
+
+    Z3_context Ctx = acquire();
+    bool Interrupted = false;
+    std::error_code EC = check(Ctx, Script, NumTerms, Result, NumModels,
+                               Models, Timeout, Cancel, Interrupted);
+    // Depending on the Z3 version, an interrupt that missed the check can
+    // stay pending on the context and cut the next query short.
+    if (Interrupted)
+      Z3_del_context(Ctx);
+    else
+      release(Ctx);
+    return EC;
+  }
+};
+
+}
+
+std::unique_ptr<SMTLIBSolver> souper::createZ3InProcessSolver(bool Keep) {
+  return std::unique_ptr<SMTLIBSolver>(new Z3InProcessSolver(Keep));
+}
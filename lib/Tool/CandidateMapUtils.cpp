@@ -67,21 +67,35 @@ bool SolveCandidateMap(llvm::raw_ostream &OS, CandidateMap &M,
       }
     }
 
-    for (int I=0; I < M.size(); ++I) {
-      if (Profile[I] == 0)
-        continue;
-      auto &Cand = M[I];
-
-      if (KVForStaticProfile) {
+    if (KVForStaticProfile) {
+      std::vector<std::string> Keys, Fields;
+      for (int I=0; I < M.size(); ++I) {
+        if (Profile[I] == 0)
+          continue;
+        auto &Cand = M[I];
         std::string Str;
         llvm::raw_string_ostream Loc(Str);
-        Instruction *I = Cand.Origin;
-        I->getDebugLoc().print(Loc);
-        std::string HField = "sprofile " + Loc.str();
+        Cand.Origin->getDebugLoc().print(Loc);
+        Fields.push_back("sprofile " + Loc.str());
         ReplacementContext Context;
-        KVForStaticProfile->hIncrBy(GetReplacementLHSString(Cand.BPCs,
-            Cand.PCs, Cand.Mapping.LHS, Context), HField, 1);
+        Keys.push_back(GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                               Cand.Mapping.LHS, Context));
       }
+      KVForStaticProfile->hIncrByMany(Keys, Fields, 1);
+    }
+
+    // Only the first candidate with each LHS is inferred, so the others
+    // needn't be looked up
+    std::vector<CandidateReplacement> ToInfer;
+    for (int I=0; I < M.size(); ++I)
+      if (Profile[I] != 0)
+        ToInfer.push_back(M[I]);
+    S->prefetch(ToInfer);
+
+    for (int I=0; I < M.size(); ++I) {
+      if (Profile[I] == 0)
+        continue;
+      auto &Cand = M[I];
 
       Inst *RHS = 0;
       if (std::error_code EC =
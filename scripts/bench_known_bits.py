@@ -0,0 +1,46 @@
+#!/usr/bin/python
+
+# Compares the per-bit known bits loop with counterexample-guided
+# refinement on the known bits tests. Run it from a build directory inside
+# the source tree; any arguments are passed on to souper-check to pick a
+# solver.
+
+import glob
+import json
+import os
+import re
+import subprocess
+import sys
+import time
+
+files = [f for f in sorted(glob.glob('../test/Infer/*.opt'))
+         if '-infer-known-bits' in open(f).read()]
+modes = [('per-bit', '-souper-known-bits-per-bit'), ('refine', '')]
+solver = ' '.join(sys.argv[1:]) or '-z3-path="../third_party/z3-install/bin/z3"'
+
+output_lines = []
+totals = dict((name, [0, 0.0]) for name, _ in modes)
+for f in files:
+    results = dict()
+    for name, flag in modes:
+        cmd = "./souper-check %s -solver-timeout=60 -infer-known-bits -stats %s %s" % (solver, flag, f)
+        time_start = time.time()
+        output = subprocess.check_output(cmd, stderr=subprocess.STDOUT, shell=True).decode("utf-8")
+        time_end = time.time()
+        queries = re.search(r'(\d+) souper\s+- Number of solver queries made to infer known bits', output)
+        queries = int(queries.group(1)) if queries else 0
+        known = re.findall('knownBits from souper: .*', output)
+        results[name] = (queries, round(time_end - time_start, 2), known)
+        totals[name][0] += queries
+        totals[name][1] += time_end - time_start
+    same = results['per-bit'][2] == results['refine'][2]
+    output_lines.append('%s: per-bit %d queries (%f s), refine %d queries (%f s)%s' %
+                        (os.path.basename(f), results['per-bit'][0], results['per-bit'][1],
+                         results['refine'][0], results['refine'][1],
+                         '' if same else ' [RESULTS DIFFER]'))
+for name, _ in modes:
+    output_lines.append('total %s: %d queries (%f s)' % (name, totals[name][0], round(totals[name][1], 2)))
+
+data = dict()
+data['body'] = '\n'.join(output_lines)
+print(json.dumps(data))
@@ -0,0 +1,3 @@
+#!/bin/sh
+# Never answers; the portfolio has to kill it once another solver wins.
+exec sleep 60
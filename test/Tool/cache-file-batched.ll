@@ -0,0 +1,37 @@
+; REQUIRES: solver
+
+; The static profile and the cache lookups of the candidates each go to the
+; cache file in one batch. %b has the same LHS as %a, so it is neither
+; looked up nor counted on its own.
+
+; RUN: %llvm-as -o %t.bc %s
+; RUN: rm -f %t.kv
+; RUN: %souper %solver -souper-external-cache -souper-cache-file=%t.kv -souper-static-profile -stats %t.bc > %t1 2> %t2
+; RUN: %FileCheck %s < %t1
+; RUN: %FileCheck -check-prefix=MISS %s < %t2
+; RUN: %souper %solver -souper-external-cache -souper-cache-file=%t.kv -souper-static-profile -stats %t.bc > %t1 2> %t2
+; RUN: %FileCheck %s < %t1
+; RUN: %FileCheck -check-prefix=HIT %s < %t2
+; RUN: %souper-kv -souper-cache-file=%t.kv dump | tr '\000' '\n' | %FileCheck -check-prefix=PROFILE %s
+
+; CHECK: ; Static profile 2
+; CHECK: result 0:i32
+
+; MISS-NOT: Number of external cache hits
+; MISS: [[N:[0-9]+]] souper - Number of external cache misses
+; MISS: [[N]] souper - Number of external cache lookups answered by a prefetch
+
+; HIT: [[N:[0-9]+]] souper - Number of external cache hits
+; HIT-NOT: Number of external cache misses
+; HIT: [[N]] souper - Number of external cache lookups answered by a prefetch
+
+; PROFILE: sprofile
+; PROFILE-NEXT: {{^}}2{{$}}
+
+define i32 @foo(i32 %x, i32 %y) {
+entry:
+  %a = mul i32 %x, 0
+  %b = mul i32 %y, 0
+  %c = or i32 %a, %b
+  ret i32 %c
+}
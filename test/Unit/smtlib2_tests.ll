@@ -0,0 +1 @@
+; RUN: %builddir/smtlib2_tests
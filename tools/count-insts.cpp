@@ -23,6 +23,7 @@
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include <iostream>
+#include <mutex>
 #include <unistd.h>
 
 using namespace souper;
@@ -40,6 +41,10 @@ static cl::opt<bool> StopAtExtUse("stop-at-ext-use",
                               cl::desc("Stop DAG traversing if instruction has external uses"),
                               cl::init(false));
 
+static cl::opt<unsigned> Jobs("jobs",
+                              cl::desc("Number of threads to parse the input with (default=1)"),
+                              cl::init(1));
+
 void countHelper(Inst *I, std::set<Inst *> &Visited,
                  std::map<int, int> &Result, Inst *OrigI) {
   if (!Visited.insert(I).second)
@@ -48,7 +53,7 @@ void countHelper(Inst *I, std::set<Inst *> &Visited,
   ++Result[I->K];
 
   for (auto Op : I->Ops)
-    if (!(StopAtExtUse && OrigI->DepsWithExternalUses.find(Op) != OrigI->DepsWithExternalUses.end()))
+    if (!(StopAtExtUse && OrigI->Meta->DepsWithExternalUses.find(Op) != OrigI->Meta->DepsWithExternalUses.end()))
       countHelper(Op, Visited, Result, OrigI);
 }
 
@@ -63,23 +68,33 @@ int main(int argc, char **argv) {
   auto MB = MemoryBuffer::getFileOrSTDIN(InputFilename);
 
   if (MB) {
-    InstContext IC;
     std::string ErrStr;
-    std::vector<ParsedReplacement> Reps;
-    std::vector<ReplacementContext> Contexts;
-    Reps = ParseReplacements(IC, MB.get()->getBufferIdentifier(),
-                             MB.get()->getBuffer(), ErrStr);
-    if (!ErrStr.empty()) {
-      llvm::errs() << ErrStr << '\n';
-      return 1;
-    }
-
     std::map<int, int> LHSResult;
     std::map<int, int> RHSResult;
-
-    for (const auto &R : Reps) {
-      instCount(R.Mapping.LHS, LHSResult);
-      instCount(R.Mapping.RHS, RHSResult);
+    std::mutex ResultMutex;
+
+    // Each replacement is counted on the thread that parsed it and merged
+    // into the totals, so that the parsed replacements are never all in
+    // memory at once
+    bool Parsed = ParseReplacementsParallel(
+        MB.get()->getBufferIdentifier(), MB.get()->getBuffer(),
+        /*LHSOnly=*/false, Jobs,
+        [&](size_t, ParsedReplacement &R, ReplacementContext &,
+            InstContext &) {
+          std::map<int, int> LHSCount, RHSCount;
+          instCount(R.Mapping.LHS, LHSCount);
+          if (R.Mapping.RHS)
+            instCount(R.Mapping.RHS, RHSCount);
+          std::lock_guard<std::mutex> Lock(ResultMutex);
+          for (auto &C : LHSCount)
+            LHSResult[C.first] += C.second;
+          for (auto &C : RHSCount)
+            RHSResult[C.first] += C.second;
+        },
+        ErrStr);
+    if (!Parsed) {
+      llvm::errs() << ErrStr << '\n';
+      return 1;
     }
 
     if (!DumpDiff) {
@@ -0,0 +1,120 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// This file contains a microbenchmark for the DAG walks that dominate
+// synthesis and query building. It builds random DAGs in a single
+// InstContext and reports the time per visited node of cost(), findVars()
+// and getInstCopy().
+
+#include "souper/Inst/Inst.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <random>
+
+using namespace souper;
+using namespace llvm;
+
+static cl::opt<unsigned> NumDAGs("dags",
+                                 cl::desc("Number of DAGs to build"),
+                                 cl::init(200));
+
+static cl::opt<unsigned> DAGSize("size",
+                                 cl::desc("Instructions per DAG"),
+                                 cl::init(500));
+
+static cl::opt<unsigned> Repeat("repeat",
+                                cl::desc("Times each walk is repeated"),
+                                cl::init(20));
+
+static cl::opt<unsigned> Seed("seed", cl::desc("Random seed"), cl::init(1));
+
+static Inst *buildDAG(InstContext &IC, std::mt19937 &R) {
+  static const Inst::Kind Kinds[] = {Inst::Add, Inst::Sub, Inst::Mul,
+                                     Inst::And, Inst::Or,  Inst::Xor,
+                                     Inst::Shl, Inst::LShr, Inst::Select};
+  std::vector<Inst *> Nodes;
+  for (unsigned I = 0; I != 8; ++I)
+    Nodes.push_back(IC.createVar(32, "x" + std::to_string(I)));
+  Inst *Cond = IC.createVar(1, "c");
+
+  for (unsigned I = 0; I != DAGSize; ++I) {
+    Inst::Kind K = Kinds[R() % (sizeof(Kinds) / sizeof(Kinds[0]))];
+    // Prefer recent nodes so that the DAG gets deep rather than wide
+    auto Pick = [&]() {
+      unsigned N = Nodes.size();
+      return Nodes[N - 1 - R() % std::min(N, 16u)];
+    };
+    if (K == Inst::Select)
+      Nodes.push_back(IC.getInst(K, 32, {Cond, Pick(), Pick()}));
+    else if (R() % 8 == 0)
+      Nodes.push_back(IC.getInst(K, 32, {Pick(),
+                                         IC.getConst(APInt(32, R() % 64))}));
+    else
+      Nodes.push_back(IC.getInst(K, 32, {Pick(), Pick()}));
+  }
+  return Nodes.back();
+}
+
+template <typename F> static double timeNsPerNode(unsigned Nodes, F Walk) {
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned I = 0; I != Repeat; ++I)
+    Walk();
+  auto End = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(End - Start).count() /
+         (double(Nodes) * Repeat);
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv);
+
+  InstContext IC;
+  std::mt19937 R(Seed);
+  std::vector<Inst *> Roots;
+  unsigned Nodes = 0;
+  for (unsigned I = 0; I != NumDAGs; ++I) {
+    Roots.push_back(buildDAG(IC, R));
+    Nodes += instCount(Roots.back());
+  }
+
+  volatile long Sink = 0;
+  double Cost = timeNsPerNode(Nodes, [&]() {
+    for (auto Root : Roots)
+      Sink += cost(Root);
+  });
+  double Vars = timeNsPerNode(Nodes, [&]() {
+    for (auto Root : Roots) {
+      std::vector<Inst *> V;
+      findVars(Root, V);
+      Sink += V.size();
+    }
+  });
+  double Copy = timeNsPerNode(Nodes, [&]() {
+    for (auto Root : Roots) {
+      std::map<Inst *, Inst *> InstCache;
+      std::map<Block *, Block *> BlockCache;
+      Sink += getInstCopy(Root, IC, InstCache, BlockCache, nullptr,
+                          /*CloneVars=*/false)->Width;
+    }
+  });
+
+  outs() << "sizeof(Inst) = " << sizeof(Inst)
+         << ", sizeof(InstMetadata) = " << sizeof(InstMetadata) << '\n'
+         << Nodes << " nodes in " << NumDAGs << " DAGs\n"
+         << "cost:        " << format("%.1f", Cost) << " ns/node\n"
+         << "findVars:    " << format("%.1f", Vars) << " ns/node\n"
+         << "getInstCopy: " << format("%.1f", Copy) << " ns/node\n";
+  return 0;
+}
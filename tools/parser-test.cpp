@@ -21,18 +21,25 @@ using namespace souper;
 using namespace llvm;
 
 int main(int argc, char **argv) {
-  int Arg = 1, LHSOnly = 0;
+  int Arg = 1, LHSOnly = 0, Binary = 0;
   if (Arg < argc && strcmp(argv[Arg], "-LHS") == 0) {
     LHSOnly = 1;
     ++Arg;
   }
+  if (Arg < argc && strcmp(argv[Arg], "-binary") == 0) {
+    Binary = 1;
+    ++Arg;
+  }
   auto MB = MemoryBuffer::getFileOrSTDIN(argc >= (Arg+1) ? argv[Arg] : "-");
   if (MB) {
     InstContext IC;
     std::string ErrStr;
     std::vector<ParsedReplacement> Reps;
     std::vector<ReplacementContext> Contexts;
-    if (LHSOnly)
+    if (isBinaryReplacements(MB.get()->getBuffer()))
+      Reps = ReadReplacementsBinary(IC, MB.get()->getBufferIdentifier(),
+                                    MB.get()->getBuffer(), Contexts, ErrStr);
+    else if (LHSOnly)
       Reps = ParseReplacementLHSs(IC, MB.get()->getBufferIdentifier(),
                                   MB.get()->getBuffer(), Contexts, ErrStr);
     else
@@ -43,6 +50,11 @@ int main(int argc, char **argv) {
       return 1;
     }
 
+    if (Binary) {
+      WriteReplacementsBinary(llvm::outs(), Reps);
+      return 0;
+    }
+
     for (const auto &R : Reps) {
       if (LHSOnly) {
         ReplacementContext Context;
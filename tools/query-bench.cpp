@@ -0,0 +1,99 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// This file contains a benchmark for the SMT-LIB expression builders. It
+// builds the validity query of every replacement in its input with each
+// builder and reports the time taken and the size of the queries.
+
+#include "souper/Extractor/ExprBuilder.h"
+#include "souper/Parser/Parser.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+
+using namespace souper;
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input replacements>"),
+                                          cl::init("-"));
+
+static cl::opt<unsigned> Repeat("repeat",
+                                cl::desc("Times each query is built"),
+                                cl::init(10));
+
+static cl::opt<bool> Fresh("fresh",
+    cl::desc("Use a new builder for every query, as BuildQuery() does, "
+             "instead of one per replacement (default=true)"),
+    cl::init(true));
+
+typedef std::unique_ptr<ExprBuilder> (*BuilderFactory)(InstContext &);
+
+static void bench(StringRef Name, BuilderFactory Create, InstContext &IC,
+                  const std::vector<ParsedReplacement> &Reps) {
+  size_t Bytes = 0, Failed = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (const auto &R : Reps) {
+    std::unique_ptr<ExprBuilder> EB = Create(IC);
+    for (unsigned I = 0; I != Repeat; ++I) {
+      if (Fresh && I)
+        EB = Create(IC);
+      std::vector<Inst *> ModelVars;
+      std::string Query = EB->BuildQuery(R.BPCs, R.PCs, R.Mapping, &ModelVars,
+                                         /*Precondition=*/0);
+      if (Query.empty())
+        ++Failed;
+      if (I == 0)
+        Bytes += Query.size();
+    }
+  }
+  auto End = std::chrono::steady_clock::now();
+  double Us = std::chrono::duration<double, std::micro>(End - Start).count() /
+              (double(Reps.size()) * Repeat);
+  outs() << format("%-8s", Name.str().c_str())
+         << format("%10.1f us/query %10.1f bytes/query", Us,
+                   double(Bytes) / Reps.size());
+  if (Failed)
+    outs() << " (" << Failed / Repeat << " not built)";
+  outs() << '\n';
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv);
+
+  auto MB = MemoryBuffer::getFileOrSTDIN(InputFilename);
+  if (!MB) {
+    errs() << MB.getError().message() << '\n';
+    return 1;
+  }
+
+  InstContext IC;
+  std::string ErrStr;
+  std::vector<ParsedReplacement> Reps =
+    ParseReplacements(IC, MB.get()->getBufferIdentifier(),
+                      MB.get()->getBuffer(), ErrStr);
+  if (!ErrStr.empty()) {
+    errs() << ErrStr << '\n';
+    return 1;
+  }
+  if (Reps.empty())
+    return 0;
+
+  outs() << Reps.size() << " replacements\n";
+  bench("klee", createKLEEBuilder, IC, Reps);
+  bench("smtlib", createSMTLIBBuilder, IC, Reps);
+  return 0;
+}
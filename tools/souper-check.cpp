@@ -28,6 +28,24 @@ static cl::opt<std::string>
 InputFilename(cl::Positional, cl::desc("<input souper optimization>"),
               cl::init("-"));
 
+enum InputFormatKind { AutoInput, TextInput, BinaryInput };
+
+static cl::opt<InputFormatKind> InputFormat("input-format",
+    cl::desc("Format of the input (default=auto)"),
+    cl::values(clEnumValN(AutoInput, "auto",
+                          "Binary if it starts with the binary header"),
+               clEnumValN(TextInput, "text", "Souper IR"),
+               clEnumValN(BinaryInput, "binary",
+                          "Binary replacements, as parser-test -binary "
+                          "writes them")),
+    cl::init(AutoInput));
+
+static cl::opt<bool> StreamInput("stream",
+    cl::desc("Parse each replacement when it is reached and free it once "
+             "it has been checked, so that large inputs are checked in "
+             "flat memory (default=false)"),
+    cl::init(false));
+
 static cl::opt<bool> PrintCounterExample("print-counterexample",
     cl::desc("Print counterexample (default=true)"),
     cl::init(true));
@@ -114,7 +132,21 @@ int SolveInst(const MemoryBufferRef &MB, Solver *S) {
 
   std::vector<ParsedReplacement> Reps;
   std::vector<ReplacementContext> Contexts;
-  if (InferRHS || ParseLHSOnly || isInferDFA()) {
+  bool LHSOnly = InferRHS || ParseLHSOnly || isInferDFA();
+  bool Binary = InputFormat == BinaryInput ||
+    (InputFormat == AutoInput && isBinaryReplacements(MB.getBuffer()));
+  if (StreamInput) {
+    // The replacements are parsed as they are checked, below
+  } else if (Binary) {
+    Reps = ReadReplacementsBinary(IC, MB.getBufferIdentifier(), MB.getBuffer(),
+                                  Contexts, ErrStr);
+    for (auto &Rep : Reps) {
+      if (LHSOnly)
+        Rep.Mapping.RHS = 0;
+      else if (!Rep.Mapping.RHS)
+        ErrStr = (MB.getBufferIdentifier() + ": replacement has no RHS").str();
+    }
+  } else if (LHSOnly) {
     Reps = ParseReplacementLHSs(IC, MB.getBufferIdentifier(), MB.getBuffer(),
                                 Contexts, ErrStr);
   } else {
@@ -132,15 +164,15 @@ int SolveInst(const MemoryBufferRef &MB, Solver *S) {
     }
   }
 
-  if (ParseOnly || ParseLHSOnly) {
+  if ((ParseOnly || ParseLHSOnly) && !StreamInput) {
     llvm::outs() << "; parsing successful\n";
     return 0;
   }
 
-  unsigned Index = 0;
   int Ret = 0;
   int Success = 0, Fail = 0, Error = 0;
-  for (auto Rep : Reps) {
+  // Returns false once no more replacements should be checked
+  auto Check = [&](ParsedReplacement Rep, ReplacementContext &RepContext) {
     if (isInferDFA()) {
       if (InferNeg) {
         bool Negative;
@@ -242,7 +274,7 @@ int SolveInst(const MemoryBufferRef &MB, Solver *S) {
           std::string s = Inst::getDemandedBitsString(DBitsVar);
           llvm::outs() << "demanded-bits from souper for %" << VarName << " : "<< s << "\n";
         }
-        return 0;
+        return false;
       }
     } else if (InferRHS || ReInferRHS) {
       int OldCost;
@@ -280,7 +312,7 @@ int SolveInst(const MemoryBufferRef &MB, Solver *S) {
         } else {
           ReplacementContext Context;
           PrintReplacementRHS(llvm::outs(), Rep.Mapping.RHS,
-                              ReInferRHS ? Context : Contexts[Index]);
+                              ReInferRHS ? Context : RepContext);
         }
       } else {
         ++Fail;
@@ -347,19 +379,60 @@ int SolveInst(const MemoryBufferRef &MB, Solver *S) {
           std::sort(Models.begin(), Models.end(),
                     [](const std::pair<Inst *, APInt> &A,
                        const std::pair<Inst *, APInt> &B) {
-                      return A.first->Name < B.first->Name;
+                      return A.first->Meta->Name < B.first->Meta->Name;
                     });
           for (const auto &M : Models) {
-            llvm::outs() << '%' << M.first->Name << " = " << M.second << '\n';
+            llvm::outs() << '%' << M.first->Meta->Name << " = " << M.second
+                         << '\n';
           }
         } else {
           llvm::outs() << "\n";
         }
       }
     }
-    ++Index;
     if (PrintRepl || PrintReplSplit)
       llvm::outs() << "\n";
+    return true;
+  };
+
+  if (StreamInput) {
+    if (Binary && !isBinaryReplacements(MB.getBuffer())) {
+      llvm::errs() << MB.getBufferIdentifier()
+                   << ": not a file of binary replacements\n";
+      return 1;
+    }
+    ReplacementStream Stream(MB.getBufferIdentifier(), MB.getBuffer(),
+                             LHSOnly);
+    while (true) {
+      InstContext::Checkpoint CP = IC.checkpoint();
+      ParsedReplacement Rep;
+      ReplacementContext Context;
+      if (!Stream.next(IC, Rep, Context, ErrStr))
+        break;
+      if (!LHSOnly && !Rep.Mapping.RHS) {
+        ErrStr = (MB.getBufferIdentifier() + ": replacement has no RHS").str();
+        break;
+      }
+      if (EmitLHSDot)
+        llvm::WriteGraph(llvm::outs(), Rep.Mapping.LHS);
+      bool More = ParseOnly || ParseLHSOnly || Check(Rep, Context);
+      IC.rollback(CP);
+      if (!More)
+        return 0;
+    }
+    if (!ErrStr.empty()) {
+      llvm::errs() << ErrStr << '\n';
+      return 1;
+    }
+    if (ParseOnly || ParseLHSOnly) {
+      llvm::outs() << "; parsing successful\n";
+      return 0;
+    }
+  } else {
+    ReplacementContext NoContext;
+    for (unsigned Index = 0; Index != Reps.size(); ++Index)
+      if (!Check(Reps[Index], Contexts.empty() ? NoContext : Contexts[Index]))
+        return 0;
   }
   if ((Success + Fail + Error) > 1)
     llvm::outs() << "successes = " << Success << ", failures = " << Fail <<
@@ -105,22 +105,23 @@ static bool fitsInBits(std::string str, unsigned bits) {
 static int Interpret(const MemoryBufferRef &MB, Solver *S) {
   InstContext IC;
   std::string ErrStr;
-  std::vector<ParsedReplacement> Reps;
-  std::vector<ReplacementContext> Contexts;
-  Reps = ParseReplacementLHSs(IC, MB.getBufferIdentifier(), MB.getBuffer(),
-			      Contexts, ErrStr);
-  if (!ErrStr.empty()) {
-    llvm::errs() << ErrStr << '\n';
-    return 1;
-  }
+  ReplacementStream Reps(MB.getBufferIdentifier(), MB.getBuffer(),
+                         /*LHSOnly=*/true);
 
   unsigned Index = 0;
   int Ret = 0;
   int Success = 0, Fail = 0, Error = 0;
-  for (unsigned i = 0 ; i < Reps.size(); ++i) {
+  while (true) {
+    // Each replacement is parsed when it is reached and destroyed once it
+    // has been interpreted, so large inputs are handled in flat memory
+    InstContext::Checkpoint CP = IC.checkpoint();
+    ParsedReplacement Rep;
+    ReplacementContext Context;
+    if (!Reps.next(IC, Rep, Context, ErrStr))
+      break;
 
     std::vector<Inst *> Vars;
-    findVars(Reps[i].Mapping.LHS, Vars);
+    findVars(Rep.Mapping.LHS, Vars);
 
     if (InputValueStrings.size() < Vars.size()) {
       llvm::errs() << "Error: One or more variables in LHS are not given any value. "
@@ -139,14 +140,15 @@ static int Interpret(const MemoryBufferRef &MB, Solver *S) {
       }
       bool Found = false;
       for (auto V : Vars) {
-        if (V->Name == Name) {
+        if (V->Meta->Name == Name) {
           if (!fitsInBits(Val, V->Width)) {
             llvm::errs() << "Error: value '" << Val << "' is too large for ";
             llvm::errs() << V->Width << " bits.\n";
             return 1;
           }
           if (InputValues.find(V) != InputValues.end()) {
-            llvm::errs() << "Error: duplicate value for %" << V->Name << "\n";
+            llvm::errs() << "Error: duplicate value for %" << V->Meta->Name
+                         << "\n";
             return 1;
           }
           APInt ValObj = APInt(V->Width, Val, 10);
@@ -154,12 +156,12 @@ static int Interpret(const MemoryBufferRef &MB, Solver *S) {
           InputValuesInstMappings.emplace_back(V, IC.getConst(ValObj));
           Found = true;
           if (DebugLevel > 3)
-            llvm::outs() << "var '" << V->Name << "' gets value '" <<
+            llvm::outs() << "var '" << V->Meta->Name << "' gets value '" <<
               APInt(V->Width, Val, 10) << "'\n";
           break;
         }
       }
-      if (auto B = Contexts[i].getBlock(Name)) {
+      if (auto B = Context.getBlock(Name)) {
         unsigned BlockValue = std::stoul(Val);
         if (BlockValue  >= B->Preds) {
           llvm::errs() << "Error: value '" << Val << "' is to large for block %";
@@ -185,18 +187,18 @@ static int Interpret(const MemoryBufferRef &MB, Solver *S) {
 
     ConcreteInterpreter CI(InputValues);
     // Concrete Interpreter
-    if (isConcrete(Reps[i].Mapping.LHS)) {
+    if (isConcrete(Rep.Mapping.LHS)) {
       llvm::outs() << " -------- Concrete Interpreter ----------- \n";
-      CI = ConcreteInterpreter(Reps[i].Mapping.LHS, InputValues);
-      auto Res = CI.evaluateInst(Reps[i].Mapping.LHS);
+      CI = ConcreteInterpreter(Rep.Mapping.LHS, InputValues);
+      auto Res = CI.evaluateInst(Rep.Mapping.LHS);
       Res.print(llvm::outs());
       llvm::outs() << "\n";
     }
 
     // Known bits interpreter
     llvm::outs() << "\n -------- KnownBits Interpreter ----------- \n";
-    auto KB = KnownBitsAnalysis().findKnownBits(Reps[i].Mapping.LHS, CI);
-    auto KBSolver = KnownBitsAnalysis::findKnownBitsUsingSolver(Reps[i].Mapping.LHS, S, InputValuesInstMappings);
+    auto KB = KnownBitsAnalysis().findKnownBits(Rep.Mapping.LHS, CI);
+    auto KBSolver = KnownBitsAnalysis::findKnownBitsUsingSolver(Rep.Mapping.LHS, S, InputValuesInstMappings);
     llvm::outs() << "KnownBits result: \n" << KnownBitsAnalysis::knownBitsString(KB) << '\n';
     llvm::outs() << "KnownBits result using solver: \n" << KnownBitsAnalysis::knownBitsString(KBSolver) << "\n\n";
 
@@ -217,8 +219,8 @@ static int Interpret(const MemoryBufferRef &MB, Solver *S) {
 
     // Constant Ranges interpreter
     llvm::outs() << "\n -------- ConstantRanges Interpreter ----------- \n";
-    auto CR = ConstantRangeAnalysis().findConstantRange(Reps[i].Mapping.LHS, CI);
-    auto CRSolver = ConstantRangeAnalysis::findConstantRangeUsingSolver(Reps[i].Mapping.LHS, S, InputValuesInstMappings);
+    auto CR = ConstantRangeAnalysis().findConstantRange(Rep.Mapping.LHS, CI);
+    auto CRSolver = ConstantRangeAnalysis::findConstantRangeUsingSolver(Rep.Mapping.LHS, S, InputValuesInstMappings);
     llvm::outs() << "ConstantRange result: \n" << CR << '\n';
     llvm::outs() << "ConstantRange result using solver: \n" << CRSolver << "\n\n";
 
@@ -233,6 +235,11 @@ static int Interpret(const MemoryBufferRef &MB, Solver *S) {
 
 
     Index++;
+    IC.rollback(CP);
+  }
+  if (!ErrStr.empty()) {
+    llvm::errs() << ErrStr << '\n';
+    return 1;
   }
 
   return Ret;
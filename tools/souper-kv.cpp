@@ -0,0 +1,130 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// This file gives the scripts in utils/ access to the external cache,
+// whether it lives in Redis or in a -souper-cache-file. Since keys span
+// several lines, the output of keys, dump and hget is separated by NULs.
+// A dump is a sequence of hashes, each of which is printed as
+//
+//   key \0 number of fields \0 field \0 value \0 field \0 value \0 ...
+//
+// and import reads the same format back, so that a dump of one store can
+// be used to fill another. compact drops the overwritten values that a cache
+// file keeps.
+
+#include "souper/KVStore/KVStore.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <map>
+
+using namespace llvm;
+using namespace souper;
+
+static cl::list<std::string> Args(cl::Positional, cl::OneOrMore,
+    cl::desc("keys | dump | import | compact | hget <key> <field> | "
+             "hset <key> <field> <value> | hincrby <key> <field> <n>"));
+
+static void printField(StringRef S) {
+  outs() << S << '\0';
+}
+
+static int import(KVStore &KV) {
+  auto MB = MemoryBuffer::getSTDIN();
+  if (!MB) {
+    errs() << MB.getError().message() << '\n';
+    return 1;
+  }
+  SmallVector<StringRef, 16> Parts;
+  MB.get()->getBuffer().split(Parts, '\0');
+  // The input ends with a NUL
+  if (!Parts.empty() && Parts.back().empty())
+    Parts.pop_back();
+
+  // Fill the store one field name at a time, so that each is a single batch
+  std::map<std::string, std::pair<std::vector<std::string>,
+                                  std::vector<std::string>>> ByField;
+  size_t N = 0, I = 0;
+  while (I < Parts.size()) {
+    unsigned Count;
+    if (I + 2 > Parts.size() || Parts[I+1].getAsInteger(10, Count) ||
+        I + 2 + 2 * Count > Parts.size()) {
+      errs() << "malformed dump\n";
+      return 1;
+    }
+    StringRef Key = Parts[I];
+    for (unsigned J = 0; J != Count; ++J) {
+      auto &Batch = ByField[Parts[I + 2 + 2 * J].str()];
+      Batch.first.push_back(Key.str());
+      Batch.second.push_back(Parts[I + 3 + 2 * J].str());
+    }
+    I += 2 + 2 * Count;
+    ++N;
+  }
+  for (const auto &F : ByField)
+    KV.hSetMany(F.second.first, F.first, F.second.second);
+  errs() << "imported " << N << " hashes\n";
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv);
+
+  StringRef Cmd = Args[0];
+  unsigned NumArgs = Args.size() - 1;
+  auto usage = [&]() {
+    errs() << "wrong arguments for " << Cmd << "; see -help\n";
+    return 1;
+  };
+
+  KVStore KV;
+  if (Cmd == "keys" && NumArgs == 0) {
+    std::vector<std::string> Keys;
+    KV.keys(Keys);
+    for (const auto &K : Keys)
+      printField(K);
+  } else if (Cmd == "dump" && NumArgs == 0) {
+    std::vector<std::string> Keys;
+    KV.keys(Keys);
+    for (const auto &K : Keys) {
+      std::vector<std::pair<std::string, std::string>> Fields;
+      KV.hGetAll(K, Fields);
+      printField(K);
+      printField(std::to_string(Fields.size()));
+      for (const auto &F : Fields) {
+        printField(F.first);
+        printField(F.second);
+      }
+    }
+  } else if (Cmd == "import" && NumArgs == 0) {
+    return import(KV);
+  } else if (Cmd == "compact" && NumArgs == 0) {
+    KV.compact();
+  } else if (Cmd == "hget" && NumArgs == 2) {
+    std::string Value;
+    if (!KV.hGet(Args[1], Args[2], Value))
+      return 1;
+    outs() << Value;
+  } else if (Cmd == "hset" && NumArgs == 3) {
+    KV.hSet(Args[1], Args[2], Args[3]);
+  } else if (Cmd == "hincrby" && NumArgs == 3) {
+    int N;
+    if (StringRef(Args[3]).getAsInteger(10, N))
+      return usage();
+    KV.hIncrBy(Args[1], Args[2], N);
+  } else {
+    return usage();
+  }
+  return 0;
+}
@@ -76,10 +76,10 @@ void SolveInst(std::unique_ptr<MemoryBuffer> MB, Solver *S) {
       std::sort(Models.begin(), Models.end(),
                 [](const std::pair<Inst *, APInt> &A,
                    const std::pair<Inst *, APInt> &B) {
-        return A.first->Name < B.first->Name;
+        return A.first->Meta->Name < B.first->Meta->Name;
       });
       for (const auto &M : Models) {
-        llvm::outs() << '%' << M.first->Name << " = " << M.second << '\n';
+        llvm::outs() << '%' << M.first->Meta->Name << " = " << M.second << '\n';
       }
     }
   }
@@ -63,3 +63,132 @@ TEST(InstTest, Print) {
   EXPECT_EQ("%0:i64 = add 1:i64, 2:i64\n"
             "%1:i64 = mul 3:i64, %0\n", SS.str());
 }
+
+TEST(InstTest, StructuralHash) {
+  // (x + y) - x, built with the variables created in either order and the
+  // operands of the add given in either order.
+  auto Build = [](InstContext &IC, bool Swap) {
+    Inst *Y = Swap ? IC.createVar(32, "y") : nullptr;
+    Inst *X = IC.createVar(32, "x");
+    if (!Swap)
+      Y = IC.createVar(32, "y");
+    Inst *Add = IC.getInst(Inst::Add, 32, Swap ? std::vector<Inst *>{Y, X}
+                                               : std::vector<Inst *>{X, Y});
+    return IC.getInst(Inst::Sub, 32, {Add, X});
+  };
+
+  InstContext IC1, IC2;
+  Inst *LHS1 = Build(IC1, false);
+  Inst *LHS2 = Build(IC2, true);
+  EXPECT_EQ(structuralHash(LHS1), structuralHash(LHS2));
+
+  EXPECT_EQ(getCanonicalKey({}, {}, {LHS1}), getCanonicalKey({}, {}, {LHS2}));
+  ReplacementContext Context1, Context2;
+  nameCanonically({}, {}, {LHS1}, Context1);
+  nameCanonically({}, {}, {LHS2}, Context2);
+  for (unsigned N = 0; N != 4; ++N) {
+    Inst *I1 = Context1.getInst(std::to_string(N));
+    Inst *I2 = Context2.getInst(std::to_string(N));
+    ASSERT_TRUE(I1 && I2);
+    EXPECT_EQ(I1 == LHS1->Ops[1], I2 == LHS2->Ops[1]);
+  }
+
+  Inst *X = LHS1->Ops[1];
+  Inst *Other = IC1.getInst(Inst::Sub, 32,
+                            {IC1.getInst(Inst::Add, 32, {X, X}), X});
+  EXPECT_NE(getCanonicalKey({}, {}, {LHS1}), getCanonicalKey({}, {}, {Other}));
+
+  // Keys are cached per root, so a path condition has to be told apart by
+  // whether it shares its variable with the LHS.
+  Inst *Zero1 = IC1.getConst(llvm::APInt(32, 0));
+  Inst *Zero2 = IC2.getConst(llvm::APInt(32, 0));
+  Inst *Z = IC2.createVar(32, "z");
+  std::vector<InstMapping> PCs1 = {{X, Zero1}};
+  std::vector<InstMapping> PCs2 = {{LHS2->Ops[1], Zero2}};
+  std::vector<InstMapping> PCs3 = {{Z, Zero2}};
+  EXPECT_EQ(getCanonicalKey({}, PCs1, {LHS1}),
+            getCanonicalKey({}, PCs2, {LHS2}));
+  EXPECT_NE(getCanonicalKey({}, PCs1, {LHS1}),
+            getCanonicalKey({}, PCs3, {LHS2}));
+}
+
+TEST(InstTest, Rollback) {
+  InstContext IC;
+  Inst *X = IC.createVar(32, "x");
+  Inst *One = IC.getConst(llvm::APInt(32, 1));
+  Inst *XP1 = IC.getInst(Inst::Add, 32, {X, One});
+
+  auto CP = IC.checkpoint();
+  Inst *Y = IC.createVar(32, "y");
+  IC.getInst(Inst::Mul, 32, {Y, IC.getConst(llvm::APInt(32, 3))});
+  EXPECT_TRUE(IC.createdSince(CP, Y));
+  EXPECT_FALSE(IC.createdSince(CP, XP1));
+  IC.rollback(CP);
+
+  EXPECT_EQ(XP1, IC.getInst(Inst::Add, 32, {One, X}));
+  EXPECT_EQ(1u, IC.createVar(32, "z")->Number);
+
+  Inst *RHS = nullptr;
+  {
+    InstContextScope Scope(IC);
+    Scope.promote(RHS);
+    Inst *W = IC.createVar(32, "w");
+    IC.getInst(Inst::Xor, 32, {W, X});
+    RHS = IC.getInst(Inst::Shl, 32, {XP1, IC.getConst(llvm::APInt(32, 5))});
+  }
+  ASSERT_NE(nullptr, RHS);
+  EXPECT_EQ(XP1, RHS->Ops[0]);
+  EXPECT_EQ(RHS, IC.getInst(Inst::Shl, 32, {XP1, IC.getConst(llvm::APInt(32, 5))}));
+  EXPECT_EQ(2u, IC.createVar(32, "v")->Number);
+}
+
+TEST(InstTest, UBConditionRollback) {
+  InstContext IC;
+  Inst *X = IC.createVar(32, "x");
+  Inst *C = IC.getInst(Inst::Ne, 1, {X, IC.getConst(llvm::APInt(32, 0))});
+
+  auto CP1 = IC.checkpoint();
+  Inst *Y = IC.createVar(32, "y");
+  auto CP2 = IC.checkpoint();
+  IC.setUBCondition(Y, 0, C);
+  IC.setUBCondition(X, 0, C);
+  Inst *Z = IC.createVar(32, "z");
+  IC.setUBCondition(Z, 0, C);
+  IC.setUBCondition(X, 1, IC.getInst(Inst::Eq, 1, {X, Z}));
+  IC.rollback(CP2);
+  EXPECT_EQ(C, IC.getUBCondition(Y, 0));
+  EXPECT_EQ(C, IC.getUBCondition(X, 0));
+  EXPECT_EQ(nullptr, IC.getUBCondition(X, 1));
+  // Conditions don't outlive their instruction, even if its memory is
+  // reused
+  EXPECT_EQ(nullptr, IC.getUBCondition(IC.createVar(32, "v"), 0));
+
+  IC.rollback(CP1);
+  EXPECT_EQ(C, IC.getUBCondition(X, 0));
+  EXPECT_EQ(nullptr, IC.getUBCondition(IC.createVar(32, "w"), 0));
+}
+
+TEST(InstTest, VisitSet) {
+  InstContext IC;
+  Inst *X = IC.createVar(32, "x");
+  Inst *Y = IC.createVar(32, "y");
+  Inst *Add = IC.getInst(Inst::Add, 32, {X, Y});
+  Inst *Mul = IC.getInst(Inst::Mul, 32, {Add, Add});
+
+  InstVisitSet Outer;
+  EXPECT_TRUE(Outer.insert(X));
+  EXPECT_FALSE(Outer.insert(X));
+  {
+    // A nested walk must not disturb the outer one
+    InstVisitSet Inner;
+    EXPECT_FALSE(Inner.count(X));
+    EXPECT_TRUE(Inner.insert(X));
+    EXPECT_TRUE(Inner.insert(Y));
+  }
+  EXPECT_TRUE(Outer.count(X));
+  EXPECT_FALSE(Outer.count(Y));
+
+  EXPECT_EQ(2, instCount(Mul));
+  EXPECT_EQ(cost(Mul), cost(Mul));
+  EXPECT_EQ(Inst::getCost(Inst::Mul) + Inst::getCost(Inst::Add), cost(Mul));
+}
@@ -203,3 +203,88 @@ TEST(InterpreterTests, ConcreteCache) {
   // We would have got 0xFF if evaluateInst had returned result from cache.
   ASSERT_EQ(Val.getValue(), APInt(8, 0x0F, true));
 }
+
+// Checks that a compiled tape agrees with the recursive interpreter on a
+// DAG with shared operands, including inputs that produce poison.
+TEST(InterpreterTests, CompiledInst) {
+  InstContext IC;
+
+  Inst *X = IC.createVar(8, "x");
+  Inst *Y = IC.createVar(8, "y");
+  Inst *Sum = IC.getInst(Inst::AddNUW, 8, {X, Y});
+  Inst *Sq = IC.getInst(Inst::Mul, 8, {Sum, Sum});
+  Inst *Div = IC.getInst(Inst::UDiv, 8, {Sq, Y});
+  Inst *Cmp = IC.getInst(Inst::Ult, 1, {X, Y});
+  Inst *Root = IC.getInst(Inst::Select, 8, {Cmp, Div, Sq});
+
+  std::vector<ValueCache> InputSets;
+  for (unsigned I = 0; I < 256; I += 15)
+    for (unsigned J = 0; J < 256; J += 17)
+      InputSets.push_back({{X, APInt(8, I)}, {Y, APInt(8, J)}});
+
+  souper::CompiledInst Tape(Root);
+  std::vector<EvalValue> Results;
+  Tape.evaluate(InputSets, Results);
+  ASSERT_EQ(Results.size(), InputSets.size());
+
+  for (unsigned I = 0; I < InputSets.size(); ++I) {
+    souper::ConcreteInterpreter CI(InputSets[I]);
+    auto Expected = CI.evaluateInst(Root);
+    ASSERT_EQ(Results[I].K, Expected.K);
+    if (Expected.hasValue())
+      ASSERT_EQ(Results[I].getValue(), Expected.getValue());
+  }
+
+  auto Single = Tape.evaluate(InputSets[1]);
+  ASSERT_EQ(Single.K, Results[1].K);
+}
+
+// Checks the lane kernels used for narrow types exhaustively at i8 against
+// the APInt interpreter, and that wide types still go through APInt.
+TEST(InterpreterTests, CompiledInstNarrow) {
+  InstContext IC;
+
+  Inst *X = IC.createVar(8, "x");
+  Inst *Y = IC.createVar(8, "y");
+
+  std::vector<ValueCache> InputSets;
+  for (unsigned I = 0; I < 256; ++I)
+    for (unsigned J = 0; J < 256; ++J)
+      InputSets.push_back({{X, APInt(8, I)}, {Y, APInt(8, J)}});
+  InputSets.push_back({{X, APInt(8, 1)}, {Y, EvalValue::poison()}});
+
+  std::vector<Inst::Kind> Kinds = {
+    Inst::Add, Inst::AddNSW, Inst::AddNUW, Inst::AddNW,
+    Inst::Sub, Inst::SubNSW, Inst::SubNUW, Inst::SubNW,
+    Inst::Mul, Inst::MulNSW, Inst::MulNUW, Inst::MulNW,
+    Inst::UDiv, Inst::SDiv, Inst::URem, Inst::SRem,
+    Inst::And, Inst::Or, Inst::Xor, Inst::Shl, Inst::LShr, Inst::AShr,
+    Inst::Eq, Inst::Ne, Inst::Ult, Inst::Slt, Inst::Ule, Inst::Sle
+  };
+  std::vector<Inst *> Roots;
+  for (auto K : Kinds)
+    Roots.push_back(IC.getInst(K, Inst::isCmp(K) ? 1 : 8, {X, Y}));
+  Roots.push_back(IC.getInst(Inst::SExt, 16, {X}));
+  Roots.push_back(IC.getInst(Inst::Select, 8,
+                             {IC.getInst(Inst::Slt, 1, {X, Y}), X,
+                              IC.getInst(Inst::Shl, 8, {X, Y})}));
+
+  for (auto Root : Roots) {
+    std::vector<EvalValue> Results;
+    souper::CompiledInst(Root).evaluate(InputSets, Results);
+    for (unsigned I = 0; I < InputSets.size(); ++I) {
+      souper::ConcreteInterpreter CI(InputSets[I]);
+      auto Expected = CI.evaluateInst(Root);
+      ASSERT_EQ(Results[I].K, Expected.K);
+      if (Expected.hasValue())
+        ASSERT_EQ(Results[I].getValue(), Expected.getValue());
+    }
+  }
+
+  Inst *Wide = IC.getInst(Inst::Mul, 128, {IC.getInst(Inst::ZExt, 128, {X}),
+                                           IC.getConst(APInt(128, 1) << 100)});
+  std::vector<EvalValue> Results;
+  souper::CompiledInst(Wide).evaluate(InputSets, Results);
+  ASSERT_TRUE(Results[3 * 256].hasValue());
+  ASSERT_EQ(Results[3 * 256].getValue(), APInt(128, 3) << 100);
+}
@@ -0,0 +1,146 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/KVStore/KVStore.h"
+#include "gtest/gtest.h"
+
+#include <map>
+
+using namespace souper;
+
+namespace {
+
+// Keeps its hashes in memory and counts the lookups that reach it
+class FakeBackend : public KVStore::Backend {
+public:
+  std::map<std::pair<std::string, std::string>, std::string> Fields;
+  unsigned Gets = 0;
+
+  void hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
+               int Incr) override {
+    std::string &V = Fields[{Key.str(), Field.str()}];
+    V = std::to_string((V.empty() ? 0 : std::stoll(V)) + Incr);
+  }
+  bool hGet(llvm::StringRef Key, llvm::StringRef Field,
+            std::string &Value) override {
+    ++Gets;
+    auto F = Fields.find({Key.str(), Field.str()});
+    if (F == Fields.end())
+      return false;
+    Value = F->second;
+    return true;
+  }
+  void hSet(llvm::StringRef Key, llvm::StringRef Field,
+            llvm::StringRef Value) override {
+    Fields[{Key.str(), Field.str()}] = Value.str();
+  }
+  void keys(std::vector<std::string> &Keys) override {
+    for (const auto &F : Fields)
+      Keys.push_back(F.first.first);
+  }
+  void hGetAll(llvm::StringRef Key,
+               std::vector<std::pair<std::string, std::string>> &Out)
+    override {
+    for (const auto &F : Fields)
+      if (F.first.first == Key)
+        Out.emplace_back(F.first.second, F.second);
+  }
+};
+
+}
+
+TEST(KVStoreTest, LRUHits) {
+  auto *Fake = new FakeBackend;
+  Fake->hSet("k", "result", "v");
+  KVStore KV(createLRUKVBackend(std::unique_ptr<KVStore::Backend>(Fake),
+                                1 << 20));
+
+  std::string Value;
+  ASSERT_TRUE(KV.hGet("k", "result", Value));
+  EXPECT_EQ("v", Value);
+  EXPECT_EQ(1u, Fake->Gets);
+  Value.clear();
+  ASSERT_TRUE(KV.hGet("k", "result", Value));
+  EXPECT_EQ("v", Value);
+  EXPECT_EQ(1u, Fake->Gets);
+
+  // Misses are remembered too
+  EXPECT_FALSE(KV.hGet("k", "other", Value));
+  EXPECT_FALSE(KV.hGet("k", "other", Value));
+  EXPECT_EQ(2u, Fake->Gets);
+
+  // Only the keys that aren't remembered reach the backend
+  std::vector<llvm::Optional<std::string>> Values;
+  KV.hGetMany({"k", "k2"}, "result", Values);
+  ASSERT_EQ(2u, Values.size());
+  EXPECT_EQ(std::string("v"), Values[0]);
+  EXPECT_FALSE(Values[1].hasValue());
+  EXPECT_EQ(3u, Fake->Gets);
+}
+
+TEST(KVStoreTest, LRUWrites) {
+  auto *Fake = new FakeBackend;
+  KVStore KV(createLRUKVBackend(std::unique_ptr<KVStore::Backend>(Fake),
+                                1 << 20));
+
+  // hSet writes through and is remembered
+  std::string Value;
+  EXPECT_FALSE(KV.hGet("k", "result", Value));
+  KV.hSet("k", "result", "v");
+  EXPECT_EQ("v", (Fake->Fields[{"k", "result"}]));
+  ASSERT_TRUE(KV.hGet("k", "result", Value));
+  EXPECT_EQ("v", Value);
+  EXPECT_EQ(1u, Fake->Gets);
+
+  // hIncrBy forgets the field, since other processes count too
+  EXPECT_FALSE(KV.hGet("k", "sprofile", Value));
+  KV.hIncrBy("k", "sprofile", 3);
+  ASSERT_TRUE(KV.hGet("k", "sprofile", Value));
+  EXPECT_EQ("3", Value);
+  EXPECT_EQ(3u, Fake->Gets);
+  KV.hIncrByMany({"k"}, {"sprofile"}, 2);
+  ASSERT_TRUE(KV.hGet("k", "sprofile", Value));
+  EXPECT_EQ("5", Value);
+  EXPECT_EQ(4u, Fake->Gets);
+}
+
+TEST(KVStoreTest, LRUEviction) {
+  // Room for two of these values, but not three
+  const std::string Big(1000, 'x');
+  auto *Fake = new FakeBackend;
+  for (const char *K : {"a", "b", "c"})
+    Fake->hSet(K, "result", Big);
+  KVStore KV(createLRUKVBackend(std::unique_ptr<KVStore::Backend>(Fake),
+                                2500));
+
+  std::string Value;
+  KV.hGet("a", "result", Value);
+  KV.hGet("b", "result", Value);
+  EXPECT_EQ(2u, Fake->Gets);
+  // a is now more recently used than b, which c pushes out
+  KV.hGet("a", "result", Value);
+  KV.hGet("c", "result", Value);
+  EXPECT_EQ(3u, Fake->Gets);
+  KV.hGet("a", "result", Value);
+  KV.hGet("c", "result", Value);
+  EXPECT_EQ(3u, Fake->Gets);
+  KV.hGet("b", "result", Value);
+  EXPECT_EQ(4u, Fake->Gets);
+
+  // A value over the whole budget isn't kept at all
+  Fake->hSet("d", "result", std::string(3000, 'x'));
+  KV.hGet("d", "result", Value);
+  KV.hGet("d", "result", Value);
+  EXPECT_EQ(6u, Fake->Gets);
+}
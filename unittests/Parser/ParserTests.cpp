@@ -16,6 +16,9 @@
 #include "souper/Parser/Parser.h"
 #include "gtest/gtest.h"
 
+#include <map>
+#include <mutex>
+
 using namespace souper;
 
 TEST(ParserTest, Errors) {
@@ -1069,3 +1072,246 @@ cand %4 %7
     EXPECT_EQ(T.Test, UnSplit);
   }
 }
+
+TEST(ParserTest, BinaryRoundTrip) {
+  std::string Tests[] = {
+      R"i(%0 = block 2
+%1:i32 = var
+%2:i32 = var
+%3:i32 = phi %0, %1, %2
+%4:i1 = eq 0:i32, %1
+blockpc %0 0 %4 1:i1
+pc %4 0:i1
+infer %3
+%5:i32 = add %1, %2
+result %5
+)i",
+      R"i(%0:i32 = var (knownBits=10xxxxxxxxxxxxxxxxxxxxxxxxxxxx01) (nonZero) (range=[1,100))
+%1:i32 = var (signBits=4) (negative) (powerOfTwo)
+%2:i32 = mul %0, %1 (hasExternalUses)
+%3:i32 = sub %2, -7:i32
+infer %3 (demandedBits=00000000000000001111111111111111) (harvestedFromUse)
+result %2
+)i",
+      R"i(%0:i8 = var
+%1:i8 = var
+%2:i9 = sadd.with.overflow %0, %1
+%3:i1 = extractvalue %2, 1:i32
+infer %3
+result 0:i1
+)i",
+      R"i(%0:i128 = var
+%1:i128 = xor %0, 340282366920938463463374607431768211455:i128
+infer %1
+%2:i128 = xor %0, -12345678901234567890123:i128
+result %2
+)i",
+      R"i(%0:i64 = var
+%1:i64 = reservedconst
+%2:i64 = shl %0, %1
+infer %2
+%3:i64 = ashr %0, -9223372036854775808:i64
+result %3
+)i",
+  };
+
+  for (const auto &T : Tests) {
+    InstContext IC;
+    std::string ErrStr;
+    auto R = ParseReplacement(IC, "<input>", T, ErrStr);
+    ASSERT_EQ("", ErrStr);
+
+    ReplacementContext Context;
+    auto Bin = GetReplacementBinary(R.BPCs, R.PCs, R.Mapping, Context);
+    InstContext IC2;
+    ReplacementContext Context2;
+    auto R2 = ReadReplacementBinary(IC2, "<input>", Bin, Context2, ErrStr);
+    ASSERT_EQ("", ErrStr);
+    EXPECT_EQ(R.getString(/*printNames=*/true),
+              R2.getString(/*printNames=*/true));
+
+    ReplacementContext Context3, Context4;
+    auto LHS = GetReplacementLHSBinary(R.BPCs, R.PCs, R.Mapping.LHS, Context3);
+    auto RHS = GetReplacementRHSBinary(R.Mapping.RHS, Context3);
+    InstContext IC3;
+    auto R3 = ReadReplacementLHSBinary(IC3, "<input>", LHS, Context4, ErrStr);
+    ASSERT_EQ("", ErrStr);
+    auto R4 = ReadReplacementRHSBinary(IC3, "<input>", RHS, Context4, ErrStr);
+    ASSERT_EQ("", ErrStr);
+    R3.Mapping.RHS = R4.Mapping.RHS;
+    EXPECT_EQ(R.getString(/*printNames=*/true),
+              R3.getString(/*printNames=*/true));
+
+    for (size_t N = 0; N != Bin.size(); ++N) {
+      ReplacementContext Context5;
+      ErrStr.clear();
+      ReadReplacementBinary(IC2, "<input>", Bin.substr(0, N), Context5,
+                            ErrStr);
+      EXPECT_NE("", ErrStr);
+    }
+  }
+
+  InstContext IC;
+  std::string ErrStr;
+  auto Reps = ParseReplacements(IC, "<input>", Tests[0] + '\n' + Tests[1],
+                                ErrStr);
+  ASSERT_EQ("", ErrStr);
+  std::string Bin;
+  llvm::raw_string_ostream OS(Bin);
+  WriteReplacementsBinary(OS, Reps);
+  OS.flush();
+  EXPECT_TRUE(isBinaryReplacements(Bin));
+  EXPECT_FALSE(isBinaryReplacements(Tests[0]));
+  std::vector<ReplacementContext> Contexts;
+  auto Reps2 = ReadReplacementsBinary(IC, "<input>", Bin, Contexts, ErrStr);
+  ASSERT_EQ("", ErrStr);
+  ASSERT_EQ(2u, Reps2.size());
+  EXPECT_EQ(Reps[1].getString(), Reps2[1].getString());
+
+  // Demanded bits that don't fit the LHS are rejected
+  ReplacementContext Context;
+  Reps[1].Mapping.LHS->Meta->DemandedBits = llvm::APInt(16, 255);
+  Bin = GetReplacementBinary(Reps[1].BPCs, Reps[1].PCs, Reps[1].Mapping,
+                             Context);
+  ReplacementContext Context2;
+  ReadReplacementBinary(IC, "<input>", Bin, Context2, ErrStr);
+  EXPECT_NE(std::string::npos, ErrStr.find("demanded bits width"));
+
+  // Reserved nodes keep the width synthesis gave them
+  Inst *Var = IC.createVar(8, "x");
+  Inst *RC = IC.getReservedConst();
+  RC->Width = 8;
+  Inst *One = IC.getConst(llvm::APInt(8, 1));
+  InstMapping Mapping(IC.getInst(Inst::Xor, 8, {Var, One}),
+                      IC.getInst(Inst::Sub, 8, {Var, RC}));
+  ReplacementContext Context3, Context4;
+  Bin = GetReplacementBinary({}, {}, Mapping, Context3);
+  ErrStr.clear();
+  auto R = ReadReplacementBinary(IC, "<input>", Bin, Context4, ErrStr);
+  ASSERT_EQ("", ErrStr);
+  EXPECT_EQ(Inst::ReservedConst, R.Mapping.RHS->Ops[1]->K);
+  EXPECT_EQ(8u, R.Mapping.RHS->Ops[1]->Width);
+}
+
+TEST(ParserTest, BinaryTypeErrors) {
+  InstContext IC;
+  Inst *X = IC.createVar(8, "x");
+  Inst *Y = IC.createVar(8, "y");
+  Inst *Wide = IC.createVar(16, "w");
+  Inst *C = IC.createVar(1, "c");
+  Inst *Two = IC.getConst(llvm::APInt(32, 2));
+  Inst *Add = IC.getInst(Inst::Add, 8, {X, Y});
+  Inst *Overflow = IC.getInst(Inst::SAddWithOverflow, 9,
+                              {Add, IC.getInst(Inst::SAddO, 1, {X, Y})});
+  Block *B = IC.createBlock(2);
+
+  struct {
+    Inst *LHS;
+    std::string Expected;
+  } Tests[] = {
+      { IC.getInst(Inst::Add, 8, {X, Y, X}),
+        "expected 2 operands, found 3" },
+      { IC.getInst(Inst::Sub, 8, {X}),
+        "expected 2 operands, found 1" },
+      { IC.getInst(Inst::Add, 8, {X, Wide}),
+        "operands have different widths" },
+      { IC.getInst(Inst::Add, 16, {X, Y}),
+        "inst must have width of 8, has width 16" },
+      { IC.getInst(Inst::Select, 8, {X, X, Y}),
+        "first operand must have width of 1, has width 8" },
+      { IC.getInst(Inst::Select, 8, {C, X}),
+        "expected 3 operands, found 2" },
+      { IC.getInst(Inst::Trunc, 16, {X}),
+        "inst must have width of at most 7, has width 16" },
+      { IC.getInst(Inst::Eq, 8, {X, Y}),
+        "inst must have width of 1, has width 8" },
+      { IC.getInst(Inst::ExtractValue, 8, {Overflow, Two}),
+        "extractvalue inst doesn't expect index value other than 0 or 1" },
+      { IC.getInst(Inst::ExtractValue, 8, {Overflow, X}),
+        "extractvalue index must be a constant" },
+      { IC.getInst(Inst::ExtractValue, 8, {Add, IC.getConst(llvm::APInt(32, 0))}),
+        "extract value expects an aggregate type" },
+      { IC.getInst(Inst::SAddWithOverflow, 9, {Add, Add}),
+        "sadd.with.overflow must be an operation and its overflow bit" },
+      { IC.getPhi(B, {X}),
+        "phi has 1 operand(s) but preceding block has 2" },
+      { IC.getPhi(B, {X, Wide}),
+        "operands have different widths" },
+  };
+
+  for (const auto &T : Tests) {
+    ReplacementContext Context, Context2;
+    std::string Bin = GetReplacementLHSBinary({}, {}, T.LHS, Context);
+    InstContext IC2;
+    std::string ErrStr;
+    ReadReplacementLHSBinary(IC2, "<input>", Bin, Context2, ErrStr);
+    EXPECT_NE(std::string::npos, ErrStr.find(T.Expected))
+        << "expected '" << T.Expected << "', got '" << ErrStr << "'";
+  }
+}
+
+TEST(ParserTest, Stream) {
+  std::string Text;
+  for (unsigned N = 0; N != 20; ++N)
+    Text += "%0:i32 = var\n%1:i32 = sub %0, " + std::to_string(N) +
+            ":i32\ninfer %1\nresult %0\n\n";
+  std::string Bad = Text + "%0:i32 = var\n%1:i32 = frob %0\ncand %1 %0\n";
+
+  InstContext IC;
+  std::string ErrStr;
+  auto Reps = ParseReplacements(IC, "<input>", Text, ErrStr);
+  ASSERT_EQ("", ErrStr);
+  ParseReplacements(IC, "<input>", Bad, ErrStr);
+  std::string BadErr = ErrStr;
+  ASSERT_NE("", BadErr);
+
+  std::string Bin;
+  llvm::raw_string_ostream OS(Bin);
+  WriteReplacementsBinary(OS, Reps);
+  OS.flush();
+
+  for (const std::string &Data : {Text, Bin}) {
+    ReplacementStream Stream("<input>", Data);
+    InstContext IC2;
+    for (const auto &R : Reps) {
+      InstContext::Checkpoint CP = IC2.checkpoint();
+      ParsedReplacement R2;
+      ReplacementContext Context;
+      ErrStr.clear();
+      ASSERT_TRUE(Stream.next(IC2, R2, Context, ErrStr));
+      EXPECT_EQ(R.getString(), R2.getString());
+      IC2.rollback(CP);
+    }
+    ParsedReplacement R2;
+    ReplacementContext Context;
+    EXPECT_FALSE(Stream.next(IC2, R2, Context, ErrStr));
+    EXPECT_EQ("", ErrStr);
+
+    for (unsigned Jobs : {1, 3, 8}) {
+      std::vector<size_t> Offsets = ReplacementStream::split(Data, false, Jobs);
+      ASSERT_LE(Offsets.size(), Jobs + 1);
+      EXPECT_EQ(Data.size(), Offsets.back());
+
+      std::mutex M;
+      std::map<size_t, std::string> Got;
+      EXPECT_TRUE(ParseReplacementsParallel("<input>", Data, false, Jobs,
+          [&](size_t Offset, ParsedReplacement &R, ReplacementContext &,
+              InstContext &) {
+            std::lock_guard<std::mutex> Lock(M);
+            Got[Offset] = R.getString();
+          }, ErrStr));
+      ASSERT_EQ(Reps.size(), Got.size());
+      unsigned I = 0;
+      for (const auto &G : Got)
+        EXPECT_EQ(Reps[I++].getString(), G.second);
+    }
+  }
+
+  for (unsigned Jobs : {1, 4}) {
+    ErrStr.clear();
+    EXPECT_FALSE(ParseReplacementsParallel("<input>", Bad, false, Jobs,
+        [](size_t, ParsedReplacement &, ReplacementContext &,
+           InstContext &) {}, ErrStr));
+    EXPECT_EQ(BadErr, ErrStr);
+  }
+}
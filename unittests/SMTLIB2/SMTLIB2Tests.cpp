@@ -0,0 +1,118 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/SMTLIB2/Solver.h"
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <thread>
+
+using namespace souper;
+
+namespace {
+
+// Looks for a factorization of a 64-bit prime; Z3 takes far longer on this
+// than the tests wait.
+const char *HardQuery =
+    "(declare-fun x () (_ BitVec 64))\n"
+    "(declare-fun y () (_ BitVec 64))\n"
+    "(assert (= (bvmul x y) #x7fffffffffffffe7))\n"
+    "(assert (bvugt x #x0000000000000001))\n"
+    "(assert (bvugt y #x0000000000000001))\n"
+    "(assert (bvult x #x00000000ffffffff))\n"
+    "(check-sat)\n";
+
+const char *SatQuery =
+    "(declare-fun x () (_ BitVec 8))\n"
+    "(assert (= (bvadd x #x01) #x10))\n"
+    "(check-sat)\n"
+    "(get-value (x))\n";
+
+const char *UnsatQuery =
+    "(declare-fun x () (_ BitVec 8))\n"
+    "(assert (bvult x x))\n"
+    "(check-sat)\n";
+
+// The hard query behind enough padding that Z3 spends a while parsing it
+// before the check starts.
+std::string paddedHardQuery() {
+  std::string Query = "(declare-fun z () (_ BitVec 64))\n";
+  for (unsigned I = 0; I != 20000; ++I)
+    Query += "(assert (= (bvadd z #x" + std::string(15, '0') + "1) "
+             "(bvadd #x" + std::string(15, '0') + "1 z)))\n";
+  return Query + HardQuery;
+}
+
+std::error_code cancelAfter(SMTLIBSolver *S, const std::string &Query,
+                            std::chrono::milliseconds Delay) {
+  std::atomic<bool> Cancel(false);
+  std::thread Canceller([&]() {
+    std::this_thread::sleep_for(Delay);
+    Cancel = true;
+  });
+  bool Result;
+  std::error_code EC = S->isSatisfiable(Query, Result, 0, 0, 10, &Cancel);
+  Canceller.join();
+  return EC;
+}
+
+void expectWorks(SMTLIBSolver *S) {
+  bool Result = false;
+  std::vector<llvm::APInt> Models;
+  ASSERT_FALSE(S->isSatisfiable(SatQuery, Result, 1, &Models, 0));
+  EXPECT_TRUE(Result);
+  ASSERT_EQ(1u, Models.size());
+  EXPECT_EQ(15u, Models[0].getZExtValue());
+
+  ASSERT_FALSE(S->isSatisfiable(UnsatQuery, Result, 0, 0, 0));
+  EXPECT_FALSE(Result);
+}
+
+}
+
+TEST(SMTLIB2Test, Z3InProcessCancel) {
+  auto S = createZ3InProcessSolver(/*Keep=*/false);
+  expectWorks(S.get());
+
+  auto Start = std::chrono::steady_clock::now();
+  EXPECT_EQ(std::errc::operation_canceled,
+            cancelAfter(S.get(), HardQuery, std::chrono::milliseconds(100)));
+  EXPECT_LT(std::chrono::steady_clock::now() - Start, std::chrono::seconds(5));
+
+  // Queries after a cancelled one are unaffected
+  expectWorks(S.get());
+
+  // Cancelling before the check starts is not lost either
+  std::string Padded = paddedHardQuery();
+  for (unsigned I = 0; I != 3; ++I) {
+    Start = std::chrono::steady_clock::now();
+    EXPECT_EQ(std::errc::operation_canceled,
+              cancelAfter(S.get(), Padded, std::chrono::milliseconds(10)));
+    EXPECT_LT(std::chrono::steady_clock::now() - Start,
+              std::chrono::seconds(5));
+    expectWorks(S.get());
+  }
+}
+
+TEST(SMTLIB2Test, Z3InProcessConcurrent) {
+  auto S = createZ3InProcessSolver(/*Keep=*/false);
+  std::vector<std::thread> Threads;
+  for (unsigned I = 0; I != 4; ++I)
+    Threads.emplace_back([&]() {
+      for (unsigned J = 0; J != 10; ++J)
+        expectWorks(S.get());
+    });
+  for (auto &T : Threads)
+    T.join();
+}